@@ -71,6 +71,18 @@ impl IPC {
 
 }
 
+#[cfg(unix)]
+impl Connection {
+
+    /// Another handle of the socket,
+    /// one thread writes to it while the other one is reading.
+    pub fn try_clone(&self) -> Result<Connection> {
+        let socket = self.socket.try_clone()?;
+        Ok(Connection { socket })
+    }
+
+}
+
 #[cfg(unix)]
 impl<'a> Iterator for Incoming<'a> {
     type Item = std::io::Result<Connection>;
@@ -5,6 +5,7 @@
  */
 mod ipc;
 mod server;
+mod worker_pool;
 
 use polodb_core::Database;
 use clap::{Arg, Command as App};
@@ -47,6 +48,13 @@ fn main() {
                     .num_args(0..=1)
             )
             .arg(Arg::new("memory"))
+            .arg(
+                Arg::new("workers")
+                    .long("workers")
+                    .value_name("COUNT")
+                    .help("pipeline the requests of a connection, run the reads on COUNT threads")
+                    .num_args(1)
+            )
             .arg(
                 Arg::new("log")
                     .help("print log")
@@ -84,10 +92,18 @@ fn main() {
 
         let socket = sub.get_one::<String>("socket").unwrap();
         let path = sub.get_one::<String>("path");
+        let workers = match sub.get_one::<String>("workers").map(|w| w.parse::<usize>()) {
+            Some(Ok(workers)) => workers,
+            Some(Err(_)) => {
+                eprintln!("--workers should be a number");
+                return;
+            }
+            None => 0,
+        };
         if let Some(path) = path {
-            server::start_socket_server(Some(path), socket);
+            server::start_socket_server(Some(path), socket, workers);
         } else if sub.contains_id("memory") {
-            server::start_socket_server(None, socket);
+            server::start_socket_server(None, socket, workers);
         } else {
             eprintln!("you should pass either --path or --memory");
         }
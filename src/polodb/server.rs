@@ -4,14 +4,19 @@
  * file, You can obtain one at https://mozilla.org/MPL/2.0/.
  */
 use std::thread;
-use std::sync::atomic::{AtomicI32, Ordering};
+use std::sync::atomic::{AtomicI32, AtomicU64, Ordering};
+#[cfg(unix)]
+use std::sync::mpsc::{channel, Receiver, Sender};
 use polodb_core::{Database, DatabaseServer};
 use std::process::exit;
 use std::sync::{Arc, Mutex};
 use byteorder::{BigEndian, ReadBytesExt, WriteBytesExt};
+#[cfg(unix)]
+use std::io::BufWriter;
 use std::io::{Read, Write};
 use crate::Error;
 use crate::ipc::{Connection, IPC};
+use crate::worker_pool::WorkerPool;
 use polodb_core::bson;
 use polodb_core::bson::{doc, Document};
 #[cfg(unix)]
@@ -21,25 +26,73 @@ use signal_hook::consts::TERM_SIGNALS;
 
 static CONN_COUNT: AtomicI32 = AtomicI32::new(0);
 
+static NEXT_CONN_ID: AtomicU64 = AtomicU64::new(1);
+
 const HEAD: [u8; 4] = [0xFF, 0x00, 0xAA, 0xBB];
 const PING_HEAD: [u8; 4] = [0xFF, 0x00, 0xAA, 0xCC];
 
+enum Request {
+    Ping(u32),
+    Body(u32, bson::Bson),
+}
+
+/// The frames written back by the pipelined connections
+#[cfg(unix)]
+enum Outgoing {
+    Ping(u32),
+    Response(u32, Document),
+    /// Quit after the frames before it are flushed
+    Quit,
+}
+
+/// The requests run in order on the queue of a pipelined connection
+#[cfg(unix)]
+enum Queued {
+    /// A write, or a read with a session
+    Request(u32, bson::Bson),
+    /// A read held until the writes received before it are applied,
+    /// then it's run on the worker pool.
+    Read(u32, bson::Bson),
+}
+
+/// The writes of a pipelined connection, numbered in the order received
+#[cfg(unix)]
+#[derive(Default)]
+struct WriteSequence {
+    /// The count of the writes sent to the queue,
+    /// only changed by the thread reading the connection.
+    queued:  AtomicU64,
+    /// The count of the writes applied by the queue
+    applied: AtomicU64,
+}
+
 #[derive(Clone)]
 struct AppContext {
     socket_path: String,
     db: Arc<Mutex<Option<Arc<DatabaseServer>>>>,
+    /// The threads running the reads of the pipelined connections,
+    /// 0 to handle the requests of a connection one by one.
+    workers: usize,
 }
 
 impl AppContext {
 
-    fn new(socket_path: String, db: Database) -> AppContext {
+    fn new(socket_path: String, db: Database, workers: usize) -> AppContext {
         let server = DatabaseServer::new(db);
         AppContext {
             socket_path,
             db: Arc::new(Mutex::new(Some(Arc::new(server)))),
+            workers,
         }
     }
 
+    fn db_server(&self) -> Option<Arc<DatabaseServer>> {
+        // limit the scope of the guard because
+        // the Database itself is threadsafe
+        let db_guard = self.db.lock().unwrap();
+        db_guard.as_ref().cloned()
+    }
+
     fn receive_request_body(request_size: u32, conn: &mut Connection) -> crate::Result<Document> {
         let mut request_body = vec![0u8; request_size as usize];
         conn.read_exact(&mut request_body)?;
@@ -52,7 +105,9 @@ impl AppContext {
     /// {
     ///     "body": <request_doc>,
     /// }
-    fn handle_incoming_connection(&self, conn: &mut Connection) -> crate::Result<bool> {
+    ///
+    /// Return `None` if the head is not matched.
+    fn receive_request(conn: &mut Connection) -> crate::Result<Option<Request>> {
         let mut header_buffer = [0u8; 4];
 
         conn.read_exact(&mut header_buffer)?;
@@ -60,46 +115,45 @@ impl AppContext {
         if header_buffer != HEAD {
             if header_buffer == PING_HEAD {
                 let req_id = conn.read_u32::<BigEndian>()?;
-                conn.write(&PING_HEAD)?;
-                conn.write_u32::<BigEndian>(req_id)?;
-                return Ok(true);
+                return Ok(Some(Request::Ping(req_id)));
             }
             eprintln!("head is not matched, received: {:#x} {:#x} {:#x} {:#x}",
                       header_buffer[0], header_buffer[1], header_buffer[2], header_buffer[3]);
             eprintln!("exit");
-            return Ok(false)
+            return Ok(None)
         }
 
         let req_id = conn.read_u32::<BigEndian>()?;
         let req_resize = conn.read_u32::<BigEndian>()?;
 
-        let req_doc = AppContext::receive_request_body(req_resize, conn)?;
+        let mut req_doc = AppContext::receive_request_body(req_resize, conn)?;
 
-        let req_body = match req_doc.get("body") {
-            Some(body) => body,
-            None => {
-                return Err(Error::RequestBodyNotFound);
+        match req_doc.remove("body") {
+            Some(body) => Ok(Some(Request::Body(req_id, body))),
+            None => Err(Error::RequestBodyNotFound),
+        }
+    }
+
+    fn handle_incoming_connection(&self, conn_id: u64, conn: &mut Connection) -> crate::Result<bool> {
+        let (req_id, req_body) = match AppContext::receive_request(conn)? {
+            Some(Request::Ping(req_id)) => {
+                write_ping(conn, req_id)?;
+                return Ok(true);
             }
+            Some(Request::Body(req_id, req_body)) => (req_id, req_body),
+            None => return Ok(false),
         };
 
         // unwrap the db from app context
-        let db = {
-            // limit the scope of the guard because
-            // the Database itself is threadsafe
-            let db_guard = self.db.lock().unwrap();
-
-            match db_guard.as_ref() {
-                Some(db) => {
-                    db.clone()
-                }
-                None => {
-                    // if the database already is None, exit
-                    return Ok(false);
-                }
+        let db = match self.db_server() {
+            Some(db) => db,
+            None => {
+                // if the database already is None, exit
+                return Ok(false);
             }
         };
 
-        AppContext::handle_request_in_db(conn, req_id, db, req_body.clone())
+        AppContext::handle_request_in_db(conn, conn_id, req_id, db, req_body)
     }
 
     /// The response body:
@@ -111,24 +165,9 @@ impl AppContext {
     /// {
     ///     "error": <error_string>,
     /// }
-    fn handle_request_in_db(conn: &mut Connection, req_id: u32, db: Arc<DatabaseServer>, req_body: bson::Bson) -> crate::Result<bool> {
-        let msg_ty_result = db.handle_request_doc(req_body.clone());
-
-        let is_quit = match msg_ty_result {
-            Ok(result) => {
-                write_response(conn, req_id, doc! {
-                    "body": result.value,
-                })?;
-                result.is_quit
-            }
-            Err(db_err) => {
-                write_response(conn, req_id, doc! {
-                    "error": format!("{}", db_err)
-                })?;
-                // exit can not be error
-                false
-            }
-        };
+    fn handle_request_in_db(conn: &mut Connection, conn_id: u64, req_id: u32, db: Arc<DatabaseServer>, req_body: bson::Bson) -> crate::Result<bool> {
+        let (resp_doc, is_quit) = execute_request(&db, conn_id, req_body);
+        write_response(conn, req_id, resp_doc)?;
 
         conn.flush()?;
 
@@ -141,7 +180,30 @@ impl AppContext {
 
 }
 
-fn write_response(conn: &mut Connection, req_id: u32, doc: Document) -> crate::Result<()> {
+/// Return the response and whether the server should quit
+fn execute_request(db: &DatabaseServer, conn_id: u64, req_body: bson::Bson) -> (Document, bool) {
+    match db.handle_connection_request(conn_id, req_body) {
+        Ok(result) => {
+            (doc! {
+                "body": result.value,
+            }, result.is_quit)
+        }
+        Err(db_err) => {
+            // exit can not be error
+            (doc! {
+                "error": format!("{}", db_err)
+            }, false)
+        }
+    }
+}
+
+fn write_ping<W: Write>(conn: &mut W, req_id: u32) -> crate::Result<()> {
+    conn.write(&PING_HEAD)?;
+    conn.write_u32::<BigEndian>(req_id)?;
+    Ok(())
+}
+
+fn write_response<W: Write>(conn: &mut W, req_id: u32, doc: Document) -> crate::Result<()> {
     let ret_buffer = bson::to_vec(&doc).unwrap();
 
     conn.write(&HEAD)?;
@@ -152,7 +214,203 @@ fn write_response(conn: &mut Connection, req_id: u32, doc: Document) -> crate::R
     Ok(())
 }
 
-pub fn start_socket_server(path: Option<&str>, socket_addr: &str) {
+/// Read the requests of the connection while the earlier ones are running.
+///
+/// The other requests are run in order on the queue of the connection.
+/// The reads without a session run on the worker pool, each one on
+/// a snapshot of its own, and the responses are written once they're ready,
+/// the clients match them by the request id.
+///
+/// The order on a connection:
+/// - A read sees all the writes received before it. If some of them
+///   are not applied yet, the read is held on the queue behind them,
+///   and passed to the pool once they are.
+/// - A read may or may not see the writes received after it,
+///   they run concurrently.
+#[cfg(unix)]
+fn serve_pipelined(app: AppContext, conn_id: u64, mut conn: Connection, pool: Arc<WorkerPool>) {
+    let write_conn = match conn.try_clone() {
+        Ok(write_conn) => write_conn,
+        Err(err) => {
+            eprintln!("io error: {}", err);
+            return;
+        }
+    };
+
+    let (out_sender, out_receiver) = channel::<Outgoing>();
+    let writer = {
+        let app = app.clone();
+        thread::spawn(move || write_outgoing(app, write_conn, out_receiver))
+    };
+
+    let write_seq = Arc::new(WriteSequence::default());
+    let (queue_sender, queue_receiver) = channel::<Queued>();
+    let queue = {
+        let app = app.clone();
+        let out_sender = out_sender.clone();
+        let write_seq = write_seq.clone();
+        let pool = pool.clone();
+        thread::spawn(move || run_queued_requests(app, conn_id, queue_receiver, out_sender, write_seq, pool))
+    };
+
+    loop {
+        let request = match AppContext::receive_request(&mut conn) {
+            Ok(Some(request)) => request,
+            Ok(None) => {
+                let _ = out_sender.send(Outgoing::Quit);
+                break;
+            }
+            Err(Error::Io(err)) => {
+                eprintln!("io error: {}", err);
+                break;
+            }
+            Err(err) => {
+                eprintln!("other error, continue: {}", err);
+                continue;
+            }
+        };
+
+        let (req_id, req_body) = match request {
+            Request::Ping(req_id) => {
+                let _ = out_sender.send(Outgoing::Ping(req_id));
+                continue;
+            }
+            Request::Body(req_id, req_body) => (req_id, req_body),
+        };
+
+        if !DatabaseServer::is_concurrent_read(&req_body) {
+            write_seq.queued.fetch_add(1, Ordering::SeqCst);
+            if queue_sender.send(Queued::Request(req_id, req_body)).is_err() {
+                break;
+            }
+            continue;
+        }
+
+        // hold the read until the writes received before it are applied
+        let received_writes = write_seq.queued.load(Ordering::SeqCst);
+        if write_seq.applied.load(Ordering::SeqCst) < received_writes {
+            if queue_sender.send(Queued::Read(req_id, req_body)).is_err() {
+                break;
+            }
+            continue;
+        }
+
+        if !dispatch_read(&app, &pool, conn_id, req_id, req_body, &out_sender) {
+            break;
+        }
+    }
+
+    // the writer stops once the queue and the workers drop their senders
+    drop(queue_sender);
+    drop(out_sender);
+    let _ = queue.join();
+    let _ = writer.join();
+}
+
+/// Run the read on the worker pool,
+/// return false if the database is closed.
+#[cfg(unix)]
+fn dispatch_read(
+    app: &AppContext,
+    pool: &WorkerPool,
+    conn_id: u64,
+    req_id: u32,
+    req_body: bson::Bson,
+    out_sender: &Sender<Outgoing>,
+) -> bool {
+    let db = match app.db_server() {
+        Some(db) => db,
+        None => return false,
+    };
+    let out_sender = out_sender.clone();
+    pool.execute(move || {
+        let (resp_doc, _) = execute_request(&db, conn_id, req_body);
+        let _ = out_sender.send(Outgoing::Response(req_id, resp_doc));
+    });
+    true
+}
+
+#[cfg(unix)]
+fn run_queued_requests(
+    app: AppContext,
+    conn_id: u64,
+    receiver: Receiver<Queued>,
+    out_sender: Sender<Outgoing>,
+    write_seq: Arc<WriteSequence>,
+    pool: Arc<WorkerPool>,
+) {
+    for queued in receiver {
+        let (req_id, req_body) = match queued {
+            Queued::Request(req_id, req_body) => (req_id, req_body),
+            Queued::Read(req_id, req_body) => {
+                // the writes before it in the queue are all applied
+                if !dispatch_read(&app, &pool, conn_id, req_id, req_body, &out_sender) {
+                    let _ = out_sender.send(Outgoing::Quit);
+                    return;
+                }
+                continue;
+            }
+        };
+
+        let db = match app.db_server() {
+            Some(db) => db,
+            None => {
+                let _ = out_sender.send(Outgoing::Quit);
+                return;
+            }
+        };
+
+        let (resp_doc, is_quit) = execute_request(&db, conn_id, req_body);
+        write_seq.applied.fetch_add(1, Ordering::SeqCst);
+        let _ = out_sender.send(Outgoing::Response(req_id, resp_doc));
+
+        if is_quit {
+            let _ = out_sender.send(Outgoing::Quit);
+            return;
+        }
+    }
+}
+
+/// Write the frames ready together, and flush once
+/// there is nothing more to write.
+#[cfg(unix)]
+fn write_outgoing(app: AppContext, conn: Connection, receiver: Receiver<Outgoing>) {
+    let mut writer = BufWriter::new(conn);
+
+    while let Ok(first) = receiver.recv() {
+        let mut is_quit = false;
+        let mut next = Some(first);
+
+        while let Some(outgoing) = next.take() {
+            let result = match outgoing {
+                Outgoing::Ping(req_id) => write_ping(&mut writer, req_id),
+                Outgoing::Response(req_id, resp_doc) => write_response(&mut writer, req_id, resp_doc),
+                Outgoing::Quit => {
+                    is_quit = true;
+                    Ok(())
+                }
+            };
+            if let Err(err) = result {
+                eprintln!("io error: {}", err);
+                return;
+            }
+            if !is_quit {
+                next = receiver.try_recv().ok();
+            }
+        }
+
+        if let Err(err) = writer.flush() {
+            eprintln!("io error: {}", err);
+            return;
+        }
+
+        if is_quit {
+            safely_quit(app);
+        }
+    }
+}
+
+pub fn start_socket_server(path: Option<&str>, socket_addr: &str, workers: usize) {
     let db = match path {
         Some(path) => {
             match Database::open_file(path) {
@@ -174,7 +432,7 @@ pub fn start_socket_server(path: Option<&str>, socket_addr: &str) {
         }
     };
 
-    let app = AppContext::new(socket_addr.into(), db);
+    let app = AppContext::new(socket_addr.into(), db, workers);
 
     start_app_async(app.clone(), socket_addr);
 
@@ -192,37 +450,30 @@ fn start_app_async(app: AppContext, socket_addr: &str) {
     let _t = thread::spawn(move || {
         let listener = IPC::bind(socket_attr_copy.as_str()).unwrap();
 
+        // the connections can't be read and written at the same time on Windows
+        let pool = if app.workers > 0 && cfg!(unix) {
+            Some(Arc::new(WorkerPool::new(app.workers)))
+        } else {
+            None
+        };
+
         for stream in listener.incoming() {
             let stream = stream.unwrap();
 
             eprintln!("Connection established!");
             CONN_COUNT.fetch_add(1, Ordering::SeqCst);
+            let conn_id = NEXT_CONN_ID.fetch_add(1, Ordering::SeqCst);
             let app = app.clone();
+            let pool = pool.clone();
             thread::spawn(move || {
-                let mut moved_stream = stream;
-                loop {
-                    let result = app.handle_incoming_connection(&mut moved_stream);
-                    match result {
-                        Ok(true) => {
-                            continue;
-                        },
-
-                        Ok(false) => {
-                            safely_quit(app.clone());
-                        },
-
-                        Err(err) => {
-                            match err {
-                                Error::Io(_) => {
-                                    eprintln!("io error: {}", err);
-                                    break;
-                                }
-                                _ => {
-                                    eprintln!("other error, continue: {}", err);
-                                }
-                            }
-                        }
-                    }
+                match pool {
+                    #[cfg(unix)]
+                    Some(pool) => serve_pipelined(app.clone(), conn_id, stream, pool),
+                    _ => serve_serial(app.clone(), conn_id, stream),
+                }
+                // nobody reads the cursors of the connection, they still hold the sessions
+                if let Some(db) = app.db_server() {
+                    let _ = db.close_connection(conn_id);
                 }
                 if CONN_COUNT.fetch_sub(1, Ordering::SeqCst) <= 1 {
                     eprintln!("no connection, quit");
@@ -236,6 +487,34 @@ fn start_app_async(app: AppContext, socket_addr: &str) {
     _t.join().unwrap();
 }
 
+fn serve_serial(app: AppContext, conn_id: u64, stream: Connection) {
+    let mut moved_stream = stream;
+    loop {
+        let result = app.handle_incoming_connection(conn_id, &mut moved_stream);
+        match result {
+            Ok(true) => {
+                continue;
+            },
+
+            Ok(false) => {
+                safely_quit(app.clone());
+            },
+
+            Err(err) => {
+                match err {
+                    Error::Io(_) => {
+                        eprintln!("io error: {}", err);
+                        break;
+                    }
+                    _ => {
+                        eprintln!("other error, continue: {}", err);
+                    }
+                }
+            }
+        }
+    }
+}
+
 fn safely_quit(app: AppContext) {
     let mut db_guard = app.db.lock().unwrap();
     *db_guard = None;
@@ -243,3 +522,92 @@ fn safely_quit(app: AppContext) {
     eprintln!("safely exit");
     exit(0);
 }
+
+#[cfg(all(test, unix))]
+mod tests {
+    use std::collections::HashMap;
+    use std::io::{Read, Write};
+    use std::os::unix::net::UnixStream;
+    use std::sync::Arc;
+    use std::thread;
+    use byteorder::{BigEndian, ReadBytesExt, WriteBytesExt};
+    use polodb_core::Database;
+    use polodb_core::bson::{self, doc, Bson, Document};
+    use crate::ipc::IPC;
+    use crate::worker_pool::WorkerPool;
+    use super::{AppContext, HEAD, serve_pipelined};
+
+    fn write_request(stream: &mut UnixStream, req_id: u32, body: Document) {
+        let buffer = bson::to_vec(&doc! { "body": body }).unwrap();
+        stream.write_all(&HEAD).unwrap();
+        stream.write_u32::<BigEndian>(req_id).unwrap();
+        stream.write_u32::<BigEndian>(buffer.len() as u32).unwrap();
+        stream.write_all(&buffer).unwrap();
+    }
+
+    fn read_response(stream: &mut UnixStream) -> (u32, Document) {
+        let mut head = [0u8; 4];
+        stream.read_exact(&mut head).unwrap();
+        assert_eq!(head, HEAD);
+        let req_id = stream.read_u32::<BigEndian>().unwrap();
+        let size = stream.read_u32::<BigEndian>().unwrap();
+        let mut buffer = vec![0u8; size as usize];
+        stream.read_exact(&mut buffer).unwrap();
+        (req_id, bson::from_slice(&buffer).unwrap())
+    }
+
+    #[test]
+    fn test_pipelined_read_after_write() {
+        let mut socket_path = std::env::temp_dir();
+        socket_path.push("test-pipelined-read-after-write.sock");
+        let _ = std::fs::remove_file(&socket_path);
+        let socket_path = socket_path.to_str().unwrap().to_string();
+
+        let listener = IPC::bind(socket_path.as_str()).unwrap();
+        let db = Database::open_memory().unwrap();
+        let app = AppContext::new(socket_path.clone(), db, 4);
+        let pool = Arc::new(WorkerPool::new(4));
+        thread::spawn(move || {
+            let conn = listener.incoming().next().unwrap().unwrap();
+            serve_pipelined(app, 1, conn, pool);
+        });
+
+        let mut stream = UnixStream::connect(&socket_path).unwrap();
+        let count = 50;
+
+        // every count is sent right after an insert, without waiting for it
+        for i in 0..count {
+            write_request(&mut stream, i * 2, doc! {
+                "command": "Insert",
+                "ns": "test",
+                "documents": [{ "_id": i as i64 }],
+            });
+            write_request(&mut stream, i * 2 + 1, doc! {
+                "command": "CountDocuments",
+                "ns": "test",
+            });
+        }
+        stream.flush().unwrap();
+
+        let mut responses = HashMap::new();
+        for _ in 0..(count * 2) {
+            let (req_id, resp) = read_response(&mut stream);
+            responses.insert(req_id, resp);
+        }
+
+        for i in 0..count {
+            let resp = &responses[&(i * 2 + 1)];
+            let body = resp.get_document("body").unwrap();
+            let seen = match body.get("count") {
+                Some(Bson::Int64(v)) => *v,
+                Some(Bson::Int32(v)) => *v as i64,
+                other => panic!("unexpected count: {:?}", other),
+            };
+            // the read sees the writes sent before it
+            assert!(seen >= (i + 1) as i64);
+        }
+
+        let _ = std::fs::remove_file(&socket_path);
+    }
+
+}
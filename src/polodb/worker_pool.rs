@@ -0,0 +1,58 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+use std::thread;
+use std::sync::{Arc, Mutex};
+use std::sync::mpsc::{channel, Receiver, Sender};
+
+type Job = Box<dyn FnOnce() + Send + 'static>;
+
+/// A fixed count of threads running the jobs shared by all the connections
+pub struct WorkerPool {
+    sender: Mutex<Sender<Job>>,
+}
+
+impl WorkerPool {
+
+    pub fn new(size: usize) -> WorkerPool {
+        let (sender, receiver) = channel::<Job>();
+        let receiver = Arc::new(Mutex::new(receiver));
+
+        for index in 0..size {
+            let receiver = receiver.clone();
+            thread::Builder::new()
+                .name(format!("polodb-worker-{}", index))
+                .spawn(move || WorkerPool::run_worker(receiver))
+                .unwrap();
+        }
+
+        WorkerPool {
+            sender: Mutex::new(sender),
+        }
+    }
+
+    fn run_worker(receiver: Arc<Mutex<Receiver<Job>>>) {
+        loop {
+            // release the lock before running the job
+            let job = {
+                let receiver = receiver.lock().unwrap();
+                receiver.recv()
+            };
+            match job {
+                Ok(job) => job(),
+                Err(_) => break,
+            }
+        }
+    }
+
+    pub fn execute<F>(&self, job: F)
+    where
+        F: FnOnce() + Send + 'static
+    {
+        let sender = self.sender.lock().unwrap();
+        let _ = sender.send(Box::new(job));
+    }
+
+}
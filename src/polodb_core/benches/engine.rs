@@ -0,0 +1,376 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+//! The workloads of the engine, run by `cargo bench --bench engine`.
+//!
+//! Every workload is run on a new file in the temp dir and prints the
+//! throughput, the percentiles of the latencies of the operations,
+//! and the counters of `LsmMetrics` after the run.
+//!
+//! `cargo bench --bench engine -- find` only runs the workloads
+//! containing the pattern in the names.
+//! The sizes are multiplied by `POLODB_BENCH_SCALE`, 1 by default.
+use std::path::Path;
+use std::time::{Duration, Instant};
+use polodb_core::bson::{doc, Document};
+use polodb_core::lsm::LsmMetrics;
+use polodb_core::test_utils::{mk_db_path, mk_journal_path};
+use polodb_core::{Config, ConfigBuilder, Database, IndexModel, LsmKv};
+
+const VALUE_SIZES: [usize; 3] = [16, 256, 4096];
+const INSERT_BATCH_SIZE: usize = 1000;
+
+/// A pseudo random sequence with a fixed seed,
+/// the workloads are the same in every run.
+struct XorShift(u64);
+
+impl XorShift {
+
+    fn new() -> XorShift {
+        XorShift(0x2545_f491_4f6c_dd1d)
+    }
+
+    fn next_below(&mut self, bound: u64) -> u64 {
+        self.0 ^= self.0 << 13;
+        self.0 ^= self.0 >> 7;
+        self.0 ^= self.0 << 17;
+        self.0 % bound
+    }
+
+}
+
+/// The durations of the operations of a workload
+struct Samples {
+    name: String,
+    /// The count of the items processed, they are the unit of the throughput,
+    /// an operation may process many items.
+    items: u64,
+    durations: Vec<Duration>,
+}
+
+impl Samples {
+
+    fn new(name: impl Into<String>) -> Samples {
+        Samples {
+            name: name.into(),
+            items: 0,
+            durations: Vec::new(),
+        }
+    }
+
+    fn measure<T, F>(&mut self, items: u64, f: F) -> T
+    where
+        F: FnOnce() -> T
+    {
+        let start = Instant::now();
+        let result = f();
+        self.durations.push(start.elapsed());
+        self.items += items;
+        result
+    }
+
+    fn percentile(sorted: &[Duration], quantile: f64) -> Duration {
+        if sorted.is_empty() {
+            return Duration::ZERO;
+        }
+        let rank = ((quantile * sorted.len() as f64).ceil() as usize).max(1);
+        sorted[rank.min(sorted.len()) - 1]
+    }
+
+    fn report(mut self, metrics: &LsmMetrics) {
+        self.durations.sort();
+        let total: Duration = self.durations.iter().sum();
+        let micros = |d: Duration| d.as_secs_f64() * 1_000_000.0;
+        let throughput = if total.is_zero() {
+            0.0
+        } else {
+            (self.items as f64) / total.as_secs_f64()
+        };
+
+        println!("{}", self.name);
+        println!(
+            "  ops: {}, items: {}, total: {:.3}s, throughput: {:.0} items/s",
+            self.durations.len(), self.items, total.as_secs_f64(), throughput,
+        );
+        println!(
+            "  latency (us): p50 {:.1}, p90 {:.1}, p99 {:.1}, max {:.1}",
+            micros(Samples::percentile(&self.durations, 0.5)),
+            micros(Samples::percentile(&self.durations, 0.9)),
+            micros(Samples::percentile(&self.durations, 0.99)),
+            micros(self.durations.last().copied().unwrap_or_default()),
+        );
+        println!("  lsm: {}", metrics.to_document());
+    }
+
+}
+
+struct Bench {
+    filter: Option<String>,
+    scale: f64,
+}
+
+impl Bench {
+
+    fn from_env() -> Bench {
+        // skip the flags passed by cargo, such as `--bench`
+        let filter = std::env::args().skip(1).find(|arg| !arg.starts_with('-'));
+        let scale = std::env::var("POLODB_BENCH_SCALE")
+            .ok()
+            .and_then(|value| value.parse::<f64>().ok())
+            .filter(|value| *value > 0.0)
+            .unwrap_or(1.0);
+        Bench { filter, scale }
+    }
+
+    fn scaled(&self, count: usize) -> usize {
+        ((count as f64) * self.scale).max(1.0) as usize
+    }
+
+    fn run<F>(&self, name: &str, f: F)
+    where
+        F: FnOnce(&Bench)
+    {
+        if let Some(filter) = &self.filter {
+            if !name.contains(filter.as_str()) {
+                return;
+            }
+        }
+        f(self);
+    }
+
+}
+
+fn clean_db(name: &str) -> std::path::PathBuf {
+    let db_path = mk_db_path(name);
+    let _ = std::fs::remove_file(db_path.as_path());
+    let _ = std::fs::remove_file(mk_journal_path(name));
+    db_path
+}
+
+fn open_kv(path: &Path, config: Config) -> LsmKv {
+    let kv = LsmKv::open_file_with_config(path, config).unwrap();
+    kv.metrics().enable();
+    kv
+}
+
+fn open_db(name: &str, config: Config) -> Database {
+    let db_path = clean_db(name);
+    let db = Database::open_file_with_config(db_path.as_path(), config).unwrap();
+    db.lsm_metrics().enable();
+    db
+}
+
+#[inline]
+fn kv_key(index: usize) -> String {
+    format!("key-{:010}", index)
+}
+
+fn bench_kv(bench: &Bench, value_size: usize) {
+    let count = bench.scaled(if value_size > 1024 { 5_000 } else { 20_000 });
+    let name = format!("bench-kv-{}", value_size);
+    let db_path = clean_db(&name);
+    let kv = open_kv(db_path.as_path(), Config::default());
+    let value = vec![0x5au8; value_size];
+
+    let mut put = Samples::new(format!("kv_put/{}B", value_size));
+    for index in 0..count {
+        put.measure(1, || kv.put(kv_key(index), &value).unwrap());
+    }
+    put.report(&kv.metrics());
+
+    let mut random = XorShift::new();
+    let mut get = Samples::new(format!("kv_get/{}B", value_size));
+    for _ in 0..count {
+        let key = kv_key(random.next_below(count as u64) as usize);
+        let found = get.measure(1, || kv.get(key).unwrap());
+        assert!(found.is_some());
+    }
+    get.report(&kv.metrics());
+
+    let mut scan = Samples::new(format!("kv_scan/{}B", value_size));
+    let cursor = kv.open_cursor();
+    cursor.seek(kv_key(0)).unwrap();
+    while cursor.key().unwrap().is_some() {
+        scan.measure(1, || {
+            cursor.value().unwrap();
+            cursor.next().unwrap();
+        });
+    }
+    assert_eq!(scan.items, count as u64);
+    scan.report(&kv.metrics());
+}
+
+/// Every put is a transaction committed to the log
+fn bench_small_transactions(bench: &Bench) {
+    let count = bench.scaled(20_000);
+    let db_path = clean_db("bench-small-transactions");
+    let kv = open_kv(db_path.as_path(), Config::default());
+
+    let mut samples = Samples::new("wal_commit/small_transactions");
+    for index in 0..count {
+        samples.measure(1, || kv.put(kv_key(index), b"value").unwrap());
+    }
+    samples.report(&kv.metrics());
+
+    let commit = kv.metrics().commit_latency();
+    println!("  commit: {}", commit.to_document());
+    println!("  log flush: {}", kv.metrics().log_flush_latency().to_document());
+}
+
+/// The segments are synced every few hundred writes,
+/// so the minor and the major compactions are run by the writes.
+fn bench_compaction(bench: &Bench) {
+    let count = bench.scaled(50_000);
+    let db_path = clean_db("bench-compaction");
+    let mut config = ConfigBuilder::new();
+    config.set_sync_log_count(200);
+    let kv = open_kv(db_path.as_path(), config.take());
+    let value = vec![0xa5u8; 128];
+
+    let mut random = XorShift::new();
+    let mut samples = Samples::new("compaction/random_puts");
+    for _ in 0..count {
+        // overwrite keys to give the compaction something to merge
+        let key = kv_key(random.next_below((count / 2) as u64) as usize);
+        samples.measure(1, || kv.put(key, &value).unwrap());
+    }
+    samples.report(&kv.metrics());
+
+    let metrics = kv.metrics();
+    println!("  sync: {}", metrics.sync_latency().to_document());
+    println!("  minor compact: {}", metrics.minor_compact_latency().to_document());
+    println!("  major compact: {}", metrics.major_compact_latency().to_document());
+}
+
+/// Reopen a file written by many syncs, the segments and the log are loaded
+fn bench_open(bench: &Bench) {
+    let count = bench.scaled(100_000);
+    let db_path = clean_db("bench-open");
+    let value = vec![0x33u8; 256];
+    {
+        let mut config = ConfigBuilder::new();
+        config.set_sync_log_count(1000);
+        let kv = open_kv(db_path.as_path(), config.take());
+        for index in 0..count {
+            kv.put(kv_key(index), &value).unwrap();
+        }
+    }
+
+    let mut samples = Samples::new("open/large_file");
+    let mut last_metrics = LsmMetrics::new();
+    for _ in 0..10 {
+        let kv = samples.measure(1, || LsmKv::open_file(db_path.as_path()).unwrap());
+        assert!(kv.get(kv_key(count - 1)).unwrap().is_some());
+        last_metrics = kv.metrics();
+    }
+    samples.report(&last_metrics);
+}
+
+fn mk_docs(start: usize, count: usize) -> Vec<Document> {
+    (start..(start + count))
+        .map(|index| doc! {
+            "uid": index as i64,
+            "group": (index % 100) as i64,
+            "name": format!("name-{}", index),
+        })
+        .collect()
+}
+
+fn fill_collection(db: &Database, col_name: &str, count: usize) {
+    let collection = db.collection::<Document>(col_name);
+    let mut start = 0;
+    while start < count {
+        let batch = INSERT_BATCH_SIZE.min(count - start);
+        collection.insert_many(mk_docs(start, batch)).unwrap();
+        start += batch;
+    }
+}
+
+fn bench_insert_many(bench: &Bench) {
+    let count = bench.scaled(100_000);
+    let db = open_db("bench-insert-many", Config::default());
+    let collection = db.collection::<Document>("test");
+
+    let mut samples = Samples::new(format!("insert_many/batch_{}", INSERT_BATCH_SIZE));
+    let mut start = 0;
+    while start < count {
+        let batch = INSERT_BATCH_SIZE.min(count - start);
+        let docs = mk_docs(start, batch);
+        samples.measure(batch as u64, || collection.insert_many(docs).unwrap());
+        start += batch;
+    }
+    samples.report(&db.lsm_metrics());
+}
+
+fn bench_find(bench: &Bench) {
+    let count = bench.scaled(20_000);
+    let db = open_db("bench-find", Config::default());
+    fill_collection(&db, "unindexed", count);
+    fill_collection(&db, "indexed", count);
+    db.collection::<Document>("indexed")
+        .create_index(IndexModel {
+            keys: doc! { "uid": 1 },
+            options: None,
+        })
+        .unwrap();
+
+    for col_name in ["indexed", "unindexed"] {
+        let collection = db.collection::<Document>(col_name);
+        let queries = if col_name == "indexed" { bench.scaled(10_000) } else { bench.scaled(100) };
+        let mut random = XorShift::new();
+        let mut samples = Samples::new(format!("find/{}", col_name));
+        for _ in 0..queries {
+            let uid = random.next_below(count as u64) as i64;
+            let result = samples.measure(1, || {
+                collection
+                    .find(doc! { "uid": uid })
+                    .unwrap()
+                    .collect::<polodb_core::Result<Vec<Document>>>()
+                    .unwrap()
+            });
+            assert_eq!(result.len(), 1);
+        }
+        samples.report(&db.lsm_metrics());
+    }
+}
+
+fn bench_aggregate_count(bench: &Bench) {
+    let count = bench.scaled(50_000);
+    let db = open_db("bench-aggregate", Config::default());
+    fill_collection(&db, "test", count);
+    let collection = db.collection::<Document>("test");
+
+    let mut random = XorShift::new();
+    let mut samples = Samples::new("aggregate/match_count");
+    for _ in 0..50 {
+        let group = random.next_below(100) as i64;
+        let result = samples.measure(1, || {
+            collection
+                .aggregate(vec![
+                    doc! { "$match": { "group": group } },
+                    doc! { "$count": "count" },
+                ])
+                .unwrap()
+                .collect::<polodb_core::Result<Vec<Document>>>()
+                .unwrap()
+        });
+        assert_eq!(result.len(), 1);
+    }
+    samples.report(&db.lsm_metrics());
+}
+
+fn main() {
+    let bench = Bench::from_env();
+
+    for value_size in VALUE_SIZES {
+        bench.run(&format!("kv/{}B", value_size), |bench| bench_kv(bench, value_size));
+    }
+    bench.run("wal_commit", bench_small_transactions);
+    bench.run("compaction", bench_compaction);
+    bench.run("open", bench_open);
+    bench.run("insert_many", bench_insert_many);
+    bench.run("find", bench_find);
+    bench.run("aggregate", bench_aggregate_count);
+}
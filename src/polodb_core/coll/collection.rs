@@ -158,6 +158,26 @@ impl<T>  Collection<T>
         let db = self.db.upgrade().ok_or(Error::DbIsClosed)?;
         db.drop_collection(&self.name, &mut session.inner)
     }
+
+    /// Inserts the BSON documents concatenated in `buffer`
+    /// in one transaction, the same as [`Collection::insert_many`].
+    /// It's an error if a document is malformed, nothing is inserted.
+    ///
+    /// The documents are written as they are, only the primary keys
+    /// and the values of the indexes are decoded.
+    /// A document without the `_id` is copied to add it.
+    pub fn insert_many_raw(&self, buffer: &[u8]) -> Result<InsertManyResult> {
+        let db = self.db.upgrade().ok_or(Error::DbIsClosed)?;
+        let docs = crate::utils::bson::split_concatenated_documents(buffer)?;
+        let mut session = db.start_session()?;
+        db.insert_many_raw(&self.name, &docs, &mut session)
+    }
+
+    pub fn insert_many_raw_with_session(&self, buffer: &[u8], session: &mut ClientSession) -> Result<InsertManyResult> {
+        let db = self.db.upgrade().ok_or(Error::DbIsClosed)?;
+        let docs = crate::utils::bson::split_concatenated_documents(buffer)?;
+        db.insert_many_raw(&self.name, &docs, &mut session.inner)
+    }
 }
 
 impl<T>  Collection<T>
@@ -254,4 +274,26 @@ impl<T>  Collection<T>
         db.aggregate_with_owned_session(&self.name, pipeline, session)
     }
 
+    /// Runs the query to the end, returns how it's run instead of the documents.
+    /// The document has the access path chosen, the program,
+    /// and the counts of the rows and the ops.
+    pub fn explain_find(&self, filter: impl Into<Option<Document>>) -> Result<Document> {
+        let db = self.db.upgrade().ok_or(Error::DbIsClosed)?;
+        let mut session = db.start_session()?;
+        db.explain_find(&self.name, filter.into(), &mut session)
+    }
+
+    /// Explains the query using the provided `ClientSession`, see [`Collection::explain_find`].
+    pub fn explain_find_with_session(&self, filter: impl Into<Option<Document>>, session: &mut ClientSession) -> Result<Document> {
+        let db = self.db.upgrade().ok_or(Error::DbIsClosed)?;
+        db.explain_find(&self.name, filter.into(), &mut session.inner)
+    }
+
+    /// Runs the aggregation to the end, returns how it's run, see [`Collection::explain_find`].
+    pub fn explain_aggregate(&self, pipeline: impl IntoIterator<Item = Document>) -> Result<Document> {
+        let db = self.db.upgrade().ok_or(Error::DbIsClosed)?;
+        let mut session = db.start_session()?;
+        db.explain_aggregate(&self.name, pipeline.into_iter().collect(), &mut session)
+    }
+
 }
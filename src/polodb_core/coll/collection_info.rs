@@ -9,6 +9,7 @@ use serde::{Deserialize, Serialize};
 use indexmap::IndexMap;
 use uuid::Uuid;
 use crate::IndexOptions;
+use crate::index::IndexStatistics;
 use crate::utils::bson::bson_datetime_now;
 
 #[derive(Debug, Clone, Deserialize, Serialize)]
@@ -19,6 +20,10 @@ pub struct IndexInfo {
     pub keys: IndexMap<String, i8>,
 
     pub options: Option<IndexOptions>,
+
+    /// Attached before the query is planned, never persisted
+    #[serde(skip)]
+    pub statistics: Option<IndexStatistics>,
 }
 
 impl IndexInfo {
@@ -29,6 +34,7 @@ impl IndexInfo {
         IndexInfo {
             keys,
             options,
+            statistics: None,
         }
     }
 
@@ -73,6 +79,16 @@ pub struct CollectionSpecification {
     /// The name is converted to the underline format.
     /// For examples, `author.age` is converted to `author_age`
     pub indexes: IndexMap<String, IndexInfo>,
+
+    /// Bumped when the indexes change,
+    /// the programs compiled are cached by it.
+    #[serde(default, skip_serializing_if = "is_first_version")]
+    pub version: u64,
+}
+
+#[inline]
+fn is_first_version(version: &u64) -> bool {
+    *version == 0
 }
 
 impl CollectionSpecification {
@@ -97,6 +113,8 @@ impl CollectionSpecification {
             },
 
             indexes: IndexMap::new(),
+
+            version: 0,
         }
     }
 
@@ -12,6 +12,11 @@ use crate::TransactionType;
 #[serde(rename_all = "camelCase")]
 pub struct FindCommandOptions {
     pub session_id: Option<ObjectId>,
+    /// Reply the first batch of the documents with a cursor,
+    /// the others are fetched by [`GetMoreCommand`].
+    pub batch_size: Option<u32>,
+    /// Reply how the query is run instead of the documents
+    pub explain: Option<bool>,
 }
 
 #[derive(Serialize, Deserialize)]
@@ -125,6 +130,19 @@ pub struct DropSessionCommand {
     pub session_id: ObjectId,
 }
 
+#[derive(Serialize, Deserialize)]
+#[serde(rename_all = "camelCase")]
+pub struct GetMoreCommand {
+    pub cursor_id: i64,
+    pub batch_size: Option<u32>,
+}
+
+#[derive(Serialize, Deserialize)]
+#[serde(rename_all = "camelCase")]
+pub struct KillCursorsCommand {
+    pub cursor_ids: Vec<i64>,
+}
+
 #[derive(Serialize, Deserialize)]
 #[serde(tag = "command")]
 pub enum CommandMessage {
@@ -140,6 +158,10 @@ pub enum CommandMessage {
     AbortTransaction(AbortTransactionCommand),
     StartSession,
     DropSession(DropSessionCommand),
+    GetMore(GetMoreCommand),
+    KillCursors(KillCursorsCommand),
+    /// The metrics of the database and the storage engine
+    ServerStatus,
     SafelyQuit,
 }
 
@@ -72,19 +72,260 @@ impl ConfigBuilder {
         self
     }
 
+    pub fn get_background_compaction(&self) -> bool {
+        self.inner.background_compaction
+    }
+
+    /// Run minor and major compaction on a background thread
+    /// instead of the thread committing the transaction.
+    ///
+    /// Not available on wasm32.
+    pub fn set_background_compaction(&mut self, v: bool) -> &mut Self {
+        self.inner.background_compaction = v;
+        self
+    }
+
+    pub fn get_level0_stall_limit(&self) -> usize {
+        self.inner.level0_stall_limit
+    }
+
+    /// The writers are stalled when the count of segments
+    /// on level 0 is greater than this value,
+    /// until the background compaction catches up.
+    pub fn set_level0_stall_limit(&mut self, v: usize) -> &mut Self {
+        self.inner.level0_stall_limit = v;
+        self
+    }
+
+    pub fn get_log_group_commit(&self) -> bool {
+        self.inner.log_group_commit
+    }
+
+    /// Let the concurrent commits share one sync of the log.
+    ///
+    /// The durability of a commit depends on the mode:
+    /// - By default the record is written to the log file and flushed,
+    ///   but not synced. A commit survives a crash of the process,
+    ///   it may be lost if the OS crashes or the power is lost.
+    /// - In the group mode the record is synced with `fsync` before
+    ///   the commit returns, it survives a crash of the OS too.
+    ///   If the sync fails, the commit returns the error and the log
+    ///   is poisoned, all the later commits fail until the database is reopened.
+    ///   The failed commit may already be visible to the other sessions,
+    ///   but it's not persisted, it's gone when the database is reopened.
+    pub fn set_log_group_commit(&mut self, v: bool) -> &mut Self {
+        self.inner.log_group_commit = v;
+        self
+    }
+
+    pub fn get_log_group_commit_window_us(&self) -> u64 {
+        self.inner.log_group_commit_window_us
+    }
+
+    /// How long the leader of a group waits for more commits, in microseconds.
+    pub fn set_log_group_commit_window_us(&mut self, v: u64) -> &mut Self {
+        self.inner.log_group_commit_window_us = v;
+        self
+    }
+
+    pub fn get_log_group_commit_max_batch(&self) -> usize {
+        self.inner.log_group_commit_max_batch
+    }
+
+    /// The max count of commits written in one group.
+    pub fn set_log_group_commit_max_batch(&mut self, v: usize) -> &mut Self {
+        self.inner.log_group_commit_max_batch = v;
+        self
+    }
+
+    pub fn get_lsm_bloom_bits_per_key(&self) -> u32 {
+        self.inner.lsm_bloom_bits_per_key
+    }
+
+    /// The bits per key of the Bloom filter built for every segment,
+    /// 0 to disable the filters.
+    pub fn set_lsm_bloom_bits_per_key(&mut self, v: u32) -> &mut Self {
+        self.inner.lsm_bloom_bits_per_key = v;
+        self
+    }
+
+    pub fn get_lsm_mmap_read(&self) -> bool {
+        self.inner.lsm_mmap_read
+    }
+
+    /// Read the values from the mapped file,
+    /// otherwise use the positional reads on the file.
+    pub fn set_lsm_mmap_read(&mut self, v: bool) -> &mut Self {
+        self.inner.lsm_mmap_read = v;
+        self
+    }
+
+    pub fn get_lsm_value_cache_size(&self) -> usize {
+        self.inner.lsm_value_cache_size
+    }
+
+    /// The capacity in bytes of the cache of the values
+    /// read from the segments, 0 to disable the cache.
+    pub fn set_lsm_value_cache_size(&mut self, v: usize) -> &mut Self {
+        self.inner.lsm_value_cache_size = v;
+        self
+    }
+
+    pub fn get_lsm_skip_list_mem_table(&self) -> bool {
+        self.inner.lsm_skip_list_mem_table
+    }
+
+    /// Store the committed data of the memory table in a skip list
+    /// with versions, instead of the persistent b-tree.
+    /// The sessions read it without copying or locking the nodes,
+    /// the old versions are kept until the table is synced.
+    pub fn set_lsm_skip_list_mem_table(&mut self, v: bool) -> &mut Self {
+        self.inner.lsm_skip_list_mem_table = v;
+        self
+    }
+
+    pub fn get_lsm_leveled_compaction(&self) -> bool {
+        self.inner.lsm_leveled_compaction
+    }
+
+    /// Keep the levels after level 0 as sorted runs of
+    /// segments not overlapped, and merge a segment into the
+    /// overlapped segments of the next level once the level
+    /// exceeds its size. Otherwise the levels are merged as a whole.
+    ///
+    /// Not available on IndexedDB.
+    pub fn set_lsm_leveled_compaction(&mut self, v: bool) -> &mut Self {
+        self.inner.lsm_leveled_compaction = v;
+        self
+    }
+
+    pub fn get_lsm_level_size_ratio(&self) -> u32 {
+        self.inner.lsm_level_size_ratio
+    }
+
+    /// The ratio of the size between the adjacent levels
+    /// of the leveled compaction.
+    pub fn set_lsm_level_size_ratio(&mut self, v: u32) -> &mut Self {
+        self.inner.lsm_level_size_ratio = v;
+        self
+    }
+
+    pub fn get_lsm_level_compression(&self) -> &[LsmCompression] {
+        &self.inner.lsm_level_compression
+    }
+
+    /// The codec of the blocks written to every level,
+    /// the last one is also used by the deeper levels.
+    /// The blocks are not compressed if it's empty.
+    ///
+    /// Only available on the file backend.
+    pub fn set_lsm_level_compression(&mut self, v: Vec<LsmCompression>) -> &mut Self {
+        self.inner.lsm_level_compression = v;
+        self
+    }
+
+    pub fn get_bulk_load_min_bytes(&self) -> usize {
+        self.inner.bulk_load_min_bytes
+    }
+
+    /// The batches of `insert_many` and the index builds writing
+    /// more bytes than this are committed as bulk loads.
+    /// They are sorted and written to a segment on the commit
+    /// without the log.
+    ///
+    /// Off by default (`usize::MAX`). In the group mode of the log
+    /// the segment is synced before the commit returns, otherwise it's
+    /// only flushed, as durable as the default mode of the log.
+    pub fn set_bulk_load_min_bytes(&mut self, v: usize) -> &mut Self {
+        self.inner.bulk_load_min_bytes = v;
+        self
+    }
+
+    pub fn get_plan_cache_size(&self) -> usize {
+        self.inner.plan_cache_size
+    }
+
+    /// The count of the programs compiled kept by the shapes
+    /// of the queries, 0 to compile every query.
+    pub fn set_plan_cache_size(&mut self, v: usize) -> &mut Self {
+        self.inner.plan_cache_size = v;
+        self
+    }
+
+    pub fn get_group_memory_budget(&self) -> usize {
+        self.inner.group_memory_budget
+    }
+
+    /// The bytes of the groups a `$group` stage keeps in memory,
+    /// the groups exceeding it are spilled to the temp files.
+    pub fn set_group_memory_budget(&mut self, v: usize) -> &mut Self {
+        self.inner.group_memory_budget = v;
+        self
+    }
+
+    pub fn get_scan_parallelism(&self) -> usize {
+        self.inner.scan_parallelism
+    }
+
+    /// The threads scanning a collection for the count and
+    /// the `$count` / `$group` pipelines, 1 disables the parallel scans.
+    pub fn set_scan_parallelism(&mut self, v: usize) -> &mut Self {
+        self.inner.scan_parallelism = v;
+        self
+    }
+
+    pub fn get_idb_write_batching(&self) -> bool {
+        self.inner.idb_write_batching
+    }
+
+    /// Queue the writes to IndexedDB and flush them together
+    /// in one transaction after the current task, instead of
+    /// a transaction for every log commit and segment.
+    /// The writes of a commit are persisted a little later.
+    ///
+    /// Only available on IndexedDB.
+    pub fn set_idb_write_batching(&mut self, v: bool) -> &mut Self {
+        self.inner.idb_write_batching = v;
+        self
+    }
+
     pub fn take(self) -> Config {
         self.inner
     }
 
 }
 
+/// The codec of the blocks of a LSM segment
+#[derive(Debug, Copy, Clone, Eq, PartialEq)]
+pub enum LsmCompression {
+    None,
+    Lz4,
+}
 
+#[derive(Clone)]
 pub struct Config {
-    pub init_block_count:  u64,
-    pub journal_full_size: u64,
-    pub lsm_page_size:     u32,
-    pub lsm_block_size:    u32,
-    pub sync_log_count:    u64,
+    pub init_block_count:           u64,
+    pub journal_full_size:          u64,
+    pub lsm_page_size:              u32,
+    pub lsm_block_size:             u32,
+    pub sync_log_count:             u64,
+    pub background_compaction:      bool,
+    pub level0_stall_limit:         usize,
+    pub log_group_commit:           bool,
+    pub log_group_commit_window_us: u64,
+    pub log_group_commit_max_batch: usize,
+    pub lsm_bloom_bits_per_key:     u32,
+    pub lsm_mmap_read:              bool,
+    pub lsm_value_cache_size:       usize,
+    pub lsm_skip_list_mem_table:    bool,
+    pub lsm_leveled_compaction:     bool,
+    pub lsm_level_size_ratio:       u32,
+    pub lsm_level_compression:      Vec<LsmCompression>,
+    pub bulk_load_min_bytes:        usize,
+    pub plan_cache_size:            usize,
+    pub group_memory_budget:        usize,
+    pub scan_parallelism:           usize,
+    pub idb_write_batching:         bool,
 }
 
 #[cfg(not(target_arch = "wasm32"))]
@@ -103,7 +344,37 @@ impl Default for Config {
             lsm_page_size: 4096,
             lsm_block_size: 4 * 1024 * 1024,
             sync_log_count: SYNC_LOG_COUNT,
+            background_compaction: false,
+            level0_stall_limit: 12,
+            log_group_commit: false,
+            log_group_commit_window_us: 200,
+            log_group_commit_max_batch: 64,
+            lsm_bloom_bits_per_key: 10,
+            lsm_mmap_read: true,
+            lsm_value_cache_size: 8 * 1024 * 1024,
+            lsm_skip_list_mem_table: false,
+            lsm_leveled_compaction: false,
+            lsm_level_size_ratio: 10,
+            lsm_level_compression: vec![],
+            bulk_load_min_bytes: usize::MAX,
+            plan_cache_size: 256,
+            group_memory_budget: 64 * 1024 * 1024,
+            scan_parallelism: 1,
+            idb_write_batching: false,
+        }
+    }
+
+}
+
+impl Config {
+
+    /// The codec of the segments written to the level
+    pub fn lsm_compression_of_level(&self, level: usize) -> LsmCompression {
+        if self.lsm_level_compression.is_empty() {
+            return LsmCompression::None;
         }
+        let index = std::cmp::min(level, self.lsm_level_compression.len() - 1);
+        self.lsm_level_compression[index]
     }
 
 }
@@ -3,10 +3,10 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at https://mozilla.org/MPL/2.0/.
  */
-use std::cmp::Ordering;
 use std::sync::Arc;
 use bson::Bson;
 use crate::Result;
+use crate::index::{prefix_successor, KeyInterval};
 use crate::lsm::LsmKvInner;
 use crate::lsm::multi_cursor::MultiCursor;
 use crate::session::SessionInner;
@@ -17,6 +17,14 @@ pub(crate) struct Cursor {
     pub(crate)  prefix_bytes: Vec<u8>,
     kv_cursor:    MultiCursor,
     current_key:  Option<Arc<[u8]>>,
+    /// The intervals of the index keys iterated,
+    /// set by [`Cursor::reset_by_index_intervals`].
+    index_intervals: Vec<KeyInterval>,
+    index_interval: usize,
+    /// The part of the keys under the prefix scanned,
+    /// set by [`Cursor::set_scan_range`] for a partitioned scan.
+    scan_start: Option<Vec<u8>>,
+    scan_end: Option<Vec<u8>>,
 }
 
 impl Cursor {
@@ -33,6 +41,25 @@ impl Cursor {
             prefix_bytes,
             kv_cursor,
             current_key: None,
+            index_intervals: Vec::new(),
+            index_interval: 0,
+            scan_start: None,
+            scan_end: None,
+        }
+    }
+
+    /// Only scan the keys in [start, end) on [`Cursor::reset`],
+    /// the range is not bounded if it's `None`.
+    pub fn set_scan_range(&mut self, start: Option<Vec<u8>>, end: Option<Vec<u8>>) {
+        self.scan_start = start;
+        self.scan_end = end;
+    }
+
+    #[inline]
+    fn before_scan_end(&self, key: &[u8]) -> bool {
+        match &self.scan_end {
+            Some(end) => key < end.as_slice(),
+            None => true,
         }
     }
 
@@ -46,7 +73,8 @@ impl Cursor {
     }
 
     pub fn reset(&mut self) -> Result<()> {
-        self.kv_cursor.seek(self.prefix_bytes.as_slice())?;
+        let start = self.scan_start.as_ref().unwrap_or(&self.prefix_bytes);
+        self.kv_cursor.seek(start.as_slice())?;
 
         self.current_key = self.kv_cursor.key();
 
@@ -77,45 +105,89 @@ impl Cursor {
     }
 
     fn reset_by_custom_key(&mut self, key_buffer: &[u8]) -> Result<bool> {
-        self.kv_cursor.seek(key_buffer)?;
+        let found = self.kv_cursor.seek_exact(key_buffer)?;
 
         self.current_key = self.kv_cursor.key();
-        if let Some(found) = &self.current_key {
-            return Ok(found.as_ref().cmp(key_buffer) == Ordering::Equal);
-        }
-        return Ok(false)
+        Ok(found)
     }
 
     pub fn reset_by_index_value(&mut self, index_value: &Bson) -> Result<bool> {
-        let key_buffer = {
-            let mut key_buffer = self.prefix_bytes.clone();
-            let primary_key_buffer = crate::utils::bson::stacked_key([
-                index_value,
-            ])?;
+        let value_buffer = crate::utils::bson::stacked_key([
+            index_value,
+        ])?;
+        let end = prefix_successor(&value_buffer);
 
-            key_buffer.extend_from_slice(&primary_key_buffer);
+        self.reset_by_index_intervals(vec![(value_buffer, end)])
+    }
+
+    /// Iterate the index keys whose values are in the intervals,
+    /// the intervals must be sorted and not overlapped.
+    pub fn reset_by_index_intervals(&mut self, intervals: Vec<KeyInterval>) -> Result<bool> {
+        let prefix_bytes = self.prefix_bytes.as_slice();
+        let intervals: Vec<KeyInterval> = intervals
+            .into_iter()
+            .map(|(start, end)| {
+                let mut start_key = prefix_bytes.to_vec();
+                start_key.extend_from_slice(&start);
+                let mut end_key = prefix_bytes.to_vec();
+                end_key.extend_from_slice(&end);
+                (start_key, end_key)
+            })
+            .collect();
+        self.index_intervals = intervals;
+        self.index_interval = 0;
+
+        match self.index_intervals.first() {
+            Some((start, _)) => {
+                self.kv_cursor.seek(start.as_slice())?;
+                self.current_key = self.kv_cursor.key();
+            }
+            None => {
+                self.current_key = None;
+            }
+        }
+        self.skip_to_index_interval()?;
 
-            key_buffer
-        };
+        Ok(self.peek_index_key().is_some())
+    }
 
-        self.kv_cursor.seek(key_buffer.as_slice())?;
+    /// Seek the next intervals until the current key is in one of them.
+    fn skip_to_index_interval(&mut self) -> Result<()> {
+        while self.index_interval < self.index_intervals.len() {
+            if self.peek_index_key().is_some() {
+                break;
+            }
 
-        self.current_key = self.kv_cursor.key();
-        if let Some(found) = &self.current_key {
-            let start_with = found.starts_with(key_buffer.as_slice());
-            return Ok(start_with);
+            self.index_interval += 1;
+            if let Some((start, _)) = self.index_intervals.get(self.index_interval) {
+                self.kv_cursor.seek(start.as_slice())?;
+                self.current_key = self.kv_cursor.key();
+            }
         }
+        Ok(())
+    }
 
-        return Ok(false);
+    /// The current key if it's in the intervals iterated,
+    /// the keys of the other values are not returned.
+    pub fn peek_index_key(&self) -> Option<Arc<[u8]>> {
+        let (start, end) = self.index_intervals.get(self.index_interval)?;
+        match &self.current_key {
+            Some(key) if key.as_ref() >= start.as_slice() && key.as_ref() < end.as_slice() => {
+                Some(key.clone())
+            }
+            _ => None,
+        }
     }
 
-    pub fn peek_key(&self) -> Option<Arc<[u8]>> {
-        self.current_key.clone()
+    /// Move to the next index key in the intervals
+    pub fn next_index_key(&mut self) -> Result<()> {
+        self.next()?;
+        self.skip_to_index_interval()
     }
 
     pub fn peek_data(&self, db: &LsmKvInner) -> Result<Option<Arc<[u8]>>> {
         if let Some(current_key) = &self.current_key {
-            if !current_key.starts_with(self.prefix_bytes.as_slice()) {
+            if !current_key.starts_with(self.prefix_bytes.as_slice()) || !self.before_scan_end(current_key) {
                 return Ok(None);
             }
 
@@ -134,7 +206,7 @@ impl Cursor {
             if !current_key.starts_with(self.prefix_bytes.as_slice()) {
                 return false;
             }
-            true
+            self.before_scan_end(current_key)
         } else {
             false
         }
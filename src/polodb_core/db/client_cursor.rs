@@ -3,6 +3,7 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at https://mozilla.org/MPL/2.0/.
  */
+use std::borrow::Cow;
 use std::fmt;
 use std::marker::PhantomData;
 use bson::Bson;
@@ -52,6 +53,50 @@ impl<T: DeserializeOwned> ClientCursor<T> {
         Ok(result)
     }
 
+    /// Move to the next document and return its BSON bytes,
+    /// `None` if the cursor is exhausted.
+    ///
+    /// The bytes are borrowed from the engine if the document is
+    /// returned as stored, they're valid until the cursor moves.
+    /// The document is not decoded, so [`ClientCursor::deserialize_current`]
+    /// can't be used for it.
+    pub fn advance_raw(&mut self) -> Result<Option<Cow<'_, [u8]>>> {
+        self.vm.set_raw_result(true);
+        let result = self.vm.execute(&mut self.session);
+        self.vm.set_raw_result(false);
+        result?;
+
+        if !self.has_row() {
+            return Ok(None);
+        }
+
+        if let Some(buf) = self.vm.stack_top_raw() {
+            return Ok(Some(Cow::Borrowed(buf.as_ref())));
+        }
+        let buf = bson::to_vec(self.get())?;
+        Ok(Some(Cow::Owned(buf)))
+    }
+
+    /// Append the BSON bytes of the next `n` documents at most to `buffer`,
+    /// and the offsets they start at to `offsets`.
+    /// Return the count of the documents appended,
+    /// it's less than `n` if the cursor is exhausted.
+    pub fn next_raw_batch(&mut self, n: usize, buffer: &mut Vec<u8>, offsets: &mut Vec<usize>) -> Result<usize> {
+        let mut count: usize = 0;
+
+        while count < n {
+            let raw_doc = match self.advance_raw()? {
+                Some(raw_doc) => raw_doc,
+                None => break,
+            };
+            offsets.push(buffer.len());
+            buffer.extend_from_slice(raw_doc.as_ref());
+            count += 1;
+        }
+
+        Ok(count)
+    }
+
 }
 
 impl<T: DeserializeOwned> fmt::Display for ClientCursor<T> {
@@ -15,6 +15,7 @@ use crate::{ClientSession, Config};
 use super::db_inner::DatabaseInner;
 use crate::coll::Collection;
 use crate::metrics::Metrics;
+use crate::lsm::LsmMetrics;
 
 pub(crate) static SHOULD_LOG: AtomicBool = AtomicBool::new(false);
 
@@ -79,7 +80,11 @@ impl Database {
 
     #[cfg(target_arch = "wasm32")]
     pub fn open_indexeddb(init_data: JsValue) -> Result<Database> {
-        let config = Config::default();
+        Database::open_indexeddb_with_config(init_data, Config::default())
+    }
+
+    #[cfg(target_arch = "wasm32")]
+    pub fn open_indexeddb_with_config(init_data: JsValue, config: Config) -> Result<Database> {
         let inner = DatabaseInner::open_indexeddb(init_data, config)?;
 
         Ok(Database {
@@ -92,6 +97,12 @@ impl Database {
         self.inner.metrics()
     }
 
+    /// Return the metrics object of the storage engine,
+    /// it's enabled separately.
+    pub fn lsm_metrics(&self) -> LsmMetrics {
+        self.inner.lsm_metrics()
+    }
+
     /// Creates a new collection in the database with the given `name`.
     pub fn create_collection(&self, name: &str) -> Result<()> {
         let _ = self.inner.create_collection(name)?;
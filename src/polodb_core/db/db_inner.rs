@@ -3,15 +3,18 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at https://mozilla.org/MPL/2.0/.
  */
-use std::borrow::Borrow;
+use std::borrow::{Borrow, Cow};
 use std::collections::HashMap;
-use bson::{Bson, Document};
+use std::convert::TryFrom;
+use std::sync::atomic::{AtomicU64, Ordering};
+use bson::{Bson, Document, RawBson, RawBsonRef, RawDocument, RawDocumentBuf};
+use indexmap::IndexMap;
 use serde::Serialize;
 use super::db::Result;
 use crate::errors::Error;
 use crate::{ClientSessionCursor, LsmKv, TransactionType};
 use crate::Config;
-use crate::vm::SubProgram;
+use crate::vm::{PartitionedScan, PartitionedStage, SubProgram, SubProgramCache};
 use crate::meta_doc_helper::meta_doc_key;
 use crate::index::{IndexBuilder, IndexModel, IndexOptions};
 use crate::db::client_cursor::ClientCursor;
@@ -27,10 +30,18 @@ use crate::coll::collection_info::{
     IndexInfo,
 };
 use crate::cursor::Cursor;
-use crate::index::{IndexHelper, IndexHelperOperation};
+use crate::index::{
+    prefix_successor,
+    IndexBatch,
+    IndexHelper,
+    IndexHelperOperation,
+    IndexStatisticsGatherer,
+    IndexStatisticsRegistry,
+};
 use crate::metrics::Metrics;
+use crate::lsm::LsmMetrics;
 use crate::session::SessionInner;
-use crate::vm::VM;
+use crate::vm::{VM, VmState};
 
 macro_rules! try_multiple {
     ($err: expr, $action: expr) => {
@@ -68,7 +79,10 @@ pub(crate) struct DatabaseInner {
     kv_engine:    LsmKv,
     node_id:      [u8; 6],
     metrics:      Metrics,
-    #[allow(dead_code)]
+    index_statistics: IndexStatisticsRegistry,
+    plan_cache:   SubProgramCache,
+    /// The last version given to a collection spec
+    spec_version: AtomicU64,
     config:       Config,
 }
 
@@ -82,7 +96,7 @@ impl DatabaseInner {
     #[cfg(not(target_arch = "wasm32"))]
     pub fn open_file(path: &Path, config: Config) -> Result<DatabaseInner> {
         let metrics = Metrics::new();
-        let kv_engine = LsmKv::open_file(path)?;
+        let kv_engine = LsmKv::open_file_with_config(path, config.clone())?;
 
         DatabaseInner::open_with_backend(
             kv_engine,
@@ -94,7 +108,7 @@ impl DatabaseInner {
     #[cfg(target_arch = "wasm32")]
     pub fn open_indexeddb(init_data: JsValue, config: Config) -> Result<DatabaseInner> {
         let metrics = Metrics::new();
-        let kv_engine = LsmKv::open_indexeddb(init_data)?;
+        let kv_engine = LsmKv::open_indexeddb(init_data, config.clone())?;
 
         DatabaseInner::open_with_backend(
             kv_engine,
@@ -105,7 +119,7 @@ impl DatabaseInner {
 
     pub fn open_memory(config: Config) -> Result<DatabaseInner> {
         let metrics = Metrics::new();
-        let kv_engine = LsmKv::open_memory()?;
+        let kv_engine = LsmKv::open_memory_with_config(config.clone())?;
         DatabaseInner::open_with_backend(
             kv_engine,
             config,
@@ -126,6 +140,9 @@ impl DatabaseInner {
             // first_page,
             node_id,
             metrics,
+            index_statistics: IndexStatisticsRegistry::new(),
+            plan_cache: SubProgramCache::new(config.plan_cache_size),
+            spec_version: AtomicU64::new(0),
             config,
         };
 
@@ -136,6 +153,30 @@ impl DatabaseInner {
         self.metrics.clone()
     }
 
+    #[inline]
+    pub fn lsm_metrics(&self) -> LsmMetrics {
+        self.kv_engine.metrics()
+    }
+
+    /// The program of the same shape is bound to the documents
+    /// instead of compiling again, see [`SubProgramCache`]
+    fn compile_cached<F>(
+        &self,
+        kind: &str,
+        col_spec: &CollectionSpecification,
+        roots: &[&Document],
+        compile: F,
+    ) -> Result<SubProgram>
+    where
+        F: FnOnce() -> Result<SubProgram>,
+    {
+        let (subprogram, hit) = self.plan_cache.get_or_compile(kind, col_spec, roots, compile)?;
+        if hit {
+            self.metrics.add_plan_cache_hit_count();
+        }
+        Ok(subprogram)
+    }
+
     pub fn start_session(&self) -> Result<SessionInner> {
         let kv_session = self.kv_engine.new_session();
         let inner = SessionInner::new(kv_session);
@@ -262,11 +303,64 @@ impl DatabaseInner {
         Ok(spec)
     }
 
+    /// The scan split for the workers, if the parallel scans are
+    /// enabled and the program scans the whole collection.
+    fn partitioned_scan(
+        &self,
+        col_spec: &CollectionSpecification,
+        program: SubProgram,
+        session: &SessionInner,
+    ) -> Result<Option<PartitionedScan>> {
+        PartitionedScan::new(
+            self.kv_engine.clone(),
+            self.metrics.clone(),
+            self.index_statistics.clone(),
+            session,
+            col_spec,
+            program,
+            self.config.scan_parallelism,
+        )
+    }
+
+    /// Run a `$count` or `$group` pipeline by the workers,
+    /// `None` if it can't be partitioned.
+    fn aggregate_partitioned(
+        &self,
+        col_spec: &CollectionSpecification,
+        pipeline: &[Document],
+        session: &SessionInner,
+    ) -> Result<Option<SubProgram>> {
+        if self.config.scan_parallelism <= 1 {
+            return Ok(None);
+        }
+        let (before, stage) = match PartitionedStage::from_pipeline(pipeline)? {
+            Some(result) => result,
+            None => return Ok(None),
+        };
+        let program = match before.first().and_then(|first| first.get("$match")) {
+            Some(Bson::Document(query)) => self.compile_cached(
+                "find",
+                col_spec,
+                &[query],
+                || SubProgram::compile_query(col_spec, query, true),
+            )?,
+            Some(_) => return Ok(None),
+            None => SubProgram::compile_query_all(col_spec, true)?,
+        };
+        let scan = match self.partitioned_scan(col_spec, program, session)? {
+            Some(scan) => scan,
+            None => return Ok(None),
+        };
+        let values = scan.merge_stage(stage, self.config.group_memory_budget)?;
+        Ok(Some(SubProgram::compile_values(values)))
+    }
+
     pub(crate) fn make_handle<T: DeserializeOwned>(&self, program: SubProgram) -> Result<ClientSessionCursor<T>> {
         let vm = VM::new(
             self.kv_engine.clone(),
             program,
             self.metrics.clone(),
+            self.index_statistics.clone(),
         );
         Ok(ClientSessionCursor::new(vm))
     }
@@ -282,33 +376,22 @@ impl DatabaseInner {
     }
 
     fn internal_create_index(&self, session: &mut SessionInner, col_name: &str, index: IndexModel) -> Result<()> {
-        if index.keys.len() != 1 {
-            return Err(Error::OnlySupportSingleFieldIndexes(Box::new(index.keys)));
+        if index.keys.is_empty() {
+            return Err(Error::InvalidIndexKeys(Box::new(index.keys)));
         }
 
-        let options = index.options.as_ref();
-
-        let tuples = index.keys.iter().collect::<Vec<(&String, &Bson)>>();
-        let first_tuple = tuples.first().unwrap();
-
-        let (key, value) = first_tuple;
-
-        self.create_single_index(session, col_name, key.as_str(), value, options)
-    }
-
-    fn create_single_index(
-        &self,
-        session: &mut SessionInner,
-        col_name: &str,
-        key: &str,
-        order: &Bson,
-        options: Option<&IndexOptions>,
-    ) -> Result<()> {
-        if !DatabaseInner::is_num_1(order) {
-            return Err(Error::OnlySupportsAscendingOrder(key.to_string()));
+        let mut keys = IndexMap::with_capacity(index.keys.len());
+        for (key, order) in index.keys.iter() {
+            let order = match DatabaseInner::index_order_of(order) {
+                Some(order) => order,
+                None => return Err(Error::InvalidIndexOrder(key.to_string())),
+            };
+            keys.insert(key.clone(), order);
         }
 
-        let index_name = DatabaseInner::make_index_name(key, 1, options)?;
+        let options = index.options.as_ref();
+
+        let index_name = DatabaseInner::make_index_name(&keys, options)?;
 
         let test_collection_spec = self.internal_get_collection_id_by_name(session, col_name);
         let mut collection_spec = match test_collection_spec {
@@ -326,16 +409,16 @@ impl DatabaseInner {
             return Ok(())
         }
 
-        let index_info = IndexInfo::single_index(
-            key.to_string(),
-            1,
-            options.map(|x| x.clone()),
-        );
+        let index_info = IndexInfo {
+            keys,
+            options: options.map(|x| x.clone()),
+            statistics: None,
+        };
         collection_spec.indexes.insert(index_name.clone(), index_info.clone());
 
-        DatabaseInner::update_collection_spec(
+        self.update_collection_spec(
             col_name,
-            &collection_spec,
+            &mut collection_spec,
             session,
         )?;
 
@@ -347,6 +430,34 @@ impl DatabaseInner {
         )
     }
 
+    /// Attach the statistics of the indexes for the planner,
+    /// they are gathered the first time after the database is opened.
+    fn attach_index_statistics(&self, session: &mut SessionInner, col_spec: &mut CollectionSpecification) -> Result<()> {
+        let col_name = col_spec._id.clone();
+
+        for (index_name, index_info) in col_spec.indexes.iter_mut() {
+            let statistics = match self.index_statistics.get(&col_name, index_name) {
+                Some(statistics) => statistics,
+                None => {
+                    let mut builder = IndexBuilder::new(
+                        &self.kv_engine,
+                        &self.index_statistics,
+                        session,
+                        &col_name,
+                        index_name,
+                        index_info,
+                    );
+                    builder.gather_statistics()?;
+
+                    self.index_statistics.get(&col_name, index_name).unwrap_or_default()
+                }
+            };
+            index_info.statistics = Some(statistics);
+        }
+
+        Ok(())
+    }
+
     fn build_index(
         &self,
         session: &mut SessionInner,
@@ -356,6 +467,7 @@ impl DatabaseInner {
     ) -> Result<()> {
         let mut builder = IndexBuilder::new(
             &self.kv_engine,
+            &self.index_statistics,
             session,
             col_name,
             index_name,
@@ -396,6 +508,7 @@ impl DatabaseInner {
 
         let mut builder = IndexBuilder::new(
             &self.kv_engine,
+            &self.index_statistics,
             session,
             col_name,
             index_name,
@@ -406,16 +519,30 @@ impl DatabaseInner {
 
         collection_spec.indexes.remove(index_name);
 
-        DatabaseInner::update_collection_spec(
+        self.update_collection_spec(
             col_name,
-            &collection_spec,
+            &mut collection_spec,
             session,
         )?;
 
         Ok(())
     }
 
-    fn update_collection_spec(col_name: &str, collection_spec: &CollectionSpecification, session: &mut SessionInner) -> Result<()> {
+    /// The programs compiled on the old indexes are dropped,
+    /// and the version of the spec is bumped.
+    ///
+    /// The version is greater than any one given before in this process,
+    /// so a version written by a transaction aborted or running
+    /// concurrently is never given again to other indexes.
+    fn update_collection_spec(&self, col_name: &str, collection_spec: &mut CollectionSpecification, session: &mut SessionInner) -> Result<()> {
+        self.plan_cache.invalidate_collection(col_name);
+
+        let base = collection_spec.version;
+        let last = self.spec_version
+            .fetch_update(Ordering::SeqCst, Ordering::SeqCst, |last| Some(last.max(base) + 1))
+            .unwrap();
+        collection_spec.version = last.max(base) + 1;
+
         let stacked_key = crate::utils::bson::stacked_key(&[
             Bson::String(TABLE_META_PREFIX.to_string()),
             Bson::String(col_name.to_string()),
@@ -428,7 +555,9 @@ impl DatabaseInner {
         Ok(())
     }
 
-    fn make_index_name(key: &str, order: i32, index_options: Option<&IndexOptions>) -> Result<String> {
+    /// The name is joined by the keys and the orders,
+    /// such as `tenant_1_created_at_-1`
+    fn make_index_name(keys: &IndexMap<String, i8>, index_options: Option<&IndexOptions>) -> Result<String> {
         if let Some(options) = index_options {
             if let Some(name) = &options.name {
                 DatabaseInner::validate_index_name(name)?;
@@ -436,21 +565,29 @@ impl DatabaseInner {
             }
         }
 
-        let mut index_name = key.to_string().replace(".", "_");
+        let mut index_name = String::new();
 
-        index_name += "_";
-        let num_str = order.to_string();
-        index_name += &num_str;
+        for (key, order) in keys {
+            if !index_name.is_empty() {
+                index_name += "_";
+            }
+            index_name += &key.replace(".", "_");
+
+            index_name += "_";
+            let num_str = order.to_string();
+            index_name += &num_str;
+        }
 
         Ok(index_name)
     }
 
+    /// 1 for ascending and -1 for descending
     #[inline]
-    fn is_num_1(val: &Bson) -> bool {
+    fn index_order_of(val: &Bson) -> Option<i8> {
         match val {
-            Bson::Int32(1) => true,
-            Bson::Int64(1) => true,
-            _ => false,
+            Bson::Int32(1) | Bson::Int64(1) => Some(1),
+            Bson::Int32(-1) | Bson::Int64(-1) => Some(-1),
+            _ => None,
         }
     }
 
@@ -468,6 +605,37 @@ impl DatabaseInner {
         doc
     }
 
+    /// The same as [`DatabaseInner::fix_doc`] for a raw document,
+    /// return it with the primary key. It's copied only if the id is added.
+    fn fix_raw_doc(doc: &RawDocument) -> Result<(Cow<RawDocument>, Bson)> {
+        match doc.get(meta_doc_key::ID).map_err(|_| Error::data_malformed())? {
+            // If the id type is not null, the document is ok
+            Some(RawBsonRef::Null) | None => (),
+            Some(id) => {
+                let pkey = Bson::try_from(id).map_err(|_| Error::data_malformed())?;
+                return Ok((Cow::Borrowed(doc), pkey));
+            }
+        }
+
+        let new_oid = ObjectId::new();
+        let mut fixed = RawDocumentBuf::new();
+        let mut replaced = false;
+        for element in doc {
+            let (key, value) = element.map_err(|_| Error::data_malformed())?;
+            if key == meta_doc_key::ID {
+                fixed.append(key, RawBson::ObjectId(new_oid));
+                replaced = true;
+            } else {
+                fixed.append(key, value.to_raw_bson());
+            }
+        }
+        if !replaced {
+            fixed.append(meta_doc_key::ID, RawBson::ObjectId(new_oid));
+        }
+
+        Ok((Cow::Owned(fixed), Bson::ObjectId(new_oid)))
+    }
+
     fn validate_col_name(col_name: &str) -> Result<()> {
         for ch in col_name.chars() {
             if ch == '$' || ch == '\n' || ch == '\t' || ch == '\r' || ch == '.' {
@@ -535,6 +703,7 @@ impl DatabaseInner {
     fn try_insert_index(&self, session: &mut SessionInner, col_spec: &CollectionSpecification, doc: &Document, pkey: &Bson) -> Result<()> {
         let mut index_helper = IndexHelper::new(
             &self.kv_engine,
+            &self.index_statistics,
             session,
             col_spec,
             doc,
@@ -565,35 +734,151 @@ impl DatabaseInner {
         docs: impl IntoIterator<Item = impl Borrow<T>>,
         node_id: &[u8; 6],
     ) -> Result<InsertManyResult> {
-        let mut col_spec = self.get_collection_meta_by_name_advanced(session, col_name, true, node_id)?
+        let col_spec = self.get_collection_meta_by_name_advanced(session, col_name, true, node_id)?
             .expect("internal: meta must exist");
         let mut inserted_ids: HashMap<usize, Bson> = HashMap::new();
-        let mut counter: usize = 0;
 
-        for item in docs {
-            let doc = bson::to_document(item.borrow())?;
-            let (insert_one_result, new_col_spec) = self.insert_one_with_meta(session, col_spec, doc)?;
-            inserted_ids.insert(counter, insert_one_result.inserted_id);
+        // All the documents are serialized first,
+        // so the keys can be written in order.
+        let mut doc_entries: Vec<(Vec<u8>, Vec<u8>)> = vec![];
+        let mut index_batches = DatabaseInner::index_batches_of(&col_spec);
+
+        for (counter, item) in docs.into_iter().enumerate() {
+            let doc = DatabaseInner::fix_doc(bson::to_document(item.borrow())?);
+            let pkey = doc.get("_id").unwrap();
 
-            counter += 1;
-            col_spec = new_col_spec;
+            let stacked_key = crate::utils::bson::stacked_key([
+                &Bson::String(col_spec._id.clone()),
+                &pkey,
+            ])?;
+            let doc_buf = bson::to_vec(&doc)?;
+
+            for index_batch in &mut index_batches {
+                index_batch.add(&doc, pkey)?;
+            }
+
+            inserted_ids.insert(counter, pkey.clone());
+            doc_entries.push((stacked_key, doc_buf));
         }
 
+        self.write_inserted_entries(session, doc_entries, index_batches)?;
+
         Ok(InsertManyResult {
             inserted_ids,
         })
     }
 
+    /// The same as [`DatabaseInner::insert_many`], but the documents
+    /// are written as they are, only the primary key and the values
+    /// of the indexes are decoded.
+    pub fn insert_many_raw(
+        &self,
+        col_name: &str,
+        docs: &[&RawDocument],
+        session: &mut SessionInner
+    ) -> Result<InsertManyResult> {
+        DatabaseInner::validate_col_name(col_name)?;
+
+        self.auto_start_transaction(session, TransactionType::Write)?;
+
+        let result = try_db_op!(self, session, self.insert_many_raw_internal(session, col_name, docs, &self.node_id));
+
+        Ok(result)
+    }
+
+    fn insert_many_raw_internal(
+        &self,
+        session: &mut SessionInner,
+        col_name: &str,
+        docs: &[&RawDocument],
+        node_id: &[u8; 6],
+    ) -> Result<InsertManyResult> {
+        let col_spec = self.get_collection_meta_by_name_advanced(session, col_name, true, node_id)?
+            .expect("internal: meta must exist");
+        let mut inserted_ids: HashMap<usize, Bson> = HashMap::new();
+
+        let mut doc_entries: Vec<(Vec<u8>, Cow<[u8]>)> = vec![];
+        let mut index_batches = DatabaseInner::index_batches_of(&col_spec);
+
+        for (counter, raw_doc) in docs.iter().enumerate() {
+            let (doc, pkey) = DatabaseInner::fix_raw_doc(raw_doc)?;
+
+            let stacked_key = crate::utils::bson::stacked_key([
+                &Bson::String(col_spec._id.clone()),
+                &pkey,
+            ])?;
+
+            for index_batch in &mut index_batches {
+                index_batch.add_raw(&doc, &pkey)?;
+            }
+
+            let doc_buf = match doc {
+                Cow::Borrowed(doc) => Cow::Borrowed(doc.as_bytes()),
+                Cow::Owned(doc) => Cow::Owned(doc.into_bytes()),
+            };
+
+            inserted_ids.insert(counter, pkey);
+            doc_entries.push((stacked_key, doc_buf));
+        }
+
+        self.write_inserted_entries(session, doc_entries, index_batches)?;
+
+        Ok(InsertManyResult {
+            inserted_ids,
+        })
+    }
+
+    fn index_batches_of(col_spec: &CollectionSpecification) -> Vec<IndexBatch> {
+        col_spec.indexes
+            .iter()
+            .map(|(index_name, index_info)| {
+                IndexBatch::new(col_spec._id.as_str(), index_name.as_str(), index_info)
+            })
+            .collect()
+    }
+
+    /// Write the documents and the index entries of an insert,
+    /// by the bulk load if the batch is large enough.
+    fn write_inserted_entries<V: AsRef<[u8]>>(
+        &self,
+        session: &mut SessionInner,
+        mut doc_entries: Vec<(Vec<u8>, V)>,
+        index_batches: Vec<IndexBatch>,
+    ) -> Result<()> {
+        let mut batch_bytes: usize = doc_entries
+            .iter()
+            .map(|(key, value)| key.len() + value.as_ref().len())
+            .sum();
+        batch_bytes += index_batches.iter().map(|batch| batch.byte_size()).sum::<usize>();
+        if batch_bytes >= self.config.bulk_load_min_bytes {
+            session.start_bulk_load()?;
+        }
+
+        // The sort is stable, the later document of the same key
+        // is written later, as they're inserted one by one.
+        doc_entries.sort_by(|(left, _), (right, _)| left.cmp(right));
+        for (key, value) in &doc_entries {
+            session.put(key.as_slice(), value.as_ref())?;
+        }
+
+        for index_batch in index_batches {
+            index_batch.write(&self.kv_engine, &self.index_statistics, session)?;
+        }
+
+        Ok(())
+    }
+
     fn find_internal<T: DeserializeOwned>(
         &self,
         col_spec: &CollectionSpecification,
         query: Option<Document>,
     ) -> Result<ClientSessionCursor<T>> {
         let subprogram = match query {
-            Some(query) => SubProgram::compile_query(
+            Some(query) => self.compile_cached(
+                "find",
                 col_spec,
-                &query,
-                true
+                &[&query],
+                || SubProgram::compile_query(col_spec, &query, true),
             ),
             None => SubProgram::compile_query_all(col_spec, true),
         }?;
@@ -642,20 +927,30 @@ impl DatabaseInner {
     ) -> Result<UpdateResult> {
         let meta_opt = self.get_collection_meta_by_name_advanced_auto(col_name, false, session)?;
 
-        let modified_count = match &meta_opt {
-            Some(col_spec) => {
-                let subprogram = SubProgram::compile_update(
-                    col_spec,
+        let modified_count = match meta_opt {
+            Some(mut col_spec) => {
+                self.attach_index_statistics(session, &mut col_spec)?;
+
+                let compile = || SubProgram::compile_update(
+                    &col_spec,
                     query,
                     update,
                     true,
                     is_many,
-                )?;
+                );
+                let subprogram = match query {
+                    Some(query) => {
+                        let kind = if is_many { "update_many" } else { "update_one" };
+                        self.compile_cached(kind, &col_spec, &[query, update], compile)?
+                    }
+                    None => compile()?,
+                };
 
                 let mut vm = VM::new(
                     self.kv_engine.clone(),
                     subprogram,
                     self.metrics.clone(),
+                    self.index_statistics.clone(),
                 );
                 vm.execute(session)?;
 
@@ -687,23 +982,26 @@ impl DatabaseInner {
             Err(err) => return Err(err),
         };
 
-        // Delete content begin
-        let subprogram = SubProgram::compile_delete_all(
-            &collection_spec,
-            col_name,
-            true,
-        )?;
-
-        {
-            let mut vm = VM::new(
-                self.kv_engine.clone(),
-                subprogram,
-                self.metrics.clone(),
-            );
-            vm.execute(session)?;
-        } // Delete content end
+        self.delete_collection_content(&collection_spec, session)?;
 
         self.delete_collection_meta(col_name, session)?;
+        self.index_statistics.remove_collection(col_name);
+        self.plan_cache.invalidate_collection(col_name);
+
+        Ok(())
+    }
+
+    /// Delete the documents and the index entries of the collection
+    /// by two ranges, the keys are not visited.
+    fn delete_collection_content(&self, col_spec: &CollectionSpecification, session: &mut SessionInner) -> Result<()> {
+        let mut data_prefix = Vec::<u8>::new();
+        crate::utils::bson::stacked_key_bytes(&mut data_prefix, &Bson::String(col_spec.name().to_string()))?;
+        session.delete_range(&data_prefix, &prefix_successor(&data_prefix))?;
+
+        if !col_spec.indexes.is_empty() {
+            let index_prefix = IndexHelper::index_key_prefix(col_spec.name(), None)?;
+            session.delete_range(&index_prefix, &prefix_successor(&index_prefix))?;
+        }
 
         Ok(())
     }
@@ -732,20 +1030,28 @@ impl DatabaseInner {
         if col_spec.is_none() {
             return Ok(0);
         }
-        let col_spec = col_spec.unwrap();
+        let mut col_spec = col_spec.unwrap();
+        self.attach_index_statistics(session, &mut col_spec)?;
 
-        let subprogram = SubProgram::compile_delete(
+        let kind = if is_many { "delete_many" } else { "delete_one" };
+        let subprogram = self.compile_cached(
+            kind,
             &col_spec,
-            col_name,
-            Some(&query),
-            true,
-            is_many,
+            &[&query],
+            || SubProgram::compile_delete(
+                &col_spec,
+                col_name,
+                Some(&query),
+                true,
+                is_many,
+            ),
         )?;
 
         let mut vm = VM::new(
             self.kv_engine.clone(),
             subprogram,
             self.metrics.clone(),
+            self.index_statistics.clone(),
         );
         vm.execute(session)?;
 
@@ -760,25 +1066,20 @@ impl DatabaseInner {
             Err(err) => return Err(err),
         };
 
-        // Delete content begin
-        let subprogram = SubProgram::compile_delete_all(
-            &collection_spec,
-            col_name,
-            true,
-        )?;
+        // the documents are counted by a read, nothing is written for them
+        let delete_count = self.count_collection(&collection_spec, session)?;
+        if delete_count == 0 {
+            return Ok(0);
+        }
 
-        let delete_count = {
-            let mut vm = VM::new(
-                self.kv_engine.clone(),
-                subprogram,
-                self.metrics.clone(),
-            );
-            vm.execute(session)?;
+        self.delete_collection_content(&collection_spec, session)?;
 
-            vm.r2 as usize
-        }; // Delete content end
+        // the indexes are empty now
+        for index_name in collection_spec.indexes.keys() {
+            self.index_statistics.set_gathered(col_name, index_name, IndexStatisticsGatherer::new());
+        }
 
-        Ok(delete_count)
+        Ok(delete_count as usize)
     }
 
     pub fn delete_all(&self, col_name: &str, session: &mut SessionInner) -> Result<usize> {
@@ -830,9 +1131,17 @@ impl DatabaseInner {
         }
 
         let col = col.unwrap();
-        let mut count = 0;
+        self.count_collection(&col, session)
+    }
 
-        let mut handle = self.find_internal::<Document>(&col, None)?;
+    fn count_collection(&self, col: &CollectionSpecification, session: &mut SessionInner) -> Result<u64> {
+        let program = SubProgram::compile_query_all(col, true)?;
+        if let Some(scan) = self.partitioned_scan(col, program.clone(), session)? {
+            return scan.count();
+        }
+
+        let mut count = 0;
+        let mut handle = self.make_handle::<Document>(program)?;
 
         while handle.advance_inner(session)? {
             count += 1;
@@ -867,6 +1176,32 @@ impl DatabaseInner {
         Ok(result)
     }
 
+    /// The program of a find, nothing is found if the collection doesn't exist
+    fn compile_find(
+        &self,
+        col_name: &str,
+        filter: Option<Document>,
+        session: &mut SessionInner,
+    ) -> Result<SubProgram> {
+        let meta_opt = self.get_collection_meta_by_name_advanced_auto(col_name, false, session)?;
+        match meta_opt {
+            Some(mut col_spec) => {
+                self.attach_index_statistics(session, &mut col_spec)?;
+
+                match filter {
+                    Some(query) => self.compile_cached(
+                        "find",
+                        &col_spec,
+                        &[&query],
+                        || SubProgram::compile_query(&col_spec, &query, true),
+                    ),
+                    None => SubProgram::compile_query_all(&col_spec, true),
+                }
+            }
+            None => Ok(SubProgram::compile_empty_query()),
+        }
+    }
+
     pub fn find_with_owned_session<T: DeserializeOwned>(
         &self,
         col_name: &str,
@@ -874,28 +1209,13 @@ impl DatabaseInner {
         mut session: SessionInner,
     ) -> Result<ClientCursor<T>> {
         DatabaseInner::validate_col_name(col_name)?;
-        let filter_query = filter.into();
-        let meta_opt = self.get_collection_meta_by_name_advanced_auto(col_name, false, &mut session)?;
-        let subprogram = match meta_opt {
-            Some(col_spec) => {
-                let subprogram = match filter_query {
-                    Some(query) => SubProgram::compile_query(
-                        &col_spec,
-                        &query,
-                        true
-                    ),
-                    None => SubProgram::compile_query_all(&col_spec, true),
-                }?;
-
-                subprogram
-            }
-            None => SubProgram::compile_empty_query(),
-        };
+        let subprogram = self.compile_find(col_name, filter.into(), &mut session)?;
 
         let vm = VM::new(
             self.kv_engine.clone(),
             subprogram,
             self.metrics.clone(),
+            self.index_statistics.clone(),
         );
 
         let handle = ClientCursor::new(vm, session);
@@ -913,7 +1233,9 @@ impl DatabaseInner {
         let filter_query = filter.into();
         let meta_opt = self.get_collection_meta_by_name_advanced_auto(col_name, false, session)?;
         match meta_opt {
-            Some(col_spec) => {
+            Some(mut col_spec) => {
+                self.attach_index_statistics(session, &mut col_spec)?;
+
                 let handle = self.find_internal(
                     &col_spec,
                     filter_query,
@@ -927,6 +1249,7 @@ impl DatabaseInner {
                     self.kv_engine.clone(),
                     subprogram,
                     self.metrics.clone(),
+                    self.index_statistics.clone(),
                 );
                 let cursor = ClientSessionCursor::new(vm);
                 Ok(cursor)
@@ -989,6 +1312,40 @@ impl DatabaseInner {
         }
     }
 
+    /// The program of an aggregation, and whether it's run by a partitioned scan.
+    /// The partitioned scan is run while compiling, the program gives out the results.
+    fn compile_aggregate(
+        &self,
+        col_name: &str,
+        pipeline: Vec<Document>,
+        session: &mut SessionInner,
+    ) -> Result<(SubProgram, bool)> {
+        let meta_opt = self.get_collection_meta_by_name_advanced_auto(col_name, false, session)?;
+        let col_spec = match meta_opt {
+            Some(col_spec) => col_spec,
+            None => return Ok((SubProgram::compile_empty_query(), false)),
+        };
+
+        if let Some(subprogram) = self.aggregate_partitioned(&col_spec, &pipeline, session)? {
+            return Ok((subprogram, true));
+        }
+        // the params are copied from the $match only
+        let roots: Vec<&Document> = match pipeline.first().and_then(|first| first.get("$match")) {
+            Some(Bson::Document(query)) => {
+                std::iter::once(query).chain(pipeline[1..].iter()).collect()
+            }
+            _ => pipeline.iter().collect(),
+        };
+        let subprogram = self.compile_cached(
+            "aggregate",
+            &col_spec,
+            &roots,
+            || SubProgram::compile_aggregate(&col_spec, pipeline.clone(), true),
+        )?;
+
+        Ok((subprogram, false))
+    }
+
     pub(crate) fn aggregate_with_owned_session<T: DeserializeOwned>(
         &self,
         col_name: &str,
@@ -996,31 +1353,100 @@ impl DatabaseInner {
         mut session: SessionInner,
     ) -> Result<ClientCursor<T>> {
         DatabaseInner::validate_col_name(col_name)?;
-        let meta_opt = self.get_collection_meta_by_name_advanced_auto(col_name, false, &mut session)?;
-        let subprogram = match meta_opt {
-            Some(col_spec) => {
-                let subprogram = SubProgram::compile_aggregate(
-                    &col_spec,
-                    pipeline,
-                    true
-                )?;
+        let (subprogram, _) = self.compile_aggregate(col_name, pipeline.into_iter().collect(), &mut session)?;
 
-                subprogram
-            }
-            None => SubProgram::compile_empty_query(),
-        };
-
-        let vm = VM::new(
+        let mut vm = VM::new(
             self.kv_engine.clone(),
             subprogram,
             self.metrics.clone(),
+            self.index_statistics.clone(),
         );
+        vm.set_group_memory_budget(self.config.group_memory_budget);
 
         let handle = ClientCursor::new(vm, session);
 
         Ok(handle)
     }
 
+    pub(crate) fn explain_find(
+        &self,
+        col_name: &str,
+        filter: Option<Document>,
+        session: &mut SessionInner,
+    ) -> Result<Document> {
+        DatabaseInner::validate_col_name(col_name)?;
+        let subprogram = self.compile_find(col_name, filter, session)?;
+        self.explain_program(col_name, subprogram, false, session)
+    }
+
+    pub(crate) fn explain_aggregate(
+        &self,
+        col_name: &str,
+        pipeline: Vec<Document>,
+        session: &mut SessionInner,
+    ) -> Result<Document> {
+        DatabaseInner::validate_col_name(col_name)?;
+        let (subprogram, partitioned) = self.compile_aggregate(col_name, pipeline, session)?;
+        self.explain_program(col_name, subprogram, partitioned, session)
+    }
+
+    /// Run the program to the end with the profiler,
+    /// the rows are counted instead of returned.
+    ///
+    /// The rows scanned by the workers of a partitioned scan
+    /// are not examined by the program, which gives out the merged results.
+    fn explain_program(
+        &self,
+        col_name: &str,
+        subprogram: SubProgram,
+        partitioned: bool,
+        session: &mut SessionInner,
+    ) -> Result<Document> {
+        let mut access_path = subprogram.access_path().to_document();
+        if partitioned {
+            access_path.insert("stage", "COLLECTION_SCAN");
+            access_path.insert("partitioned", true);
+        }
+        let program = subprogram.to_string();
+
+        let mut vm = VM::new(
+            self.kv_engine.clone(),
+            subprogram,
+            self.metrics.clone(),
+            self.index_statistics.clone(),
+        );
+        vm.set_group_memory_budget(self.config.group_memory_budget);
+        vm.enable_profiler();
+
+        let start = if cfg!(target_arch = "wasm32") {
+            None
+        } else {
+            Some(std::time::Instant::now())
+        };
+        let mut returned: u64 = 0;
+        vm.execute(session)?;
+        while vm.state == VmState::HasRow {
+            returned += 1;
+            vm.execute(session)?;
+        }
+
+        let profiler = vm.profiler().unwrap();
+        let mut stats = Document::new();
+        stats.insert("nReturned", Bson::Int64(returned as i64));
+        stats.insert("rowsExamined", Bson::Int64(profiler.rows_examined() as i64));
+        if let Some(start) = start {
+            stats.insert("executionTimeMicros", Bson::Double((start.elapsed().as_nanos() as f64) / 1000.0));
+        }
+        stats.insert("ops", profiler.ops_to_bson());
+
+        let mut doc = Document::new();
+        doc.insert("ns", col_name);
+        doc.insert("accessPath", access_path);
+        doc.insert("program", program);
+        doc.insert("executionStats", stats);
+        Ok(doc)
+    }
+
 }
 
 fn collection_metas_to_names(doc_meta: Vec<Document>) -> Vec<String> {
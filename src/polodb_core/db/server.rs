@@ -4,12 +4,26 @@
  * file, You can obtain one at https://mozilla.org/MPL/2.0/.
  */
 use std::sync::{Arc, Mutex};
+use std::sync::atomic::{AtomicI64, Ordering};
+use std::time::{Duration, Instant};
 use bson::{Bson, Document};
 use bson::oid::ObjectId;
 use hashbrown::HashMap;
-use crate::{ClientSession, Database, Error, Result};
-use crate::commands::{CommandMessage, CommitTransactionCommand, CountDocumentsCommand, CreateCollectionCommand, DeleteCommand, DropCollectionCommand, FindCommand, InsertCommand, AbortTransactionCommand, StartTransactionCommand, UpdateCommand, DropSessionCommand};
-use crate::results::CountDocumentsResult;
+use crate::{ClientSession, ClientSessionCursor, Database, Error, Result};
+use crate::commands::{CommandMessage, CommitTransactionCommand, CountDocumentsCommand, CreateCollectionCommand, DeleteCommand, DropCollectionCommand, FindCommand, InsertCommand, AbortTransactionCommand, StartTransactionCommand, UpdateCommand, DropSessionCommand, GetMoreCommand, KillCursorsCommand};
+use crate::results::{CountDocumentsResult, CursorBatchResult, KillCursorsResult};
+use crate::utils::bson::approx_size_of;
+
+/// A batch is replied once its documents take this many bytes,
+/// even if the batch size is not reached.
+const MAX_BATCH_BYTES: usize = 16 * 1024 * 1024;
+
+/// A cursor not read for this long is killed.
+const CURSOR_IDLE_TIMEOUT: Duration = Duration::from_secs(10 * 60);
+
+/// The least recently read cursor is killed to open one more,
+/// every cursor holds a session and the snapshot of it.
+const MAX_CURSORS: usize = 1024;
 
 #[derive(Clone)]
 pub struct HandleRequestResult {
@@ -17,9 +31,24 @@ pub struct HandleRequestResult {
     pub value: Bson,
 }
 
+/// A cursor of a find kept for the getMore commands
+struct ServerCursor {
+    /// `None` if the session is started for the cursor
+    session_id: Option<ObjectId>,
+    session: Arc<Mutex<ClientSession>>,
+    cursor: ClientSessionCursor<Document>,
+    /// The connection opening the cursor
+    conn_id: Option<u64>,
+    last_used: Instant,
+}
+
 pub struct DatabaseServer {
     db: Database,
     session_map: Mutex<HashMap<ObjectId, Arc<Mutex<ClientSession>>>>,
+    cursor_map: Mutex<HashMap<i64, ServerCursor>>,
+    next_cursor_id: AtomicI64,
+    cursor_timeout: Duration,
+    max_cursors: usize,
 }
 
 impl DatabaseServer {
@@ -28,10 +57,31 @@ impl DatabaseServer {
         DatabaseServer {
             db,
             session_map: Mutex::new(HashMap::new()),
+            cursor_map: Mutex::new(HashMap::new()),
+            next_cursor_id: AtomicI64::new(1),
+            cursor_timeout: CURSOR_IDLE_TIMEOUT,
+            max_cursors: MAX_CURSORS,
         }
     }
 
     pub fn handle_request_doc(&self, value: Bson) -> Result<HandleRequestResult> {
+        self.handle_request(value, None)
+    }
+
+    /// Handle the request sent on the connection,
+    /// the cursors opened are killed by `close_connection`.
+    pub fn handle_connection_request(&self, conn_id: u64, value: Bson) -> Result<HandleRequestResult> {
+        self.handle_request(value, Some(conn_id))
+    }
+
+    /// Kill the cursors opened on the connection closed
+    pub fn close_connection(&self, conn_id: u64) -> Result<()> {
+        let mut cursor_map = self.cursor_map.lock()?;
+        cursor_map.retain(|_, server_cursor| server_cursor.conn_id != Some(conn_id));
+        Ok(())
+    }
+
+    fn handle_request(&self, value: Bson, conn_id: Option<u64>) -> Result<HandleRequestResult> {
         let command_message = bson::from_bson::<CommandMessage>(value)?;
         let is_quit = if let CommandMessage::SafelyQuit = command_message {
             true
@@ -41,7 +91,7 @@ impl DatabaseServer {
 
         let result_value: Bson = match command_message {
             CommandMessage::Find(find) => {
-                self.handle_find_operation(find)?
+                self.handle_find_operation(find, conn_id)?
             }
             CommandMessage::Insert(insert) => {
                 self.handle_insert_operation(insert)?
@@ -79,6 +129,15 @@ impl DatabaseServer {
             CommandMessage::DropSession(drop_session) => {
                 self.handle_drop_session(drop_session)?
             }
+            CommandMessage::GetMore(get_more) => {
+                self.handle_get_more(get_more)?
+            }
+            CommandMessage::KillCursors(kill_cursors) => {
+                self.handle_kill_cursors(kill_cursors)?
+            }
+            CommandMessage::ServerStatus => {
+                self.handle_server_status()?
+            }
         };
 
 
@@ -88,6 +147,24 @@ impl DatabaseServer {
         })
     }
 
+    /// The request only reads without a session, so it can run
+    /// on a snapshot of its own concurrently with the other requests.
+    pub fn is_concurrent_read(value: &Bson) -> bool {
+        let doc = match value.as_document() {
+            Some(doc) => doc,
+            None => return false,
+        };
+        match doc.get_str("command") {
+            Ok("Find") | Ok("CountDocuments") => (),
+            _ => return false,
+        }
+        match doc.get("options") {
+            None | Some(Bson::Null) => true,
+            Some(Bson::Document(options)) => matches!(options.get("sessionId"), None | Some(Bson::Null)),
+            _ => false,
+        }
+    }
+
     fn get_session_by_session_id(&self, sid: Option<&ObjectId>) -> Result<Arc<Mutex<ClientSession>>> {
         match sid {
             Some(sid) => {
@@ -101,17 +178,56 @@ impl DatabaseServer {
         }
     }
 
-    fn handle_find_operation(&self, find: FindCommand) -> Result<Bson> {
+    fn handle_find_operation(&self, find: FindCommand, conn_id: Option<u64>) -> Result<Bson> {
         let col_name = find.ns.as_str();
         let session_id = find.options
             .as_ref()
             .map(|o| o.session_id.as_ref())
             .flatten();
+        let batch_size = find.options
+            .as_ref()
+            .map(|o| o.batch_size)
+            .flatten();
+        let explain = find.options
+            .as_ref()
+            .map(|o| o.explain.unwrap_or(false))
+            .unwrap_or(false);
         let session_ref = self.get_session_by_session_id(session_id)?;
         let mut session = session_ref.lock()?;
         let collection = self.db.collection::<Document>(col_name);
+        if explain {
+            let doc = collection.explain_find_with_session(find.filter, &mut session)?;
+            return Ok(Bson::Document(doc));
+        }
         let mut result = collection.find_with_session(find.filter, &mut session)?;
 
+        if let (Some(batch_size), true) = (batch_size, find.multi) {
+            let (batch, is_exhausted) = DatabaseServer::next_batch(&mut result, &mut session, batch_size)?;
+            drop(session);
+
+            let cursor_id = if is_exhausted {
+                0
+            } else {
+                let cursor_id = self.next_cursor_id.fetch_add(1, Ordering::SeqCst);
+                let mut cursor_map = self.cursor_map.lock()?;
+                self.evict_cursors(&mut cursor_map);
+                cursor_map.insert(cursor_id, ServerCursor {
+                    session_id: session_id.cloned(),
+                    session: session_ref,
+                    cursor: result,
+                    conn_id,
+                    last_used: Instant::now(),
+                });
+                cursor_id
+            };
+
+            let bson_val = bson::to_bson(&CursorBatchResult {
+                cursor_id,
+                batch,
+            })?;
+            return Ok(bson_val);
+        }
+
         let mut value_arr = bson::Array::new();
 
         let mut counter : usize = 0;
@@ -129,6 +245,108 @@ impl DatabaseServer {
         Ok(result_value)
     }
 
+    /// Kill the cursors not read for `cursor_timeout`
+    fn expire_cursors(&self, cursor_map: &mut HashMap<i64, ServerCursor>) {
+        let now = Instant::now();
+        let timeout = self.cursor_timeout;
+        cursor_map.retain(|_, server_cursor| now.duration_since(server_cursor.last_used) < timeout);
+    }
+
+    /// Kill the expired cursors, and the least recently read ones
+    /// to leave room for a new cursor.
+    fn evict_cursors(&self, cursor_map: &mut HashMap<i64, ServerCursor>) {
+        self.expire_cursors(cursor_map);
+
+        while !cursor_map.is_empty() && cursor_map.len() >= self.max_cursors {
+            let oldest = cursor_map
+                .iter()
+                .min_by_key(|(cursor_id, server_cursor)| (server_cursor.last_used, **cursor_id))
+                .map(|(cursor_id, _)| *cursor_id)
+                .unwrap();
+            cursor_map.remove(&oldest);
+        }
+    }
+
+    /// Read the documents until the batch is full,
+    /// return true if the cursor is exhausted.
+    fn next_batch(
+        cursor: &mut ClientSessionCursor<Document>,
+        session: &mut ClientSession,
+        batch_size: u32,
+    ) -> Result<(Vec<Bson>, bool)> {
+        let mut batch = Vec::new();
+        let mut batch_bytes: usize = 0;
+
+        while batch.len() < batch_size as usize && batch_bytes < MAX_BATCH_BYTES {
+            if !cursor.advance(session)? {
+                return Ok((batch, true));
+            }
+            let value = cursor.get().clone();
+            batch_bytes += approx_size_of(&value);
+            batch.push(value);
+        }
+
+        Ok((batch, false))
+    }
+
+    fn handle_get_more(&self, get_more: GetMoreCommand) -> Result<Bson> {
+        let cursor_id = get_more.cursor_id;
+
+        // taken out of the map while it's read,
+        // the getMore of another request on it fails
+        let mut server_cursor = {
+            let mut cursor_map = self.cursor_map.lock()?;
+            self.expire_cursors(&mut cursor_map);
+            match cursor_map.remove(&cursor_id) {
+                Some(server_cursor) => server_cursor,
+                None => return Err(Error::CursorNotFound(cursor_id)),
+            }
+        };
+
+        let batch_size = get_more.batch_size.filter(|size| *size > 0).unwrap_or(u32::MAX);
+        let (batch, is_exhausted) = {
+            let mut session = server_cursor.session.lock()?;
+            DatabaseServer::next_batch(&mut server_cursor.cursor, &mut session, batch_size)?
+        };
+
+        let result_cursor_id = if is_exhausted {
+            0
+        } else {
+            server_cursor.last_used = Instant::now();
+            let mut cursor_map = self.cursor_map.lock()?;
+            cursor_map.insert(cursor_id, server_cursor);
+            cursor_id
+        };
+
+        let bson_val = bson::to_bson(&CursorBatchResult {
+            cursor_id: result_cursor_id,
+            batch,
+        })?;
+        Ok(bson_val)
+    }
+
+    fn handle_kill_cursors(&self, kill_cursors: KillCursorsCommand) -> Result<Bson> {
+        let mut result = KillCursorsResult {
+            cursors_killed: vec![],
+            cursors_not_found: vec![],
+        };
+
+        {
+            let mut cursor_map = self.cursor_map.lock()?;
+            self.expire_cursors(&mut cursor_map);
+            for cursor_id in kill_cursors.cursor_ids {
+                if cursor_map.remove(&cursor_id).is_some() {
+                    result.cursors_killed.push(cursor_id);
+                } else {
+                    result.cursors_not_found.push(cursor_id);
+                }
+            }
+        }
+
+        let bson_val = bson::to_bson(&result)?;
+        Ok(bson_val)
+    }
+
     fn handle_insert_operation(&self, insert: InsertCommand) -> Result<Bson> {
         let col_name = insert.ns.as_str();
         let session_id = insert.options
@@ -269,10 +487,181 @@ impl DatabaseServer {
         Ok(Bson::ObjectId(sid))
     }
 
+    fn handle_server_status(&self) -> Result<Bson> {
+        let mut doc = Document::new();
+        doc.insert("sessions", Bson::Int64(self.session_map.lock()?.len() as i64));
+        let cursors_count = {
+            let mut cursor_map = self.cursor_map.lock()?;
+            self.expire_cursors(&mut cursor_map);
+            cursor_map.len()
+        };
+        doc.insert("cursors", Bson::Int64(cursors_count as i64));
+        doc.insert("metrics", self.db.metrics().to_document());
+        doc.insert("lsm", self.db.lsm_metrics().to_document());
+        Ok(Bson::Document(doc))
+    }
+
     fn handle_drop_session(&self, drop_session_command: DropSessionCommand) -> Result<Bson> {
+        let sid = &drop_session_command.session_id;
+        {
+            let mut cursor_map = self.cursor_map.lock()?;
+            cursor_map.retain(|_, server_cursor| server_cursor.session_id.as_ref() != Some(sid));
+        }
         let mut session_map = self.session_map.lock()?;
-        session_map.remove(&drop_session_command.session_id);
+        session_map.remove(sid);
         Ok(Bson::Null)
     }
 
 }
+
+#[cfg(test)]
+mod tests {
+    use std::time::Duration;
+    use bson::{doc, Bson, Document};
+    use bson::oid::ObjectId;
+    use crate::commands::{CommandMessage, CountDocumentsCommand, CountDocumentsCommandOptions, DropSessionCommand};
+    use crate::{Database, DatabaseServer};
+
+    #[test]
+    fn test_concurrent_read() {
+        let count = CommandMessage::CountDocuments(CountDocumentsCommand {
+            ns: "test".into(),
+            options: None,
+        });
+        assert!(DatabaseServer::is_concurrent_read(&bson::to_bson(&count).unwrap()));
+
+        let count_in_session = CommandMessage::CountDocuments(CountDocumentsCommand {
+            ns: "test".into(),
+            options: Some(CountDocumentsCommandOptions {
+                session_id: Some(ObjectId::new()),
+            }),
+        });
+        assert!(!DatabaseServer::is_concurrent_read(&bson::to_bson(&count_in_session).unwrap()));
+
+        let drop_session = CommandMessage::DropSession(DropSessionCommand {
+            session_id: ObjectId::new(),
+        });
+        assert!(!DatabaseServer::is_concurrent_read(&bson::to_bson(&drop_session).unwrap()));
+    }
+
+    fn batch_of(server: &DatabaseServer, request: Document) -> (i64, usize) {
+        let result = server.handle_request_doc(Bson::Document(request)).unwrap();
+        let doc = result.value.as_document().unwrap();
+        (doc.get_i64("cursorId").unwrap(), doc.get_array("batch").unwrap().len())
+    }
+
+    #[test]
+    fn test_get_more() {
+        let db = Database::open_memory().unwrap();
+        let docs: Vec<Document> = (0..10).map(|i| doc! { "_id": i }).collect();
+        db.collection::<Document>("test").insert_many(docs).unwrap();
+        let server = DatabaseServer::new(db);
+
+        let (cursor_id, len) = batch_of(&server, doc! {
+            "command": "Find",
+            "ns": "test",
+            "multi": true,
+            "options": {
+                "batchSize": 4,
+            },
+        });
+        assert_ne!(cursor_id, 0);
+        assert_eq!(len, 4);
+
+        let get_more = doc! {
+            "command": "GetMore",
+            "cursorId": cursor_id,
+            "batchSize": 4,
+        };
+        assert_eq!(batch_of(&server, get_more.clone()), (cursor_id, 4));
+        assert_eq!(batch_of(&server, get_more.clone()), (0, 2));
+        assert!(server.handle_request_doc(Bson::Document(get_more)).is_err());
+
+        let result = server.handle_request_doc(Bson::Document(doc! {
+            "command": "KillCursors",
+            "cursorIds": [cursor_id],
+        })).unwrap();
+        let doc = result.value.as_document().unwrap();
+        assert_eq!(doc.get_array("cursorsNotFound").unwrap().len(), 1);
+    }
+
+    fn find_in_batches() -> Document {
+        doc! {
+            "command": "Find",
+            "ns": "test",
+            "multi": true,
+            "options": {
+                "batchSize": 4,
+            },
+        }
+    }
+
+    fn get_more_of(cursor_id: i64) -> Bson {
+        Bson::Document(doc! {
+            "command": "GetMore",
+            "cursorId": cursor_id,
+            "batchSize": 4,
+        })
+    }
+
+    fn open_test_server() -> DatabaseServer {
+        let db = Database::open_memory().unwrap();
+        let docs: Vec<Document> = (0..10).map(|i| doc! { "_id": i }).collect();
+        db.collection::<Document>("test").insert_many(docs).unwrap();
+        DatabaseServer::new(db)
+    }
+
+    #[test]
+    fn test_evict_cursors() {
+        let mut server = open_test_server();
+        server.max_cursors = 2;
+
+        let cursor_ids: Vec<i64> = (0..3)
+            .map(|_| batch_of(&server, find_in_batches()).0)
+            .collect();
+        assert!(server.handle_request_doc(get_more_of(cursor_ids[0])).is_err());
+        assert!(server.handle_request_doc(get_more_of(cursor_ids[1])).is_ok());
+        assert!(server.handle_request_doc(get_more_of(cursor_ids[2])).is_ok());
+
+        server.cursor_timeout = Duration::from_secs(0);
+        assert!(server.handle_request_doc(get_more_of(cursor_ids[1])).is_err());
+    }
+
+    #[test]
+    fn test_close_connection() {
+        let server = open_test_server();
+
+        let result = server.handle_connection_request(1, Bson::Document(find_in_batches())).unwrap();
+        let closed_id = result.value.as_document().unwrap().get_i64("cursorId").unwrap();
+        let result = server.handle_connection_request(2, Bson::Document(find_in_batches())).unwrap();
+        let open_id = result.value.as_document().unwrap().get_i64("cursorId").unwrap();
+
+        server.close_connection(1).unwrap();
+        assert!(server.handle_request_doc(get_more_of(closed_id)).is_err());
+        assert!(server.handle_request_doc(get_more_of(open_id)).is_ok());
+    }
+
+    #[test]
+    fn test_server_status() {
+        let db = Database::open_memory().unwrap();
+        db.metrics().enable();
+        db.lsm_metrics().enable();
+        let collection = db.collection::<Document>("test");
+        collection.insert_one(doc! { "_id": 1 }).unwrap();
+        collection.find(None).unwrap().count();
+        let server = DatabaseServer::new(db);
+
+        let result = server.handle_request_doc(Bson::Document(doc! {
+            "command": "ServerStatus",
+        })).unwrap();
+        let doc = result.value.as_document().unwrap();
+
+        let metrics = doc.get_document("metrics").unwrap();
+        assert!(metrics.get_document("vmExecute").unwrap().get_i64("count").unwrap() > 0);
+
+        let latency = doc.get_document("lsm").unwrap().get_document("latency").unwrap();
+        assert!(latency.get_document("commit").unwrap().get_i64("count").unwrap() > 0);
+        assert_eq!(latency.get_document("sync").unwrap().get_i64("count").unwrap(), 0);
+    }
+
+}
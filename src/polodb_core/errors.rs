@@ -239,10 +239,10 @@ pub enum Error {
     DataMalformed(Box<DataMalformedReason>),
     #[error("the database is not ready")]
     DbNotReady,
-    #[error("only support single field indexes currently: {0:?}")]
-    OnlySupportSingleFieldIndexes(Box<Document>),
-    #[error("only support ascending order index currently: {0}")]
-    OnlySupportsAscendingOrder(String),
+    #[error("the keys of the index are empty: {0:?}")]
+    InvalidIndexKeys(Box<Document>),
+    #[error("the order of the index key must be 1 or -1: {0}")]
+    InvalidIndexOrder(String),
     #[error("duplicate key error collection: {}, index: {}, key: {}", .0.ns, .0.name, .0.key)]
     DuplicateKey(Box<DuplicateKeyError>),
     #[error("the element type {0} is unknown")]
@@ -253,6 +253,10 @@ pub enum Error {
     UnknownAggregationOperation(String),
     #[error("invalid aggregation stage: {0:?}")]
     InvalidAggregationStage(Box<Document>),
+    #[error("background compaction failed: {0}")]
+    CompactionFailed(String),
+    #[error("cursor {0} not found")]
+    CursorNotFound(i64),
 }
 
 impl Error {
@@ -8,6 +8,9 @@ const STORE_NAME_METAS = "metas";
 const STORE_NAME_SEGMENTS = "segments";
 const STORE_NAME_LOGS = "logs";
 
+// the longest time a queued write waits for the browser being idle
+const FLUSH_TIMEOUT_MS = 500;
+
 /**
  *
  * @param {string} name
@@ -130,7 +133,7 @@ export async function load_snapshot(name) {
 
     for (const level of latest_meta.levels) {
         for (const segment of level.segments) {
-            const item = await read_segment(transaction, map, segment);
+            const item = await read_segment(transaction, data, segment);
             if (item) {
                 data.set(segment, item);
             }
@@ -150,7 +153,14 @@ export async function load_snapshot(name) {
     }
 }
 
-export class IdbBackendAdapter {
+/**
+ * The writes of the backend and the log to a database, in the order they are made.
+ *
+ * The writes are flushed when the browser is idle, in as few transactions
+ * as the order allows. The metas of a transaction are replaced by the latest one,
+ * every meta is a complete list of the segments, which are written once.
+ */
+class WriteQueue {
 
     /**
      *
@@ -158,9 +168,212 @@ export class IdbBackendAdapter {
      */
     constructor(db) {
         this._db = db;
+        this._ops = [];
+        this._scheduled = false;
+        this._flushing = Promise.resolve();
+    }
+
+    /**
+     *
+     * @param {"meta" | "segment" | "delete_segments" | "log" | "shrink"} type
+     * @param {any} value
+     */
+    push(type, value) {
+        this._ops.push({ type, value });
+        this._schedule();
+    }
+
+    _schedule() {
+        if (this._scheduled) {
+            return;
+        }
+        this._scheduled = true;
+        const run = () => {
+            this._scheduled = false;
+            this.flush();
+        };
+        if (typeof requestIdleCallback === "function") {
+            requestIdleCallback(run, { timeout: FLUSH_TIMEOUT_MS });
+        } else {
+            setTimeout(run, 0);
+        }
+    }
+
+    /**
+     * Write the queued ops, after the flushes before it.
+     *
+     * @returns {Promise<void>}
+     */
+    flush() {
+        const ops = this._ops.splice(0);
+        this._flushing = this._flushing
+            .catch((err) => console.error("flush IndexedDB failed", err))
+            .then(() => write_ops(this._db, ops));
+        return this._flushing;
+    }
+
+}
+
+/** @type {WeakMap<IDBDatabase, WriteQueue>} */
+const write_queues = new WeakMap();
+
+/**
+ * The backend and the log of a database share the queue,
+ * so the order of the segments, the metas and the logs is kept.
+ *
+ * @param {IDBDatabase} db
+ * @returns {WriteQueue}
+ */
+function write_queue_of(db) {
+    let queue = write_queues.get(db);
+    if (!queue) {
+        queue = new WriteQueue(db);
+        write_queues.set(db, queue);
+    }
+    return queue;
+}
+
+/**
+ * Only the latest meta of a transaction is written.
+ */
+function coalesce_metas(ops) {
+    let last_meta = -1;
+    ops.forEach((op, index) => {
+        if (op.type === "meta") {
+            last_meta = index;
+        }
+    });
+    return ops.filter((op, index) => op.type !== "meta" || index === last_meta);
+}
+
+/**
+ *
+ * @param {IDBDatabase} db
+ * @param {any[]} ops
+ * @returns {Promise<void>}
+ */
+async function write_ops(db, ops) {
+    for (const chunk of split_transactions(ops)) {
+        await write_transaction(db, coalesce_metas(chunk));
+    }
+}
+
+/**
+ * The logs are deleted by the cursor of a shrink asynchronously,
+ * so the logs put after a shrink are written by the next transaction.
+ * The meta following the shrink stays in its transaction,
+ * the logs are never deleted before the meta of the segment synced from them.
+ *
+ * @param {any[]} ops
+ * @returns {any[][]}
+ */
+function split_transactions(ops) {
+    const chunks = [];
+    let chunk = [];
+    let shrunk = false;
+    for (const op of ops) {
+        if (shrunk && op.type === "log") {
+            chunks.push(chunk);
+            chunk = [];
+            shrunk = false;
+        }
+        chunk.push(op);
+        if (op.type === "shrink") {
+            shrunk = true;
+        }
+    }
+    if (chunk.length > 0) {
+        chunks.push(chunk);
+    }
+    return chunks;
+}
+
+/**
+ *
+ * @param {IDBDatabase} db
+ * @param {any[]} ops
+ * @returns {Promise<void>}
+ */
+function write_transaction(db, ops) {
+    return new Promise((resolve, reject) => {
+        const transaction = db.transaction([
+            STORE_NAME_METAS,
+            STORE_NAME_SEGMENTS,
+            STORE_NAME_LOGS,
+        ], "readwrite");
+
+        for (const op of ops) {
+            switch (op.type) {
+                case "meta":
+                    transaction.objectStore(STORE_NAME_METAS).put(op.value);
+                    break;
+
+                case "segment":
+                    transaction.objectStore(STORE_NAME_SEGMENTS).put(op.value);
+                    break;
+
+                case "delete_segments": {
+                    const segments_store = transaction.objectStore(STORE_NAME_SEGMENTS);
+                    op.value.forEach(key => {
+                        segments_store.delete(key);
+                    });
+                    break;
+                }
+
+                case "log":
+                    transaction.objectStore(STORE_NAME_LOGS).put(op.value);
+                    break;
+
+                case "shrink":
+                    delete_logs_of_session(transaction.objectStore(STORE_NAME_LOGS), op.value);
+                    break;
+
+            }
+        }
+
+        // committed automatically, the cursor of a shrink is still running
+        transaction.oncomplete = () => resolve();
+        transaction.onerror = reject;
+        transaction.onabort = reject;
+    });
+}
+
+/**
+ *
+ * @param {IDBObjectStore} logs_store
+ * @param {string} session
+ */
+function delete_logs_of_session(logs_store, session) {
+    const session_index = logs_store.index("session");
+    const cursor_req = session_index.openCursor(session);
+
+    cursor_req.onsuccess = (e) => {
+        const cursor = cursor_req.result;
+
+        if (cursor) {
+            cursor.delete();
+            cursor.continue()
+        }
+    }
+}
+
+export class IdbBackendAdapter {
+
+    /**
+     *
+     * @param {IDBDatabase} db
+     * @param {boolean} batching
+     */
+    constructor(db, batching) {
+        this._db = db;
+        this._queue = batching ? write_queue_of(db) : null;
     }
 
     write_snapshot_to_idb(snapshot) {
+        if (this._queue) {
+            this._queue.push("meta", snapshot);
+            return Promise.resolve();
+        }
         return new Promise((resolve, reject) => {
             const transaction = this._db.transaction([STORE_NAME_METAS], "readwrite");
 
@@ -176,6 +389,10 @@ export class IdbBackendAdapter {
     }
 
     write_segments_to_idb(segments) {
+        if (this._queue) {
+            this._queue.push("segment", segments);
+            return Promise.resolve();
+        }
         return new Promise((resolve, reject) => {
             const transaction = this._db.transaction([STORE_NAME_SEGMENTS], "readwrite");
 
@@ -191,6 +408,10 @@ export class IdbBackendAdapter {
     }
 
     batch_delete_segments(ids) {
+        if (this._queue) {
+            this._queue.push("delete_segments", ids);
+            return;
+        }
         const transaction = this._db.transaction([STORE_NAME_SEGMENTS], "readwrite");
         const segments_store = transaction.objectStore(STORE_NAME_SEGMENTS);
 
@@ -200,6 +421,11 @@ export class IdbBackendAdapter {
     }
 
     dispose() {
+        if (this._queue) {
+            const db = this._db;
+            this._queue.flush().finally(() => db.close());
+            return;
+        }
         this._db.close();
     }
 
@@ -209,12 +435,18 @@ export class IdbLogAdapter {
     /**
      *
      * @param {IDBDatabase} db
+     * @param {boolean} batching
      */
-    constructor(db) {
+    constructor(db, batching) {
         this._db = db;
+        this._queue = batching ? write_queue_of(db) : null;
     }
 
     commit(buffer) {
+        if (this._queue) {
+            this._queue.push("log", buffer);
+            return;
+        }
         const transaction = this._db.transaction([STORE_NAME_LOGS], "readwrite");
         const logs_store = transaction.objectStore(STORE_NAME_LOGS);
         logs_store.put(buffer);
@@ -222,20 +454,13 @@ export class IdbLogAdapter {
     }
 
     shrink(session) {
+        if (this._queue) {
+            this._queue.push("shrink", session);
+            return;
+        }
         const transaction = this._db.transaction([STORE_NAME_LOGS], "readwrite");
         const logs_store = transaction.objectStore(STORE_NAME_LOGS);
-        const session_index = logs_store.index("session");
-        const cursor_req = session_index.openCursor(session);
-
-        cursor_req.onsuccess = (e) => {
-            const cursor = cursor_req.result;
-
-            if (cursor.value) {
-                cursor.delete();
-                cursor.continue()
-            }
-        }
-
+        delete_logs_of_session(logs_store, session);
     }
 
 }
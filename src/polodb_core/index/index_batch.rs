@@ -0,0 +1,128 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+use bson::{Bson, Document};
+use bson::raw::RawDocument;
+use bson::spec::ElementType;
+use crate::{LsmKv, Result};
+use crate::coll::collection_info::IndexInfo;
+use crate::index::{IndexHelper, IndexStatisticsRegistry};
+use crate::session::SessionInner;
+
+/// The entries of an index for a batch of documents.
+///
+/// The entries are sorted before they're written, so the memory table
+/// is filled in order, and the duplicated keys of a unique index
+/// are found among the batch too.
+pub(crate) struct IndexBatch<'a> {
+    col_name: &'a str,
+    index_name: &'a str,
+    index_info: &'a IndexInfo,
+    /// The index key, and the length of it without the primary key
+    entries: Vec<(Vec<u8>, usize)>,
+    byte_size: usize,
+}
+
+impl<'a> IndexBatch<'a> {
+
+    pub fn new(col_name: &'a str, index_name: &'a str, index_info: &'a IndexInfo) -> IndexBatch<'a> {
+        IndexBatch {
+            col_name,
+            index_name,
+            index_info,
+            entries: vec![],
+            byte_size: 0,
+        }
+    }
+
+    pub fn add(&mut self, data_doc: &Document, pkey: &Bson) -> Result<()> {
+        let value_key = IndexHelper::index_value_key(
+            data_doc,
+            self.col_name,
+            self.index_name,
+            self.index_info,
+        )?;
+        self.add_value_key(value_key, pkey)
+    }
+
+    /// The same as [`IndexBatch::add`] for a raw document
+    pub fn add_raw(&mut self, data_doc: &RawDocument, pkey: &Bson) -> Result<()> {
+        let value_key = IndexHelper::raw_index_value_key(
+            data_doc,
+            self.col_name,
+            self.index_name,
+            self.index_info,
+        )?;
+        self.add_value_key(value_key, pkey)
+    }
+
+    fn add_value_key(&mut self, value_key: Option<Vec<u8>>, pkey: &Bson) -> Result<()> {
+        let mut index_key = match value_key {
+            Some(key) => key,
+            None => return Ok(()),
+        };
+
+        let value_key_len = index_key.len();
+        crate::utils::bson::stacked_key_bytes(&mut index_key, pkey)?;
+
+        // the key and the null value
+        self.byte_size += index_key.len() + 1;
+        self.entries.push((index_key, value_key_len));
+
+        Ok(())
+    }
+
+    /// The bytes written by the batch
+    #[inline]
+    pub fn byte_size(&self) -> usize {
+        self.byte_size
+    }
+
+    /// All the unique keys are checked before the first one is written,
+    /// otherwise the entries of the batch would be found.
+    pub fn write(
+        mut self,
+        kv_engine: &LsmKv,
+        statistics: &IndexStatisticsRegistry,
+        session: &mut SessionInner,
+    ) -> Result<()> {
+        self.entries.sort_unstable_by(|(left, _), (right, _)| left.cmp(right));
+
+        if self.index_info.is_unique() {
+            for (index, (index_key, value_key_len)) in self.entries.iter().enumerate() {
+                let value_key = &index_key[0..*value_key_len];
+
+                // the values are prefix-free, the same values are adjacent
+                if index > 0 {
+                    let (prev_key, prev_len) = &self.entries[index - 1];
+                    if &prev_key[0..*prev_len] == value_key {
+                        return Err(IndexHelper::duplicate_key_error(
+                            self.col_name,
+                            self.index_name,
+                            value_key,
+                        ));
+                    }
+                }
+
+                IndexHelper::check_unique_key(
+                    self.col_name,
+                    self.index_name,
+                    value_key,
+                    kv_engine,
+                    session,
+                )?;
+            }
+        }
+
+        let value_buf = [ElementType::Null as u8];
+        for (index_key, value_key_len) in &self.entries {
+            session.put(index_key.as_slice(), &value_buf)?;
+            statistics.record_insert(self.col_name, self.index_name, &index_key[0..*value_key_len]);
+        }
+
+        Ok(())
+    }
+
+}
@@ -8,12 +8,13 @@ use bson::Document;
 use crate::Result;
 use crate::coll::collection_info::IndexInfo;
 use crate::cursor::Cursor;
-use crate::index::{IndexHelper, IndexHelperOperation};
+use crate::index::{prefix_successor, IndexBatch, IndexHelper, IndexHelperOperation, IndexStatisticsGatherer, IndexStatisticsRegistry};
 use crate::LsmKv;
 use crate::session::SessionInner;
 
 pub(crate) struct IndexBuilder<'a, 'b, 'c, 'd, 'e> {
     kv_engine: &'a LsmKv,
+    statistics: &'a IndexStatisticsRegistry,
     session: &'b mut SessionInner,
     col_name: &'c str,
     index_name: &'d str,
@@ -25,6 +26,7 @@ impl<'a, 'b, 'c, 'd, 'e> IndexBuilder<'a, 'b, 'c, 'd, 'e> {
     #[inline]
     pub fn new(
         kv_engine: &'a LsmKv,
+        statistics: &'a IndexStatisticsRegistry,
         session: &'b mut SessionInner,
         col_name: &'c str,
         index_name: &'d str,
@@ -32,6 +34,7 @@ impl<'a, 'b, 'c, 'd, 'e> IndexBuilder<'a, 'b, 'c, 'd, 'e> {
     ) -> IndexBuilder<'a, 'b, 'c, 'd, 'e> {
         IndexBuilder {
             kv_engine,
+            statistics,
             session,
             col_name,
             index_name,
@@ -39,7 +42,70 @@ impl<'a, 'b, 'c, 'd, 'e> IndexBuilder<'a, 'b, 'c, 'd, 'e> {
         }
     }
 
+    /// The statistics of the index are gathered on the entries inserted,
+    /// and removed with the entries.
+    ///
+    /// The entries are deleted by one range over the prefix of the index,
+    /// the documents are not visited.
     pub fn execute(&mut self, op: IndexHelperOperation) -> Result<()> {
+        match op {
+            IndexHelperOperation::Insert => self.build_index(),
+            IndexHelperOperation::Delete => {
+                let prefix = IndexHelper::index_key_prefix(self.col_name, Some(self.index_name))?;
+                self.session.delete_range(&prefix, &prefix_successor(&prefix))?;
+                self.statistics.remove(self.col_name, self.index_name);
+                Ok(())
+            }
+        }
+    }
+
+    /// All the entries are collected and written in order,
+    /// the large index is loaded into a segment directly.
+    fn build_index(&mut self) -> Result<()> {
+        self.statistics.set_gathered(self.col_name, self.index_name, IndexStatisticsGatherer::new());
+
+        let mut index_batch = IndexBatch::new(self.col_name, self.index_name, self.index_info);
+        self.for_each_document(|_, current_data| {
+            let data_doc = bson::from_slice::<Document>(current_data)?;
+            let pkey = data_doc.get("_id").unwrap();
+            index_batch.add(&data_doc, pkey)
+        })?;
+
+        if index_batch.byte_size() >= self.kv_engine.inner.config.bulk_load_min_bytes {
+            self.session.start_bulk_load()?;
+        }
+
+        index_batch.write(self.kv_engine, self.statistics, self.session)
+    }
+
+    /// Gather the statistics of the index built before,
+    /// the entries are not changed.
+    pub fn gather_statistics(&mut self) -> Result<()> {
+        let mut gatherer = IndexStatisticsGatherer::new();
+
+        self.for_each_document(|this, current_data| {
+            let data_doc = bson::from_slice::<Document>(current_data)?;
+            let value_key = IndexHelper::index_value_key(
+                &data_doc,
+                this.col_name,
+                this.index_name,
+                this.index_info,
+            )?;
+            if let Some(value_key) = value_key {
+                gatherer.add(&value_key);
+            }
+            Ok(())
+        })?;
+
+        self.statistics.set_gathered(self.col_name, self.index_name, gatherer);
+
+        Ok(())
+    }
+
+    fn for_each_document<F>(&mut self, mut f: F) -> Result<()>
+    where
+        F: FnMut(&mut Self, &[u8]) -> Result<()>,
+    {
         let multi_cursor = self.kv_engine.open_multi_cursor(
             Some(self.session.kv_session()),
         );
@@ -54,7 +120,7 @@ impl<'a, 'b, 'c, 'd, 'e> IndexBuilder<'a, 'b, 'c, 'd, 'e> {
             // get the value and insert index
             let current_data = cursor.peek_data(self.kv_engine.inner.as_ref()).unwrap().unwrap();
 
-            self.execute_index_item(op, current_data.as_ref())?;
+            f(self, current_data.as_ref())?;
 
             cursor.next()?;
         }
@@ -62,20 +128,4 @@ impl<'a, 'b, 'c, 'd, 'e> IndexBuilder<'a, 'b, 'c, 'd, 'e> {
         Ok(())
     }
 
-    fn execute_index_item(&mut self, op: IndexHelperOperation, current_data: &[u8]) -> Result<()> {
-        let data_doc = bson::from_slice::<Document>(current_data)?;
-        let pkey = data_doc.get("_id").unwrap();
-
-        IndexHelper::try_execute_with_index_info(
-            op,
-            &data_doc,
-            self.col_name,
-            &pkey,
-            self.index_name,
-            self.index_info,
-            &self.kv_engine,
-            self.session,
-        )
-    }
-
 }
@@ -6,13 +6,15 @@
 
 use std::sync::Arc;
 use bson::{Bson, Document};
+use bson::raw::RawDocument;
 use bson::spec::ElementType;
-use crate::{LsmKv, Result};
+use crate::{Error, LsmKv, Result};
 use crate::coll::collection_info::{
     CollectionSpecification,
     IndexInfo,
 };
 use crate::errors::DuplicateKeyError;
+use crate::index::IndexStatisticsRegistry;
 use crate::session::SessionInner;
 
 pub(crate) const INDEX_PREFIX: &'static str = "$I";
@@ -26,6 +28,7 @@ pub(crate) enum IndexHelperOperation {
 
 pub(crate) struct IndexHelper<'a, 'b, 'c, 'd, 'e> {
     kv_engine: &'a LsmKv,
+    statistics: &'a IndexStatisticsRegistry,
     session: &'b mut SessionInner,
     col_spec: &'c CollectionSpecification,
     doc: &'d Document,
@@ -37,6 +40,7 @@ impl<'a, 'b, 'c, 'd, 'e> IndexHelper<'a, 'b, 'c, 'd, 'e> {
     #[inline]
     pub fn new(
         kv_engine: &'a LsmKv,
+        statistics: &'a IndexStatisticsRegistry,
         session: &'b mut SessionInner,
         col_spec: &'c CollectionSpecification,
         doc: &'d Document,
@@ -44,6 +48,7 @@ impl<'a, 'b, 'c, 'd, 'e> IndexHelper<'a, 'b, 'c, 'd, 'e> {
     ) -> IndexHelper<'a, 'b, 'c, 'd, 'e> {
         IndexHelper {
             kv_engine,
+            statistics,
             session,
             col_spec,
             doc,
@@ -63,6 +68,7 @@ impl<'a, 'b, 'c, 'd, 'e> IndexHelper<'a, 'b, 'c, 'd, 'e> {
                 index_name.as_str(),
                 index_info,
                 self.kv_engine,
+                self.statistics,
                 self.session,
             )?;
         }
@@ -80,60 +86,121 @@ impl<'a, 'b, 'c, 'd, 'e> IndexHelper<'a, 'b, 'c, 'd, 'e> {
         index_name: &str,
         index_info: &IndexInfo,
         kv_engine: &'a LsmKv,
+        statistics: &IndexStatisticsRegistry,
         session: &mut SessionInner,
     ) -> Result<()> {
-        let tuples = index_info.keys.iter().collect::<Vec<(&String, &i8)>>();
-        let first_tuple = tuples.first().unwrap();
-        let (keys, _order) = first_tuple;
+        let mut index_key = match IndexHelper::index_value_key(data_doc, col_name, index_name, index_info)? {
+            Some(key) => key,
+            None => return Ok(()),
+        };
 
-        let value = crate::utils::bson::try_get_document_value(data_doc, keys);
-        if value.is_none() {
-            return Ok(())
-        }
-
-        if index_info.is_unique() {
+        if op == IndexHelperOperation::Insert && index_info.is_unique() {
             IndexHelper::check_unique_key(
                 col_name,
                 index_name,
-                value.as_ref().unwrap(),
+                &index_key,
                 kv_engine,
                 session,
             )?;
         }
 
-        let index_key = IndexHelper::make_index_key(
-            col_name,
-            index_name,
-            value.as_ref().unwrap(),
-            Some(pkey),
-        )?;
+        let value_key_len = index_key.len();
+        crate::utils::bson::stacked_key_bytes(&mut index_key, pkey)?;
 
         if op == IndexHelperOperation::Insert {
             let value_buf = [ElementType::Null as u8];
             session.put(index_key.as_slice(), &value_buf)?;
+            statistics.record_insert(col_name, index_name, &index_key[0..value_key_len]);
         } else {
             session.delete(index_key.as_slice())?;
+            statistics.record_delete(col_name, index_name);
         }
 
         Ok(())
     }
 
-    fn check_unique_key(
+    /// The index key of the document without the primary key,
+    /// None if the document is not indexed.
+    pub(crate) fn index_value_key(
+        data_doc: &Document,
         col_name: &str,
         index_name: &str,
-        value: &Bson,
-        kv_engine: &'a LsmKv,
-        session: &mut SessionInner,
-    ) -> Result<()> {
-        let index_key_tester = IndexHelper::make_index_key(
+        index_info: &IndexInfo,
+    ) -> Result<Option<Vec<u8>>> {
+        let values = IndexHelper::index_values_of(index_info, |key| {
+            Ok(crate::utils::bson::try_get_document_value(data_doc, key))
+        })?;
+        IndexHelper::index_value_key_of(values, col_name, index_name, index_info)
+    }
+
+    /// The same as [`IndexHelper::index_value_key`],
+    /// only the values of the keys are decoded from the raw document.
+    pub(crate) fn raw_index_value_key(
+        data_doc: &RawDocument,
+        col_name: &str,
+        index_name: &str,
+        index_info: &IndexInfo,
+    ) -> Result<Option<Vec<u8>>> {
+        let values = IndexHelper::index_values_of(index_info, |key| {
+            crate::utils::bson::try_get_raw_field_value(data_doc, key)
+        })?;
+        IndexHelper::index_value_key_of(values, col_name, index_name, index_info)
+    }
+
+    fn index_value_key_of(
+        values: Option<Vec<Bson>>,
+        col_name: &str,
+        index_name: &str,
+        index_info: &IndexInfo,
+    ) -> Result<Option<Vec<u8>>> {
+        let values = match values {
+            Some(values) => values,
+            None => return Ok(None),
+        };
+
+        let key = IndexHelper::make_index_key(
             col_name,
             index_name,
-            value,
+            index_info,
+            &values,
             None,
         )?;
+        Ok(Some(key))
+    }
 
+    /// The values of the keys of the index in the document,
+    /// read by `get_value`.
+    ///
+    /// The document is not indexed without the first key,
+    /// the other keys missing are indexed as null,
+    /// so the document is still found by a prefix of the index.
+    fn index_values_of<F>(index_info: &IndexInfo, mut get_value: F) -> Result<Option<Vec<Bson>>>
+    where
+        F: FnMut(&str) -> Result<Option<Bson>>
+    {
+        let mut result = Vec::with_capacity(index_info.keys.len());
+
+        for (index, key) in index_info.keys.keys().enumerate() {
+            match get_value(key)? {
+                Some(value) => result.push(value),
+                None if index == 0 => return Ok(None),
+                None => result.push(Bson::Null),
+            }
+        }
+
+        Ok(Some(result))
+    }
+
+    /// The tester is the index key without the primary key
+    pub(crate) fn check_unique_key(
+        col_name: &str,
+        index_name: &str,
+        index_key_tester: &[u8],
+        kv_engine: &'a LsmKv,
+        session: &mut SessionInner,
+    ) -> Result<()> {
         let mut cursor = kv_engine.open_multi_cursor(Some(session.kv_session()));
-        cursor.seek(&index_key_tester)?;
+        cursor.seek(index_key_tester)?;
 
         let current_key = cursor.key();
         if current_key.is_none() {
@@ -142,34 +209,82 @@ impl<'a, 'b, 'c, 'd, 'e> IndexHelper<'a, 'b, 'c, 'd, 'e> {
 
         let current_key: Arc<[u8]> = current_key.unwrap();
 
-        if current_key.starts_with(&index_key_tester) {
-            return Err(DuplicateKeyError {
-                name: index_name.to_string(),
-                key: value.to_string(),
-                ns: col_name.to_string(),
-            }.into());
+        if current_key.starts_with(index_key_tester) {
+            return Err(IndexHelper::duplicate_key_error(col_name, index_name, index_key_tester));
         }
 
         Ok(())
     }
 
-    pub fn make_index_key(col_name: &str, index_name: &str, value: &Bson, pkey: Option<&Bson>) -> Result<Vec<u8>> {
+    /// The values are decoded from the index key without the primary key,
+    /// the first three are the prefix of the index.
+    pub(crate) fn duplicate_key_error(col_name: &str, index_name: &str, value_key: &[u8]) -> Error {
+        let mut values = crate::utils::bson::split_stacked_keys(value_key).unwrap_or_default();
+        values.drain(0..std::cmp::min(values.len(), 3));
+
+        let key = if values.len() == 1 {
+            values[0].to_string()
+        } else {
+            Bson::Array(values).to_string()
+        };
+
+        DuplicateKeyError {
+            name: index_name.to_string(),
+            key,
+            ns: col_name.to_string(),
+        }.into()
+    }
+
+    /// The prefix of the keys of the indexes of the collection,
+    /// or only the index named.
+    pub fn index_key_prefix(col_name: &str, index_name: Option<&str>) -> Result<Vec<u8>> {
+        let b_prefix = Bson::String(INDEX_PREFIX.to_string());
+        let b_col_name = Bson::String(col_name.to_string());
+
+        let mut buf = crate::utils::bson::stacked_key([
+            &b_prefix,
+            &b_col_name,
+        ])?;
+
+        if let Some(index_name) = index_name {
+            crate::utils::bson::stacked_key_bytes(&mut buf, &Bson::String(index_name.to_string()))?;
+        }
+
+        Ok(buf)
+    }
+
+    /// The values are in the order of the keys of the index,
+    /// the values of the descending keys are inverted.
+    pub fn make_index_key(
+        col_name: &str,
+        index_name: &str,
+        index_info: &IndexInfo,
+        values: &[Bson],
+        pkey: Option<&Bson>,
+    ) -> Result<Vec<u8>> {
         let b_prefix = Bson::String(INDEX_PREFIX.to_string());
         let b_col_name = Bson::String(col_name.to_string());
         let b_index_name = &Bson::String(index_name.to_string());
 
-        let mut buf: Vec<&Bson> = vec![
+        let mut buf = crate::utils::bson::stacked_key([
             &b_prefix,
             &b_col_name,
-            &b_index_name,
-            value,
-        ];
+            b_index_name,
+        ])?;
+
+        for (order, value) in index_info.keys.values().zip(values) {
+            if *order < 0 {
+                crate::utils::bson::stacked_key_bytes_desc(&mut buf, value)?;
+            } else {
+                crate::utils::bson::stacked_key_bytes(&mut buf, value)?;
+            }
+        }
 
         if let Some(pkey) = pkey {
-            buf.push(pkey);
+            crate::utils::bson::stacked_key_bytes(&mut buf, pkey)?;
         }
 
-        crate::utils::bson::stacked_key(buf)
+        Ok(buf)
     }
 
 }
@@ -177,15 +292,19 @@ impl<'a, 'b, 'c, 'd, 'e> IndexHelper<'a, 'b, 'c, 'd, 'e> {
 #[cfg(test)]
 mod tests {
     use bson::Bson;
+    use indexmap::indexmap;
+    use crate::coll::collection_info::IndexInfo;
     use crate::utils::str::escape_binary_to_string;
     use super::IndexHelper;
 
     #[test]
     fn test_make_index_key() {
+        let index_info = IndexInfo::single_index("name".to_string(), 1, None);
         let index_key = IndexHelper::make_index_key(
             "users",
             "name",
-            &Bson::String("value".to_string()),
+            &index_info,
+            &[Bson::String("value".to_string())],
             Some(&Bson::String("Vincent".to_string())),
         ).unwrap() ;
 
@@ -194,4 +313,30 @@ mod tests {
         assert_eq!(escaped_string, "\\x02$I\\x00\\x02users\\x00\\x02name\\x00\\x02value\\x00\\x02Vincent\\x00");
     }
 
+    #[test]
+    fn test_make_compound_index_key() {
+        let index_info = IndexInfo {
+            keys: indexmap! {
+                "tenant".to_string() => 1,
+                "age".to_string() => -1,
+            },
+            options: None,
+            statistics: None,
+        };
+        let make_key = |age: i32| IndexHelper::make_index_key(
+            "users",
+            "tenant_1_age_-1",
+            &index_info,
+            &[Bson::String("t1".to_string()), Bson::Int32(age)],
+            Some(&Bson::Int32(1)),
+        ).unwrap();
+
+        assert!(make_key(30) < make_key(20));
+
+        let slices = crate::utils::bson::split_stacked_keys(&make_key(30)).unwrap();
+        assert_eq!(slices[3], Bson::String("t1".to_string()));
+        assert_eq!(slices[4], Bson::Int32(30));
+        assert_eq!(slices[5], Bson::Int32(1));
+    }
+
 }
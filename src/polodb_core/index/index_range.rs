@@ -0,0 +1,461 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+use bson::{Binary, Bson, DateTime};
+use bson::spec::{BinarySubtype, ElementType};
+use crate::utils::bson::stacked_key_bytes;
+
+/// An interval of the encoded index values,
+/// the start is included and the end is excluded.
+///
+/// The intervals cover all the values matched by the query,
+/// but maybe more, the documents found are always filtered
+/// by the query again.
+pub(crate) type KeyInterval = (Vec<u8>, Vec<u8>);
+
+/// The intervals are built in ascending order with both ends included,
+/// the keys starting with the end are in the interval too.
+/// It's converted by [`finish_intervals`] for the order of the index.
+type ClosedInterval = (Vec<u8>, Vec<u8>);
+
+/// The range of all the types indexed, MinKey can't be indexed.
+const TYPE_START: u8 = 0x01;
+const TYPE_END: u8 = 0xFF;
+
+#[derive(Copy, Clone)]
+enum Number {
+    Int(i64),
+    Float(f64),
+}
+
+fn number_of(value: &Bson) -> Option<Number> {
+    match value {
+        Bson::Int32(i) => Some(Number::Int(*i as i64)),
+        Bson::Int64(i) => Some(Number::Int(*i)),
+        Bson::Double(f) if !f.is_nan() => Some(Number::Float(*f)),
+        _ => None,
+    }
+}
+
+/// The smallest key greater than all the keys starting with the prefix
+pub(crate) fn prefix_successor(prefix: &[u8]) -> Vec<u8> {
+    let mut result = prefix.to_vec();
+    while let Some(last) = result.last_mut() {
+        if *last < u8::MAX {
+            *last += 1;
+            return result;
+        }
+        result.pop();
+    }
+    result
+}
+
+fn encode(value: &Bson) -> Option<Vec<u8>> {
+    let mut buf = Vec::with_capacity(16);
+    stacked_key_bytes(&mut buf, value).ok()?;
+    Some(buf)
+}
+
+fn invert(bytes: &[u8]) -> Vec<u8> {
+    bytes.iter().map(|b| !b).collect()
+}
+
+/// The descending keys are inverted, see [`crate::utils::bson::stacked_key_bytes_desc`],
+/// so the intervals are inverted and reversed.
+fn finish_intervals(intervals: Vec<ClosedInterval>, descending: bool) -> Vec<KeyInterval> {
+    let result = intervals
+        .into_iter()
+        .map(|(start, last)| {
+            if descending {
+                (invert(&last), prefix_successor(&invert(&start)))
+            } else {
+                (start, prefix_successor(&last))
+            }
+        })
+        .filter(|(start, end)| start < end)
+        .collect();
+    merge_intervals(result)
+}
+
+/// The values of the type between the bounds,
+/// the encoding of the type must keep the order.
+fn push_ordered(
+    out: &mut Vec<ClosedInterval>,
+    ty: ElementType,
+    lower: Option<&Bson>,
+    upper: Option<&Bson>,
+) -> Option<()> {
+    let start = match lower {
+        Some(value) => encode(value)?,
+        None => vec![ty as u8],
+    };
+    let last = match upper {
+        Some(value) => encode(value)?,
+        None => vec![ty as u8],
+    };
+    out.push((start, last));
+    Some(())
+}
+
+/// The signed integers are encoded as two's complement,
+/// so the negative values are after the others.
+fn push_signed<F>(out: &mut Vec<ClosedInterval>, lower: i128, upper: i128, make: F) -> Option<()>
+where
+    F: Fn(i128) -> Bson,
+{
+    let mut push_part = |from: i128, to: i128| -> Option<()> {
+        if from <= to {
+            out.push((encode(&make(from))?, encode(&make(to))?));
+        }
+        Some(())
+    };
+    push_part(lower, std::cmp::min(upper, -1))?;
+    push_part(std::cmp::max(lower, 0), upper)
+}
+
+/// The negative doubles are ordered reversely by the encoding,
+/// and NaN is at both ends of the type.
+fn push_double(out: &mut Vec<ClosedInterval>, lower: Option<f64>, upper: Option<f64>) -> Option<()> {
+    let whole_type = vec![ElementType::Double as u8];
+
+    if upper.map_or(true, |upper| upper >= 0.0) {
+        let start = encode(&Bson::Double(lower.map_or(0.0, |lower| lower.max(0.0))))?;
+        let last = match upper {
+            Some(upper) => encode(&Bson::Double(upper))?,
+            None => whole_type.clone(),
+        };
+        out.push((start, last));
+    }
+
+    if lower.map_or(true, |lower| lower < 0.0) {
+        let start = encode(&Bson::Double(upper.map_or(-0.0, |upper| upper.min(-0.0))))?;
+        let last = match lower {
+            Some(lower) => encode(&Bson::Double(lower))?,
+            None => whole_type,
+        };
+        out.push((start, last));
+    }
+
+    Some(())
+}
+
+fn integer_lower(bound: Option<Number>) -> i128 {
+    match bound {
+        None => i128::MIN,
+        Some(Number::Int(i)) => i as i128,
+        Some(Number::Float(f)) => float_to_i128(f.floor()),
+    }
+}
+
+fn integer_upper(bound: Option<Number>) -> i128 {
+    match bound {
+        None => i128::MAX,
+        Some(Number::Int(i)) => i as i128,
+        Some(Number::Float(f)) => float_to_i128(f.ceil()),
+    }
+}
+
+fn float_to_i128(f: f64) -> i128 {
+    if f < i64::MIN as f64 {
+        i64::MIN as i128 - 1
+    } else if f > i64::MAX as f64 {
+        i64::MAX as i128 + 1
+    } else {
+        f as i128
+    }
+}
+
+/// The integers beyond 2^53 are not exact as doubles,
+/// the side is left unbounded.
+fn float_bound(bound: Option<Number>) -> Option<f64> {
+    match bound {
+        Some(Number::Int(i)) if i.unsigned_abs() <= (1u64 << 53) => Some(i as f64),
+        Some(Number::Float(f)) => Some(f),
+        _ => None,
+    }
+}
+
+fn push_numbers(out: &mut Vec<ClosedInterval>, lower: Option<Number>, upper: Option<Number>) -> Option<()> {
+    let (lo, hi) = (integer_lower(lower), integer_upper(upper));
+
+    push_signed(
+        out,
+        std::cmp::max(lo, i32::MIN as i128),
+        std::cmp::min(hi, i32::MAX as i128),
+        |i| Bson::Int32(i as i32),
+    )?;
+    push_signed(
+        out,
+        std::cmp::max(lo, i64::MIN as i128),
+        std::cmp::min(hi, i64::MAX as i128),
+        |i| Bson::Int64(i as i64),
+    )?;
+    push_double(out, float_bound(lower), float_bound(upper))
+}
+
+#[inline]
+fn is_number_type(ty: u8) -> bool {
+    ty == ElementType::Double as u8 || ty == ElementType::Int32 as u8 || ty == ElementType::Int64 as u8
+}
+
+/// All the values of the types in `[from, to)`,
+/// the numbers are skipped if they are compared by the values.
+fn push_types_between(out: &mut Vec<ClosedInterval>, from: u8, to: u8, skip_numbers: bool) {
+    let mut run_start: Option<u8> = None;
+    for ty in from..to {
+        if skip_numbers && is_number_type(ty) {
+            if let Some(start) = run_start.take() {
+                out.push((vec![start], vec![ty - 1]));
+            }
+        } else if run_start.is_none() {
+            run_start = Some(ty);
+        }
+    }
+    if let Some(start) = run_start {
+        out.push((vec![start], vec![to - 1]));
+    }
+}
+
+fn datetime_bound(bound: Option<&Bson>, unbounded: i128) -> Option<i128> {
+    match bound {
+        Some(Bson::DateTime(dt)) => Some(dt.timestamp_millis() as i128),
+        Some(_) => None,
+        None => Some(unbounded),
+    }
+}
+
+/// The intervals of the values between the bounds, both are included.
+///
+/// The values of different types are compared by the types,
+/// so the types between the bounds are all included.
+/// Return None if the bounds can't be served by the index.
+pub(crate) fn intervals_of_range(
+    lower: Option<&Bson>,
+    upper: Option<&Bson>,
+    descending: bool,
+) -> Option<Vec<KeyInterval>> {
+    let sample = lower.or(upper)?;
+    let mut result = vec![];
+
+    if number_of(sample).is_some() {
+        let lower_num = match lower {
+            Some(value) => Some(number_of(value)?),
+            None => None,
+        };
+        let upper_num = match upper {
+            Some(value) => Some(number_of(value)?),
+            None => None,
+        };
+        push_numbers(&mut result, lower_num, upper_num)?;
+    } else {
+        let ty = sample.element_type();
+        let same_type = |bound: Option<&Bson>| bound.map_or(true, |value| value.element_type() == ty);
+        if !same_type(lower) || !same_type(upper) {
+            return None;
+        }
+
+        match sample {
+            Bson::DateTime(_) => {
+                let lo = datetime_bound(lower, i64::MIN as i128)?;
+                let hi = datetime_bound(upper, i64::MAX as i128)?;
+                push_signed(&mut result, lo, hi, |i| Bson::DateTime(DateTime::from_millis(i as i64)))?;
+            }
+
+            Bson::String(_) | Bson::ObjectId(_) | Bson::Boolean(_) => {
+                push_ordered(&mut result, ty, lower, upper)?;
+            }
+
+            _ => return None,
+        }
+    }
+
+    // the other types ordered between the bounds
+    let types_start = lower.map_or(TYPE_START, |value| value.element_type() as u8 + 1);
+    let types_end = upper.map_or(TYPE_END, |value| value.element_type() as u8);
+    push_types_between(&mut result, types_start, types_end, number_of(sample).is_some());
+
+    Some(finish_intervals(result, descending))
+}
+
+/// Whether the values between the bounds, which are both included
+/// in the intervals, are scanned in the order of the values.
+///
+/// The numbers are scanned one type after another, and the negative
+/// integers and dates are after the others, so they're not ordered.
+pub(crate) fn is_range_scan_ordered(lower: &Bson, upper: &Bson) -> bool {
+    if lower.element_type() != upper.element_type() {
+        return false;
+    }
+
+    match lower {
+        Bson::String(_) | Bson::ObjectId(_) | Bson::Boolean(_) => true,
+        Bson::DateTime(dt) => dt.timestamp_millis() >= 0,
+        _ => false,
+    }
+}
+
+/// The intervals of the values equal to the value,
+/// the numbers of all the types are included.
+pub(crate) fn intervals_of_point(value: &Bson, descending: bool) -> Option<Vec<KeyInterval>> {
+    let mut result = vec![];
+
+    if let Some(number) = number_of(value) {
+        push_numbers(&mut result, Some(number), Some(number))?;
+    } else {
+        match value {
+            // the documents without the field are not indexed
+            Bson::Null | Bson::Undefined => return None,
+            _ => {
+                let encoded = encode(value)?;
+                result.push((encoded.clone(), encoded));
+            }
+        }
+    }
+
+    Some(finish_intervals(result, descending))
+}
+
+/// Sort the intervals and merge the overlapped ones,
+/// so no key is visited twice.
+pub(crate) fn merge_intervals(mut intervals: Vec<KeyInterval>) -> Vec<KeyInterval> {
+    intervals.sort();
+
+    let mut result: Vec<KeyInterval> = Vec::with_capacity(intervals.len());
+    for (start, end) in intervals {
+        if let Some(last) = result.last_mut() {
+            if start <= last.1 {
+                if end > last.1 {
+                    last.1 = end;
+                }
+                continue;
+            }
+        }
+        result.push((start, end));
+    }
+
+    result
+}
+
+/// The intervals are stored in the static values of the program
+/// as an array of `[start, end]` binaries.
+pub(crate) fn intervals_to_bson(intervals: &[KeyInterval]) -> Bson {
+    let to_binary = |bytes: &Vec<u8>| Bson::Binary(Binary {
+        subtype: BinarySubtype::Generic,
+        bytes: bytes.clone(),
+    });
+    Bson::Array(
+        intervals
+            .iter()
+            .map(|(start, end)| Bson::Array(vec![to_binary(start), to_binary(end)]))
+            .collect(),
+    )
+}
+
+pub(crate) fn intervals_from_bson(value: &Bson) -> Vec<KeyInterval> {
+    let items = value.as_array().expect("intervals must be an array");
+    items
+        .iter()
+        .map(|item| match item.as_array().map(|pair| pair.as_slice()) {
+            Some([Bson::Binary(start), Bson::Binary(end)]) => (start.bytes.clone(), end.bytes.clone()),
+            _ => panic!("unexpected interval: {:?}", item),
+        })
+        .collect()
+}
+
+#[cfg(test)]
+mod tests {
+    use bson::{Bson, DateTime};
+    use crate::index::index_range::{intervals_of_point, intervals_of_range, KeyInterval};
+    use crate::utils::bson::{stacked_key, stacked_key_bytes, stacked_key_bytes_desc};
+
+    fn contains(intervals: &[KeyInterval], value: &Bson) -> bool {
+        let key = stacked_key([value, &Bson::Int32(1)]).unwrap();
+        intervals.iter().any(|(start, end)| key >= *start && key < *end)
+    }
+
+    fn contains_desc(intervals: &[KeyInterval], value: &Bson) -> bool {
+        let mut key = vec![];
+        stacked_key_bytes_desc(&mut key, value).unwrap();
+        stacked_key_bytes(&mut key, &Bson::Int32(1)).unwrap();
+        intervals.iter().any(|(start, end)| key >= *start && key < *end)
+    }
+
+    #[test]
+    fn test_number_range() {
+        let intervals = intervals_of_range(Some(&Bson::Int32(-3)), Some(&Bson::Int32(5)), false).unwrap();
+        for i in -3..=5 {
+            assert!(contains(&intervals, &Bson::Int32(i)), "{}", i);
+            assert!(contains(&intervals, &Bson::Int64(i as i64)), "{}", i);
+            if i < 5 {
+                assert!(contains(&intervals, &Bson::Double(i as f64 + 0.5)), "{}", i);
+            }
+        }
+        assert!(!contains(&intervals, &Bson::Int32(-4)));
+        assert!(!contains(&intervals, &Bson::Int32(6)));
+        assert!(!contains(&intervals, &Bson::Int64(i64::MIN)));
+        assert!(!contains(&intervals, &Bson::Double(-3.5)));
+        assert!(!contains(&intervals, &Bson::String("a".into())));
+
+        let intervals = intervals_of_range(Some(&Bson::Double(1.5)), None, false).unwrap();
+        assert!(!contains(&intervals, &Bson::Int32(1)));
+        assert!(contains(&intervals, &Bson::Int32(2)));
+        assert!(contains(&intervals, &Bson::Int64(i64::MAX)));
+        assert!(contains(&intervals, &Bson::Double(f64::INFINITY)));
+        assert!(!contains(&intervals, &Bson::Double(-2.0)));
+    }
+
+    #[test]
+    fn test_datetime_range() {
+        let from = DateTime::from_millis(1_000);
+        let to = DateTime::from_millis(2_000);
+        let intervals = intervals_of_range(Some(&Bson::DateTime(from)), Some(&Bson::DateTime(to)), false).unwrap();
+
+        assert_eq!(intervals.len(), 1);
+        assert!(contains(&intervals, &Bson::DateTime(DateTime::from_millis(1_500))));
+        assert!(contains(&intervals, &Bson::DateTime(to)));
+        assert!(!contains(&intervals, &Bson::DateTime(DateTime::from_millis(-1_500))));
+        assert!(!contains(&intervals, &Bson::Int64(1_500)));
+    }
+
+    #[test]
+    fn test_descending_range() {
+        let intervals = intervals_of_range(Some(&Bson::Int32(-3)), Some(&Bson::Int32(5)), true).unwrap();
+        for i in -3..=5 {
+            assert!(contains_desc(&intervals, &Bson::Int32(i)), "{}", i);
+            assert!(contains_desc(&intervals, &Bson::Int64(i as i64)), "{}", i);
+        }
+        assert!(!contains_desc(&intervals, &Bson::Int32(-4)));
+        assert!(!contains_desc(&intervals, &Bson::Int32(6)));
+        assert!(!contains_desc(&intervals, &Bson::Double(-3.5)));
+
+        let intervals = intervals_of_range(None, Some(&Bson::String("b".into())), true).unwrap();
+        assert!(contains_desc(&intervals, &Bson::String("a".into())));
+        assert!(contains_desc(&intervals, &Bson::String("b".into())));
+        assert!(!contains_desc(&intervals, &Bson::String("ba".into())));
+        assert!(contains_desc(&intervals, &Bson::Double(1.0)));
+        assert!(!contains_desc(&intervals, &Bson::Int32(1)));
+
+        let intervals = intervals_of_point(&Bson::String("abc".into()), true).unwrap();
+        assert!(contains_desc(&intervals, &Bson::String("abc".into())));
+        assert!(!contains_desc(&intervals, &Bson::String("abcd".into())));
+        assert!(!contains_desc(&intervals, &Bson::String("ab".into())));
+    }
+
+    #[test]
+    fn test_point() {
+        let intervals = intervals_of_point(&Bson::Int32(3), false).unwrap();
+        assert!(contains(&intervals, &Bson::Int32(3)));
+        assert!(contains(&intervals, &Bson::Int64(3)));
+        assert!(contains(&intervals, &Bson::Double(3.0)));
+        assert!(!contains(&intervals, &Bson::Int32(4)));
+
+        let intervals = intervals_of_point(&Bson::String("abc".into()), false).unwrap();
+        assert!(contains(&intervals, &Bson::String("abc".into())));
+        assert!(!contains(&intervals, &Bson::String("abcd".into())));
+
+        assert!(intervals_of_point(&Bson::Null, false).is_none());
+    }
+
+}
@@ -0,0 +1,237 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+use std::collections::hash_map::DefaultHasher;
+use std::collections::HashMap;
+use std::hash::Hasher;
+use std::sync::{Arc, Mutex};
+
+/// The count of the registers of the distinct sketch
+const SKETCH_REGISTERS: usize = 256;
+
+/// The statistics given to the planner
+#[derive(Debug, Clone, Copy, Default, PartialEq)]
+pub struct IndexStatistics {
+    /// The count of the entries of the index
+    pub entry_count: u64,
+    /// The estimated count of the distinct values
+    pub distinct_count: u64,
+}
+
+/// A HyperLogLog sketch of the values indexed.
+///
+/// The entries deleted can't be removed from the sketch,
+/// so the distinct count is estimated on all the values ever inserted.
+#[derive(Clone)]
+struct DistinctSketch {
+    registers: Box<[u8; SKETCH_REGISTERS]>,
+}
+
+impl DistinctSketch {
+
+    fn new() -> DistinctSketch {
+        DistinctSketch {
+            registers: Box::new([0; SKETCH_REGISTERS]),
+        }
+    }
+
+    fn add(&mut self, value_key: &[u8]) {
+        let mut hasher = DefaultHasher::new();
+        hasher.write(value_key);
+        let hash = hasher.finish();
+
+        let index = (hash >> 56) as usize;
+        // the bit at the end bounds the rank of the remaining 56 bits
+        let rank = ((hash << 8) | 0x80).leading_zeros() as u8 + 1;
+        if rank > self.registers[index] {
+            self.registers[index] = rank;
+        }
+    }
+
+    fn estimate(&self) -> u64 {
+        let m = SKETCH_REGISTERS as f64;
+        let alpha = 0.7213 / (1.0 + 1.079 / m);
+
+        let mut sum = 0.0;
+        let mut zeros = 0;
+        for register in self.registers.iter() {
+            sum += 2f64.powi(-(*register as i32));
+            if *register == 0 {
+                zeros += 1;
+            }
+        }
+
+        let raw = alpha * m * m / sum;
+        // linear counting is more accurate on the small sets
+        let estimate = if raw <= 2.5 * m && zeros > 0 {
+            m * (m / zeros as f64).ln()
+        } else {
+            raw
+        };
+
+        estimate.round() as u64
+    }
+
+}
+
+#[derive(Clone)]
+struct IndexStatisticsEntry {
+    entry_count: u64,
+    sketch: DistinctSketch,
+}
+
+impl IndexStatisticsEntry {
+
+    fn new() -> IndexStatisticsEntry {
+        IndexStatisticsEntry {
+            entry_count: 0,
+            sketch: DistinctSketch::new(),
+        }
+    }
+
+    fn statistics(&self) -> IndexStatistics {
+        let distinct_count = std::cmp::min(self.sketch.estimate(), self.entry_count);
+        IndexStatistics {
+            entry_count: self.entry_count,
+            // the values are never fewer than one if there are entries
+            distinct_count: std::cmp::max(distinct_count, std::cmp::min(self.entry_count, 1)),
+        }
+    }
+
+}
+
+/// The statistics of the indexes of the database.
+///
+/// They are gathered when the index is built, or the first time
+/// the index is planned after the database is opened,
+/// and updated on every entry inserted or deleted.
+/// They are only used to estimate the costs, so they are not
+/// persisted, and the entries of the transactions rolled back
+/// are not reverted.
+#[derive(Clone)]
+pub(crate) struct IndexStatisticsRegistry {
+    inner: Arc<Mutex<HashMap<(String, String), IndexStatisticsEntry>>>,
+}
+
+impl IndexStatisticsRegistry {
+
+    pub fn new() -> IndexStatisticsRegistry {
+        IndexStatisticsRegistry {
+            inner: Arc::new(Mutex::new(HashMap::new())),
+        }
+    }
+
+    fn with_entry<F>(&self, col_name: &str, index_name: &str, f: F)
+    where
+        F: FnOnce(&mut IndexStatisticsEntry),
+    {
+        let mut inner = self.inner.lock().unwrap();
+        // the entries not gathered yet are not tracked,
+        // they are all counted when they're gathered
+        if let Some(entry) = inner.get_mut(&(col_name.to_string(), index_name.to_string())) {
+            f(entry);
+        }
+    }
+
+    /// The value key is the index key without the primary key
+    pub fn record_insert(&self, col_name: &str, index_name: &str, value_key: &[u8]) {
+        self.with_entry(col_name, index_name, |entry| {
+            entry.entry_count += 1;
+            entry.sketch.add(value_key);
+        });
+    }
+
+    pub fn record_delete(&self, col_name: &str, index_name: &str) {
+        self.with_entry(col_name, index_name, |entry| {
+            entry.entry_count = entry.entry_count.saturating_sub(1);
+        });
+    }
+
+    pub fn get(&self, col_name: &str, index_name: &str) -> Option<IndexStatistics> {
+        let inner = self.inner.lock().unwrap();
+        inner
+            .get(&(col_name.to_string(), index_name.to_string()))
+            .map(|entry| entry.statistics())
+    }
+
+    /// Replace the statistics with the ones gathered
+    pub fn set_gathered(&self, col_name: &str, index_name: &str, gathered: IndexStatisticsGatherer) {
+        let mut inner = self.inner.lock().unwrap();
+        inner.insert((col_name.to_string(), index_name.to_string()), gathered.entry);
+    }
+
+    pub fn remove(&self, col_name: &str, index_name: &str) {
+        let mut inner = self.inner.lock().unwrap();
+        inner.remove(&(col_name.to_string(), index_name.to_string()));
+    }
+
+    pub fn remove_collection(&self, col_name: &str) {
+        let mut inner = self.inner.lock().unwrap();
+        inner.retain(|(name, _), _| name != col_name);
+    }
+
+}
+
+/// Count the entries of an index scanned by the builder
+pub(crate) struct IndexStatisticsGatherer {
+    entry: IndexStatisticsEntry,
+}
+
+impl IndexStatisticsGatherer {
+
+    pub fn new() -> IndexStatisticsGatherer {
+        IndexStatisticsGatherer {
+            entry: IndexStatisticsEntry::new(),
+        }
+    }
+
+    pub fn add(&mut self, value_key: &[u8]) {
+        self.entry.entry_count += 1;
+        self.entry.sketch.add(value_key);
+    }
+
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::index::index_statistics::{IndexStatisticsGatherer, IndexStatisticsRegistry};
+
+    #[test]
+    fn test_distinct_estimate() {
+        let registry = IndexStatisticsRegistry::new();
+
+        let mut gatherer = IndexStatisticsGatherer::new();
+        for i in 0..10000u32 {
+            gatherer.add(format!("value-{}", i % 2).as_bytes());
+        }
+        registry.set_gathered("orders", "status_1", gatherer);
+
+        let mut gatherer = IndexStatisticsGatherer::new();
+        for i in 0..10000u32 {
+            gatherer.add(format!("value-{}", i).as_bytes());
+        }
+        registry.set_gathered("orders", "order_id_1", gatherer);
+
+        let status = registry.get("orders", "status_1").unwrap();
+        assert_eq!(status.entry_count, 10000);
+        assert_eq!(status.distinct_count, 2);
+
+        let order_id = registry.get("orders", "order_id_1").unwrap();
+        assert!(order_id.distinct_count > 7000 && order_id.distinct_count < 13000, "{}", order_id.distinct_count);
+
+        registry.record_insert("orders", "status_1", b"value-2");
+        registry.record_delete("orders", "order_id_1");
+        assert_eq!(registry.get("orders", "status_1").unwrap().entry_count, 10001);
+        assert_eq!(registry.get("orders", "order_id_1").unwrap().entry_count, 9999);
+
+        // not gathered yet
+        registry.record_insert("orders", "created_at_1", b"value-0");
+        assert!(registry.get("orders", "created_at_1").is_none());
+
+        registry.remove_collection("orders");
+        assert!(registry.get("orders", "status_1").is_none());
+    }
+
+}
@@ -4,10 +4,29 @@
  * file, You can obtain one at https://mozilla.org/MPL/2.0/.
  */
 
+mod index_batch;
 mod index_helper;
 mod index_model;
 mod index_builder;
+mod index_range;
+mod index_statistics;
 
+pub(crate) use index_batch::IndexBatch;
 pub(crate) use index_helper::{IndexHelper, IndexHelperOperation, INDEX_PREFIX};
 pub(crate) use index_builder::IndexBuilder;
+pub(crate) use index_range::{
+    intervals_from_bson,
+    intervals_of_point,
+    intervals_of_range,
+    intervals_to_bson,
+    is_range_scan_ordered,
+    merge_intervals,
+    prefix_successor,
+    KeyInterval,
+};
+pub(crate) use index_statistics::{
+    IndexStatistics,
+    IndexStatisticsGatherer,
+    IndexStatisticsRegistry,
+};
 pub use index_model::{IndexModel, IndexOptions};
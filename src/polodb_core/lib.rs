@@ -161,7 +161,7 @@ mod coll;
 
 pub use db::{Database, DatabaseServer, Result};
 pub use coll::Collection;
-pub use config::{Config, ConfigBuilder};
+pub use config::{Config, ConfigBuilder, LsmCompression};
 pub use transaction::TransactionType;
 pub use db::client_cursor::{ClientCursor, ClientSessionCursor};
 pub use errors::Error;
@@ -0,0 +1,125 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+use std::borrow::Cow;
+use byteorder::{BigEndian, ReadBytesExt, WriteBytesExt};
+use crate::{Error, LsmCompression, Result};
+
+/// The header before every block of a compressed segment
+///
+/// 1 byte: codec
+/// 4 bytes: length of the raw block
+/// 4 bytes: length of the stored bytes after the header
+pub(crate) const BLOCK_HEADER_SIZE: usize = 9;
+
+const CODEC_NONE: u8 = 0;
+const CODEC_LZ4: u8 = 1;
+
+/// Append the header and the stored bytes of the block.
+/// The block is stored raw if the codec doesn't shrink it,
+/// so the stored length never exceeds the raw length.
+pub(crate) fn encode_block(raw: &[u8], compression: LsmCompression, out: &mut Vec<u8>) -> Result<()> {
+    let compressed = match compression {
+        LsmCompression::None => None,
+        LsmCompression::Lz4 => {
+            let compressed = lz4_flex::block::compress(raw);
+            if compressed.len() < raw.len() {
+                Some(compressed)
+            } else {
+                None
+            }
+        }
+    };
+
+    match compressed {
+        Some(compressed) => {
+            out.write_u8(CODEC_LZ4)?;
+            out.write_u32::<BigEndian>(raw.len() as u32)?;
+            out.write_u32::<BigEndian>(compressed.len() as u32)?;
+            out.extend_from_slice(&compressed);
+        }
+        None => {
+            out.write_u8(CODEC_NONE)?;
+            out.write_u32::<BigEndian>(raw.len() as u32)?;
+            out.write_u32::<BigEndian>(raw.len() as u32)?;
+            out.extend_from_slice(raw);
+        }
+    }
+
+    Ok(())
+}
+
+/// The length of the header and the stored bytes,
+/// only the header is read.
+pub(crate) fn encoded_block_len(mut data: &[u8]) -> Result<usize> {
+    if data.len() < BLOCK_HEADER_SIZE {
+        return Err(Error::data_malformed());
+    }
+    let _codec = data.read_u8()?;
+    let _raw_len = data.read_u32::<BigEndian>()?;
+    let stored_len = data.read_u32::<BigEndian>()? as usize;
+    Ok(BLOCK_HEADER_SIZE + stored_len)
+}
+
+/// Decode the block starting with the header,
+/// the raw blocks are borrowed without copying.
+pub(crate) fn decode_block(mut data: &[u8]) -> Result<Cow<[u8]>> {
+    if data.len() < BLOCK_HEADER_SIZE {
+        return Err(Error::data_malformed());
+    }
+    let codec = data.read_u8()?;
+    let raw_len = data.read_u32::<BigEndian>()? as usize;
+    let stored_len = data.read_u32::<BigEndian>()? as usize;
+    if stored_len > data.len() {
+        return Err(Error::data_malformed());
+    }
+    let stored = &data[0..stored_len];
+
+    match codec {
+        CODEC_NONE => Ok(Cow::Borrowed(stored)),
+        CODEC_LZ4 => {
+            let raw = lz4_flex::block::decompress(stored, raw_len)
+                .map_err(|_| Error::data_malformed())?;
+            if raw.len() != raw_len {
+                return Err(Error::data_malformed());
+            }
+            Ok(Cow::Owned(raw))
+        }
+        _ => Err(Error::data_malformed()),
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::LsmCompression;
+    use crate::lsm::block_compression::{decode_block, encode_block, encoded_block_len, BLOCK_HEADER_SIZE};
+
+    #[test]
+    fn test_block_round_trip() {
+        let mut raw = vec![];
+        for i in 0..1000u32 {
+            raw.extend_from_slice(format!("key-{:06}", i).as_bytes());
+        }
+
+        let mut lz4 = vec![];
+        encode_block(&raw, LsmCompression::Lz4, &mut lz4).unwrap();
+        assert!(lz4.len() < raw.len());
+        assert_eq!(encoded_block_len(&lz4).unwrap(), lz4.len());
+        assert_eq!(decode_block(&lz4).unwrap().as_ref(), raw.as_slice());
+
+        let mut plain = vec![];
+        encode_block(&raw, LsmCompression::None, &mut plain).unwrap();
+        assert_eq!(plain.len(), raw.len() + BLOCK_HEADER_SIZE);
+        assert_eq!(decode_block(&plain).unwrap().as_ref(), raw.as_slice());
+
+        // not shrunk by the codec
+        let random: Vec<u8> = (0..64u32).map(|i| (i.wrapping_mul(2654435761) >> 24) as u8).collect();
+        let mut stored = vec![];
+        encode_block(&random, LsmCompression::Lz4, &mut stored).unwrap();
+        assert!(stored.len() <= random.len() + BLOCK_HEADER_SIZE);
+        assert_eq!(decode_block(&stored).unwrap().as_ref(), random.as_slice());
+    }
+
+}
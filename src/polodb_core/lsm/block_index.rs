@@ -0,0 +1,745 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+use std::cmp::Ordering;
+use std::fs::File;
+use std::io::{Read, Write};
+use std::sync::Arc;
+use byteorder::{BigEndian, ReadBytesExt, WriteBytesExt};
+use memmap2::{Mmap, MmapOptions};
+use crate::{Error, Result};
+use crate::lsm::block_compression;
+use crate::lsm::block_compression::BLOCK_HEADER_SIZE;
+use crate::lsm::bloom_filter::{BloomFilter, BloomFilterBuilder};
+use crate::lsm::lsm_backend::format;
+use crate::lsm::lsm_segment::LsmTuplePtr;
+use crate::lsm::lsm_tree::LsmTreeValueMarker;
+use crate::lsm::range_delete::{RangeDeletes, RangeDeletesBuilder};
+use crate::utils::vli;
+
+/// "PDBI"
+const BLOCK_INDEX_MAGIC: u32 = 0x50444249;
+
+/// "PDBZ", every block starts with a header
+/// and may be compressed.
+const BLOCK_INDEX_COMPRESSED_MAGIC: u32 = 0x5044425A;
+
+/// The footer at the end of the block index
+///
+/// 4 bytes: magic
+/// 4 bytes: block count
+/// 8 bytes: offset of the first index entry, relative to the segment
+/// 8 bytes: offset of the Bloom filter, relative to the segment
+/// 4 bytes: length of the Bloom filter(0 if there is no filter)
+/// 4 bytes: hash count of the Bloom filter
+///
+/// The ranges deleted are written between the index entries
+/// and the Bloom filter, as pairs of the start and the end key.
+pub(crate) const BLOCK_INDEX_FOOTER_SIZE: usize = 32;
+
+/// A new block is started when the tuples of current block
+/// exceed this size.
+const BLOCK_TARGET_SIZE: u64 = 4096;
+
+pub(crate) type BlockEntry = (Arc<[u8]>, LsmTreeValueMarker<LsmTuplePtr>);
+
+/// A block is a run of tuples about one page size.
+/// Only the first key of the block is kept in memory.
+pub(crate) struct SegmentBlock {
+    pub first_key:   Arc<[u8]>,
+    /// Offset relative to the start of segment
+    pub offset:      u64,
+    pub tuple_count: u64,
+}
+
+/// Collect the blocks while the tuples are written.
+/// It's also used to estimate the size of the index before writing.
+pub(crate) struct BlockIndexBuilder {
+    blocks:              Vec<SegmentBlock>,
+    current_block_bytes: u64,
+    written_bytes:       u64,
+    filter:              Option<BloomFilterBuilder>,
+    compressed:          bool,
+    range_deletes:       RangeDeletesBuilder,
+}
+
+impl BlockIndexBuilder {
+
+    /// No Bloom filter is built if `bloom_bits_per_key` is 0.
+    pub fn new(bloom_bits_per_key: u32) -> BlockIndexBuilder {
+        let filter = if bloom_bits_per_key > 0 {
+            Some(BloomFilterBuilder::new(bloom_bits_per_key))
+        } else {
+            None
+        };
+        BlockIndexBuilder {
+            blocks: Vec::new(),
+            current_block_bytes: 0,
+            written_bytes: 0,
+            filter,
+            compressed: false,
+            range_deletes: RangeDeletesBuilder::new(),
+        }
+    }
+
+    /// The blocks are written with headers, see `block_compression`.
+    #[inline]
+    pub fn set_compressed(&mut self, compressed: bool) {
+        self.compressed = compressed;
+    }
+
+    /// The next tuple added will start a new block
+    #[inline]
+    pub fn is_block_full(&self) -> bool {
+        self.blocks.is_empty() || self.current_block_bytes >= BLOCK_TARGET_SIZE
+    }
+
+    /// The compressed blocks are smaller than the tuples added,
+    /// the writer sets the real position after writing a block.
+    #[inline]
+    pub fn set_written_bytes(&mut self, written_bytes: u64) {
+        self.written_bytes = written_bytes;
+    }
+
+    /// The bytes of the headers if every block is written with a header
+    #[inline]
+    pub fn block_headers_len(&self) -> usize {
+        self.blocks.len() * BLOCK_HEADER_SIZE
+    }
+
+    /// A range delete covers the keys not in the segment,
+    /// so the segment can't be skipped by a filter.
+    pub fn add_range_marker<V>(&mut self, key: &[u8], tuple_size: u64, marker: &LsmTreeValueMarker<V>) {
+        self.filter = None;
+        self.range_deletes.add_marker(key, marker);
+        self.add_tuple(key, tuple_size);
+    }
+
+    /// The tuples must be added in order
+    pub fn add_tuple(&mut self, key: &[u8], tuple_size: u64) {
+        if self.is_block_full() {
+            self.blocks.push(SegmentBlock {
+                first_key: key.into(),
+                offset: self.written_bytes,
+                tuple_count: 0,
+            });
+            self.current_block_bytes = 0;
+        }
+
+        let block = self.blocks.last_mut().unwrap();
+        block.tuple_count += 1;
+
+        if let Some(filter) = &mut self.filter {
+            filter.add_key(key);
+        }
+
+        self.current_block_bytes += tuple_size;
+        self.written_bytes += tuple_size;
+    }
+
+    /// The bytes of the index entries, the filter and the footer
+    pub fn encoded_len(&self) -> usize {
+        let mut result = BLOCK_INDEX_FOOTER_SIZE + self.filter_len();
+
+        for block in &self.blocks {
+            result += vli::vli_len_u64(block.first_key.len() as u64);
+            result += block.first_key.len();
+            result += vli::vli_len_u64(block.offset);
+            result += vli::vli_len_u64(block.tuple_count);
+        }
+
+        for (start, end) in self.range_deletes.ranges().iter() {
+            result += vli::vli_len_u64(start.len() as u64) + start.len();
+            result += vli::vli_len_u64(end.len() as u64) + end.len();
+        }
+
+        result
+    }
+
+    #[inline]
+    fn filter_len(&self) -> usize {
+        self.filter.as_ref().map(|f| f.encoded_len()).unwrap_or(0)
+    }
+
+    /// Write the entries, the filter and the footer after the tuples,
+    /// return the offset of the footer relative to the segment.
+    pub fn write_to<W: Write>(&self, writer: &mut W) -> Result<u64> {
+        let entries_offset = self.written_bytes;
+        let mut footer_offset = entries_offset;
+
+        for block in &self.blocks {
+            vli::encode(writer, block.first_key.len() as i64)?;
+            writer.write_all(&block.first_key)?;
+            vli::encode(writer, block.offset as i64)?;
+            vli::encode(writer, block.tuple_count as i64)?;
+
+            footer_offset += (vli::vli_len_u64(block.first_key.len() as u64) + block.first_key.len()) as u64;
+            footer_offset += (vli::vli_len_u64(block.offset) + vli::vli_len_u64(block.tuple_count)) as u64;
+        }
+
+        for (start, end) in self.range_deletes.ranges().iter() {
+            for key in [start, end] {
+                vli::encode(writer, key.len() as i64)?;
+                writer.write_all(key)?;
+
+                footer_offset += (vli::vli_len_u64(key.len() as u64) + key.len()) as u64;
+            }
+        }
+
+        let filter_offset = footer_offset;
+        let filter_len = self.filter_len();
+        let hash_count = self.filter.as_ref().map(|f| f.hash_count()).unwrap_or(0);
+        if let Some(filter) = &self.filter {
+            filter.write_to(writer)?;
+        }
+        footer_offset += filter_len as u64;
+
+        let magic = if self.compressed {
+            BLOCK_INDEX_COMPRESSED_MAGIC
+        } else {
+            BLOCK_INDEX_MAGIC
+        };
+        writer.write_u32::<BigEndian>(magic)?;
+        writer.write_u32::<BigEndian>(self.blocks.len() as u32)?;
+        writer.write_u64::<BigEndian>(entries_offset)?;
+        writer.write_u64::<BigEndian>(filter_offset)?;
+        writer.write_u32::<BigEndian>(filter_len as u32)?;
+        writer.write_u32::<BigEndian>(hash_count)?;
+
+        Ok(footer_offset)
+    }
+
+    pub fn build(self, data: Mmap, start_pid: u64, page_size: u32, footer_offset: u64) -> BlockIndex {
+        let filter_len = self.filter_len() as u64;
+        let filter = SegmentFilter {
+            offset: footer_offset - filter_len,
+            len: filter_len,
+            hash_count: self.filter.as_ref().map(|f| f.hash_count()).unwrap_or(0),
+        };
+        let mut index = BlockIndex::new(self.blocks, data, start_pid, page_size, footer_offset, filter, self.compressed);
+        index.range_deletes = self.range_deletes.build();
+        index
+    }
+
+}
+
+/// The position of the Bloom filter in the segment
+struct SegmentFilter {
+    offset:     u64,
+    len:        u64,
+    hash_count: u32,
+}
+
+/// The sparse index of a segment on the disk.
+///
+/// The content of the segment is mapped in the memory,
+/// the tuples are decoded block by block on demand.
+pub(crate) struct BlockIndex {
+    blocks:        Vec<SegmentBlock>,
+    data:          Mmap,
+    start_pid:     u64,
+    page_size:     u32,
+    tuple_count:   u64,
+    footer_offset: u64,
+    filter:        SegmentFilter,
+    compressed:    bool,
+    range_deletes: RangeDeletes,
+}
+
+impl BlockIndex {
+
+    fn new(
+        blocks: Vec<SegmentBlock>,
+        data: Mmap,
+        start_pid: u64,
+        page_size: u32,
+        footer_offset: u64,
+        filter: SegmentFilter,
+        compressed: bool,
+    ) -> BlockIndex {
+        let tuple_count = blocks.iter().map(|b| b.tuple_count).sum();
+        BlockIndex {
+            blocks,
+            data,
+            start_pid,
+            page_size,
+            tuple_count,
+            footer_offset,
+            filter,
+            compressed,
+            range_deletes: RangeDeletes::new(),
+        }
+    }
+
+    /// Map the pages of a segment into memory
+    pub fn map_segment(file: &File, start_pid: u64, end_pid: u64, page_size: u32) -> Result<Mmap> {
+        let start_offset = start_pid * (page_size as u64);
+        let len = (end_pid - start_pid + 1) * (page_size as u64);
+        let mmap = unsafe {
+            MmapOptions::new()
+                .offset(start_offset)
+                .len(len as usize)
+                .map(file)?
+        };
+        Ok(mmap)
+    }
+
+    /// Read the index from the footer of the segment
+    pub fn read_from(data: Mmap, start_pid: u64, page_size: u32, footer_offset: u64) -> Result<BlockIndex> {
+        let footer_start = footer_offset as usize;
+        if footer_start + BLOCK_INDEX_FOOTER_SIZE > data.len() {
+            return Err(Error::data_malformed());
+        }
+
+        let mut footer = &data[footer_start..(footer_start + BLOCK_INDEX_FOOTER_SIZE)];
+        let magic = footer.read_u32::<BigEndian>()?;
+        let compressed = match magic {
+            BLOCK_INDEX_MAGIC => false,
+            BLOCK_INDEX_COMPRESSED_MAGIC => true,
+            _ => return Err(Error::data_malformed()),
+        };
+        let block_count = footer.read_u32::<BigEndian>()?;
+        let entries_offset = footer.read_u64::<BigEndian>()? as usize;
+        let filter = SegmentFilter {
+            offset: footer.read_u64::<BigEndian>()?,
+            len: footer.read_u32::<BigEndian>()? as u64,
+            hash_count: footer.read_u32::<BigEndian>()?,
+        };
+
+        if entries_offset > footer_start || filter.offset + filter.len != footer_offset {
+            return Err(Error::data_malformed());
+        }
+
+        let mut entries = &data[entries_offset..(filter.offset as usize)];
+        let mut blocks = Vec::with_capacity(block_count as usize);
+
+        for _ in 0..block_count {
+            let key_len = vli::decode_u64(&mut entries)?;
+            let mut key_buffer = vec![0u8; key_len as usize];
+            entries.read_exact(&mut key_buffer)?;
+
+            let offset = vli::decode_u64(&mut entries)?;
+            let tuple_count = vli::decode_u64(&mut entries)?;
+
+            blocks.push(SegmentBlock {
+                first_key: key_buffer.into(),
+                offset,
+                tuple_count,
+            });
+        }
+
+        // the segments written before have no ranges
+        let mut range_deletes = RangeDeletes::new();
+        while !entries.is_empty() {
+            let start = read_key(&mut entries)?;
+            let end = read_key(&mut entries)?;
+            if start >= end {
+                return Err(Error::data_malformed());
+            }
+            range_deletes.insert(start, end);
+        }
+
+        let mut index = BlockIndex::new(blocks, data, start_pid, page_size, footer_offset, filter, compressed);
+        index.range_deletes = range_deletes;
+        Ok(index)
+    }
+
+    #[inline]
+    pub fn tuple_count(&self) -> u64 {
+        self.tuple_count
+    }
+
+    #[inline]
+    pub fn footer_offset(&self) -> u64 {
+        self.footer_offset
+    }
+
+    #[inline]
+    pub fn block_count(&self) -> usize {
+        self.blocks.len()
+    }
+
+    #[inline]
+    pub fn is_compressed(&self) -> bool {
+        self.compressed
+    }
+
+    #[inline]
+    pub fn range_deletes(&self) -> &RangeDeletes {
+        &self.range_deletes
+    }
+
+    #[inline]
+    pub fn has_filter(&self) -> bool {
+        self.filter.len > 0
+    }
+
+    #[inline]
+    pub fn first_key(&self) -> Option<Arc<[u8]>> {
+        self.blocks.first().map(|block| block.first_key.clone())
+    }
+
+    /// The first keys of the blocks starting in [start, end),
+    /// with the count of the tuples of the blocks.
+    pub fn sample_keys(&self, start: &[u8], end: &[u8], samples: &mut Vec<(Arc<[u8]>, u64)>) {
+        let begin = self.blocks.partition_point(|block| block.first_key.as_ref() < start);
+        for block in &self.blocks[begin..] {
+            if block.first_key.as_ref() >= end {
+                break;
+            }
+            samples.push((block.first_key.clone(), block.tuple_count));
+        }
+    }
+
+    /// Only the first keys are in memory,
+    /// so the last block is decoded to get it.
+    pub fn last_key(&self) -> Result<Option<Arc<[u8]>>> {
+        if self.blocks.is_empty() {
+            return Ok(None);
+        }
+        let entries = self.decode_block(self.blocks.len() - 1)?;
+        Ok(entries.last().map(|(key, _)| key.clone()))
+    }
+
+    /// Test the Bloom filter, always true if the segment has no filter.
+    pub fn may_contain(&self, key: &[u8]) -> bool {
+        if !self.has_filter() {
+            return true;
+        }
+        let start = self.filter.offset as usize;
+        let end = start + (self.filter.len as usize);
+        let filter = BloomFilter::new(&self.data[start..end], self.filter.hash_count);
+        filter.may_contain(key)
+    }
+
+    /// Find the last block whose first key is not greater than the key
+    fn find_block(&self, key: &[u8]) -> usize {
+        let pos = self.blocks.partition_point(|block| block.first_key.as_ref() <= key);
+        if pos == 0 {
+            0
+        } else {
+            pos - 1
+        }
+    }
+
+    pub fn decode_block(&self, block_idx: usize) -> Result<Vec<BlockEntry>> {
+        let block = &self.blocks[block_idx];
+        let page_size = self.page_size as u64;
+        let block_start = self.start_pid * page_size + block.offset;
+
+        if self.compressed {
+            if block.offset as usize >= self.data.len() {
+                return Err(Error::data_malformed());
+            }
+            let raw = block_compression::decode_block(&self.data[(block.offset as usize)..])?;
+            // the tuples are pointed by the header of block
+            return decode_tuples(&raw, block.tuple_count, |tuple_start, byte_size| LsmTuplePtr {
+                pid: block_start / page_size,
+                pid_ext: 0,
+                offset: (block_start % page_size) as u32,
+                byte_size,
+                block_offset: Some(tuple_start as u32),
+            });
+        }
+
+        let data = &self.data[(block.offset as usize)..];
+        decode_tuples(data, block.tuple_count, |tuple_start, byte_size| {
+            let global_offset = block_start + tuple_start;
+            LsmTuplePtr {
+                pid: global_offset / page_size,
+                pid_ext: 0,
+                offset: (global_offset % page_size) as u32,
+                byte_size,
+                block_offset: None,
+            }
+        })
+    }
+
+}
+
+fn read_key(slice: &mut &[u8]) -> Result<Arc<[u8]>> {
+    let key_len = vli::decode_u64(slice)? as usize;
+    if key_len > slice.len() {
+        return Err(Error::data_malformed());
+    }
+    let key: Arc<[u8]> = slice[0..key_len].into();
+    *slice = &slice[key_len..];
+    Ok(key)
+}
+
+/// Decode `count` tuples from the start of the slice,
+/// `make_ptr` receives the offset of tuple relative to the slice and its size.
+fn decode_tuples<F>(data: &[u8], count: u64, make_ptr: F) -> Result<Vec<BlockEntry>>
+where
+    F: Fn(u64, u64) -> LsmTuplePtr,
+{
+    let mut slice = data;
+    let mut result = Vec::with_capacity(count as usize);
+
+    for _ in 0..count {
+        let tuple_start = (data.len() - slice.len()) as u64;
+
+        let flag = slice.read_u8()?;
+
+        let key_len = vli::decode_u64(&mut slice)? as usize;
+        if key_len > slice.len() {
+            return Err(Error::data_malformed());
+        }
+        let key: Arc<[u8]> = slice[0..key_len].into();
+        slice = &slice[key_len..];
+
+        let marker = match flag {
+            format::LSM_INSERT => {
+                let value_len = vli::decode_u64(&mut slice)? as usize;
+                if value_len > slice.len() {
+                    return Err(Error::data_malformed());
+                }
+                slice = &slice[value_len..];
+
+                let tuple_end = (data.len() - slice.len()) as u64;
+
+                LsmTreeValueMarker::Value(make_ptr(tuple_start, tuple_end - tuple_start))
+            }
+            format::LSM_POINT_DELETE => LsmTreeValueMarker::Deleted,
+            format::LSM_START_DELETE => LsmTreeValueMarker::DeleteStart,
+            format::LSM_END_DELETE => LsmTreeValueMarker::DeleteEnd,
+            _ => return Err(Error::data_malformed()),
+        };
+
+        result.push((key, marker));
+    }
+
+    Ok(result)
+}
+
+/// The cursor decodes one block at a time.
+pub(crate) struct BlockCursor {
+    index:     Arc<BlockIndex>,
+    block_idx: usize,
+    entries:   Vec<BlockEntry>,
+    entry_idx: usize,
+    done:      bool,
+}
+
+impl BlockCursor {
+
+    pub fn new(index: Arc<BlockIndex>) -> BlockCursor {
+        BlockCursor {
+            index,
+            block_idx: 0,
+            entries: Vec::new(),
+            entry_idx: 0,
+            done: true,
+        }
+    }
+
+    fn load_block(&mut self, block_idx: usize) -> Result<()> {
+        if block_idx >= self.index.block_count() {
+            self.reset();
+            return Ok(());
+        }
+        self.entries = self.index.decode_block(block_idx)?;
+        self.block_idx = block_idx;
+        self.entry_idx = 0;
+        self.done = self.entries.is_empty();
+        Ok(())
+    }
+
+    /// Position the cursor at the first key not less than the key.
+    ///
+    /// Return `Greater` if all the keys are less than the key,
+    /// like the `TreeCursor`.
+    pub fn seek(&mut self, key: &[u8]) -> Result<Option<Ordering>> {
+        if self.index.block_count() == 0 {
+            self.reset();
+            return Ok(None);
+        }
+
+        let block_idx = self.index.find_block(key);
+        self.load_block(block_idx)?;
+
+        let pos = self.entries.partition_point(|(k, _)| k.as_ref() < key);
+        if pos < self.entries.len() {
+            self.entry_idx = pos;
+            let order = if self.entries[pos].0.as_ref() == key {
+                Ordering::Equal
+            } else {
+                Ordering::Less
+            };
+            return Ok(Some(order));
+        }
+
+        // the first key of the next block is greater than the key
+        self.load_block(block_idx + 1)?;
+        if self.done {
+            Ok(Some(Ordering::Greater))
+        } else {
+            Ok(Some(Ordering::Less))
+        }
+    }
+
+    pub fn go_to_min(&mut self) -> Result<()> {
+        self.load_block(0)
+    }
+
+    #[inline]
+    pub fn index(&self) -> &BlockIndex {
+        self.index.as_ref()
+    }
+
+    pub fn next(&mut self) -> Result<()> {
+        if self.done {
+            return Ok(());
+        }
+        self.entry_idx += 1;
+        if self.entry_idx >= self.entries.len() {
+            let next_block = self.block_idx + 1;
+            self.load_block(next_block)?;
+        }
+        Ok(())
+    }
+
+    pub fn key(&self) -> Option<Arc<[u8]>> {
+        if self.done {
+            return None;
+        }
+        Some(self.entries[self.entry_idx].0.clone())
+    }
+
+    pub fn value(&self) -> Option<LsmTreeValueMarker<LsmTuplePtr>> {
+        if self.done {
+            return None;
+        }
+        Some(self.entries[self.entry_idx].1.clone())
+    }
+
+    pub fn marker(&self) -> Option<LsmTreeValueMarker<()>> {
+        self.value().map(|value| match value {
+            LsmTreeValueMarker::Deleted => LsmTreeValueMarker::Deleted,
+            LsmTreeValueMarker::DeleteStart => LsmTreeValueMarker::DeleteStart,
+            LsmTreeValueMarker::DeleteEnd => LsmTreeValueMarker::DeleteEnd,
+            LsmTreeValueMarker::Value(_) => LsmTreeValueMarker::Value(()),
+        })
+    }
+
+    #[inline]
+    pub fn done(&self) -> bool {
+        self.done
+    }
+
+    pub fn reset(&mut self) {
+        self.entries.clear();
+        self.block_idx = 0;
+        self.entry_idx = 0;
+        self.done = true;
+    }
+
+}
+
+#[cfg(test)]
+mod test {
+    use std::cmp::Ordering;
+    use std::io::Write;
+    use std::sync::Arc;
+    use crate::lsm::block_index::{BlockCursor, BlockIndex, BlockIndexBuilder, BLOCK_INDEX_FOOTER_SIZE};
+    use crate::lsm::lsm_backend::format;
+    use crate::test_utils::mk_db_path;
+    use crate::utils::vli;
+
+    const PAGE_SIZE: u32 = 4096;
+
+    fn write_segment(name: &str, count: u32) -> BlockIndex {
+        let path = mk_db_path(name);
+        let _ = std::fs::remove_file(path.as_path());
+        let mut file = std::fs::OpenOptions::new()
+            .create(true)
+            .write(true)
+            .read(true)
+            .open(path.as_path())
+            .unwrap();
+
+        let mut builder = BlockIndexBuilder::new(10);
+        let mut buffer = Vec::<u8>::new();
+
+        for i in 0..count {
+            let key = (i * 2).to_be_bytes();
+            let value = vec![0xffu8; 100];
+            let start = buffer.len();
+
+            buffer.push(format::LSM_INSERT);
+            vli::encode(&mut buffer, key.len() as i64).unwrap();
+            buffer.extend_from_slice(&key);
+            vli::encode(&mut buffer, value.len() as i64).unwrap();
+            buffer.extend_from_slice(&value);
+
+            builder.add_tuple(&key, (buffer.len() - start) as u64);
+        }
+
+        let tuples_len = buffer.len();
+        let footer_offset = builder.write_to(&mut buffer).unwrap();
+        assert_eq!(buffer.len(), tuples_len + builder.encoded_len());
+        assert_eq!(buffer.len(), (footer_offset as usize) + BLOCK_INDEX_FOOTER_SIZE);
+
+        let end_pid = (buffer.len() as u64) / (PAGE_SIZE as u64);
+        buffer.resize(((end_pid + 1) * (PAGE_SIZE as u64)) as usize, 0);
+        file.write_all(&buffer).unwrap();
+        file.flush().unwrap();
+
+        let data = BlockIndex::map_segment(&file, 0, end_pid, PAGE_SIZE).unwrap();
+        let index = BlockIndex::read_from(data, 0, PAGE_SIZE, footer_offset).unwrap();
+        assert_eq!(index.tuple_count(), count as u64);
+        assert_eq!(index.has_filter(), count > 0);
+        index
+    }
+
+    #[test]
+    fn test_block_cursor_seek() {
+        let index = Arc::new(write_segment("test-block-index-seek", 1000));
+        assert!(index.block_count() > 1);
+
+        let mut cursor = BlockCursor::new(index.clone());
+        for i in 0..1000u32 {
+            let key = (i * 2).to_be_bytes();
+            assert_eq!(cursor.seek(&key).unwrap(), Some(Ordering::Equal));
+            assert_eq!(cursor.key().unwrap().as_ref(), key.as_ref());
+
+            let key = (i * 2 + 1).to_be_bytes();
+            let ord = cursor.seek(&key).unwrap();
+            if i == 999 {
+                assert_eq!(ord, Some(Ordering::Greater));
+                assert!(cursor.done());
+            } else {
+                assert_eq!(ord, Some(Ordering::Less));
+                let expected = ((i + 1) * 2).to_be_bytes();
+                assert_eq!(cursor.key().unwrap().as_ref(), expected.as_ref());
+            }
+        }
+
+        cursor.go_to_min().unwrap();
+        let mut count = 0;
+        while !cursor.done() {
+            let key = (count * 2u32).to_be_bytes();
+            assert_eq!(cursor.key().unwrap().as_ref(), key.as_ref());
+            assert!(cursor.value().unwrap().is_value());
+            cursor.next().unwrap();
+            count += 1;
+        }
+        assert_eq!(count, 1000);
+
+        for i in 0..1000u32 {
+            assert!(index.may_contain(&(i * 2).to_be_bytes()));
+        }
+    }
+
+    #[test]
+    fn test_empty_block_index() {
+        let index = Arc::new(write_segment("test-block-index-empty", 0));
+        let mut cursor = BlockCursor::new(index);
+        assert_eq!(cursor.seek(&[1, 2, 3]).unwrap(), None);
+        cursor.go_to_min().unwrap();
+        assert!(cursor.done());
+    }
+
+}
@@ -0,0 +1,159 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+use std::io::Write;
+use crate::Result;
+
+const MAX_HASH_COUNT: u32 = 30;
+
+/// The hash must be stable across versions,
+/// because the filters are persisted in the segments.
+fn bloom_hash(key: &[u8]) -> u64 {
+    // FNV-1a
+    let mut h: u64 = 0xcbf29ce484222325;
+    for b in key {
+        h ^= *b as u64;
+        h = h.wrapping_mul(0x100000001b3);
+    }
+
+    // finalizer of MurmurHash3
+    h ^= h >> 33;
+    h = h.wrapping_mul(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h = h.wrapping_mul(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+    h
+}
+
+/// Collect the hashes of the keys of a segment.
+pub(crate) struct BloomFilterBuilder {
+    bits_per_key: u32,
+    hashes:       Vec<u64>,
+}
+
+impl BloomFilterBuilder {
+
+    pub fn new(bits_per_key: u32) -> BloomFilterBuilder {
+        BloomFilterBuilder {
+            bits_per_key,
+            hashes: Vec::new(),
+        }
+    }
+
+    #[inline]
+    pub fn add_key(&mut self, key: &[u8]) {
+        self.hashes.push(bloom_hash(key));
+    }
+
+    #[inline]
+    pub fn hash_count(&self) -> u32 {
+        // k = ln(2) * bits_per_key minimizes the false positive rate
+        let k = (self.bits_per_key as f64 * 0.69) as u32;
+        k.max(1).min(MAX_HASH_COUNT)
+    }
+
+    pub fn encoded_len(&self) -> usize {
+        if self.bits_per_key == 0 || self.hashes.is_empty() {
+            return 0;
+        }
+        let bits = std::cmp::max(self.hashes.len() * (self.bits_per_key as usize), 64);
+        (bits + 7) / 8
+    }
+
+    pub fn write_to<W: Write>(&self, writer: &mut W) -> Result<()> {
+        let len = self.encoded_len();
+        if len == 0 {
+            return Ok(());
+        }
+
+        let mut bits = vec![0u8; len];
+        let bits_count = (len * 8) as u64;
+        let hash_count = self.hash_count();
+
+        for hash in &self.hashes {
+            let mut h = *hash;
+            let delta = h.rotate_right(17);
+            for _ in 0..hash_count {
+                let pos = h % bits_count;
+                bits[(pos / 8) as usize] |= 1 << (pos % 8);
+                h = h.wrapping_add(delta);
+            }
+        }
+
+        writer.write_all(&bits)?;
+
+        Ok(())
+    }
+
+}
+
+/// A view on the filter mapped from the segment.
+pub(crate) struct BloomFilter<'a> {
+    bits:       &'a [u8],
+    hash_count: u32,
+}
+
+impl<'a> BloomFilter<'a> {
+
+    pub fn new(bits: &'a [u8], hash_count: u32) -> BloomFilter<'a> {
+        BloomFilter {
+            bits,
+            hash_count,
+        }
+    }
+
+    /// False positive is possible, but false negative is not.
+    pub fn may_contain(&self, key: &[u8]) -> bool {
+        if self.bits.is_empty() {
+            return true;
+        }
+
+        let bits_count = (self.bits.len() * 8) as u64;
+        let mut h = bloom_hash(key);
+        let delta = h.rotate_right(17);
+        for _ in 0..self.hash_count {
+            let pos = h % bits_count;
+            if self.bits[(pos / 8) as usize] & (1 << (pos % 8)) == 0 {
+                return false;
+            }
+            h = h.wrapping_add(delta);
+        }
+
+        true
+    }
+
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::lsm::bloom_filter::{BloomFilter, BloomFilterBuilder};
+
+    #[test]
+    fn test_bloom_filter() {
+        let mut builder = BloomFilterBuilder::new(10);
+        for i in 0..10000u32 {
+            builder.add_key(&(i * 2).to_be_bytes());
+        }
+
+        let mut buffer = Vec::<u8>::new();
+        builder.write_to(&mut buffer).unwrap();
+        assert_eq!(buffer.len(), builder.encoded_len());
+
+        let filter = BloomFilter::new(&buffer, builder.hash_count());
+        for i in 0..10000u32 {
+            assert!(filter.may_contain(&(i * 2).to_be_bytes()));
+        }
+
+        let mut false_positive = 0;
+        for i in 0..10000u32 {
+            if filter.may_contain(&(i * 2 + 1).to_be_bytes()) {
+                false_positive += 1;
+            }
+        }
+        // about 1% with 10 bits per key
+        assert!(false_positive < 300, "false positive: {}", false_positive);
+    }
+
+}
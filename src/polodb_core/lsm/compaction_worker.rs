@@ -0,0 +1,182 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+use std::sync::{Arc, Condvar, Mutex, Weak};
+use std::thread::JoinHandle;
+use crate::{Error, Result};
+use crate::lsm::LsmKvInner;
+
+#[derive(Default)]
+struct CompactionState {
+    pending:    bool,
+    shutdown:   bool,
+    /// Incremental counter of the finished rounds
+    round:      u64,
+    /// The error of the last round failed,
+    /// it's returned by the next commit or wait.
+    last_error: Option<String>,
+}
+
+struct CompactionShared {
+    state:     Mutex<CompactionState>,
+    job_cond:  Condvar,
+    done_cond: Condvar,
+}
+
+/// The worker running the minor/major compaction of the engine
+/// on a dedicated thread.
+///
+/// The commits only schedule a round when the levels need compaction,
+/// the writers are stalled only if level 0 gets too large.
+pub(crate) struct CompactionWorker {
+    shared: Arc<CompactionShared>,
+    thread: Mutex<Option<JoinHandle<()>>>,
+}
+
+impl CompactionWorker {
+
+    pub fn new() -> CompactionWorker {
+        let shared = CompactionShared {
+            state: Mutex::new(CompactionState::default()),
+            job_cond: Condvar::new(),
+            done_cond: Condvar::new(),
+        };
+        CompactionWorker {
+            shared: Arc::new(shared),
+            thread: Mutex::new(None),
+        }
+    }
+
+    /// The worker only keeps a weak reference of the engine,
+    /// so it won't prevent the engine from being dropped.
+    pub fn start(&self, engine: Weak<LsmKvInner>) -> Result<()> {
+        let shared = self.shared.clone();
+        let handle = std::thread::Builder::new()
+            .name("polodb-compaction".into())
+            .spawn(move || {
+                CompactionWorker::run(shared, engine);
+            })?;
+
+        let mut thread = self.thread.lock()?;
+        *thread = Some(handle);
+
+        Ok(())
+    }
+
+    pub fn schedule(&self) {
+        let mut state = self.shared.state.lock().unwrap();
+        state.pending = true;
+        self.shared.job_cond.notify_one();
+    }
+
+    /// Return the error of the background round failed since the last call
+    pub fn take_error(&self) -> Result<()> {
+        let mut state = self.shared.state.lock()?;
+        match state.last_error.take() {
+            Some(err) => Err(Error::CompactionFailed(err)),
+            None => Ok(()),
+        }
+    }
+
+    /// Schedule a round and block until a round is finished.
+    pub fn wait_for_round(&self) -> Result<()> {
+        let mut state = self.shared.state.lock()?;
+        let round = state.round;
+
+        state.pending = true;
+        self.shared.job_cond.notify_one();
+
+        while state.round == round && !state.shutdown {
+            state = self.shared.done_cond.wait(state)?;
+        }
+
+        if let Some(err) = state.last_error.take() {
+            return Err(Error::CompactionFailed(err));
+        }
+
+        Ok(())
+    }
+
+    pub fn stop(&self) {
+        {
+            let mut state = self.shared.state.lock().unwrap();
+            state.shutdown = true;
+            self.shared.job_cond.notify_all();
+            self.shared.done_cond.notify_all();
+        }
+
+        let handle = {
+            let mut thread = self.thread.lock().unwrap();
+            thread.take()
+        };
+
+        if let Some(handle) = handle {
+            // The engine may be dropped on the worker thread
+            // if the worker holds the last reference.
+            if handle.thread().id() != std::thread::current().id() {
+                let _ = handle.join();
+            }
+        }
+    }
+
+    fn run(shared: Arc<CompactionShared>, engine: Weak<LsmKvInner>) {
+        loop {
+            {
+                let mut state = shared.state.lock().unwrap();
+                while !state.pending && !state.shutdown {
+                    state = shared.job_cond.wait(state).unwrap();
+                }
+                if state.shutdown {
+                    return;
+                }
+                state.pending = false;
+            }
+
+            let result = match engine.upgrade() {
+                Some(engine) => CompactionWorker::compact_all(&engine),
+                None => return,
+            };
+
+            let mut state = shared.state.lock().unwrap();
+            state.round += 1;
+            if let Err(err) = result {
+                state.last_error = Some(err.to_string());
+            }
+            shared.done_cond.notify_all();
+        }
+    }
+
+    /// The sessions are counted by every compaction when it's published,
+    /// the weak reference of the worker itself is included.
+    fn compact_all(engine: &Arc<LsmKvInner>) -> Result<()> {
+        while engine.background_compact()? {}
+        Ok(())
+    }
+
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::Error;
+    use crate::lsm::compaction_worker::CompactionWorker;
+
+    #[test]
+    fn test_take_error_once() {
+        let worker = CompactionWorker::new();
+        assert!(worker.take_error().is_ok());
+
+        {
+            let mut state = worker.shared.state.lock().unwrap();
+            state.last_error = Some("io error".into());
+        }
+
+        match worker.take_error() {
+            Err(Error::CompactionFailed(msg)) => assert_eq!(msg, "io error"),
+            _ => panic!("the error of the round is expected"),
+        }
+        assert!(worker.take_error().is_ok());
+    }
+
+}
@@ -0,0 +1,301 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+use std::sync::Arc;
+use crate::{Config, Result};
+use crate::lsm::lsm_segment::ImLsmSegment;
+use crate::lsm::lsm_snapshot::{LsmLevel, LsmSnapshot};
+use crate::lsm::multi_cursor::{CursorRepr, LevelCursor, MultiCursor};
+use crate::lsm::range_delete::RangeDeletes;
+
+/// Level 0 is merged once it has more segments than this
+const LEVEL0_COMPACT_TRIGGER: usize = 4;
+
+type KeyRange = (Arc<[u8]>, Arc<[u8]>);
+
+/// The max bytes of the level, level 0 is limited by the count of segments.
+///
+/// Level 1 is `ratio` times the memory table,
+/// and every level is `ratio` times the previous one.
+fn level_max_bytes(config: &Config, level: usize) -> u64 {
+    let ratio = std::cmp::max(config.lsm_level_size_ratio, 2) as u64;
+    let mut result = config.lsm_block_size as u64;
+    for _ in 0..level {
+        result = result.saturating_mul(ratio);
+    }
+    result
+}
+
+/// The segments also grow with the levels, so every level
+/// has about `ratio` segments and the meta page never overflows.
+fn level_segment_size(config: &Config, level: usize) -> u64 {
+    level_max_bytes(config, level) / (std::cmp::max(config.lsm_level_size_ratio, 2) as u64)
+}
+
+fn key_range(segment: &ImLsmSegment) -> Result<Option<KeyRange>> {
+    let first_key = match segment.first_key() {
+        Some(key) => key,
+        None => return Ok(None),
+    };
+    let last_key = segment.last_key()?.unwrap_or_else(|| first_key.clone());
+    Ok(Some((first_key, last_key)))
+}
+
+fn merge_range(left: Option<KeyRange>, right: Option<KeyRange>) -> Option<KeyRange> {
+    match (left, right) {
+        (Some((l_first, l_last)), Some((r_first, r_last))) => {
+            let first = std::cmp::min(l_first, r_first);
+            let last = std::cmp::max(l_last, r_last);
+            Some((first, last))
+        }
+        (Some(range), None) | (None, Some(range)) => Some(range),
+        (None, None) => None,
+    }
+}
+
+/// The indexes of the segments on the level overlapping the range
+fn overlapped_segments(level: &LsmLevel, range: &KeyRange) -> Result<Vec<usize>> {
+    let mut result = vec![];
+    for (index, segment) in level.content.iter().enumerate() {
+        if let Some((first, last)) = key_range(segment)? {
+            if first <= range.1 && last >= range.0 {
+                result.push(index);
+            }
+        }
+    }
+    Ok(result)
+}
+
+/// Return true if the leveled compaction has work to do.
+/// The key ranges are not read, so it's cheap to call on every commit.
+pub(crate) fn needs_compaction(snapshot: &LsmSnapshot, config: &Config) -> bool {
+    if snapshot.levels.is_empty() {
+        return false;
+    }
+
+    if snapshot.levels[0].content.len() > LEVEL0_COMPACT_TRIGGER {
+        return true;
+    }
+
+    snapshot.levels
+        .iter()
+        .enumerate()
+        .skip(1)
+        .any(|(index, level)| level.byte_size(config.lsm_page_size) > level_max_bytes(config, index))
+}
+
+/// A merge of some segments into the next level.
+///
+/// The levels after level 0 are sorted runs of segments
+/// not overlapped. Only the segments of the next level
+/// overlapping the inputs are merged, the others are untouched.
+pub(crate) struct LeveledTask {
+    /// The level of the inputs, the outputs are put on the next level
+    pub level:    usize,
+    /// Indexes of the input segments on `level`
+    pub inputs:   Vec<usize>,
+    /// Indexes of the overlapped segments on the next level
+    pub overlaps: Vec<usize>,
+    /// Nothing is under the next level, the deletes can be dropped
+    pub bottom:   bool,
+}
+
+impl LeveledTask {
+
+    /// Level 0 goes first, because the readers search all its segments.
+    /// Otherwise the first level exceeding its size pushes down the
+    /// segment overlapping the least bytes of the next level
+    /// relative to its own size.
+    pub fn pick(snapshot: &LsmSnapshot, config: &Config) -> Result<Option<LeveledTask>> {
+        if snapshot.levels.is_empty() {
+            return Ok(None);
+        }
+
+        let level0 = &snapshot.levels[0];
+        if level0.content.len() > LEVEL0_COMPACT_TRIGGER {
+            // the last segment is kept on level 0 as the minor compaction does
+            let inputs: Vec<usize> = (0..(level0.content.len() - 1)).collect();
+
+            let mut range: Option<KeyRange> = None;
+            for index in &inputs {
+                range = merge_range(range, key_range(&level0.content[*index])?);
+            }
+
+            let overlaps = match (&range, snapshot.levels.get(1)) {
+                (Some(range), Some(next)) => overlapped_segments(next, range)?,
+                _ => vec![],
+            };
+
+            return Ok(Some(LeveledTask {
+                level: 0,
+                inputs,
+                overlaps,
+                bottom: snapshot.levels.len() <= 2,
+            }));
+        }
+
+        let page_size = config.lsm_page_size;
+
+        for level in 1..snapshot.levels.len() {
+            let current = &snapshot.levels[level];
+            if current.byte_size(page_size) <= level_max_bytes(config, level) {
+                continue;
+            }
+
+            let next = snapshot.levels.get(level + 1);
+            let mut best: Option<(usize, Vec<usize>, f64)> = None;
+
+            for (index, segment) in current.content.iter().enumerate() {
+                let (overlaps, overlapped_bytes) = match (key_range(segment)?, next) {
+                    (Some(range), Some(next)) => {
+                        let overlaps = overlapped_segments(next, &range)?;
+                        let bytes: u64 = overlaps
+                            .iter()
+                            .map(|index| next.content[*index].byte_size(page_size))
+                            .sum();
+                        (overlaps, bytes)
+                    }
+                    _ => (vec![], 0),
+                };
+
+                let ratio = (overlapped_bytes as f64) / (segment.byte_size(page_size) as f64);
+                let better = match &best {
+                    Some((_, _, best_ratio)) => ratio < *best_ratio,
+                    None => true,
+                };
+                if better {
+                    best = Some((index, overlaps, ratio));
+                }
+            }
+
+            if let Some((index, overlaps, _)) = best {
+                return Ok(Some(LeveledTask {
+                    level,
+                    inputs: vec![index],
+                    overlaps,
+                    bottom: level + 2 >= snapshot.levels.len(),
+                }));
+            }
+        }
+
+        Ok(None)
+    }
+
+    /// The segment can be moved to the next level without rewriting
+    #[inline]
+    pub fn is_trivial_move(&self) -> bool {
+        self.level > 0 && self.overlaps.is_empty()
+    }
+
+    /// The segment moved by a trivial move
+    pub fn moved_segment(&self, snapshot: &LsmSnapshot) -> ImLsmSegment {
+        assert!(self.is_trivial_move());
+        snapshot.levels[self.level].content[self.inputs[0]].clone()
+    }
+
+    /// The newer segments come first
+    pub fn open_cursor(&self, snapshot: &LsmSnapshot) -> MultiCursor {
+        let level = &snapshot.levels[self.level];
+        let mut cursors: Vec<CursorRepr> = vec![];
+        let mut range_deletes: Vec<RangeDeletes> = vec![];
+        for index in self.inputs.iter().rev() {
+            cursors.push(level.content[*index].open_cursor());
+            range_deletes.push(level.content[*index].range_deletes().clone());
+        }
+
+        if !self.overlaps.is_empty() {
+            let next = &snapshot.levels[self.level + 1];
+            let overlapped: Vec<ImLsmSegment> = self.overlaps
+                .iter()
+                .map(|index| next.content[*index].clone())
+                .collect();
+            cursors.push(LevelCursor::new(&overlapped).into());
+            range_deletes.push(ImLsmSegment::union_range_deletes(&overlapped));
+        }
+
+        let mut cursor = MultiCursor::new(cursors);
+        cursor.set_range_deletes(range_deletes);
+        cursor
+    }
+
+    /// The size of the segments written to the next level
+    #[inline]
+    pub fn target_size(&self, config: &Config) -> u64 {
+        level_segment_size(config, self.level + 1)
+    }
+
+    /// The bytes of all the segments merged
+    pub fn input_bytes(&self, snapshot: &LsmSnapshot, page_size: u32) -> u64 {
+        let level = &snapshot.levels[self.level];
+        let mut result: u64 = self.inputs
+            .iter()
+            .map(|index| level.content[*index].byte_size(page_size))
+            .sum();
+
+        if let Some(next) = snapshot.levels.get(self.level + 1) {
+            result += self.overlaps
+                .iter()
+                .map(|index| next.content[*index].byte_size(page_size))
+                .sum::<u64>();
+        }
+
+        result
+    }
+
+    /// Replace the inputs and the overlapped segments with the outputs,
+    /// return the segments to free.
+    ///
+    /// The levels after level 0 are only changed by the compaction,
+    /// and level 0 is only appended by the commits, so the indexes
+    /// picked on an older copy of the snapshot are still valid.
+    pub fn apply(&self, snapshot: &mut LsmSnapshot, outputs: Vec<ImLsmSegment>) -> Vec<ImLsmSegment> {
+        let mut removed = vec![];
+
+        if self.level == 0 {
+            let level0 = &mut snapshot.levels[0];
+            removed.extend(level0.content.drain(0..self.inputs.len()));
+            level0.age += 1;
+        } else {
+            let input = snapshot.levels[self.level].content.remove(self.inputs[0]);
+            // the segment moved is still in use
+            if !self.is_trivial_move() {
+                removed.push(input);
+            }
+        }
+
+        if snapshot.levels.len() == self.level + 1 {
+            snapshot.levels.push(LsmLevel::new());
+        }
+
+        let next = &mut snapshot.levels[self.level + 1];
+        for index in self.overlaps.iter().rev() {
+            removed.push(next.content.remove(*index));
+        }
+
+        let pos = match outputs.first().and_then(|segment| segment.first_key()) {
+            Some(first_key) => next.content.partition_point(|segment| {
+                match segment.first_key() {
+                    Some(key) => key < first_key,
+                    None => true,
+                }
+            }),
+            None => next.content.len(),
+        };
+        next.content.insert_many(pos, outputs);
+
+        // the empty levels would be given a smaller size
+        let mut index = 1;
+        while index < snapshot.levels.len() {
+            if snapshot.levels[index].content.is_empty() {
+                snapshot.levels.remove(index);
+            } else {
+                index += 1;
+            }
+        }
+
+        removed
+    }
+
+}
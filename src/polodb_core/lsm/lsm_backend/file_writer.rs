@@ -7,7 +7,9 @@ use std::io::{Seek, SeekFrom, Write};
 use std::fs::File;
 use std::sync::Arc;
 use byteorder::WriteBytesExt;
-use crate::{Config, Result};
+use crate::{Config, LsmCompression, Result};
+use crate::lsm::block_compression;
+use crate::lsm::block_index::BlockIndexBuilder;
 use crate::lsm::lsm_segment::LsmTuplePtr;
 use crate::lsm::lsm_tree::LsmTreeValueMarker;
 use crate::utils::vli;
@@ -16,18 +18,29 @@ use super::format;
 /// Write the data to file.
 /// Record the position of tuple,
 /// to make a index in snapshot.
+///
+/// The block index is written after the tuples
+/// by [`FileWriter::write_block_index`].
+///
+/// If the segment is compressed, the tuples of a block
+/// are buffered and written with a header when the block is full.
 pub(crate) struct FileWriter<'a> {
     file:          &'a mut File,
     start_pid:     u64,
     page_size:     u32,
     written_bytes: u64,
     config:        Arc<Config>,
+    index_builder: BlockIndexBuilder,
+    compression:   LsmCompression,
+    block_buffer:  Vec<u8>,
 }
 
 impl<'a> FileWriter<'a> {
 
-    pub fn open(file: &'a mut File, start_pid: u64, config: Arc<Config>) -> FileWriter<'a> {
+    pub fn open(file: &'a mut File, start_pid: u64, config: Arc<Config>, compression: LsmCompression) -> FileWriter<'a> {
         let page_size = config.lsm_page_size;
+        let mut index_builder = BlockIndexBuilder::new(config.lsm_bloom_bits_per_key);
+        index_builder.set_compressed(compression != LsmCompression::None);
 
         FileWriter {
             file,
@@ -35,9 +48,17 @@ impl<'a> FileWriter<'a> {
             page_size,
             written_bytes: 0,
             config,
+            index_builder,
+            compression,
+            block_buffer: Vec::new(),
         }
     }
 
+    #[inline]
+    fn is_compressed(&self) -> bool {
+        self.compression != LsmCompression::None
+    }
+
     #[inline]
     pub fn written_bytes(&self) -> u64 {
         self.written_bytes
@@ -51,6 +72,7 @@ impl<'a> FileWriter<'a> {
             pid_ext: 0,
             offset: page_offset as u32,
             byte_size: self.written_bytes,
+            block_offset: None,
         }
     }
 
@@ -60,7 +82,31 @@ impl<'a> FileWriter<'a> {
             pid_ext: 0,
             offset: start_mark.offset,
             byte_size: self.written_bytes - start_mark.byte_size,
+            block_offset: None,
+        }
+    }
+
+    /// The pointer of a tuple buffered in the current block,
+    /// the header of block will be written at `written_bytes`.
+    fn block_mark(&self, block_offset: usize, byte_size: usize) -> LsmTuplePtr {
+        let mut result = self.start_mark();
+        result.byte_size = byte_size as u64;
+        result.block_offset = Some(block_offset as u32);
+        result
+    }
+
+    /// Compress the buffered block and write it to the file
+    fn flush_block(&mut self) -> Result<()> {
+        if self.block_buffer.is_empty() {
+            return Ok(());
         }
+        let mut encoded = Vec::with_capacity(self.block_buffer.len() + block_compression::BLOCK_HEADER_SIZE);
+        block_compression::encode_block(&self.block_buffer, self.compression, &mut encoded)?;
+        self.block_buffer.clear();
+
+        self.write_all(&encoded)?;
+        self.index_builder.set_written_bytes(self.written_bytes);
+        Ok(())
     }
 
     pub fn write_tuple(
@@ -68,47 +114,72 @@ impl<'a> FileWriter<'a> {
         key: &[u8],
         value: LsmTreeValueMarker<&[u8]>,
     ) -> Result<LsmTreeValueMarker<LsmTuplePtr>> {
-        let start_mark = self.start_mark();
-        match value {
-            LsmTreeValueMarker::Value(insert_buffer) => {
-                self.write_u8(format::LSM_INSERT)?;
-                vli::encode(self, key.len() as i64)?;
-                self.write_all(key)?;
-
-                let value_len = insert_buffer.len();
-                vli::encode(self, value_len as i64)?;
-                self.write_all(&insert_buffer)?;
-                Ok(LsmTreeValueMarker::Value(self.end_mark(&start_mark)))
-            }
-            LsmTreeValueMarker::Deleted => {
-                self.write_u8(format::LSM_POINT_DELETE)?;
-                vli::encode(self, key.len() as i64)?;
-                self.write_all(key)?;
-                Ok(LsmTreeValueMarker::Deleted)
-            }
-            LsmTreeValueMarker::DeleteStart => {
-                self.write_u8(format::LSM_START_DELETE)?;
-                vli::encode(self, key.len() as i64)?;
-                self.write_all(key)?;
-                Ok(LsmTreeValueMarker::DeleteStart)
-            }
-            LsmTreeValueMarker::DeleteEnd => {
-                self.write_u8(format::LSM_END_DELETE)?;
-                vli::encode(self, key.len() as i64)?;
-                self.write_all(key)?;
-                Ok(LsmTreeValueMarker::DeleteEnd)
+        let is_range_marker = value.is_delete_start() || value.is_delete_end();
+
+        let ptr = if self.is_compressed() {
+            if self.index_builder.is_block_full() {
+                self.flush_block()?;
             }
+            let block_offset = self.block_buffer.len();
+            encode_tuple(&mut self.block_buffer, key, &value)?;
+            self.block_mark(block_offset, self.block_buffer.len() - block_offset)
+        } else {
+            let start_mark = self.start_mark();
+            encode_tuple(self, key, &value)?;
+            self.end_mark(&start_mark)
+        };
+        let tuple_size = ptr.byte_size;
+
+        let result = match value {
+            LsmTreeValueMarker::Value(_) => LsmTreeValueMarker::Value(ptr),
+            LsmTreeValueMarker::Deleted => LsmTreeValueMarker::Deleted,
+            LsmTreeValueMarker::DeleteStart => LsmTreeValueMarker::DeleteStart,
+            LsmTreeValueMarker::DeleteEnd => LsmTreeValueMarker::DeleteEnd,
+        };
+
+        if is_range_marker {
+            self.index_builder.add_range_marker(key, tuple_size, &result);
+        } else {
+            self.index_builder.add_tuple(key, tuple_size);
         }
+        Ok(result)
     }
 
-    pub fn write_buffer(&mut self, buffer: &[u8]) -> Result<LsmTuplePtr> {
+    /// Write an encoded tuple, the key is used to build the block index.
+    pub fn write_buffer(&mut self, key: &[u8], buffer: &[u8]) -> Result<LsmTuplePtr> {
+        if self.is_compressed() {
+            if self.index_builder.is_block_full() {
+                self.flush_block()?;
+            }
+            let block_offset = self.block_buffer.len();
+            self.block_buffer.extend_from_slice(buffer);
+            self.index_builder.add_tuple(key, buffer.len() as u64);
+            return Ok(self.block_mark(block_offset, buffer.len()));
+        }
+
         let start_mark = self.start_mark();
 
         self.write_all(buffer)?;
+        self.index_builder.add_tuple(key, buffer.len() as u64);
 
         Ok(self.end_mark(&start_mark))
     }
 
+    /// Write the block index and the footer after all the tuples,
+    /// return the offset of the footer relative to the segment.
+    pub fn write_block_index(&mut self) -> Result<u64> {
+        self.flush_block()?;
+        let builder = std::mem::replace(&mut self.index_builder, BlockIndexBuilder::new(0));
+        let footer_offset = builder.write_to(self)?;
+        self.index_builder = builder;
+        Ok(footer_offset)
+    }
+
+    #[inline]
+    pub fn into_index_builder(self) -> BlockIndexBuilder {
+        self.index_builder
+    }
+
     pub fn begin(&mut self) -> Result<()> {
         let page_size = self.config.lsm_page_size;
         let offset = (page_size as u64) * self.start_pid;
@@ -131,6 +202,25 @@ impl<'a> FileWriter<'a> {
 
 }
 
+fn encode_tuple<W: Write>(writer: &mut W, key: &[u8], value: &LsmTreeValueMarker<&[u8]>) -> Result<()> {
+    let flag = match value {
+        LsmTreeValueMarker::Value(_) => format::LSM_INSERT,
+        LsmTreeValueMarker::Deleted => format::LSM_POINT_DELETE,
+        LsmTreeValueMarker::DeleteStart => format::LSM_START_DELETE,
+        LsmTreeValueMarker::DeleteEnd => format::LSM_END_DELETE,
+    };
+    writer.write_u8(flag)?;
+    vli::encode(writer, key.len() as i64)?;
+    writer.write_all(key)?;
+
+    if let LsmTreeValueMarker::Value(insert_buffer) = value {
+        vli::encode(writer, insert_buffer.len() as i64)?;
+        writer.write_all(insert_buffer)?;
+    }
+
+    Ok(())
+}
+
 impl Write for FileWriter<'_> {
 
     fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
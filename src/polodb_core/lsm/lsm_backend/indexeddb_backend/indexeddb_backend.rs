@@ -23,7 +23,7 @@ use crate::lsm::mem_table::MemTable;
 use super::models::IdbMeta;
 use byteorder::WriteBytesExt;
 use crate::lsm::lsm_backend::lsm_backend::lsm_backend_utils;
-use crate::lsm::multi_cursor::{CursorRepr, MultiCursor};
+use crate::lsm::multi_cursor::MultiCursor;
 use crate::utils::vli;
 
 #[wasm_bindgen(module = "/idb-adapter.js")]
@@ -33,7 +33,7 @@ extern "C" {
     type IdbBackendAdapter;
 
     #[wasm_bindgen(constructor)]
-    fn new_backend(db: JsValue) -> IdbBackendAdapter;
+    fn new_backend(db: JsValue, batching: bool) -> IdbBackendAdapter;
 
     #[wasm_bindgen(method)]
     fn write_snapshot_to_idb(this: &IdbBackendAdapter, value: JsValue);
@@ -50,7 +50,7 @@ extern "C" {
     type IdbLogAdapter;
 
     #[wasm_bindgen(constructor)]
-    fn new_log(db: JsValue) -> IdbLogAdapter;
+    fn new_log(db: JsValue, batching: bool) -> IdbLogAdapter;
 
     #[wasm_bindgen(method)]
     fn commit(this: &IdbLogAdapter, content: JsValue);
@@ -79,7 +79,9 @@ impl IndexeddbBackend {
         load_snapshot(db_name).await
     }
 
-    pub fn open(init_data: JsValue) -> Result<IndexeddbBackend> {
+    /// If `batching` is true, the writes are queued by the adapter
+    /// and flushed in one transaction when the browser is idle.
+    pub fn open(init_data: JsValue, batching: bool) -> Result<IndexeddbBackend> {
         let oid_js = Reflect::get(&init_data, JsValue::from_str("session_id").as_ref()).unwrap();
 
         let session_id = if oid_js.is_string() {
@@ -92,6 +94,7 @@ impl IndexeddbBackend {
         let inner = IndexeddbBackendInner::new(
             session_id,
             init_data,
+            batching,
         )?;
 
         let result = IndexeddbBackend {
@@ -107,18 +110,7 @@ impl IndexeddbBackend {
 
         let preserve_delete = snapshot.levels.len() > 1;
 
-        let cursor = {
-            let mut cursor_repo: Vec<CursorRepr> = vec![];
-            let mut idx: i64 = (level0.content.len() as i64) - 2;
-
-            while idx >= 0 {
-                let cursor = level0.content[idx as usize].segments.open_cursor();
-                cursor_repo.push(cursor.into());
-                idx -= 1;
-            }
-
-            MultiCursor::new(cursor_repo)
-        };
+        let cursor = lsm_backend_utils::level0_except_last_cursor(snapshot);
 
         let segment = self.merge_level(snapshot, cursor, preserve_delete)?;
 
@@ -126,7 +118,8 @@ impl IndexeddbBackend {
     }
 
     fn merge_level(&self, snapshot: &mut LsmSnapshot, cursor: MultiCursor, preserve_delete: bool) -> Result<ImLsmSegment> {
-        let result = lsm_backend_utils::merge_level(cursor, preserve_delete)?;
+        // the segments of IndexedDB have no Bloom filter
+        let result = lsm_backend_utils::merge_level(cursor, preserve_delete, 0)?;
         self.write_merged_tuples(snapshot, &result.tuples)
     }
 
@@ -209,18 +202,7 @@ impl IndexeddbBackend {
     }
 
     fn merge_last_two_levels(&self, snapshot: &mut LsmSnapshot) -> Result<ImLsmSegment> {
-        let level_len = snapshot.levels.len();
-        let last2 = &snapshot.levels[level_len - 2];
-        let last1 = &snapshot.levels[level_len - 1];
-
-        let cursor = {
-            let cursor_repo: Vec<CursorRepr> = vec![
-                last2.content[0].segments.open_cursor().into(),
-                last1.content[0].segments.open_cursor().into(),
-            ];
-
-            MultiCursor::new(cursor_repo)
-        };
+        let cursor = lsm_backend_utils::last_two_levels_cursor(snapshot);
 
         let segment = self.merge_level(snapshot, cursor, false)?;
 
@@ -281,12 +263,7 @@ fn mem_table_to_segments(oid: ObjectId, mem_table: &MemTable) -> Result<(IdbSegm
 
     let mut segments = LsmTree::<Arc<[u8]>, LsmTuplePtr>::new();
 
-    let mut mem_table_cursor = mem_table.open_cursor();
-    mem_table_cursor.go_to_min();
-
-    while !mem_table_cursor.done() {
-        let (key, value) = mem_table_cursor.tuple().unwrap();
-
+    for (key, value) in mem_table.tuples() {
         let pos = write_tuple_to_buffer(
             &mut result,
             &oid,
@@ -295,8 +272,6 @@ fn mem_table_to_segments(oid: ObjectId, mem_table: &MemTable) -> Result<(IdbSegm
         )?;
 
         segments.update_in_place(key, pos);
-
-        mem_table_cursor.next();
     }
 
     let s = IdbSegment::compress(oid, &result);
@@ -397,6 +372,27 @@ impl LsmBackend for IndexeddbBackend {
         Ok(())
     }
 
+    fn write_merged_segment(
+        &self,
+        _tuples: &[(Arc<[u8]>, LsmTreeValueMarker<LsmTuplePtr>)],
+        _start_pid: u64,
+        _level: usize,
+    ) -> Result<ImLsmSegment> {
+        // The segments in IndexedDB are addressed by ObjectId,
+        // and there is no compaction worker on wasm32.
+        unreachable!("background compaction is not supported by IndexedDB backend")
+    }
+
+    fn write_merged_tuples(
+        &self,
+        _snapshot: &mut LsmSnapshot,
+        _tuples: &[(Arc<[u8]>, LsmTreeValueMarker<LsmTuplePtr>)],
+        _estimate_size: usize,
+        _level: usize,
+    ) -> Result<ImLsmSegment> {
+        unreachable!("leveled compaction is not supported by IndexedDB backend")
+    }
+
 }
 
 struct IndexeddbBackendInner {
@@ -429,11 +425,11 @@ impl IndexeddbBackendInner {
         result
     }
 
-    fn new(session_id: ObjectId, init_data: JsValue) -> Result<IndexeddbBackendInner> {
+    fn new(session_id: ObjectId, init_data: JsValue, batching: bool) -> Result<IndexeddbBackendInner> {
         let db = Reflect::get(&init_data, JsValue::from_str("db").as_ref()).unwrap();
         let meta_snapshot = Reflect::get(&init_data, JsValue::from_str("snapshot").as_ref()).unwrap();
 
-        let adapter = IdbBackendAdapter::new_backend(db);
+        let adapter = IdbBackendAdapter::new_backend(db, batching);
 
         if meta_snapshot.is_object() {
             let segments = Reflect::get(&init_data, JsValue::from_str("segments").as_ref()).unwrap();
@@ -498,10 +494,10 @@ unsafe impl Send for IndexeddbLog {}
 impl IndexeddbLog {
 
     #[allow(dead_code)]
-    pub fn new(session_id: ObjectId, init_data: JsValue) -> IndexeddbLog {
+    pub fn new(session_id: ObjectId, init_data: JsValue, batching: bool) -> IndexeddbLog {
         let db = Reflect::get(&init_data, JsValue::from_str("db").as_ref()).unwrap();
         let init_logs = Reflect::get(&init_data, JsValue::from_str("logs_data").as_ref()).unwrap();
-        let adapter = IdbLogAdapter::new_log(db);
+        let adapter = IdbLogAdapter::new_log(db, batching);
         IndexeddbLog {
             session_id,
             adapter,
@@ -4,7 +4,9 @@
  * file, You can obtain one at https://mozilla.org/MPL/2.0/.
  */
 use bson::oid::ObjectId;
-use serde::{Deserialize, Serialize, Serializer};
+use std::fmt;
+use serde::{Deserialize, Deserializer, Serialize, Serializer};
+use serde::de::{self, SeqAccess, Visitor};
 use lz4_flex::{
     compress_prepend_size,
     decompress_size_prepended,
@@ -19,6 +21,7 @@ pub(crate) struct IdbSegment {
     #[serde(serialize_with = "bson::serde_helpers::serialize_object_id_as_hex_string")]
     pub id: ObjectId,
     pub compress: Option<String>,
+    #[serde(serialize_with = "serialize_buffer", deserialize_with = "deserialize_buffer")]
     pub data: Vec<u8>,
 }
 
@@ -46,11 +49,58 @@ impl IdbSegment {
 
 #[derive(Serialize, Deserialize)]
 pub(crate) struct IdbLog {
+    #[serde(serialize_with = "serialize_buffer", deserialize_with = "deserialize_buffer")]
     pub content: Vec<u8>,
     #[serde(serialize_with = "bson::serde_helpers::serialize_object_id_as_hex_string")]
     pub session: ObjectId,
 }
 
+/// Written as an Uint8Array instead of an array of numbers,
+/// which is much cheaper to make and to store.
+fn serialize_buffer<S>(buffer: &Vec<u8>, serializer: S) -> Result<S::Ok, S::Error>
+    where
+        S: Serializer,
+{
+    serializer.serialize_bytes(buffer)
+}
+
+struct BufferVisitor;
+
+impl<'de> Visitor<'de> for BufferVisitor {
+    type Value = Vec<u8>;
+
+    fn expecting(&self, formatter: &mut fmt::Formatter) -> fmt::Result {
+        formatter.write_str("bytes or an array of numbers")
+    }
+
+    fn visit_bytes<E: de::Error>(self, v: &[u8]) -> Result<Self::Value, E> {
+        Ok(v.to_vec())
+    }
+
+    fn visit_byte_buf<E: de::Error>(self, v: Vec<u8>) -> Result<Self::Value, E> {
+        Ok(v)
+    }
+
+    // written by the older versions
+    fn visit_seq<A>(self, mut seq: A) -> Result<Self::Value, A::Error>
+        where
+            A: SeqAccess<'de>,
+    {
+        let mut result = Vec::with_capacity(seq.size_hint().unwrap_or(0));
+        while let Some(byte) = seq.next_element::<u8>()? {
+            result.push(byte);
+        }
+        Ok(result)
+    }
+}
+
+fn deserialize_buffer<'de, D>(deserializer: D) -> Result<Vec<u8>, D::Error>
+    where
+        D: Deserializer<'de>,
+{
+    deserializer.deserialize_byte_buf(BufferVisitor)
+}
+
 #[derive(Serialize, Deserialize)]
 pub(crate) struct IdbLevel {
     pub age: u16,
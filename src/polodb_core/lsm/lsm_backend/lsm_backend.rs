@@ -6,8 +6,9 @@
 
 use std::sync::Arc;
 use crate::Result;
-use crate::lsm::lsm_segment::LsmTuplePtr;
+use crate::lsm::lsm_segment::{ImLsmSegment, LsmTuplePtr};
 use crate::lsm::lsm_snapshot::LsmSnapshot;
+use crate::lsm::lsm_tree::LsmTreeValueMarker;
 use crate::lsm::mem_table::MemTable;
 
 pub(crate) trait LsmBackend: Send + Sync {
@@ -17,16 +18,47 @@ pub(crate) trait LsmBackend: Send + Sync {
     fn minor_compact(&self, snapshot: &mut LsmSnapshot, db_weak_count: usize) -> Result<()>;
     fn major_compact(&self, snapshot: &mut LsmSnapshot, db_weak_count: usize) -> Result<()>;
     fn checkpoint_snapshot(&self, snapshot: &mut LsmSnapshot) -> Result<()>;
+
+    /// Sync the segments and the meta page written to the disk.
+    /// Nothing to do if the backend has no file.
+    fn sync_data(&self) -> Result<()> {
+        Ok(())
+    }
+
+    /// Write the merged tuples to the pages starting from `start_pid`.
+    /// The pages are reserved by the compaction worker before calling,
+    /// so the free list of the snapshot is not touched here.
+    ///
+    /// `level` is the level the segment is put on, it decides the codec.
+    fn write_merged_segment(
+        &self,
+        tuples: &[(Arc<[u8]>, LsmTreeValueMarker<LsmTuplePtr>)],
+        start_pid: u64,
+        level: usize,
+    ) -> Result<ImLsmSegment>;
+
+    /// Write the merged tuples to a free segment large enough,
+    /// or the end of file. Used by the leveled compaction
+    /// running on the committing thread.
+    fn write_merged_tuples(
+        &self,
+        snapshot: &mut LsmSnapshot,
+        tuples: &[(Arc<[u8]>, LsmTreeValueMarker<LsmTuplePtr>)],
+        estimate_size: usize,
+        level: usize,
+    ) -> Result<ImLsmSegment>;
 }
 
 pub(crate) mod lsm_backend_utils {
     use std::sync::Arc;
     use smallvec::smallvec;
     use crate::Result;
+    use crate::lsm::block_index::BlockIndexBuilder;
     use crate::lsm::lsm_segment::{ImLsmSegment, LsmTuplePtr};
     use crate::lsm::lsm_snapshot::{LsmLevel, LsmSnapshot};
     use crate::lsm::lsm_tree::LsmTreeValueMarker;
-    use crate::lsm::multi_cursor::MultiCursor;
+    use crate::lsm::multi_cursor::{CursorRepr, MultiCursor};
+    use crate::lsm::range_delete::RangeDeletes;
     use crate::utils::vli;
 
     pub(crate) struct MergeLevelResult {
@@ -34,7 +66,13 @@ pub(crate) mod lsm_backend_utils {
         pub estimate_size: usize,
     }
 
-    pub(crate) fn merge_level(mut cursor: MultiCursor, preserve_delete: bool) -> Result<MergeLevelResult> {
+    /// The estimate size includes the Bloom filter built with `bloom_bits_per_key`.
+    ///
+    /// The tuples covered by the ranges deleted in the newer segments are
+    /// discarded by the cursor. The markers of the ranges are kept with
+    /// the point deletes if `preserve_delete`, they still shadow the levels below.
+    pub(crate) fn merge_level(mut cursor: MultiCursor, preserve_delete: bool, bloom_bits_per_key: u32) -> Result<MergeLevelResult> {
+        cursor.set_keep_deletes(preserve_delete);
         cursor.go_to_min()?;
 
         let mut tuples = Vec::<(Arc<[u8]>, LsmTreeValueMarker<LsmTuplePtr>)>::new();
@@ -61,7 +99,7 @@ pub(crate) mod lsm_backend_utils {
             cursor.next()?;
         }
 
-        let estimate_size = estimate_merge_tuples_byte_size(&tuples);
+        let estimate_size = estimate_merge_tuples_byte_size(&tuples, bloom_bits_per_key);
 
         Ok(MergeLevelResult {
             tuples,
@@ -69,8 +107,168 @@ pub(crate) mod lsm_backend_utils {
         })
     }
 
-    fn estimate_merge_tuples_byte_size(tuples: &[(Arc<[u8]>, LsmTreeValueMarker<LsmTuplePtr>)]) -> usize {
+    /// Open a cursor over all the segments of level 0 except the last one,
+    /// the newer segment comes first.
+    pub(crate) fn level0_except_last_cursor(snapshot: &LsmSnapshot) -> MultiCursor {
+        let level0 = &snapshot.levels[0];
+        assert!(level0.content.len() > 1);
+
+        let mut cursor_repo: Vec<CursorRepr> = vec![];
+        let mut range_deletes: Vec<RangeDeletes> = vec![];
+        let mut idx: i64 = (level0.content.len() as i64) - 2;
+
+        while idx >= 0 {
+            let segment = &level0.content[idx as usize];
+            cursor_repo.push(segment.open_cursor());
+            range_deletes.push(segment.range_deletes().clone());
+            idx -= 1;
+        }
+
+        let mut cursor = MultiCursor::new(cursor_repo);
+        cursor.set_range_deletes(range_deletes);
+        cursor
+    }
+
+    pub(crate) fn last_two_levels_cursor(snapshot: &LsmSnapshot) -> MultiCursor {
+        let level_len = snapshot.levels.len();
+        let last2 = &snapshot.levels[level_len - 2];
+        let last1 = &snapshot.levels[level_len - 1];
+
+        let cursor_repo: Vec<CursorRepr> = vec![
+            last2.open_cursor(),
+            last1.open_cursor(),
+        ];
+
+        let mut cursor = MultiCursor::new(cursor_repo);
+        cursor.set_range_deletes(vec![last2.range_deletes(), last1.range_deletes()]);
+        cursor
+    }
+
+    /// Split the merged tuples into runs of about `target_size` bytes,
+    /// return the tuples and the estimate size of every run.
+    ///
+    /// A range deleted across a split is clipped, the run is closed with
+    /// the end markers at the split key and the next run is opened with
+    /// the start markers at the same key. So the ranges of every segment
+    /// only cover its own keys. The split key is the successor of the last key
+    /// of the run, it's never a key of the data.
+    ///
+    /// The markers clipped by the previous compaction meet again at the same key,
+    /// the ends and the starts at a key are joined pairwise before splitting.
+    /// A nested range is clipped with more than one pair at the same key.
+    pub(crate) fn split_merged_tuples(
+        tuples: &[(Arc<[u8]>, LsmTreeValueMarker<LsmTuplePtr>)],
+        target_size: u64,
+        bloom_bits_per_key: u32,
+    ) -> Vec<(Vec<(Arc<[u8]>, LsmTreeValueMarker<LsmTuplePtr>)>, usize)> {
+        let mut result = vec![];
+        let mut run: Vec<(Arc<[u8]>, LsmTreeValueMarker<LsmTuplePtr>)> = vec![];
+        let mut run_size: u64 = 0;
+        // the ranges may be nested
+        let mut range_depth: usize = 0;
+        let mut index: usize = 0;
+
+        while index < tuples.len() {
+            let key = &tuples[index].0;
+            let mut value_opt: Option<&LsmTreeValueMarker<LsmTuplePtr>> = None;
+            let mut end_count: usize = 0;
+            let mut start_count: usize = 0;
+
+            while index < tuples.len() && &tuples[index].0 == key {
+                let value = &tuples[index].1;
+                if value.is_delete_end() {
+                    end_count += 1;
+                } else if value.is_delete_start() {
+                    start_count += 1;
+                } else if value_opt.is_none() {
+                    // the first one is from the newest source
+                    value_opt = Some(value);
+                }
+                index += 1;
+            }
+
+            let joined = end_count.min(start_count);
+
+            for _ in joined..end_count {
+                push_tuple(&mut run, &mut run_size, key, LsmTreeValueMarker::DeleteEnd);
+                range_depth = range_depth.saturating_sub(1);
+            }
+            if let Some(value) = value_opt {
+                push_tuple(&mut run, &mut run_size, key, value.clone());
+            }
+            for _ in joined..start_count {
+                push_tuple(&mut run, &mut run_size, key, LsmTreeValueMarker::DeleteStart);
+                range_depth += 1;
+            }
+
+            if run_size < target_size {
+                continue;
+            }
+
+            let next_key = match tuples.get(index) {
+                Some((next_key, _)) => next_key,
+                None => continue,
+            };
+
+            if range_depth == 0 {
+                result.push(finish_run(std::mem::take(&mut run), bloom_bits_per_key));
+                run_size = 0;
+                continue;
+            }
+
+            let mut split_key = key.to_vec();
+            split_key.push(0);
+            if split_key.as_slice() >= next_key.as_ref() {
+                continue;
+            }
+            let split_key: Arc<[u8]> = split_key.into();
+
+            for _ in 0..range_depth {
+                run.push((split_key.clone(), LsmTreeValueMarker::DeleteEnd));
+            }
+            result.push(finish_run(std::mem::take(&mut run), bloom_bits_per_key));
+
+            for _ in 0..range_depth {
+                run.push((split_key.clone(), LsmTreeValueMarker::DeleteStart));
+            }
+            run_size = (estimate_key_size(&split_key) * range_depth) as u64;
+        }
+
+        if !run.is_empty() {
+            result.push(finish_run(run, bloom_bits_per_key));
+        }
+
+        result
+    }
+
+    #[inline]
+    fn push_tuple(
+        run: &mut Vec<(Arc<[u8]>, LsmTreeValueMarker<LsmTuplePtr>)>,
+        run_size: &mut u64,
+        key: &Arc<[u8]>,
+        value: LsmTreeValueMarker<LsmTuplePtr>,
+    ) {
+        *run_size += match &value {
+            LsmTreeValueMarker::Value(tuple) => tuple.byte_size,
+            _ => estimate_key_size(key) as u64,
+        };
+        run.push((key.clone(), value));
+    }
+
+    fn finish_run(
+        run: Vec<(Arc<[u8]>, LsmTreeValueMarker<LsmTuplePtr>)>,
+        bloom_bits_per_key: u32,
+    ) -> (Vec<(Arc<[u8]>, LsmTreeValueMarker<LsmTuplePtr>)>, usize) {
+        let estimate_size = estimate_merge_tuples_byte_size(&run, bloom_bits_per_key);
+        (run, estimate_size)
+    }
+
+    /// The size includes the block index written after the tuples,
+    /// it's an upper bound because the headers of the compressed blocks
+    /// are also counted.
+    pub(crate) fn estimate_merge_tuples_byte_size(tuples: &[(Arc<[u8]>, LsmTreeValueMarker<LsmTuplePtr>)], bloom_bits_per_key: u32) -> usize {
         let mut result: usize = 0;
+        let mut index_builder = BlockIndexBuilder::new(bloom_bits_per_key);
 
         for (key, value) in tuples {
             let value_size = match value {
@@ -80,9 +278,18 @@ pub(crate) mod lsm_backend_utils {
                 }
             };
 
+            if value.is_delete_start() || value.is_delete_end() {
+                index_builder.add_range_marker(key, value_size as u64, value);
+            } else {
+                index_builder.add_tuple(key, value_size as u64);
+            }
+
             result += value_size;
         }
 
+        result += index_builder.encoded_len();
+        result += index_builder.block_headers_len();
+
         result
     }
 
@@ -108,3 +315,125 @@ pub(crate) mod lsm_backend_utils {
     }
 
 }
+
+#[cfg(test)]
+mod tests {
+    use std::sync::Arc;
+    use crate::lsm::lsm_backend::lsm_backend_utils::split_merged_tuples;
+    use crate::lsm::lsm_segment::LsmTuplePtr;
+    use crate::lsm::lsm_tree::LsmTreeValueMarker;
+    use crate::lsm::range_delete::RangeDeletesBuilder;
+
+    type Tuple = (Arc<[u8]>, LsmTreeValueMarker<LsmTuplePtr>);
+
+    fn value(key: &str) -> Tuple {
+        let ptr = LsmTuplePtr {
+            pid: 0,
+            pid_ext: 0,
+            offset: 0,
+            byte_size: 100,
+            block_offset: None,
+        };
+        (key.as_bytes().into(), LsmTreeValueMarker::Value(ptr))
+    }
+
+    fn marker(key: &str, marker: LsmTreeValueMarker<LsmTuplePtr>) -> Tuple {
+        (key.as_bytes().into(), marker)
+    }
+
+    /// Split the tuples and check every run is balanced,
+    /// and its ranges only cover its own keys.
+    /// Return the runs concatenated.
+    fn split_and_check(tuples: &[Tuple]) -> Vec<Tuple> {
+        let runs = split_merged_tuples(tuples, 1000, 10);
+        assert!(runs.len() >= 10);
+
+        let mut clipped: Vec<Tuple> = vec![];
+        for (run, _) in &runs {
+            let mut builder = RangeDeletesBuilder::new();
+            let mut depth: i64 = 0;
+            for (key, value) in run {
+                builder.add_marker(key, value);
+                if value.is_delete_start() {
+                    depth += 1;
+                } else if value.is_delete_end() {
+                    depth -= 1;
+                }
+                assert!(depth >= 0);
+            }
+            assert_eq!(depth, 0);
+
+            // the range only covers the keys of the run
+            let ranges = builder.build();
+            let bounds: Vec<&(Arc<[u8]>, Arc<[u8]>)> = ranges.iter().collect();
+            assert_eq!(bounds.len(), 1);
+            assert_eq!(&bounds[0].0, &run.first().unwrap().0);
+            assert_eq!(&bounds[0].1, &run.last().unwrap().0);
+
+            clipped.extend(run.iter().cloned());
+        }
+
+        clipped
+    }
+
+    fn assert_same_tuples(actual: &[Tuple], expected: &[Tuple]) {
+        let kind = |value: &LsmTreeValueMarker<LsmTuplePtr>| {
+            if value.is_delete_start() {
+                1
+            } else if value.is_delete_end() {
+                2
+            } else {
+                0
+            }
+        };
+        let actual: Vec<(&Arc<[u8]>, i32)> = actual.iter().map(|(key, value)| (key, kind(value))).collect();
+        let expected: Vec<(&Arc<[u8]>, i32)> = expected.iter().map(|(key, value)| (key, kind(value))).collect();
+        assert_eq!(actual, expected);
+    }
+
+    #[test]
+    fn test_split_range_deleted() {
+        let mut tuples = vec![marker("a", LsmTreeValueMarker::DeleteStart)];
+        for i in 0..100 {
+            tuples.push(value(&format!("b{:03}", i)));
+        }
+        tuples.push(marker("c", LsmTreeValueMarker::DeleteEnd));
+
+        let clipped = split_and_check(&tuples);
+
+        // the clipped markers are joined again when merged
+        let rejoined = split_merged_tuples(&clipped, u64::MAX, 10);
+        assert_eq!(rejoined.len(), 1);
+        assert_same_tuples(&rejoined[0].0, &tuples);
+    }
+
+    #[test]
+    fn test_split_nested_range_deleted() {
+        // [b, c) is nested in [a, z), the splits inside it have depth 2
+        let mut tuples = vec![
+            marker("a", LsmTreeValueMarker::DeleteStart),
+            marker("b", LsmTreeValueMarker::DeleteStart),
+        ];
+        for i in 0..100 {
+            tuples.push(value(&format!("b{:03}", i)));
+        }
+        tuples.push(marker("c", LsmTreeValueMarker::DeleteEnd));
+        for i in 0..100 {
+            tuples.push(value(&format!("d{:03}", i)));
+        }
+        tuples.push(marker("z", LsmTreeValueMarker::DeleteEnd));
+
+        let clipped = split_and_check(&tuples);
+
+        // the pairs at the same split key are all joined
+        let rejoined = split_merged_tuples(&clipped, u64::MAX, 10);
+        assert_eq!(rejoined.len(), 1);
+        assert_same_tuples(&rejoined[0].0, &tuples);
+
+        // merged and split again, the runs are still balanced
+        let resplit = split_and_check(&clipped);
+        let rejoined = split_merged_tuples(&resplit, u64::MAX, 10);
+        assert_same_tuples(&rejoined[0].0, &tuples);
+    }
+
+}
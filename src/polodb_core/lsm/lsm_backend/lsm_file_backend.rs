@@ -5,28 +5,52 @@
  */
 
 use std::fs::File;
-use std::io::{Read, Seek, SeekFrom, Write};
+use std::io::{Seek, SeekFrom, Write};
 use std::num::NonZeroU32;
 use std::path::Path;
 use std::sync::{Mutex, Arc};
-use byteorder::ReadBytesExt;
 use memmap2::Mmap;
 use smallvec::smallvec;
 use crate::{Config, Error, Result};
 use crate::lsm::lsm_backend::file_writer::FileWriter;
-use crate::lsm::lsm_backend::format;
 use crate::lsm::lsm_backend::lsm_backend::{lsm_backend_utils, LsmBackend};
+use crate::lsm::lsm_backend::segment_reader::SegmentReader;
 use crate::lsm::lsm_backend::snapshot_reader::SnapshotReader;
 use crate::lsm::mem_table::MemTable;
-use crate::lsm::lsm_segment::{ImLsmSegment, LsmTuplePtr};
+use crate::lsm::block_compression;
+use crate::lsm::block_index::{BlockIndex, BlockIndexBuilder};
+use crate::lsm::lsm_segment::{ImLsmSegment, LsmTuplePtr, SegmentIndex};
 use crate::lsm::lsm_snapshot::{FreeSegmentRecord, LsmLevel, LsmMetaDelegate, LsmSnapshot};
 use crate::page::RawPage;
-use crate::lsm::lsm_tree::{LsmTree, LsmTreeValueMarker};
+use crate::lsm::lsm_tree::LsmTreeValueMarker;
 use crate::lsm::lsm_snapshot::lsm_meta::{META_ID_OFFSET};
 use crate::lsm::LsmMetrics;
-use crate::lsm::multi_cursor::{CursorRepr, MultiCursor};
+use crate::lsm::multi_cursor::MultiCursor;
+use crate::lsm::value_cache::ValueCache;
 use crate::utils::vli;
 
+#[cfg(target_os = "linux")]
+fn punch_hole_native(file: &File, offset: u64, len: u64) -> std::io::Result<()> {
+    use std::os::unix::io::AsRawFd;
+    let ret = unsafe {
+        libc::fallocate(
+            file.as_raw_fd(),
+            libc::FALLOC_FL_PUNCH_HOLE | libc::FALLOC_FL_KEEP_SIZE,
+            offset as libc::off_t,
+            len as libc::off_t,
+        )
+    };
+    if ret != 0 {
+        return Err(std::io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+#[cfg(not(target_os = "linux"))]
+fn punch_hole_native(_file: &File, _offset: u64, _len: u64) -> std::io::Result<()> {
+    Ok(())
+}
+
 #[cfg(target_os = "windows")]
 mod winerror {
     pub const ERROR_SHARING_VIOLATION: i32 = 32;
@@ -80,7 +104,8 @@ fn open_file_native(path: &Path) -> Result<File> {
 }
 
 pub(crate) struct LsmFileBackend {
-    inner: Mutex<LsmFileBackendInner>,
+    inner:  Mutex<LsmFileBackendInner>,
+    reader: SegmentReader,
 }
 
 impl LsmFileBackend {
@@ -90,10 +115,17 @@ impl LsmFileBackend {
         path: &Path,
         metrics: LsmMetrics,
         config: Arc<Config>,
+        value_cache: Option<ValueCache>,
     ) -> Result<LsmFileBackend> {
-        let inner = LsmFileBackendInner::open(path, metrics, config)?;
+        let inner = LsmFileBackendInner::open(path, metrics, config.clone(), value_cache)?;
+        let reader = SegmentReader::new(
+            inner.file.try_clone()?,
+            config.lsm_page_size,
+            config.lsm_mmap_read,
+        );
         Ok(LsmFileBackend {
             inner: Mutex::new(inner),
+            reader,
         })
     }
 
@@ -102,8 +134,7 @@ impl LsmFileBackend {
 impl LsmBackend for LsmFileBackend {
 
     fn read_segment_by_ptr(&self, ptr: LsmTuplePtr) -> Result<Arc<[u8]>> {
-        let mut inner = self.inner.lock()?;
-        inner.read_segment_by_ptr(ptr)
+        self.reader.read_segment_by_ptr(ptr)
     }
 
     fn read_latest_snapshot(&self) -> Result<LsmSnapshot> {
@@ -128,15 +159,52 @@ impl LsmBackend for LsmFileBackend {
 
     fn checkpoint_snapshot(&self, snapshot: &mut LsmSnapshot) -> Result<()> {
         let mut inner = self.inner.lock()?;
-        inner.checkpoint_snapshot(snapshot)
+        inner.checkpoint_snapshot(snapshot, &self.reader)
+    }
+
+    fn sync_data(&self) -> Result<()> {
+        let inner = self.inner.lock()?;
+        inner.file.sync_data()?;
+        Ok(())
+    }
+
+    fn write_merged_segment(
+        &self,
+        tuples: &[(Arc<[u8]>, LsmTreeValueMarker<LsmTuplePtr>)],
+        start_pid: u64,
+        level: usize,
+    ) -> Result<ImLsmSegment> {
+        let mut inner = self.inner.lock()?;
+        inner.write_merged_tuples_at(tuples, start_pid, level)
+    }
+
+    fn write_merged_tuples(
+        &self,
+        snapshot: &mut LsmSnapshot,
+        tuples: &[(Arc<[u8]>, LsmTreeValueMarker<LsmTuplePtr>)],
+        estimate_size: usize,
+        level: usize,
+    ) -> Result<ImLsmSegment> {
+        let mut inner = self.inner.lock()?;
+        let segment = inner.write_merged_tuples(snapshot, tuples, estimate_size, level)?;
+        inner.update_file_size(snapshot)?;
+        Ok(segment)
     }
 
 }
 
+/// The interior free ranges of at least so many pages
+/// are given back to the file system.
+const PUNCH_HOLE_MIN_PAGES: u64 = 16;
+
 struct LsmFileBackendInner {
-    file:    File,
-    metrics: LsmMetrics,
-    config:  Arc<Config>,
+    file:        File,
+    metrics:     LsmMetrics,
+    config:      Arc<Config>,
+    value_cache: Option<ValueCache>,
+    /// The ranges punched by the last checkpoint,
+    /// they are not punched again.
+    punched:     Vec<FreeSegmentRecord>,
 }
 
 impl LsmFileBackendInner {
@@ -145,15 +213,26 @@ impl LsmFileBackendInner {
         path: &Path,
         metrics: LsmMetrics,
         config: Arc<Config>,
+        value_cache: Option<ValueCache>,
     ) -> Result<LsmFileBackendInner> {
         let file = open_file_native(path)?;
         Ok(LsmFileBackendInner {
             file,
             metrics,
             config,
+            value_cache,
+            punched: Vec::new(),
         })
     }
 
+    /// The cached values on the freed pages are stale
+    /// once the pages are reused.
+    fn invalidate_cached_pages(&self, start_pid: u64, end_pid: u64) {
+        if let Some(cache) = &self.value_cache {
+            cache.invalidate_pages(start_pid, end_pid);
+        }
+    }
+
     fn force_init_file(&mut self) -> Result<LsmSnapshot> {
         let mut result = LsmSnapshot::new();
         let mut first_page = RawPage::new(0, NonZeroU32::new(self.config.lsm_page_size).unwrap());
@@ -172,24 +251,6 @@ impl LsmFileBackendInner {
         Ok(result)
     }
 
-    fn read_segment_by_ptr(&mut self, tuple: LsmTuplePtr) -> Result<Arc<[u8]>> {
-        let page_size = self.config.lsm_page_size;
-        let offset = (tuple.pid as u64) * (page_size as u64) + (tuple.offset as u64);
-        self.file.seek(SeekFrom::Start(offset))?;
-        let flag = self.file.read_u8()?;
-        assert!(flag == format::LSM_INSERT || flag == format::LSM_POINT_DELETE);
-
-        let key_len = vli::decode_u64(&mut self.file)?;
-        self.file.seek(SeekFrom::Current(key_len as i64))?;
-
-        let value_len = vli::decode_u64(&mut self.file)?;
-
-        let mut buffer = vec![0u8; value_len as usize];
-        self.file.read_exact(&mut buffer)?;
-
-        Ok(buffer.into())
-    }
-
     fn check_first_page_valid(data: &[u8]) -> Result<()> {
         let mut title_area: [u8; 32] = [0; 32];
         if data.len() < 32 {
@@ -238,6 +299,7 @@ impl LsmFileBackendInner {
 
         let reader = SnapshotReader::new(
             &mmap,
+            &self.file,
             page_size,
         );
 
@@ -261,56 +323,52 @@ impl LsmFileBackendInner {
     fn sync_latest_segment(&mut self, mem_table: &MemTable, snapshot: &mut LsmSnapshot) -> Result<()> {
         let config = self.config.clone();
 
-        let estimate_size = LsmFileBackendInner::estimate_mem_table_byte_size(mem_table);
+        let estimate_size = LsmFileBackendInner::estimate_mem_table_byte_size(mem_table, config.lsm_bloom_bits_per_key);
         let (start_pid, used_free_segment) = self.get_start_writing_pid(snapshot, estimate_size);
 
+        let compression = config.lsm_compression_of_level(0);
         let mut writer = FileWriter::open(
             &mut self.file,
             start_pid,
             config,
+            compression,
         );
 
         writer.begin()?;
 
-        let mut segments = LsmTree::<Arc<[u8]>, LsmTuplePtr>::new();
-
-        let mut mem_table_cursor = mem_table.open_cursor();
-        mem_table_cursor.go_to_min();
-
-        while !mem_table_cursor.done() {
-            let (key, value) = mem_table_cursor.tuple().unwrap();
-            let pos = writer.write_tuple(key.as_ref(), value.as_ref())?;
-
-            segments.update_in_place(key, pos);
-
-            mem_table_cursor.next();
+        for (key, value) in mem_table.tuples() {
+            writer.write_tuple(key.as_ref(), value.as_ref())?;
         }
 
-        assert_eq!(writer.written_bytes(), estimate_size as u64);
+        let footer_offset = writer.write_block_index()?;
+
+        assert!(writer.written_bytes() <= estimate_size as u64);
 
         let end_ptr = writer.end()?;
+        let index_builder = writer.into_index_builder();
 
-        let im_seg = ImLsmSegment {
-            segments,
-            start_pid,
-            end_pid: end_ptr.pid,
-        };
+        let im_seg = self.make_block_segment(index_builder, start_pid, end_ptr.pid, footer_offset)?;
 
-        LsmFileBackendInner::return_used_segment(used_free_segment.as_ref(), end_ptr.pid, snapshot);
+        self.return_used_segment(used_free_segment.as_ref(), end_ptr.pid, snapshot);
 
         snapshot.add_latest_segment(im_seg);
-        snapshot.file_size = self.file.seek(SeekFrom::End(0))?;
+        self.update_file_size(snapshot)?;
 
         Ok(())
     }
 
-    fn return_used_segment(used_segment: Option<&FreeSegmentRecord>, end_pid: u64, snapshot: &mut LsmSnapshot) {
+    /// Give back the pages reserved but not written,
+    /// they are merged with the rest of the free range.
+    fn return_used_segment(&self, used_segment: Option<&FreeSegmentRecord>, end_pid: u64, snapshot: &mut LsmSnapshot) {
         if let Some(used_segment) = &used_segment {
+            assert!(end_pid <= used_segment.end_pid);
             if end_pid < used_segment.end_pid {
+                self.invalidate_cached_pages(end_pid + 1, used_segment.end_pid);
                 snapshot.free_segments.push(FreeSegmentRecord {
                     start_pid: end_pid + 1,
                     end_pid: used_segment.end_pid,
-                })
+                });
+                snapshot.normalize_free_segments();
             }
         }
     }
@@ -331,7 +389,7 @@ impl LsmFileBackendInner {
             snapshot.normalize_free_segments();
         }
 
-        snapshot.file_size = self.file.seek(SeekFrom::End(0))?;
+        self.update_file_size(snapshot)?;
 
         Ok(())
     }
@@ -341,16 +399,16 @@ impl LsmFileBackendInner {
         let new_segment = self.merge_last_two_levels(snapshot)?;
 
         let mut level_len = snapshot.levels.len();
-        let last2 = &snapshot.levels[level_len - 2];
-        let last1 = &snapshot.levels[level_len - 1];
-        snapshot.pending_free_segments.push(FreeSegmentRecord {
-            start_pid: last2.content[0].start_pid,
-            end_pid: last2.content[0].end_pid,
-        });
-        snapshot.pending_free_segments.push(FreeSegmentRecord {
-            start_pid: last1.content[0].start_pid,
-            end_pid: last1.content[0].end_pid,
-        });
+        // the levels left by the leveled compaction may have many segments
+        for level in &snapshot.levels[(level_len - 2)..] {
+            for segment in &level.content {
+                self.invalidate_cached_pages(segment.start_pid, segment.end_pid);
+                snapshot.pending_free_segments.push(FreeSegmentRecord {
+                    start_pid: segment.start_pid,
+                    end_pid: segment.end_pid,
+                });
+            }
+        }
 
         snapshot.levels.remove(level_len - 1);
         level_len -= 1;
@@ -364,26 +422,17 @@ impl LsmFileBackendInner {
             snapshot.normalize_free_segments();
         }
 
-        snapshot.file_size = self.file.seek(SeekFrom::End(0))?;
+        self.update_file_size(snapshot)?;
 
         Ok(())
     }
 
     fn merge_last_two_levels(&mut self, snapshot: &mut LsmSnapshot) -> Result<ImLsmSegment> {
-        let level_len = snapshot.levels.len();
-        let last2 = &snapshot.levels[level_len - 2];
-        let last1 = &snapshot.levels[level_len - 1];
-
-        let cursor = {
-            let cursor_repo: Vec<CursorRepr> = vec![
-                last2.content[0].segments.open_cursor().into(),
-                last1.content[0].segments.open_cursor().into(),
-            ];
+        let cursor = lsm_backend_utils::last_two_levels_cursor(snapshot);
 
-            MultiCursor::new(cursor_repo)
-        };
-
-        let segment = self.merge_level(snapshot, cursor, false)?;
+        // the last two levels are replaced by the new segment
+        let level = snapshot.levels.len() - 2;
+        let segment = self.merge_level(snapshot, cursor, false, level)?;
 
         Ok(segment)
     }
@@ -395,6 +444,7 @@ impl LsmFileBackendInner {
 
         while index < level0.content.len() - 1 {
             let segment = &level0.content[index];
+            self.invalidate_cached_pages(segment.start_pid, segment.end_pid);
             snapshot.pending_free_segments.push(FreeSegmentRecord {
                 start_pid: segment.start_pid,
                 end_pid: segment.end_pid,
@@ -408,154 +458,265 @@ impl LsmFileBackendInner {
     }
 
     fn merge_level0_except_last(&mut self, snapshot: &mut LsmSnapshot) -> Result<ImLsmSegment> {
-        let level0 = &snapshot.levels[0];
-        assert!(level0.content.len() > 1);
-
         let preserve_delete = snapshot.levels.len() > 1;
 
-        let cursor = {
-            let mut cursor_repo: Vec<CursorRepr> = vec![];
-            let mut idx: i64 = (level0.content.len() as i64) - 2;
-
-            while idx >= 0 {
-                let cursor = level0.content[idx as usize].segments.open_cursor();
-                cursor_repo.push(cursor.into());
-                idx -= 1;
-            }
-
-            MultiCursor::new(cursor_repo)
-        };
+        let cursor = lsm_backend_utils::level0_except_last_cursor(snapshot);
 
-        let segment = self.merge_level(snapshot, cursor, preserve_delete)?;
+        let segment = self.merge_level(snapshot, cursor, preserve_delete, 1)?;
 
         Ok(segment)
     }
 
-    fn merge_level(&mut self, snapshot: &mut LsmSnapshot, cursor: MultiCursor, preserve_delete: bool) -> Result<ImLsmSegment> {
-        let result = lsm_backend_utils::merge_level(cursor, preserve_delete)?;
-        self.write_merged_tuples(snapshot, &result.tuples, result.estimate_size)
+    fn merge_level(&mut self, snapshot: &mut LsmSnapshot, cursor: MultiCursor, preserve_delete: bool, level: usize) -> Result<ImLsmSegment> {
+        let bloom_bits_per_key = self.config.lsm_bloom_bits_per_key;
+        let result = lsm_backend_utils::merge_level(cursor, preserve_delete, bloom_bits_per_key)?;
+        self.write_merged_tuples(snapshot, &result.tuples, result.estimate_size, level)
     }
 
-    fn estimate_mem_table_byte_size(mem_table: &MemTable) -> usize {
+    /// The size includes the block index written after the tuples,
+    /// and the headers of the blocks in case the segment is compressed.
+    fn estimate_mem_table_byte_size(mem_table: &MemTable, bloom_bits_per_key: u32) -> usize {
         let mut result: usize = 0;
+        let mut index_builder = BlockIndexBuilder::new(bloom_bits_per_key);
 
-        let mut cursor = mem_table.open_cursor();
-        cursor.go_to_min();
+        for (key, value) in mem_table.tuples() {
+            let mut tuple_size = lsm_backend_utils::estimate_key_size(&key);
 
-        while !cursor.done() {
-            let tuple = cursor.tuple();
-            if let Some((key, value)) = &tuple {
-                result += lsm_backend_utils::estimate_key_size(key);
+            match &value {
+                LsmTreeValueMarker::Value(v) => {
 
-                match value {
-                    LsmTreeValueMarker::Value(v) => {
+                    tuple_size += vli::vli_len_u64(v.len() as u64);
 
-                        result += vli::vli_len_u64(v.len() as u64);
-
-                        result += v.len();
-                    }
-                    _ => ()
+                    tuple_size += v.len();
                 }
+                _ => ()
+            }
+
+            if value.is_delete_start() || value.is_delete_end() {
+                index_builder.add_range_marker(&key, tuple_size as u64, &value);
+            } else {
+                index_builder.add_tuple(&key, tuple_size as u64);
             }
 
-            cursor.next();
+            result += tuple_size;
         }
 
+        result += index_builder.encoded_len();
+        result += index_builder.block_headers_len();
+
         result
     }
 
+    /// Reserve the pages of a free range by the best fit,
+    /// or write at the end of file if no range is large enough.
     fn get_start_writing_pid(&self, snapshot: &mut LsmSnapshot, estimate_size: usize) -> (u64, Option<FreeSegmentRecord>) {
-        let page_size = self.config.lsm_page_size;
-
-        let mut index: usize = 0;
-        for seg in &snapshot.free_segments {
-            let page_count = seg.end_pid - seg.start_pid + 1;
-            let seg_size = (page_count as usize) * (page_size as usize);
-
-            if seg_size > estimate_size {
-                return self.choose_selected_segments(snapshot, index, estimate_size);
+        let page_size = self.config.lsm_page_size as u64;
+
+        // the writer pads the last page
+        let page_count = (estimate_size as u64) / page_size + 1;
+        match snapshot.allocate_free_pages(page_count) {
+            Some(seg) => {
+                self.metrics.add_use_free_segment_count();
+                (seg.start_pid, Some(seg))
             }
-
-            index += 1;
+            None => (snapshot.file_size / page_size, None),
         }
-
-        (snapshot.file_size / (page_size as u64), None)
     }
 
-    fn choose_selected_segments(&self, snapshot: &mut LsmSnapshot, index: usize, _estimate_size: usize) -> (u64, Option<FreeSegmentRecord>) {
-        let seg = snapshot.free_segments[index];
-        let start_pid = seg.start_pid;
+    fn write_merged_tuples(
+        &mut self,
+        snapshot: &mut LsmSnapshot,
+        tuples: &[(Arc<[u8]>, LsmTreeValueMarker<LsmTuplePtr>)],
+        estimate_size: usize,
+        level: usize,
+    ) -> Result<ImLsmSegment> {
+        let (start_pid, used_free_segment) = self.get_start_writing_pid(snapshot, estimate_size);
 
-        snapshot.free_segments.remove(index);
+        let im_seg = self.write_merged_tuples_at(tuples, start_pid, level)?;
 
-        self.metrics.add_use_free_segment_count();
+        self.return_used_segment(used_free_segment.as_ref(), im_seg.end_pid, snapshot);
 
-        (start_pid, Some(seg))
+        Ok(im_seg)
     }
 
-    fn write_merged_tuples(
+    fn write_merged_tuples_at(
         &mut self,
-        snapshot: &mut LsmSnapshot,
         tuples: &[(Arc<[u8]>, LsmTreeValueMarker<LsmTuplePtr>)],
-        estimate_size: usize,
+        start_pid: u64,
+        level: usize,
     ) -> Result<ImLsmSegment> {
         let config = self.config.clone();
         let page_size = config.lsm_page_size;
+        let compression = config.lsm_compression_of_level(level);
 
         let mmap = unsafe{
             Mmap::map(&self.file)?
         };
 
-        let (start_pid, used_free_segment) = self.get_start_writing_pid(snapshot, estimate_size);
-
         let mut writer = FileWriter::open(
             &mut self.file,
             start_pid,
             config,
+            compression,
         );
 
-        writer.begin()?;
+        // the tuples of a compressed block are adjacent,
+        // so the last block decoded is kept
+        let mut last_block: Option<(usize, Vec<u8>)> = None;
 
-        let mut segments = LsmTree::<Arc<[u8]>, LsmTuplePtr>::new();
+        writer.begin()?;
 
         for (key, value) in tuples {
-           let tuple =  match value {
+            match value {
                 LsmTreeValueMarker::Deleted => {
-                    writer.write_tuple(key, LsmTreeValueMarker::Deleted)?
+                    writer.write_tuple(key, LsmTreeValueMarker::Deleted)?;
                 },
                 LsmTreeValueMarker::DeleteStart => {
-                    writer.write_tuple(key, LsmTreeValueMarker::DeleteStart)?
+                    writer.write_tuple(key, LsmTreeValueMarker::DeleteStart)?;
                 },
                 LsmTreeValueMarker::DeleteEnd => {
-                    writer.write_tuple(key, LsmTreeValueMarker::DeleteEnd)?
+                    writer.write_tuple(key, LsmTreeValueMarker::DeleteEnd)?;
                 },
                 LsmTreeValueMarker::Value(legacy_tuple) => {
                     let offset = ((legacy_tuple.pid as usize) * (page_size as usize)) + (legacy_tuple.offset as usize);
-
-                    let mut buffer = vec![0u8; legacy_tuple.byte_size as usize];
-                    buffer.copy_from_slice(&mmap[offset..(offset + (legacy_tuple.byte_size as usize))]);
-
-                    let tuple_ptr = writer.write_buffer(&buffer)?;
-                    LsmTreeValueMarker::Value(tuple_ptr)
+                    let byte_size = legacy_tuple.byte_size as usize;
+
+                    match legacy_tuple.block_offset {
+                        Some(block_offset) => {
+                            let cached = matches!(&last_block, Some((block_start, _)) if *block_start == offset);
+                            if !cached {
+                                if offset >= mmap.len() {
+                                    return Err(Error::data_malformed());
+                                }
+                                let raw = block_compression::decode_block(&mmap[offset..])?;
+                                last_block = Some((offset, raw.into_owned()));
+                            }
+                            let raw = &last_block.as_ref().unwrap().1;
+                            let start = block_offset as usize;
+                            if start + byte_size > raw.len() {
+                                return Err(Error::data_malformed());
+                            }
+                            writer.write_buffer(key, &raw[start..(start + byte_size)])?;
+                        }
+                        None => {
+                            let mut buffer = vec![0u8; byte_size];
+                            buffer.copy_from_slice(&mmap[offset..(offset + byte_size)]);
+
+                            writer.write_buffer(key, &buffer)?;
+                        }
+                    }
                 }
             };
-            segments.update_in_place(key.clone(), tuple);
         }
 
+        let footer_offset = writer.write_block_index()?;
+
         let end_ptr = writer.end()?;
+        let index_builder = writer.into_index_builder();
 
-        let im_seg = ImLsmSegment {
-            segments,
-            start_pid,
-            end_pid: end_ptr.pid,
-        };
+        drop(mmap);
 
-        LsmFileBackendInner::return_used_segment(used_free_segment.as_ref(), end_ptr.pid, snapshot);
+        self.make_block_segment(index_builder, start_pid, end_ptr.pid, footer_offset)
+    }
 
-        Ok(im_seg)
+    /// Map the pages of the segment just written,
+    /// only the block index is kept in memory.
+    fn make_block_segment(
+        &self,
+        index_builder: BlockIndexBuilder,
+        start_pid: u64,
+        end_pid: u64,
+        footer_offset: u64,
+    ) -> Result<ImLsmSegment> {
+        let page_size = self.config.lsm_page_size;
+        let data = BlockIndex::map_segment(&self.file, start_pid, end_pid, page_size)?;
+        let index = index_builder.build(data, start_pid, page_size, footer_offset);
+
+        Ok(ImLsmSegment::new(SegmentIndex::Blocks(Arc::new(index)), start_pid, end_pid))
+    }
+
+    /// The compaction worker may reserve pages beyond the end of file,
+    /// so the file size of the snapshot never goes backward.
+    fn update_file_size(&mut self, snapshot: &mut LsmSnapshot) -> Result<()> {
+        let file_end = self.file.seek(SeekFrom::End(0))?;
+        snapshot.file_size = std::cmp::max(snapshot.file_size, file_end);
+        Ok(())
+    }
+
+    /// Write the meta page of the snapshot,
+    /// and truncate the free pages at the end of file.
+    ///
+    /// The file is truncated after the meta page is written,
+    /// the meta page written before never references the pages cut.
+    /// The truncation is only an optimization, if it fails,
+    /// the pages are kept in the free list.
+    fn checkpoint_snapshot(&mut self, snapshot: &mut LsmSnapshot, reader: &SegmentReader) -> Result<()> {
+        snapshot.normalize_free_segments();
+        let file_size = snapshot.file_size;
+        let tail = LsmFileBackendInner::truncate_free_tail(snapshot, self.config.lsm_page_size);
+
+        if let Err(err) = self.write_meta_page(snapshot) {
+            if let Some(tail) = tail {
+                snapshot.restore_free_tail(tail, file_size);
+            }
+            return Err(err);
+        }
+
+        if let Some(tail) = tail {
+            // the mapping of the reader covers the pages cut
+            let truncated = reader.invalidate()
+                .and_then(|_| self.file.set_len(snapshot.file_size).map_err(Error::from));
+            if truncated.is_err() {
+                snapshot.restore_free_tail(tail, file_size);
+            }
+        }
+        self.metrics.set_free_segments_count(snapshot.free_segments.len());
+
+        self.punch_free_holes(snapshot);
+
+        Ok(())
+    }
+
+    /// A file mapped can't be truncated on Windows,
+    /// and the segments are always mapped.
+    #[cfg(not(target_os = "windows"))]
+    #[inline]
+    fn truncate_free_tail(snapshot: &mut LsmSnapshot, page_size: u32) -> Option<FreeSegmentRecord> {
+        snapshot.truncate_free_tail(page_size)
+    }
+
+    #[cfg(target_os = "windows")]
+    #[inline]
+    fn truncate_free_tail(_snapshot: &mut LsmSnapshot, _page_size: u32) -> Option<FreeSegmentRecord> {
+        None
+    }
+
+    /// Release the disk space of the large free ranges
+    /// inside the file, the size of the file is kept.
+    /// It's only an optimization, the errors are ignored.
+    fn punch_free_holes(&mut self, snapshot: &LsmSnapshot) {
+        let page_size = self.config.lsm_page_size as u64;
+        let mut punched = Vec::new();
+
+        for seg in &snapshot.free_segments {
+            if seg.end_pid - seg.start_pid + 1 < PUNCH_HOLE_MIN_PAGES {
+                continue;
+            }
+            let is_punched = self.punched
+                .iter()
+                .any(|old| old.start_pid == seg.start_pid && old.end_pid == seg.end_pid);
+            if !is_punched {
+                let offset = seg.start_pid * page_size;
+                let len = (seg.end_pid - seg.start_pid + 1) * page_size;
+                let _ = punch_hole_native(&self.file, offset, len);
+            }
+            punched.push(*seg);
+        }
+
+        self.punched = punched;
     }
 
-    fn checkpoint_snapshot(&mut self, snapshot: &mut LsmSnapshot) -> Result<()> {
+    fn write_meta_page(&mut self, snapshot: &mut LsmSnapshot) -> Result<()> {
         let meta_pid = snapshot.meta_pid as u64;
         let next_meta_pid = snapshot.next_meta_pid();
         let mut meta_page = self.read_page(meta_pid)?;
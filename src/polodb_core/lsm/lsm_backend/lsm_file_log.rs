@@ -7,7 +7,10 @@
 use std::fs::File;
 use std::io::{Read, Seek, SeekFrom, Write};
 use std::path::{Path, PathBuf};
-use std::sync::{Arc, Mutex};
+use std::sync::{Arc, Condvar, Mutex};
+#[cfg(test)]
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::time::{Duration, Instant};
 use crc64fast::Digest;
 use getrandom::getrandom;
 use memmap2::Mmap;
@@ -34,19 +37,221 @@ impl LogTransactionState {
 
 }
 
+struct GroupCommitState {
+    /// The ticket of the last record appended, incremental
+    appended:      u64,
+    /// The records up to the ticket are synced
+    durable:       u64,
+    /// The offset after the last record appended
+    appended_offset: u64,
+    /// The offset after the last durable record,
+    /// where the records not synced begin
+    durable_offset:  u64,
+    leader_active: bool,
+    /// The error of a failed sync. The records after the last
+    /// durable one are in an unknown state, so the log is poisoned,
+    /// all the later appends and waits fail with it.
+    poisoned:      Option<String>,
+}
+
+/// The commits are appended in order by the engine,
+/// only the sync of the log is shared.
+///
+/// The first commit waiting becomes the leader, it syncs at once if
+/// it's the only one not synced. Otherwise it waits a short window
+/// for more commits, then syncs all of them.
+/// The commits appended while syncing are synced by the next leader.
+///
+/// A failed sync poisons the queue, the commits of the group already
+/// applied to the mem table get the error, and every later commit
+/// fails before it's applied, until the database is reopened.
+/// The records not durable are cut from the log, so the failed
+/// commits are not replayed when it's reopened.
+struct GroupCommitQueue {
+    state:     Mutex<GroupCommitState>,
+    cond:      Condvar,
+    /// A handle of the log file,
+    /// the appends are not blocked by the sync.
+    file:      File,
+    window:    Duration,
+    max_batch: u64,
+    #[cfg(test)]
+    fail_next_sync: AtomicBool,
+}
+
+impl GroupCommitQueue {
+
+    fn new(config: &Config, file: File) -> GroupCommitQueue {
+        GroupCommitQueue {
+            state: Mutex::new(GroupCommitState {
+                appended: 0,
+                durable: 0,
+                appended_offset: 0,
+                durable_offset: 0,
+                leader_active: false,
+                poisoned: None,
+            }),
+            cond: Condvar::new(),
+            file,
+            window: Duration::from_micros(config.log_group_commit_window_us),
+            max_batch: std::cmp::max(config.log_group_commit_max_batch, 1) as u64,
+            #[cfg(test)]
+            fail_next_sync: AtomicBool::new(false),
+        }
+    }
+
+    /// Write the record by `write` and take the ticket of it.
+    /// `write` returns the offsets before and after the record.
+    /// Called under the lock of the log, so the tickets are in the order of the records.
+    ///
+    /// The state is locked while writing, so a poisoned queue never
+    /// gets a record the engine doesn't apply.
+    fn append<F>(&self, write: F) -> Result<(u64, u64)>
+    where
+        F: FnOnce() -> Result<(u64, u64)>
+    {
+        let mut state = self.state.lock()?;
+        GroupCommitQueue::check_poisoned(&state)?;
+        let (start_offset, end_offset) = write()?;
+        if state.appended == state.durable {
+            // the data before it is durable, or replayed on opening
+            state.durable_offset = start_offset;
+        }
+        state.appended += 1;
+        state.appended_offset = end_offset;
+        self.cond.notify_all();
+        Ok((end_offset, state.appended))
+    }
+
+    /// The log is truncated, the records appended
+    /// are written to the segments.
+    fn reset_after_shrink(&self) -> Result<()> {
+        let mut state = self.state.lock()?;
+        state.durable = state.appended;
+        state.appended_offset = 0;
+        state.durable_offset = 0;
+        self.cond.notify_all();
+        Ok(())
+    }
+
+    fn wait_durable(&self, ticket: u64) -> Result<bool> {
+        let mut state = self.state.lock()?;
+        let mut synced = false;
+
+        loop {
+            if ticket <= state.durable {
+                return Ok(synced);
+            }
+
+            GroupCommitQueue::check_poisoned(&state)?;
+
+            if state.leader_active {
+                state = self.cond.wait(state)?;
+                continue;
+            }
+
+            // become the leader
+            state.leader_active = true;
+            synced = true;
+
+            if state.appended - state.durable > 1 {
+                let deadline = Instant::now() + self.window;
+                while state.appended - state.durable < self.max_batch {
+                    let now = Instant::now();
+                    if now >= deadline {
+                        break;
+                    }
+                    state = self.cond.wait_timeout(state, deadline - now)?.0;
+                }
+            }
+
+            let end = state.appended;
+            let end_offset = state.appended_offset;
+            drop(state);
+
+            let sync_result = self.sync_file();
+
+            state = self.state.lock()?;
+            state.leader_active = false;
+            match sync_result {
+                Ok(()) => {
+                    // the log may be shrunk while syncing
+                    if end > state.durable {
+                        state.durable = end;
+                        state.durable_offset = end_offset;
+                    }
+                }
+                Err(err) => {
+                    // the error of the sync is the one to report
+                    let _ = self.file.set_len(DATA_BEGIN_OFFSET + state.durable_offset);
+                    state.poisoned = Some(err.to_string());
+                }
+            }
+            self.cond.notify_all();
+        }
+    }
+
+    fn sync_file(&self) -> std::io::Result<()> {
+        #[cfg(test)]
+        if self.fail_next_sync.swap(false, Ordering::SeqCst) {
+            return Err(std::io::Error::new(std::io::ErrorKind::Other, "sync failed by the test"));
+        }
+        self.file.sync_data()
+    }
+
+    fn check(&self) -> Result<()> {
+        let state = self.state.lock()?;
+        GroupCommitQueue::check_poisoned(&state)
+    }
+
+    #[inline]
+    fn check_poisoned(state: &GroupCommitState) -> Result<()> {
+        match &state.poisoned {
+            Some(msg) => {
+                let msg = format!("the log is poisoned by a failed sync: {}", msg);
+                Err(std::io::Error::new(std::io::ErrorKind::Other, msg).into())
+            }
+            None => Ok(()),
+        }
+    }
+
+}
+
 pub(crate) struct LsmFileLog {
-    inner: Mutex<LsmFileLogInner>
+    inner: Mutex<LsmFileLogInner>,
+    group_commit: Option<GroupCommitQueue>,
 }
 
 impl LsmFileLog {
 
     pub fn open(path: &Path, config: Arc<Config>) -> Result<LsmFileLog> {
-        let inner = LsmFileLogInner::open(path, config)?;
+        let group_commit_enabled = config.log_group_commit;
+        let inner = LsmFileLogInner::open(path, config.clone())?;
+        let group_commit = if group_commit_enabled {
+            Some(GroupCommitQueue::new(&config, inner.file.try_clone()?))
+        } else {
+            None
+        };
         Ok(LsmFileLog {
             inner: Mutex::new(inner),
+            group_commit,
         })
     }
 
+    /// Write the record of the commit without syncing,
+    /// return the offset after it and the ticket of the group.
+    fn append_to_group(&self, group_commit: &GroupCommitQueue, buffer: Option<&[u8]>) -> Result<(u64, u64)> {
+        let record = LsmFileLogInner::make_commit_record(buffer);
+        let record_len = record.len() as u64;
+        let mut inner = self.inner.lock()?;
+        let result = group_commit.append(|| {
+            let offsets = inner.write_commit_records(&[record])?;
+            Ok((offsets[0] - record_len, offsets[0]))
+        });
+        inner.transaction = None;
+        result
+    }
+
     #[allow(dead_code)]
     pub fn path(&self) -> PathBuf {
         let inner = self.inner.lock().unwrap();
@@ -63,10 +268,49 @@ impl LsmLog for LsmFileLog {
     }
 
     fn commit(&self, buffer: Option<&[u8]>) -> Result<LsmCommitResult> {
+        if let Some(group_commit) = &self.group_commit {
+            let (offset, ticket) = self.append_to_group(group_commit, buffer)?;
+            group_commit.wait_durable(ticket)?;
+            return Ok(LsmCommitResult { offset });
+        }
         let mut inner = self.inner.lock()?;
         inner.commit(buffer)
     }
 
+    fn append_commit(&self, buffer: Option<&[u8]>) -> Result<Option<u64>> {
+        match &self.group_commit {
+            Some(group_commit) => {
+                let (_, ticket) = self.append_to_group(group_commit, buffer)?;
+                Ok(Some(ticket))
+            }
+            None => {
+                self.commit(buffer)?;
+                Ok(None)
+            }
+        }
+    }
+
+    fn wait_durable(&self, ticket: u64) -> Result<bool> {
+        match &self.group_commit {
+            Some(group_commit) => group_commit.wait_durable(ticket),
+            None => Ok(false),
+        }
+    }
+
+    fn check_poisoned(&self) -> Result<()> {
+        match &self.group_commit {
+            Some(group_commit) => group_commit.check(),
+            None => Ok(()),
+        }
+    }
+
+    #[cfg(test)]
+    fn fail_next_sync(&self) {
+        if let Some(group_commit) = &self.group_commit {
+            group_commit.fail_next_sync.store(true, Ordering::SeqCst);
+        }
+    }
+
     fn update_mem_table_with_latest_log(
         &self,
         snapshot: &LsmSnapshot,
@@ -78,7 +322,11 @@ impl LsmLog for LsmFileLog {
 
     fn shrink(&self, snapshot: &mut LsmSnapshot) -> Result<()> {
         let mut inner = self.inner.lock()?;
-        inner.shrink(snapshot)
+        inner.shrink(snapshot)?;
+        if let Some(group_commit) = &self.group_commit {
+            group_commit.reset_after_shrink()?;
+        }
+        Ok(())
     }
 
     fn enable_safe_clear(&self) {
@@ -288,6 +536,43 @@ impl LsmFileLogInner {
         })
     }
 
+    /// The record is the same as a single commit:
+    /// the buffer, the COMMIT flag and the checksum of the buffer.
+    fn make_commit_record(buffer: Option<&[u8]>) -> Vec<u8> {
+        let buffer = buffer.unwrap_or(&[]);
+        let mut record = Vec::with_capacity(buffer.len() + 9);
+        record.extend_from_slice(buffer);
+
+        let checksum_be: [u8; 8] = crc64(buffer).to_be_bytes();
+        record.push(format::COMMIT);
+        record.extend_from_slice(&checksum_be);
+
+        record
+    }
+
+    /// Write the records with one write, they are synced by the group,
+    /// return the offset after each record.
+    fn write_commit_records(&mut self, records: &[Vec<u8>]) -> Result<Vec<u64>> {
+        self.offset = self.file.seek(SeekFrom::End(0))?;
+
+        let total_len = records.iter().map(|r| r.len()).sum();
+        let mut buffer = Vec::<u8>::with_capacity(total_len);
+        let mut offsets = Vec::with_capacity(records.len());
+        let mut end_offset = self.offset;
+
+        for record in records {
+            buffer.extend_from_slice(record);
+            end_offset += record.len() as u64;
+            offsets.push(end_offset - DATA_BEGIN_OFFSET);
+        }
+
+        self.file.write_all(&buffer)?;
+        self.file.flush()?;
+        self.offset = end_offset;
+
+        Ok(offsets)
+    }
+
 }
 
 impl Write for LsmFileLogInner {
@@ -12,7 +12,9 @@ use crate::lsm::mem_table::MemTable;
 #[derive(Debug)]
 pub(crate) enum LogCommand {
     Insert(Arc<[u8]>, Arc<[u8]>),
-    Delete(Arc<[u8]>)
+    Delete(Arc<[u8]>),
+    /// The keys in [start, end)
+    DeleteRange(Arc<[u8]>, Arc<[u8]>),
 }
 
 #[allow(dead_code)]
@@ -24,6 +26,7 @@ pub(crate) mod format {
     pub const JUMP: u8    = 0x04;
     pub const WRITE: u8   = 0x06;
     pub const DELETE: u8  = 0x08;
+    pub const DELETE_RANGE: u8 = 0x0A;
 }
 
 #[allow(dead_code)]
@@ -37,6 +40,31 @@ pub(crate) trait LsmLog: Send + Sync {
 
     fn commit(&self, buffer: Option<&[u8]>) -> Result<LsmCommitResult>;
 
+    /// Write the commit, the caller waits for it to be durable
+    /// by `wait_durable` if a ticket is returned.
+    /// It's written as `commit` by default.
+    fn append_commit(&self, buffer: Option<&[u8]>) -> Result<Option<u64>> {
+        self.commit(buffer)?;
+        Ok(None)
+    }
+
+    /// Block until the commit of the ticket is durable,
+    /// return true if the caller synced the log for the group.
+    fn wait_durable(&self, _ticket: u64) -> Result<bool> {
+        Ok(false)
+    }
+
+    /// Return the error of the failed sync if the log is poisoned.
+    /// The commits after the last durable one are dropped from the log,
+    /// so they must not be written to a segment either.
+    fn check_poisoned(&self) -> Result<()> {
+        Ok(())
+    }
+
+    /// Fail the next sync of the group
+    #[cfg(test)]
+    fn fail_next_sync(&self) {}
+
     fn update_mem_table_with_latest_log(
         &self,
         snapshot: &LsmSnapshot,
@@ -74,6 +102,9 @@ pub(crate) mod lsm_log_utils {
                 LogCommand::Delete(key) => {
                     mem_table.delete(key.as_ref(), true);
                 }
+                LogCommand::DeleteRange(start, end) => {
+                    mem_table.delete_range(start.as_ref(), end.as_ref(), true);
+                }
             }
         }
     }
@@ -110,6 +141,24 @@ pub(crate) mod lsm_log_utils {
         Ok(())
     }
 
+    pub(crate) fn read_delete_range_command(mmap: &[u8], commands: &mut Vec<LogCommand>, ptr: &mut usize) -> Result<()> {
+        let mut remain = &mmap[*ptr..];
+
+        let start_len = vli::decode_u64(&mut remain)?;
+        let mut start_buff = vec![0u8; start_len as usize];
+        remain.read_exact(&mut start_buff)?;
+
+        let end_len = vli::decode_u64(&mut remain)?;
+        let mut end_buff = vec![0u8; end_len as usize];
+        remain.read_exact(&mut end_buff)?;
+
+        commands.push(LogCommand::DeleteRange(start_buff.into(), end_buff.into()));
+
+        *ptr = remain.as_ptr() as usize - mmap.as_ptr() as usize;
+
+        Ok(())
+    }
+
     fn crc64(bytes: &[u8]) -> u64 {
         let mut c = Digest::new();
         c.write(bytes);
@@ -167,6 +216,12 @@ pub(crate) mod lsm_log_utils {
                     reset = true;
                     break;
                 }
+            } else if flag == format::DELETE_RANGE {
+                let test_delete = read_delete_range_command(content, &mut commands, &mut ptr);
+                if test_delete.is_err() {
+                    reset = true;
+                    break;
+                }
             } else {  // unknown command
                 reset = true;
                 break;
@@ -11,6 +11,8 @@ mod snapshot_reader;
 mod lsm_backend;
 mod indexeddb_backend;
 mod lsm_file_log;
+#[cfg(not(target_arch = "wasm32"))]
+mod segment_reader;
 
 #[cfg(not(target_arch = "wasm32"))]
 pub(crate) use lsm_file_backend::LsmFileBackend;
@@ -19,7 +21,7 @@ pub(crate) use lsm_file_backend::LsmFileBackend;
 pub(crate) use lsm_file_log::LsmFileLog;
 
 pub(crate) use lsm_log::LsmLog;
-pub(crate) use lsm_backend::LsmBackend;
+pub(crate) use lsm_backend::{LsmBackend, lsm_backend_utils};
 pub use indexeddb_backend::{IndexeddbBackend, IndexeddbLog};
 
 #[allow(unused)]
@@ -0,0 +1,157 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+use std::fs::File;
+use std::sync::{Arc, RwLock};
+use byteorder::ReadBytesExt;
+use memmap2::Mmap;
+use crate::{Error, Result};
+use crate::lsm::block_compression;
+use crate::lsm::block_compression::BLOCK_HEADER_SIZE;
+use crate::lsm::lsm_segment::LsmTuplePtr;
+use crate::utils::vli;
+use super::format;
+
+#[cfg(unix)]
+fn read_exact_at(file: &File, buf: &mut [u8], offset: u64) -> std::io::Result<()> {
+    use std::os::unix::fs::FileExt;
+    file.read_exact_at(buf, offset)
+}
+
+#[cfg(windows)]
+fn read_exact_at(file: &File, mut buf: &mut [u8], mut offset: u64) -> std::io::Result<()> {
+    use std::os::windows::fs::FileExt;
+    while !buf.is_empty() {
+        let n = file.seek_read(buf, offset)?;
+        if n == 0 {
+            return Err(std::io::ErrorKind::UnexpectedEof.into());
+        }
+        buf = &mut buf[n..];
+        offset += n as u64;
+    }
+    Ok(())
+}
+
+/// Read the values of the segments without
+/// the lock of the backend.
+///
+/// The file is mapped in the memory and remapped when it grows.
+/// If the mmap is disabled, the values are read by positional reads
+/// on a cloned file handle, so the readers never share the
+/// position of file.
+pub(crate) struct SegmentReader {
+    file:      File,
+    page_size: u32,
+    use_mmap:  bool,
+    mmap:      RwLock<Option<Arc<Mmap>>>,
+}
+
+impl SegmentReader {
+
+    pub fn new(file: File, page_size: u32, use_mmap: bool) -> SegmentReader {
+        SegmentReader {
+            file,
+            page_size,
+            use_mmap,
+            mmap: RwLock::new(None),
+        }
+    }
+
+    pub fn read_segment_by_ptr(&self, tuple: LsmTuplePtr) -> Result<Arc<[u8]>> {
+        let offset = (tuple.pid as u64) * (self.page_size as u64) + (tuple.offset as u64);
+
+        let block_offset = match tuple.block_offset {
+            Some(block_offset) => block_offset as usize,
+            None => return self.read_range(offset, tuple.byte_size, SegmentReader::decode_value),
+        };
+
+        // the whole block is decoded to read a tuple of a compressed block
+        let block_len = self.read_range(offset, BLOCK_HEADER_SIZE as u64, block_compression::encoded_block_len)?;
+        self.read_range(offset, block_len as u64, |block| {
+            let raw = block_compression::decode_block(block)?;
+            let end = block_offset + (tuple.byte_size as usize);
+            if end > raw.len() {
+                return Err(Error::data_malformed());
+            }
+            SegmentReader::decode_value(&raw[block_offset..end])
+        })
+    }
+
+    /// Pass the bytes from `offset` of the file to `f`,
+    /// they are borrowed from the mapping if possible.
+    fn read_range<T, F>(&self, offset: u64, len: u64, f: F) -> Result<T>
+    where
+        F: FnOnce(&[u8]) -> Result<T>,
+    {
+        let end = offset + len;
+
+        if self.use_mmap {
+            if let Some(mmap) = self.mapped_range(end)? {
+                return f(&mmap[(offset as usize)..(end as usize)]);
+            }
+        }
+
+        let mut buffer = vec![0u8; len as usize];
+        read_exact_at(&self.file, &mut buffer, offset)?;
+        f(&buffer)
+    }
+
+    /// Drop the mapping, it will be mapped again on the next read.
+    pub fn invalidate(&self) -> Result<()> {
+        let mut mmap = self.mmap.write()?;
+        *mmap = None;
+        Ok(())
+    }
+
+    /// Return the mapping covering `end`, remap if the file has grown.
+    fn mapped_range(&self, end: u64) -> Result<Option<Arc<Mmap>>> {
+        {
+            let mmap = self.mmap.read()?;
+            if let Some(mmap) = mmap.as_ref() {
+                if (mmap.len() as u64) >= end {
+                    return Ok(Some(mmap.clone()));
+                }
+            }
+        }
+
+        let mut mmap = self.mmap.write()?;
+        // another reader may have remapped
+        if let Some(current) = mmap.as_ref() {
+            if (current.len() as u64) >= end {
+                return Ok(Some(current.clone()));
+            }
+        }
+
+        let new_map = Arc::new(unsafe {
+            Mmap::map(&self.file)?
+        });
+        *mmap = Some(new_map.clone());
+
+        if (new_map.len() as u64) < end {
+            return Ok(None);
+        }
+
+        Ok(Some(new_map))
+    }
+
+    fn decode_value(mut slice: &[u8]) -> Result<Arc<[u8]>> {
+        let flag = slice.read_u8()?;
+        assert!(flag == format::LSM_INSERT || flag == format::LSM_POINT_DELETE);
+
+        let key_len = vli::decode_u64(&mut slice)? as usize;
+        if key_len > slice.len() {
+            return Err(Error::data_malformed());
+        }
+        slice = &slice[key_len..];
+
+        let value_len = vli::decode_u64(&mut slice)? as usize;
+        if value_len > slice.len() {
+            return Err(Error::data_malformed());
+        }
+
+        Ok(slice[0..value_len].into())
+    }
+
+}
@@ -4,13 +4,15 @@
  * file, You can obtain one at https://mozilla.org/MPL/2.0/.
  */
 
+use std::fs::File;
 use std::io::Read;
 use std::sync::Arc;
 use byteorder::ReadBytesExt;
 use memmap2::Mmap;
 use smallvec::{SmallVec, smallvec};
 use crate::{Error, Result};
-use crate::lsm::lsm_segment::{ImLsmSegment, LsmTuplePtr};
+use crate::lsm::block_index::BlockIndex;
+use crate::lsm::lsm_segment::{ImLsmSegment, LsmTuplePtr, SegmentIndex};
 use crate::lsm::lsm_snapshot::lsm_meta::{
     DB_FILE_SIZE_OFFSET,
     LEVEL_COUNT_OFFSET,
@@ -25,14 +27,16 @@ use super::format;
 
 pub(crate) struct SnapshotReader<'a> {
     mmap: &'a Mmap,
+    file: &'a File,
     page_size: u32,
 }
 
 impl<'a> SnapshotReader<'a> {
 
-    pub fn new(mmap: &'a Mmap, page_size: u32) -> SnapshotReader {
+    pub fn new(mmap: &'a Mmap, file: &'a File, page_size: u32) -> SnapshotReader<'a> {
         SnapshotReader {
             mmap,
+            file,
             page_size,
         }
     }
@@ -106,14 +110,27 @@ impl<'a> SnapshotReader<'a> {
                 let tuple_len = u64::from_be_bytes(tuple_len_be);
                 ptr += 8;
 
-                // preserved
+                let mut footer_offset_be: [u8; 8] = [0; 8];
+                footer_offset_be.copy_from_slice(&meta_slice[ptr..(ptr + 8)]);
+
+                let footer_offset = u64::from_be_bytes(footer_offset_be);
                 ptr += 8;
 
-                let segment = self.read_segment(
-                    start_pid,
-                    end_pid,
-                    tuple_len,
-                )?;
+                // the segments written by the legacy version have no block index
+                let segment = if footer_offset == 0 {
+                    self.read_segment(
+                        start_pid,
+                        end_pid,
+                        tuple_len,
+                    )?
+                } else {
+                    self.read_block_index(
+                        start_pid,
+                        end_pid,
+                        tuple_len,
+                        footer_offset,
+                    )?
+                };
 
                 level_content.push(segment)
             }
@@ -158,6 +175,7 @@ impl<'a> SnapshotReader<'a> {
                             pid_ext: 0,
                             offset: offset as u32,
                             byte_size: (segment_slice.as_ptr() as usize - tuple_start_ptr) as u64,
+                            block_offset: None,
                         },
                     );
                 }
@@ -185,11 +203,20 @@ impl<'a> SnapshotReader<'a> {
             }
         }
 
-        Ok(ImLsmSegment {
-            segments,
-            start_pid,
-            end_pid,
-        })
+        Ok(ImLsmSegment::new(SegmentIndex::Tree(segments), start_pid, end_pid))
+    }
+
+    /// Only the footer and the block index are read,
+    /// the tuples are decoded on demand.
+    fn read_block_index(&self, start_pid: u64, end_pid: u64, tuple_len: u64, footer_offset: u64) -> Result<ImLsmSegment> {
+        let data = BlockIndex::map_segment(self.file, start_pid, end_pid, self.page_size)?;
+        let index = BlockIndex::read_from(data, start_pid, self.page_size, footer_offset)?;
+
+        if index.tuple_count() != tuple_len {
+            return Err(Error::data_malformed());
+        }
+
+        Ok(ImLsmSegment::new(SegmentIndex::Blocks(Arc::new(index)), start_pid, end_pid))
     }
 
     fn read_free_segments_from_page(&self, meta_slice: &[u8]) -> Result<Vec<FreeSegmentRecord>> {
@@ -8,15 +8,21 @@ use std::sync::{Arc, Mutex, Weak};
 use std::sync::atomic::{AtomicU64, Ordering};
 #[cfg(target_arch = "wasm32")]
 use wasm_bindgen::JsValue;
+use smallvec::smallvec;
 use crate::{Config, Error, Result, TransactionType};
+use crate::lsm::compaction_worker::CompactionWorker;
 use crate::lsm::kv_cursor::KvCursor;
+use crate::lsm::leveled_compaction::{self, LeveledTask};
 use crate::lsm::lsm_backend::LsmBackend;
-use crate::lsm::lsm_segment::LsmTuplePtr;
+use crate::lsm::lsm_backend::lsm_backend_utils;
+use crate::lsm::lsm_segment::{ImLsmSegment, LsmTuplePtr};
 use crate::lsm::lsm_session::LsmSession;
 use crate::lsm::LsmMetrics;
-use crate::lsm::lsm_snapshot::LsmSnapshot;
+use crate::lsm::lsm_snapshot::{FreeSegmentRecord, LsmLevel, LsmSnapshot};
 use crate::lsm::mem_table::MemTable;
 use crate::lsm::multi_cursor::{CursorRepr, MultiCursor};
+use crate::lsm::range_delete::RangeDeletes;
+use crate::lsm::value_cache::ValueCache;
 use crate::transaction::TransactionState;
 use super::lsm_backend::LsmLog;
 #[cfg(not(target_arch = "wasm32"))]
@@ -45,8 +51,8 @@ impl LsmKv {
 
 
     #[cfg(target_arch = "wasm32")]
-    pub fn open_indexeddb(init_data: JsValue) -> Result<LsmKv> {
-        let config = Arc::new(Config::default());
+    pub fn open_indexeddb(init_data: JsValue, config: Config) -> Result<LsmKv> {
+        let config = Arc::new(config);
         let inner = LsmKvInner::open_indexeddb(init_data, config)?;
         LsmKv::open_with_inner(inner)
     }
@@ -58,20 +64,23 @@ impl LsmKv {
     pub fn open_memory_with_config(config: Config) -> Result<LsmKv> {
         let metrics = LsmMetrics::new();
         let config = Arc::new(config);
-        let inner = LsmKvInner::open_with_backend(None, None, metrics, config)?;
+        let inner = LsmKvInner::open_with_backend(None, None, metrics, config, None)?;
         LsmKv::open_with_inner(inner)
     }
 
     #[inline]
     fn open_with_inner(inner: LsmKvInner) -> Result<LsmKv> {
+        let inner = Arc::new(inner);
+        if let Some(worker) = &inner.compaction_worker {
+            worker.start(Arc::downgrade(&inner))?;
+        }
         Ok(LsmKv {
-            inner: Arc::new(inner),
+            inner,
         })
     }
 
     pub fn open_cursor(&self) -> KvCursor {
-        let multi_cursor = self.inner.open_multi_cursor(None);
-        KvCursor::new(self.inner.clone(), multi_cursor)
+        self.open_cursor_with_session(None)
     }
 
     fn open_cursor_with_session(&self, session: Option<&LsmSession>) -> KvCursor {
@@ -83,6 +92,12 @@ impl LsmKv {
         self.inner.open_multi_cursor(session)
     }
 
+    /// See [`LsmKvInner::split_keys`]
+    #[inline]
+    pub(crate) fn split_keys(&self, session: &LsmSession, start: &[u8], end: &[u8], parts: usize) -> Result<Vec<Arc<[u8]>>> {
+        self.inner.split_keys(session, start, end, parts)
+    }
+
     pub fn new_session(&self) -> LsmSession {
         let db_ref = Arc::downgrade(&self.inner);
         self.inner.new_session(db_ref)
@@ -134,20 +149,13 @@ impl LsmKv {
         where
             K: AsRef<[u8]>,
     {
-        let cursor = self.open_cursor_with_session(session);
-        cursor.seek(key.as_ref())?;
-        let test_key = cursor.key()?;
-
-        match test_key {
-            Some(test_key) => {
-                if test_key.as_ref().cmp(key.as_ref()) != std::cmp::Ordering::Equal {
-                    return Ok(None);
-                }
-            }
-            None => return Ok(None),
-        };
+        let mut cursor = self.inner.open_multi_cursor(session);
+        let found = cursor.seek_exact(key.as_ref())?;
+        if !found {
+            return Ok(None);
+        }
 
-        let value = cursor.value()?;
+        let value = cursor.value(self.inner.as_ref())?;
         let result = match value {
             Some(bytes) => Some(bytes),
             None => None,
@@ -201,14 +209,44 @@ pub(crate) struct LsmKvInner {
     /// including insert/delete
     op_count: AtomicU64,
     metrics: LsmMetrics,
+    /// Only available when the background compaction is enabled
+    compaction_worker: Option<CompactionWorker>,
+    /// Only available for the file backend
+    value_cache: Option<ValueCache>,
     pub(crate) config: Arc<Config>,
+    /// Run by the worker after the merge, before it's published
+    #[cfg(test)]
+    before_publish_hook: Mutex<Option<Box<dyn FnMut() + Send>>>,
+}
+
+/// One key of every 64 keys in memory is sampled to split a range,
+/// it's about the tuples of a block on the disk.
+const SPLIT_SAMPLE_STRIDE: usize = 64;
+
+enum CompactionJob {
+    Minor,
+    Major,
 }
 
 impl LsmKvInner {
 
     pub(crate) fn read_segment_by_ptr(&self, ptr: LsmTuplePtr) -> Result<Arc<[u8]>> {
+        if let Some(cache) = &self.value_cache {
+            if let Some(value) = cache.get(&ptr) {
+                return Ok(value);
+            }
+        }
+
         let backend = self.backend.as_ref().expect("no file backend");
-        backend.read_segment_by_ptr(ptr)
+        let timer = self.metrics.start_timer();
+        let value = backend.read_segment_by_ptr(ptr)?;
+        self.metrics.record_read_segment(timer);
+
+        if let Some(cache) = &self.value_cache {
+            cache.insert(&ptr, value.clone());
+        }
+
+        Ok(value)
     }
 
     fn mk_log_path(db_path: &Path) -> PathBuf {
@@ -223,7 +261,12 @@ impl LsmKvInner {
     fn open_file(path: &Path, config: Config) -> Result<LsmKvInner> {
         let metrics = LsmMetrics::new();
         let config = Arc::new(config);
-        let backend = LsmFileBackend::open(path, metrics.clone(), config.clone())?;
+        let value_cache = if config.lsm_value_cache_size > 0 {
+            Some(ValueCache::new(config.lsm_value_cache_size, metrics.clone()))
+        } else {
+            None
+        };
+        let backend = LsmFileBackend::open(path, metrics.clone(), config.clone(), value_cache.clone())?;
         let log_file = LsmKvInner::mk_log_path(path);
         let log = LsmFileLog::open(log_file.as_path(), config.clone())?;
         LsmKvInner::open_with_backend(
@@ -231,6 +274,7 @@ impl LsmKvInner {
             Some(Box::new(log)),
             metrics,
             config,
+            value_cache,
         )
     }
 
@@ -239,16 +283,18 @@ impl LsmKvInner {
         let metrics = LsmMetrics::new();
         let backend = IndexeddbBackend::open(
             init_data.clone(),
+            config.idb_write_batching,
         )?;
 
         let session_id = backend.session_id();
 
-        let log = IndexeddbLog::new(session_id, init_data);
+        let log = IndexeddbLog::new(session_id, init_data, config.idb_write_batching);
         LsmKvInner::open_with_backend(
             Some(Box::new(backend)),
             Some(Box::new(log)),
             metrics,
             config,
+            None,
         )
     }
 
@@ -257,12 +303,17 @@ impl LsmKvInner {
         log: Option<Box<dyn LsmLog>>,
         metrics: LsmMetrics,
         config: Arc<Config>,
+        value_cache: Option<ValueCache>,
     ) -> Result<LsmKvInner> {
         let snapshot = match &backend {
             Some(backend) => backend.read_latest_snapshot()?,
             None => LsmSnapshot::new(),
         };
-        let mut mem_table = MemTable::new();
+        let mut mem_table = if config.lsm_skip_list_mem_table {
+            MemTable::new_with_skip_list()
+        } else {
+            MemTable::new()
+        };
 
         if let Some(log) = &log {
             log.update_mem_table_with_latest_log(
@@ -271,6 +322,12 @@ impl LsmKvInner {
             )?;
         }
 
+        let compaction_worker = if LsmKvInner::use_background_compaction(&backend, &config) {
+            Some(CompactionWorker::new())
+        } else {
+            None
+        };
+
         Ok(LsmKvInner {
             backend,
             log,
@@ -279,24 +336,58 @@ impl LsmKvInner {
             transaction: Mutex::new(TransactionState::NoTrans),
             op_count: AtomicU64::new(0),
             metrics,
+            compaction_worker,
+            value_cache,
             config,
+            #[cfg(test)]
+            before_publish_hook: Mutex::new(None),
         })
     }
 
+    #[cfg(not(target_arch = "wasm32"))]
+    #[inline]
+    fn use_background_compaction(backend: &Option<Box<dyn LsmBackend>>, config: &Config) -> bool {
+        backend.is_some() && config.background_compaction
+    }
+
+    /// There is no thread on wasm32
+    #[cfg(target_arch = "wasm32")]
+    #[inline]
+    fn use_background_compaction(_backend: &Option<Box<dyn LsmBackend>>, _config: &Config) -> bool {
+        false
+    }
+
+    #[cfg(not(target_arch = "wasm32"))]
+    #[inline]
+    fn use_leveled_compaction(&self) -> bool {
+        self.config.lsm_leveled_compaction
+    }
+
+    /// The segments of IndexedDB are addressed by ObjectId,
+    /// they are always merged as a whole level.
+    #[cfg(target_arch = "wasm32")]
+    #[inline]
+    fn use_leveled_compaction(&self) -> bool {
+        false
+    }
+
+    fn needs_compaction(&self, snapshot: &LsmSnapshot) -> bool {
+        if self.use_leveled_compaction() {
+            leveled_compaction::needs_compaction(snapshot, &self.config)
+        } else {
+            LsmKvInner::should_minor_compact(snapshot) || LsmKvInner::should_major_compact(snapshot)
+        }
+    }
+
     #[inline]
     fn metrics(&self) -> LsmMetrics {
         self.metrics.clone()
     }
 
     fn open_multi_cursor(&self, session: Option<&LsmSession>) -> MultiCursor {
-        let mem_table_cursor = match session {
-            Some(session) => {
-                session.mem_table.open_cursor()
-            }
-            None => {
-                let mem_table = self.main_mem_table.lock().unwrap();
-                mem_table.open_cursor()
-            }
+        let mem_table = match session {
+            Some(session) => session.mem_table.clone(),
+            None => self.main_mem_table.lock().unwrap().clone(),
         };
 
         let snapshot_ref = match session {
@@ -305,27 +396,84 @@ impl LsmKvInner {
         };
         let snapshot = snapshot_ref.lock().unwrap();
 
+        // the writes not committed must be the first one,
+        // the cursor updates them in place
         let mut cursors: Vec<CursorRepr> = vec![
-            mem_table_cursor.into(),
+            mem_table.open_cursor().into(),
         ];
+        let mut range_deletes: Vec<RangeDeletes> = vec![
+            mem_table.range_deletes().clone(),
+        ];
+
+        if let Some(skip_list_cursor) = mem_table.open_skip_list_cursor() {
+            cursors.push(skip_list_cursor.into());
+            range_deletes.push(mem_table.skip_list_range_deletes().clone());
+        }
 
         if !snapshot.levels.is_empty() {
             // push all cursor on level 0
             let level0 = &snapshot.levels[0];
 
             for item in level0.content.iter().rev() {
-                let cursor = item.segments.open_cursor();
-                cursors.push(cursor.into());
+                cursors.push(item.open_cursor());
+                range_deletes.push(item.range_deletes().clone());
             }
 
             for level in &snapshot.levels[1..] {
-                assert_eq!(level.content.len(), 1);
-                let cursor = level.content[0].segments.open_cursor();
-                cursors.push(cursor.into());
+                cursors.push(level.open_cursor());
+                range_deletes.push(level.range_deletes());
             }
         }
 
-        MultiCursor::new(cursors)
+        let mut result = MultiCursor::new(cursors);
+        result.set_range_deletes(range_deletes);
+        result.set_metrics(self.metrics.clone());
+        result
+    }
+
+    /// Pick the keys splitting [start, end) of the view of the session
+    /// into `parts` ranges of about the same count of the keys.
+    ///
+    /// The keys are estimated by the first keys of the blocks and
+    /// the keys sampled from the trees in memory, so nothing is read
+    /// from the disk. Less keys are given if the range is too small.
+    pub(crate) fn split_keys(&self, session: &LsmSession, start: &[u8], end: &[u8], parts: usize) -> Result<Vec<Arc<[u8]>>> {
+        let mut samples: Vec<(Arc<[u8]>, u64)> = Vec::new();
+        session.mem_table.sample_keys(start, end, SPLIT_SAMPLE_STRIDE, &mut samples);
+        {
+            let snapshot = session.snapshot.lock()?;
+            for level in &snapshot.levels {
+                for segment in &level.content {
+                    segment.sample_keys(start, end, SPLIT_SAMPLE_STRIDE, &mut samples);
+                }
+            }
+        }
+
+        samples.sort_by(|(a, _), (b, _)| a.cmp(b));
+
+        let total: u64 = samples.iter().map(|(_, weight)| *weight).sum();
+        if parts < 2 || total == 0 {
+            return Ok(vec![]);
+        }
+
+        let mut result: Vec<Arc<[u8]>> = Vec::with_capacity(parts - 1);
+        let mut passed = 0u64;
+        let mut part = 1u64;
+        for (key, weight) in samples {
+            // the first key is never a split key, the first range is not empty
+            if passed >= total * part / (parts as u64) && passed > 0 {
+                if result.last().map(|last| last.as_ref() != key.as_ref()).unwrap_or(true) {
+                    result.push(key);
+                }
+                part += 1;
+                if part >= parts as u64 {
+                    break;
+                }
+            }
+            passed += weight;
+        }
+
+        Ok(result)
     }
 
     fn indeed_start_transaction(&self, state: TransactionState) -> Result<()> {
@@ -350,11 +498,12 @@ impl LsmKvInner {
 
     fn new_session(&self, engine: Weak<LsmKvInner>) -> LsmSession {
         let id = (self.op_count.load(Ordering::SeqCst) + 1) as u64;
-        let mem_table = {
+        // the snapshot is taken under the lock of mem table,
+        // the worker publishes the compactions under it
+        let (mem_table, snapshot) = {
             let m = self.main_mem_table.lock().unwrap();
-            m.clone()
+            (m.clone(), self.current_snapshot_ref())
         };
-        let snapshot = self.current_snapshot_ref();
         LsmSession::new(
             engine,
             id,
@@ -391,19 +540,42 @@ impl LsmKvInner {
             return Ok(())
         }
 
+        let commit_timer = self.metrics.start_timer();
+
+        // fail the commit before it's applied if the worker failed
+        if let Some(worker) = &self.compaction_worker {
+            worker.take_error()?;
+        }
+
+        self.stall_if_level0_full()?;
+
+        // The check of the session, the append of the log and
+        // the apply of the mem table are ordered by the lock,
+        // only the sync of the log is grouped after it.
+        let mut mem_table_col = self.main_mem_table.lock()?;
+
         if session.id() != self.op_count.load(Ordering::SeqCst) + 1 {
             return Err(Error::SessionOutdated);
         }
 
+        // the bulk load skips the log, it's checked here too
         if let Some(log) = &self.log {
+            log.check_poisoned()?;
+        }
+
+        // the bulk load is durable once the segment is written
+        let mut log_commit = None;
+        let mut sync_error = None;
+        if let Some(log) = self.log.as_ref().filter(|_| !session.is_bulk_load()) {
+            let timer = self.metrics.start_timer();
             log.start_transaction()?;
-            let _commit_result = log.commit(session.log_buffer())?;
-            // let mut snapshot = self.snapshot.lock()?;
-            // snapshot.log_offset = commit_result.offset;
+            let ticket = log.append_commit(session.log_buffer())?;
+            log_commit = Some((log, ticket, timer));
+            self.metrics.add_log_write_bytes(session.log_buffer().map_or(0, |buffer| buffer.len()));
         }
 
-        let mut mem_table_col = self.main_mem_table.lock()?;
-        *mem_table_col = session.mem_table.clone();
+        mem_table_col.commit(&session.mem_table);
+        session.mem_table = mem_table_col.clone();
 
         if let Some(backend) = &self.backend {
             let current_snapshot = self.current_snapshot_ref();
@@ -425,53 +597,590 @@ impl LsmKvInner {
             };
             let mut snapshot = snapshot_ref.lock()?;
 
+            // A sync of the group may fail after the commit is appended,
+            // the mem table is not written to a segment then.
+            let log_poisoned = self.log.as_ref().and_then(|log| log.check_poisoned().err());
             let store_bytes = mem_table_col.store_bytes();
-            if self.should_sync(store_bytes) {
+            if let Some(err) = log_poisoned {
+                // the logged commit fails by `wait_durable`
+                if session.is_bulk_load() {
+                    sync_error = Some(err);
+                }
+            } else if session.is_bulk_load() || self.should_sync(store_bytes) {
+                let timer = self.metrics.start_timer();
                 backend.sync_latest_segment(
                     &mem_table_col,
                     &mut snapshot,
                 )?;
+                self.metrics.record_sync(timer);
 
-                if let Some(log) = &self.log {
-                    log.shrink(&mut snapshot)?;
-                }
-
-                backend.checkpoint_snapshot(&mut snapshot)?;
+                self.checkpoint_and_shrink_log(backend.as_ref(), &mut snapshot)?;
 
                 mem_table_col.clear();
 
                 self.metrics.add_sync_count();
+                self.add_flush_bytes(&snapshot);
+            } else if self.compaction_worker.is_some() {
+                // leave the compaction to the worker
+            } else if self.use_leveled_compaction() {
+                self.leveled_compact(backend.as_ref(), &mut snapshot, db_weak_count)?;
             } else if LsmKvInner::should_minor_compact(&snapshot) {
                 self.minor_compact(backend.as_ref(), &mut snapshot, db_weak_count)?;
             } else if LsmKvInner::should_major_compact(&snapshot) {
                 self.major_compact(backend.as_ref(), &mut snapshot, db_weak_count)?;
             }
+
+            if let Some(worker) = &self.compaction_worker {
+                if self.needs_compaction(&snapshot) {
+                    worker.schedule();
+                }
+            }
+        }
+
+        if session.is_bulk_load() {
+            self.metrics.add_bulk_load_count();
         }
 
         self.op_count.store(session.id(), Ordering::SeqCst);
+        drop(mem_table_col);
+
+        if let Some(err) = sync_error {
+            session.rollback_failed_commit();
+            return Err(err);
+        }
+
+        // The commit is visible before it's durable. If the sync fails,
+        // the log is poisoned: this commit and every later one fail,
+        // so no commit is acknowledged after a lost one.
+        // The failed commit is dropped from the log and never written
+        // to a segment, the session is rolled back to the data
+        // before the transaction.
+        if let Some((log, ticket, timer)) = log_commit {
+            if let Some(ticket) = ticket {
+                match log.wait_durable(ticket) {
+                    Ok(true) => self.metrics.add_log_sync_count(),
+                    Ok(false) => (),
+                    Err(err) => {
+                        session.rollback_failed_commit();
+                        return Err(err);
+                    }
+                }
+            }
+            self.metrics.record_log_flush(timer);
+        }
+
         session.finished_transaction();
+        self.metrics.record_commit(commit_timer);
 
         Ok(())
     }
 
     fn minor_compact(&self, backend: &dyn LsmBackend, snapshot: &mut LsmSnapshot, db_weak_count: usize) -> Result<()> {
+        let timer = self.metrics.start_timer();
+        let read_bytes = self.tiered_read_bytes(&CompactionJob::Minor, snapshot);
+
         backend.minor_compact(snapshot, db_weak_count)?;
         backend.checkpoint_snapshot(snapshot)?;
 
         self.metrics.add_minor_compact();
+        self.metrics.record_minor_compact(timer);
+        self.add_compaction_bytes(read_bytes, &snapshot.levels[1].content);
 
         Ok(())
     }
 
     fn major_compact(&self, backend: &dyn LsmBackend, snapshot: &mut LsmSnapshot, db_weak_count: usize) -> Result<()> {
+        let timer = self.metrics.start_timer();
+        let read_bytes = self.tiered_read_bytes(&CompactionJob::Major, snapshot);
+
         backend.major_compact(snapshot, db_weak_count)?;
         backend.checkpoint_snapshot(snapshot)?;
 
         self.metrics.add_major_compact();
+        self.metrics.record_major_compact(timer);
+        self.add_compaction_bytes(read_bytes, &snapshot.levels.last().unwrap().content);
+
+        Ok(())
+    }
+
+    /// The bytes of the segments merged by the job of the tiered compaction
+    fn tiered_read_bytes(&self, job: &CompactionJob, snapshot: &LsmSnapshot) -> u64 {
+        let page_size = self.config.lsm_page_size;
+        match job {
+            CompactionJob::Minor => {
+                let level0 = &snapshot.levels[0];
+                level0.content[0..(level0.content.len() - 1)]
+                    .iter()
+                    .map(|segment| segment.byte_size(page_size))
+                    .sum()
+            }
+            CompactionJob::Major => {
+                let level_len = snapshot.levels.len();
+                snapshot.levels[(level_len - 2)..]
+                    .iter()
+                    .map(|level| level.byte_size(page_size))
+                    .sum()
+            }
+        }
+    }
+
+    fn add_compaction_bytes(&self, read_bytes: u64, written: &[ImLsmSegment]) {
+        let page_size = self.config.lsm_page_size;
+        let write_bytes: u64 = written.iter().map(|segment| segment.byte_size(page_size)).sum();
+        self.metrics.add_compaction_read_bytes(read_bytes as usize);
+        self.metrics.add_compaction_write_bytes(write_bytes as usize);
+    }
+
+    /// Count the segment just synced on the top of level 0
+    fn add_flush_bytes(&self, snapshot: &LsmSnapshot) {
+        if let Some(segment) = snapshot.levels.first().and_then(|level0| level0.content.last()) {
+            self.metrics.add_flush_bytes(segment.byte_size(self.config.lsm_page_size) as usize);
+        }
+    }
+
+    /// Run one task of the leveled compaction on the committing thread.
+    fn leveled_compact(&self, backend: &dyn LsmBackend, snapshot: &mut LsmSnapshot, db_weak_count: usize) -> Result<()> {
+        let task = match LeveledTask::pick(snapshot, &self.config)? {
+            Some(task) => task,
+            None => return Ok(()),
+        };
+        let timer = self.metrics.start_timer();
+
+        let outputs = if task.is_trivial_move() {
+            vec![task.moved_segment(snapshot)]
+        } else {
+            let bloom_bits_per_key = self.config.lsm_bloom_bits_per_key;
+            let cursor = task.open_cursor(snapshot);
+            let merge_result = lsm_backend_utils::merge_level(cursor, !task.bottom, bloom_bits_per_key)?;
+            let runs = lsm_backend_utils::split_merged_tuples(
+                &merge_result.tuples,
+                task.target_size(&self.config),
+                bloom_bits_per_key,
+            );
+
+            let mut outputs = Vec::with_capacity(runs.len());
+            for (run, estimate_size) in runs {
+                let segment = backend.write_merged_tuples(snapshot, &run, estimate_size, task.level + 1)?;
+                outputs.push(segment);
+            }
+            outputs
+        };
+
+        self.publish_leveled_task(&task, snapshot, outputs);
+
+        // indicates that there is only one session
+        if db_weak_count == 1 {
+            snapshot.flush_pending_segments();
+            snapshot.normalize_free_segments();
+        }
+
+        self.metrics.set_free_segments_count(snapshot.free_segments.len());
+
+        backend.checkpoint_snapshot(snapshot)?;
+
+        self.metrics.record_leveled_compact(timer);
+
+        Ok(())
+    }
+
+    /// Put the outputs of the task on the snapshot and free the merged segments.
+    fn publish_leveled_task(&self, task: &LeveledTask, snapshot: &mut LsmSnapshot, outputs: Vec<ImLsmSegment>) {
+        if task.is_trivial_move() {
+            self.metrics.add_trivial_move();
+        } else {
+            let read_bytes = task.input_bytes(snapshot, self.config.lsm_page_size);
+            self.add_compaction_bytes(read_bytes, &outputs);
+
+            if task.level == 0 {
+                self.metrics.add_minor_compact();
+            } else {
+                self.metrics.add_major_compact();
+            }
+        }
+
+        let removed = task.apply(snapshot, outputs);
+        for segment in &removed {
+            self.invalidate_cached_pages(segment.start_pid, segment.end_pid);
+            snapshot.pending_free_segments.push(FreeSegmentRecord {
+                start_pid: segment.start_pid,
+                end_pid: segment.end_pid,
+            });
+        }
+    }
+
+    /// Block the writer until the compaction worker merges level 0
+    /// if there are too many segments on it.
+    fn stall_if_level0_full(&self) -> Result<()> {
+        let worker = match &self.compaction_worker {
+            Some(worker) => worker,
+            None => return Ok(()),
+        };
+
+        let limit = self.config.level0_stall_limit;
+        let mut stalled = false;
+
+        loop {
+            let level0_len = {
+                let snapshot_ref = self.current_snapshot_ref();
+                let snapshot = snapshot_ref.lock()?;
+                if !LsmKvInner::should_minor_compact(&snapshot) {
+                    return Ok(());
+                }
+                snapshot.levels[0].content.len()
+            };
+
+            if level0_len <= limit {
+                return Ok(());
+            }
+
+            if !stalled {
+                self.metrics.add_write_stall_count();
+                stalled = true;
+            }
+
+            worker.wait_for_round()?;
+        }
+    }
+
+    /// Run one job of compaction on the worker thread.
+    /// Return false if there is nothing to compact.
+    ///
+    /// The snapshot is only locked to take a copy, reserve the pages
+    /// and publish the result. The tuples are merged and written without
+    /// holding it, so the writers keep committing meanwhile.
+    ///
+    /// Only the worker changes the levels, the committing thread
+    /// only appends segments at the end of level 0.
+    pub(crate) fn background_compact(self: &Arc<Self>) -> Result<bool> {
+        let backend = match &self.backend {
+            Some(backend) => backend,
+            None => return Ok(false),
+        };
+
+        if self.use_leveled_compaction() {
+            return self.background_leveled_compact(backend.as_ref());
+        }
+
+        let (job, base) = {
+            let snapshot_ref = self.current_snapshot_ref();
+            let snapshot = snapshot_ref.lock()?;
+            let job = if LsmKvInner::should_minor_compact(&snapshot) {
+                CompactionJob::Minor
+            } else if LsmKvInner::should_major_compact(&snapshot) {
+                CompactionJob::Major
+            } else {
+                return Ok(false);
+            };
+            (job, snapshot.clone())
+        };
+        let timer = self.metrics.start_timer();
+
+        // the level the new segment is put on
+        let level = match job {
+            CompactionJob::Minor => 1,
+            CompactionJob::Major => base.levels.len() - 2,
+        };
+
+        let merge_result = match job {
+            CompactionJob::Minor => {
+                let preserve_delete = base.levels.len() > 1;
+                let cursor = lsm_backend_utils::level0_except_last_cursor(&base);
+                lsm_backend_utils::merge_level(cursor, preserve_delete, self.config.lsm_bloom_bits_per_key)?
+            }
+            CompactionJob::Major => {
+                let cursor = lsm_backend_utils::last_two_levels_cursor(&base);
+                lsm_backend_utils::merge_level(cursor, false, self.config.lsm_bloom_bits_per_key)?
+            }
+        };
+
+        // reserve the pages at the end of file,
+        // the writer pads the last page
+        let page_size = self.config.lsm_page_size as u64;
+        let reserved_pages = (merge_result.estimate_size as u64) / page_size + 1;
+        let start_pid = {
+            let _mem_table = self.main_mem_table.lock()?;
+            let snapshot_ref = self.current_snapshot_ref();
+            let mut snapshot = snapshot_ref.lock()?;
+            let start_pid = snapshot.file_size / page_size;
+            snapshot.file_size += reserved_pages * page_size;
+            start_pid
+        };
+
+        let reserved_end_pid = start_pid + reserved_pages - 1;
+        let new_segment = match backend.write_merged_segment(&merge_result.tuples, start_pid, level) {
+            Ok(segment) => segment,
+            Err(err) => {
+                // the error of the write is the one to report
+                let _ = self.release_reserved_pages(start_pid, reserved_end_pid);
+                return Err(err);
+            }
+        };
+
+        #[cfg(test)]
+        self.run_before_publish_hook();
+
+        // no commit is running while holding the lock of mem table
+        let _mem_table = self.main_mem_table.lock()?;
+        // A session opened while merging may read the merged segments,
+        // so the sessions are counted now. The new ones take the snapshot
+        // under the lock, they get the published one.
+        let db_weak_count = Arc::weak_count(self);
+        let snapshot_ref = self.snapshot_ref_to_publish()?;
+        let mut snapshot_guard = snapshot_ref.lock()?;
+        let snapshot: &mut LsmSnapshot = &mut snapshot_guard;
+
+        if new_segment.end_pid < reserved_end_pid {
+            self.invalidate_cached_pages(new_segment.end_pid + 1, reserved_end_pid);
+            snapshot.free_segments.push(FreeSegmentRecord {
+                start_pid: new_segment.end_pid + 1,
+                end_pid: reserved_end_pid,
+            });
+        }
+
+        match job {
+            CompactionJob::Minor => {
+                let merged_count = base.levels[0].content.len() - 1;
+                let level0 = &mut snapshot.levels[0];
+                let merged: Vec<_> = level0.content.drain(0..merged_count).collect();
+                level0.age += 1;
+
+                for segment in &merged {
+                    self.invalidate_cached_pages(segment.start_pid, segment.end_pid);
+                    snapshot.pending_free_segments.push(FreeSegmentRecord {
+                        start_pid: segment.start_pid,
+                        end_pid: segment.end_pid,
+                    });
+                }
+
+                lsm_backend_utils::insert_new_segment_to_right_level(new_segment.clone(), snapshot);
+
+                self.metrics.add_minor_compact();
+            }
+            CompactionJob::Major => {
+                let level_len = snapshot.levels.len();
+                for level in &snapshot.levels[(level_len - 2)..] {
+                    for segment in &level.content {
+                        self.invalidate_cached_pages(segment.start_pid, segment.end_pid);
+                        snapshot.pending_free_segments.push(FreeSegmentRecord {
+                            start_pid: segment.start_pid,
+                            end_pid: segment.end_pid,
+                        });
+                    }
+                }
+
+                snapshot.levels.remove(level_len - 1);
+                snapshot.levels[level_len - 2] = LsmLevel {
+                    age: 0,
+                    content: smallvec![new_segment.clone()],
+                };
+
+                self.metrics.add_major_compact();
+            }
+        }
+
+        let read_bytes = self.tiered_read_bytes(&job, &base);
+        self.add_compaction_bytes(read_bytes, &[new_segment]);
+
+        // indicates that there is no session except the worker
+        if db_weak_count == 1 {
+            snapshot.flush_pending_segments();
+            snapshot.normalize_free_segments();
+        }
+
+        self.metrics.set_free_segments_count(snapshot.free_segments.len());
+
+        backend.checkpoint_snapshot(snapshot)?;
+
+        match job {
+            CompactionJob::Minor => self.metrics.record_minor_compact(timer),
+            CompactionJob::Major => self.metrics.record_major_compact(timer),
+        }
+
+        Ok(true)
+    }
+
+    #[cfg(test)]
+    fn run_before_publish_hook(&self) {
+        let mut hook = self.before_publish_hook.lock().unwrap();
+        if let Some(hook) = hook.as_mut() {
+            hook();
+        }
+    }
+
+    /// Checkpoint the snapshot after the mem table is written
+    /// to a segment, then cut the log.
+    ///
+    /// The commits of the group mode are synced, so the segment
+    /// and the meta page are synced before the log is cut,
+    /// including the ones of a bulk load, which skip the log.
+    fn checkpoint_and_shrink_log(&self, backend: &dyn LsmBackend, snapshot: &mut LsmSnapshot) -> Result<()> {
+        backend.checkpoint_snapshot(snapshot)?;
+
+        if let Some(log) = &self.log {
+            if self.config.log_group_commit {
+                backend.sync_data()?;
+            }
+            log.shrink(snapshot)?;
+        }
+
+        Ok(())
+    }
+
+    /// Give back the pages reserved by a failed compaction,
+    /// no segment published refers to them.
+    fn release_reserved_pages(&self, start_pid: u64, end_pid: u64) -> Result<()> {
+        let _mem_table = self.main_mem_table.lock()?;
+        let snapshot_ref = self.current_snapshot_ref();
+        let mut snapshot = snapshot_ref.lock()?;
+
+        self.invalidate_cached_pages(start_pid, end_pid);
+        snapshot.free_segments.push(FreeSegmentRecord {
+            start_pid,
+            end_pid,
+        });
+
+        self.metrics.set_free_segments_count(snapshot.free_segments.len());
 
         Ok(())
     }
 
+    /// The worker and the readers share the snapshot,
+    /// copy it before changing if anyone else holds it.
+    fn snapshot_ref_to_publish(&self) -> Result<Arc<Mutex<LsmSnapshot>>> {
+        let current_snapshot = self.current_snapshot_ref();
+        if Arc::strong_count(&current_snapshot) == 2 {
+            return Ok(current_snapshot);
+        }
+
+        let cloned = {
+            let origin = current_snapshot.lock()?;
+            origin.clone()
+        };
+        let snapshot_ref = Arc::new(Mutex::new(cloned));
+        self.set_current_snapshot_ref(snapshot_ref.clone());
+
+        self.metrics.add_clone_snapshot_count();
+
+        Ok(snapshot_ref)
+    }
+
+    /// The leveled version of `background_compact`.
+    ///
+    /// The task may write many segments, the pages of all of them
+    /// are reserved at once.
+    fn background_leveled_compact(self: &Arc<Self>, backend: &dyn LsmBackend) -> Result<bool> {
+        let (task, base) = {
+            let snapshot_ref = self.current_snapshot_ref();
+            let snapshot = snapshot_ref.lock()?;
+            let task = match LeveledTask::pick(&snapshot, &self.config)? {
+                Some(task) => task,
+                None => return Ok(false),
+            };
+            (task, snapshot.clone())
+        };
+        let timer = self.metrics.start_timer();
+
+        let mut written: Vec<(ImLsmSegment, u64)> = vec![];
+
+        if !task.is_trivial_move() {
+            let bloom_bits_per_key = self.config.lsm_bloom_bits_per_key;
+            let cursor = task.open_cursor(&base);
+            let merge_result = lsm_backend_utils::merge_level(cursor, !task.bottom, bloom_bits_per_key)?;
+            let runs = lsm_backend_utils::split_merged_tuples(
+                &merge_result.tuples,
+                task.target_size(&self.config),
+                bloom_bits_per_key,
+            );
+
+            // the writer pads the last page of every segment
+            let page_size = self.config.lsm_page_size as u64;
+            let reserved_pages: Vec<u64> = runs
+                .iter()
+                .map(|(_, estimate_size)| (*estimate_size as u64) / page_size + 1)
+                .collect();
+            let total_pages: u64 = reserved_pages.iter().sum();
+            let mut start_pid = {
+                let _mem_table = self.main_mem_table.lock()?;
+                let snapshot_ref = self.current_snapshot_ref();
+                let mut snapshot = snapshot_ref.lock()?;
+                let start_pid = snapshot.file_size / page_size;
+                snapshot.file_size += total_pages * page_size;
+                start_pid
+            };
+
+            let reserved_start_pid = start_pid;
+
+            for ((run, _), pages) in runs.into_iter().zip(reserved_pages) {
+                let segment = match backend.write_merged_segment(&run, start_pid, task.level + 1) {
+                    Ok(segment) => segment,
+                    Err(err) => {
+                        // the segments written are not published yet,
+                        // all the pages are released
+                        let reserved_end_pid = reserved_start_pid + total_pages - 1;
+                        let _ = self.release_reserved_pages(reserved_start_pid, reserved_end_pid);
+                        return Err(err);
+                    }
+                };
+                start_pid += pages;
+                written.push((segment, start_pid - 1));
+            }
+        }
+
+        #[cfg(test)]
+        self.run_before_publish_hook();
+
+        // no commit is running while holding the lock of mem table
+        let _mem_table = self.main_mem_table.lock()?;
+        // A session opened while merging may read the merged segments,
+        // so the sessions are counted now. The new ones take the snapshot
+        // under the lock, they get the published one.
+        let db_weak_count = Arc::weak_count(self);
+        let snapshot_ref = self.snapshot_ref_to_publish()?;
+        let mut snapshot_guard = snapshot_ref.lock()?;
+        let snapshot: &mut LsmSnapshot = &mut snapshot_guard;
+
+        let outputs = if task.is_trivial_move() {
+            vec![task.moved_segment(snapshot)]
+        } else {
+            written
+                .into_iter()
+                .map(|(segment, reserved_end_pid)| {
+                    if segment.end_pid < reserved_end_pid {
+                        self.invalidate_cached_pages(segment.end_pid + 1, reserved_end_pid);
+                        snapshot.free_segments.push(FreeSegmentRecord {
+                            start_pid: segment.end_pid + 1,
+                            end_pid: reserved_end_pid,
+                        });
+                    }
+                    segment
+                })
+                .collect()
+        };
+
+        self.publish_leveled_task(&task, snapshot, outputs);
+
+        // indicates that there is no session except the worker
+        if db_weak_count == 1 {
+            snapshot.flush_pending_segments();
+            snapshot.normalize_free_segments();
+        }
+
+        self.metrics.set_free_segments_count(snapshot.free_segments.len());
+
+        backend.checkpoint_snapshot(snapshot)?;
+
+        self.metrics.record_leveled_compact(timer);
+
+        Ok(true)
+    }
+
+    #[inline]
+    fn invalidate_cached_pages(&self, start_pid: u64, end_pid: u64) {
+        if let Some(cache) = &self.value_cache {
+            cache.invalidate_pages(start_pid, end_pid);
+        }
+    }
+
     #[inline]
     fn should_sync(&self, store_bytes: usize) -> bool {
         let sync_loc_count = self.config.sync_log_count;
@@ -509,6 +1218,11 @@ impl LsmKvInner {
     // }
     //
     fn force_sync_last_segment(&mut self) -> Result<()> {
+        // the mem table may have the commits failed by the sync
+        if let Some(log) = &self.log {
+            log.check_poisoned()?;
+        }
+
         if let Some(backend) = &self.backend {
             let mem_table = self.main_mem_table.lock().unwrap();
             let snapshot_ref = self.current_snapshot_ref();
@@ -524,12 +1238,9 @@ impl LsmKvInner {
                 &mem_table,
                 &mut snapshot,
             )?;
+            self.add_flush_bytes(&snapshot);
 
-            if let Some(log) = &self.log {
-                log.shrink(&mut snapshot)?;
-            }
-
-            backend.checkpoint_snapshot(&mut snapshot)?;
+            self.checkpoint_and_shrink_log(backend.as_ref(), &mut snapshot)?;
         }
 
         Ok(())
@@ -540,6 +1251,10 @@ impl LsmKvInner {
 impl Drop for LsmKvInner {
 
     fn drop(&mut self) {
+        if let Some(worker) = &self.compaction_worker {
+            worker.stop();
+        }
+
         let sync_result = self.force_sync_last_segment();
         if sync_result.is_ok() {
             if let Some(log) = &self.log {
@@ -552,3 +1267,112 @@ impl Drop for LsmKvInner {
     }
 
 }
+
+#[cfg(all(test, not(target_arch = "wasm32")))]
+mod tests {
+    use std::path::PathBuf;
+    use std::sync::{Arc, Mutex};
+    use crate::ConfigBuilder;
+    use crate::lsm::LsmKv;
+    use crate::lsm::lsm_session::LsmSession;
+    use crate::test_utils::mk_db_path;
+
+    fn clean_path(path: &PathBuf) {
+        let str_wal = path.to_str().unwrap().to_string() + ".wal";
+        let _ = std::fs::remove_file(path);
+        let _ = std::fs::remove_file(PathBuf::from(str_wal));
+    }
+
+    #[test]
+    fn test_session_opened_while_merging() {
+        let db_path = mk_db_path("test-lsm-session-while-merging");
+        clean_path(&db_path);
+
+        let mut config_builder = ConfigBuilder::new();
+        config_builder
+            .set_background_compaction(true)
+            .set_sync_log_count(100)
+            .set_lsm_block_size(16 * 1024);
+        let db = LsmKv::open_file_with_config(db_path.as_path(), config_builder.take()).unwrap();
+
+        // the session is opened by the worker after the merge,
+        // before the result is published
+        let held: Arc<Mutex<Option<LsmSession>>> = Arc::new(Mutex::new(None));
+        {
+            let held = held.clone();
+            // taken on the first run, it's not counted as a session later
+            let mut engine = Some(Arc::downgrade(&db.inner));
+            let hook = move || {
+                let engine = match engine.take() {
+                    Some(engine) => engine,
+                    None => return,
+                };
+                if let Some(inner) = engine.upgrade() {
+                    *held.lock().unwrap() = Some(inner.new_session(engine.clone()));
+                }
+            };
+            *db.inner.before_publish_hook.lock().unwrap() = Some(Box::new(hook));
+        }
+
+        let mut count = 0;
+        while held.lock().unwrap().is_none() && count < 100_000 {
+            db.put(format!("key-{}", count), format!("value-{}", count)).unwrap();
+            count += 1;
+        }
+        assert!(held.lock().unwrap().is_some(), "no compaction is published");
+
+        // more syncs and compactions, the freed pages are reused
+        for i in count..(count * 2) {
+            db.put(format!("key-{}", i), format!("value-{}", i)).unwrap();
+        }
+        db.inner.compaction_worker.as_ref().unwrap().wait_for_round().unwrap();
+
+        let session = held.lock().unwrap().take().unwrap();
+        let mut found = 0;
+        for i in 0..count {
+            let key = format!("key-{}", i);
+            if let Some(value) = db.get_with_session(key.as_str(), &session).unwrap() {
+                assert_eq!(value.as_ref(), format!("value-{}", i).as_bytes(), "key: {}", key);
+                found += 1;
+            }
+        }
+        assert!(found > 0);
+
+        drop(session);
+        drop(db);
+        clean_path(&db_path);
+    }
+
+    #[test]
+    fn test_failed_sync_is_not_persisted() {
+        let db_path = mk_db_path("test-lsm-failed-sync");
+        clean_path(&db_path);
+
+        {
+            let mut config_builder = ConfigBuilder::new();
+            config_builder.set_log_group_commit(true);
+            let db = LsmKv::open_file_with_config(db_path.as_path(), config_builder.take()).unwrap();
+            for i in 0..10 {
+                db.put(format!("key-{}", i), format!("value-{}", i)).unwrap();
+            }
+
+            db.inner.log.as_ref().unwrap().fail_next_sync();
+            assert!(db.put("key-lost", "value-lost").is_err());
+
+            // the log is poisoned
+            assert!(db.put("key-after", "value-after").is_err());
+        }
+
+        let db = LsmKv::open_file(db_path.as_path()).unwrap();
+        for i in 0..10 {
+            let value = db.get_string(format!("key-{}", i)).unwrap();
+            assert_eq!(value, Some(format!("value-{}", i)));
+        }
+        assert!(db.get_string("key-lost").unwrap().is_none());
+        assert!(db.get_string("key-after").unwrap().is_none());
+
+        drop(db);
+        clean_path(&db_path);
+    }
+
+}
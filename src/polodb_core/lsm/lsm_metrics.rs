@@ -1,5 +1,7 @@
 use std::sync::Arc;
 use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use bson::{Bson, Document};
+use crate::metrics::{HistogramSnapshot, LatencyHistogram, LatencyTimer};
 
 #[derive(Clone)]
 pub struct LsmMetrics {
@@ -67,6 +69,256 @@ impl LsmMetrics {
         self.inner.clone_snapshot_count.load(Ordering::SeqCst)
     }
 
+    pub fn add_write_stall_count(&self) {
+        self.inner.add_write_stall_count()
+    }
+
+    pub fn write_stall_count(&self) -> usize {
+        self.inner.write_stall_count.load(Ordering::Relaxed)
+    }
+
+    /// The segment is skipped because the filter excludes the key
+    pub fn add_bloom_filter_negative(&self) {
+        self.inner.add_bloom_filter_negative()
+    }
+
+    pub fn bloom_filter_negative(&self) -> usize {
+        self.inner.bloom_filter_negative.load(Ordering::Relaxed)
+    }
+
+    /// The filter passes the key, and the key is found in the segment
+    pub fn add_bloom_filter_positive(&self) {
+        self.inner.add_bloom_filter_positive()
+    }
+
+    pub fn bloom_filter_positive(&self) -> usize {
+        self.inner.bloom_filter_positive.load(Ordering::Relaxed)
+    }
+
+    /// The filter passes the key, but the key is not in the segment
+    pub fn add_bloom_filter_false_positive(&self) {
+        self.inner.add_bloom_filter_false_positive()
+    }
+
+    pub fn bloom_filter_false_positive(&self) -> usize {
+        self.inner.bloom_filter_false_positive.load(Ordering::Relaxed)
+    }
+
+    pub fn add_value_cache_hit(&self) {
+        self.inner.add_value_cache_hit()
+    }
+
+    pub fn value_cache_hit(&self) -> usize {
+        self.inner.value_cache_hit.load(Ordering::Relaxed)
+    }
+
+    pub fn add_value_cache_miss(&self) {
+        self.inner.add_value_cache_miss()
+    }
+
+    pub fn value_cache_miss(&self) -> usize {
+        self.inner.value_cache_miss.load(Ordering::Relaxed)
+    }
+
+    pub fn add_value_cache_eviction(&self) {
+        self.inner.add_value_cache_eviction()
+    }
+
+    pub fn value_cache_eviction(&self) -> usize {
+        self.inner.value_cache_eviction.load(Ordering::Relaxed)
+    }
+
+    /// 0 if there is no lookup
+    pub fn value_cache_hit_ratio(&self) -> f64 {
+        let hit = self.value_cache_hit();
+        let total = hit + self.value_cache_miss();
+        if total == 0 {
+            return 0.0;
+        }
+        (hit as f64) / (total as f64)
+    }
+
+    /// The bytes of the segments written by syncing the memory table
+    pub fn add_flush_bytes(&self, bytes: usize) {
+        self.inner.add_flush_bytes(bytes)
+    }
+
+    pub fn flush_bytes(&self) -> usize {
+        self.inner.flush_bytes.load(Ordering::Relaxed)
+    }
+
+    /// The bytes of the segments read by the compaction
+    pub fn add_compaction_read_bytes(&self, bytes: usize) {
+        self.inner.add_compaction_read_bytes(bytes)
+    }
+
+    pub fn compaction_read_bytes(&self) -> usize {
+        self.inner.compaction_read_bytes.load(Ordering::Relaxed)
+    }
+
+    /// The bytes of the segments written by the compaction
+    pub fn add_compaction_write_bytes(&self, bytes: usize) {
+        self.inner.add_compaction_write_bytes(bytes)
+    }
+
+    pub fn compaction_write_bytes(&self) -> usize {
+        self.inner.compaction_write_bytes.load(Ordering::Relaxed)
+    }
+
+    /// A segment is moved to the next level without rewriting
+    pub fn add_trivial_move(&self) {
+        self.inner.add_trivial_move()
+    }
+
+    pub fn trivial_move(&self) -> usize {
+        self.inner.trivial_move.load(Ordering::Relaxed)
+    }
+
+    /// A transaction is committed as a bulk load without the log
+    pub fn add_bulk_load_count(&self) {
+        self.inner.add_bulk_load_count()
+    }
+
+    pub fn bulk_load_count(&self) -> usize {
+        self.inner.bulk_load_count.load(Ordering::Relaxed)
+    }
+
+    /// The bytes written to the segments per byte flushed,
+    /// 0 if nothing is flushed.
+    pub fn write_amplification(&self) -> f64 {
+        let flushed = self.flush_bytes();
+        if flushed == 0 {
+            return 0.0;
+        }
+        ((flushed + self.compaction_write_bytes()) as f64) / (flushed as f64)
+    }
+
+    /// The bytes of the transactions written to the log
+    pub fn add_log_write_bytes(&self, bytes: usize) {
+        self.inner.add_log_write_bytes(bytes)
+    }
+
+    pub fn log_write_bytes(&self) -> usize {
+        self.inner.log_write_bytes.load(Ordering::Relaxed)
+    }
+
+    /// The syncs of the log run by the group commit,
+    /// a sync may make many commits durable.
+    pub fn add_log_sync_count(&self) {
+        self.inner.add_log_sync_count()
+    }
+
+    pub fn log_sync_count(&self) -> usize {
+        self.inner.log_sync_count.load(Ordering::Relaxed)
+    }
+
+    /// Times nothing if the metrics are not enabled
+    #[inline]
+    pub(crate) fn start_timer(&self) -> LatencyTimer {
+        LatencyTimer::start(self.inner.enable.load(Ordering::Relaxed))
+    }
+
+    pub(crate) fn record_commit(&self, timer: LatencyTimer) {
+        timer.stop(&self.inner.commit_latency);
+    }
+
+    /// The durations of the write transactions committed
+    pub fn commit_latency(&self) -> HistogramSnapshot {
+        self.inner.commit_latency.snapshot()
+    }
+
+    pub(crate) fn record_log_flush(&self, timer: LatencyTimer) {
+        timer.stop(&self.inner.log_flush_latency);
+    }
+
+    /// The durations of writing a transaction to the log
+    pub fn log_flush_latency(&self) -> HistogramSnapshot {
+        self.inner.log_flush_latency.snapshot()
+    }
+
+    pub(crate) fn record_sync(&self, timer: LatencyTimer) {
+        timer.stop(&self.inner.sync_latency);
+    }
+
+    /// The durations of writing the memory table to a segment
+    pub fn sync_latency(&self) -> HistogramSnapshot {
+        self.inner.sync_latency.snapshot()
+    }
+
+    pub(crate) fn record_minor_compact(&self, timer: LatencyTimer) {
+        timer.stop(&self.inner.minor_compact_latency);
+    }
+
+    pub fn minor_compact_latency(&self) -> HistogramSnapshot {
+        self.inner.minor_compact_latency.snapshot()
+    }
+
+    pub(crate) fn record_major_compact(&self, timer: LatencyTimer) {
+        timer.stop(&self.inner.major_compact_latency);
+    }
+
+    pub fn major_compact_latency(&self) -> HistogramSnapshot {
+        self.inner.major_compact_latency.snapshot()
+    }
+
+    pub(crate) fn record_leveled_compact(&self, timer: LatencyTimer) {
+        timer.stop(&self.inner.leveled_compact_latency);
+    }
+
+    /// The durations of the tasks of the leveled compaction
+    pub fn leveled_compact_latency(&self) -> HistogramSnapshot {
+        self.inner.leveled_compact_latency.snapshot()
+    }
+
+    pub(crate) fn record_read_segment(&self, timer: LatencyTimer) {
+        timer.stop(&self.inner.read_segment_latency);
+    }
+
+    /// The durations of reading the values from the backend,
+    /// the values found in the value cache are not counted.
+    pub fn read_segment_latency(&self) -> HistogramSnapshot {
+        self.inner.read_segment_latency.snapshot()
+    }
+
+    pub fn to_document(&self) -> Document {
+        let count = |value: usize| Bson::Int64(value as i64);
+        let mut doc = Document::new();
+        doc.insert("enabled", Bson::Boolean(self.inner.enable.load(Ordering::Relaxed)));
+        doc.insert("syncCount", count(self.sync_count()));
+        doc.insert("minorCompact", count(self.minor_compact()));
+        doc.insert("majorCompact", count(self.major_compact()));
+        doc.insert("trivialMove", count(self.trivial_move()));
+        doc.insert("bulkLoadCount", count(self.bulk_load_count()));
+        doc.insert("writeStallCount", count(self.write_stall_count()));
+        doc.insert("cloneSnapshotCount", count(self.clone_snapshot_count()));
+        doc.insert("freeSegmentsCount", count(self.free_segments_count()));
+        doc.insert("useFreeSegmentCount", count(self.use_free_segment_count()));
+        doc.insert("bloomFilterNegative", count(self.bloom_filter_negative()));
+        doc.insert("bloomFilterPositive", count(self.bloom_filter_positive()));
+        doc.insert("bloomFilterFalsePositive", count(self.bloom_filter_false_positive()));
+        doc.insert("valueCacheHit", count(self.value_cache_hit()));
+        doc.insert("valueCacheMiss", count(self.value_cache_miss()));
+        doc.insert("valueCacheEviction", count(self.value_cache_eviction()));
+        doc.insert("logWriteBytes", count(self.log_write_bytes()));
+        doc.insert("logSyncCount", count(self.log_sync_count()));
+        doc.insert("flushBytes", count(self.flush_bytes()));
+        doc.insert("compactionReadBytes", count(self.compaction_read_bytes()));
+        doc.insert("compactionWriteBytes", count(self.compaction_write_bytes()));
+        doc.insert("writeAmplification", Bson::Double(self.write_amplification()));
+
+        let mut latency = Document::new();
+        latency.insert("commit", self.commit_latency().to_document());
+        latency.insert("logFlush", self.log_flush_latency().to_document());
+        latency.insert("sync", self.sync_latency().to_document());
+        latency.insert("minorCompact", self.minor_compact_latency().to_document());
+        latency.insert("majorCompact", self.major_compact_latency().to_document());
+        latency.insert("leveledCompact", self.leveled_compact_latency().to_document());
+        latency.insert("readSegment", self.read_segment_latency().to_document());
+        doc.insert("latency", latency);
+
+        doc
+    }
+
 }
 
 macro_rules! test_enable {
@@ -85,6 +337,27 @@ struct LsmMetricsInner {
     free_segments_count: AtomicUsize,
     use_free_segment_count: AtomicUsize,
     clone_snapshot_count: AtomicUsize,
+    write_stall_count: AtomicUsize,
+    bloom_filter_negative: AtomicUsize,
+    bloom_filter_positive: AtomicUsize,
+    bloom_filter_false_positive: AtomicUsize,
+    value_cache_hit: AtomicUsize,
+    value_cache_miss: AtomicUsize,
+    value_cache_eviction: AtomicUsize,
+    flush_bytes: AtomicUsize,
+    compaction_read_bytes: AtomicUsize,
+    compaction_write_bytes: AtomicUsize,
+    trivial_move: AtomicUsize,
+    bulk_load_count: AtomicUsize,
+    log_write_bytes: AtomicUsize,
+    log_sync_count: AtomicUsize,
+    commit_latency: LatencyHistogram,
+    log_flush_latency: LatencyHistogram,
+    sync_latency: LatencyHistogram,
+    minor_compact_latency: LatencyHistogram,
+    major_compact_latency: LatencyHistogram,
+    leveled_compact_latency: LatencyHistogram,
+    read_segment_latency: LatencyHistogram,
 }
 
 impl LsmMetricsInner {
@@ -133,6 +406,76 @@ impl LsmMetricsInner {
         self.use_free_segment_count.load(Ordering::Relaxed)
     }
 
+    fn add_write_stall_count(&self) {
+        test_enable!(self);
+        self.write_stall_count.fetch_add(1, Ordering::Relaxed);
+    }
+
+    fn add_bloom_filter_negative(&self) {
+        test_enable!(self);
+        self.bloom_filter_negative.fetch_add(1, Ordering::Relaxed);
+    }
+
+    fn add_bloom_filter_positive(&self) {
+        test_enable!(self);
+        self.bloom_filter_positive.fetch_add(1, Ordering::Relaxed);
+    }
+
+    fn add_bloom_filter_false_positive(&self) {
+        test_enable!(self);
+        self.bloom_filter_false_positive.fetch_add(1, Ordering::Relaxed);
+    }
+
+    fn add_value_cache_hit(&self) {
+        test_enable!(self);
+        self.value_cache_hit.fetch_add(1, Ordering::Relaxed);
+    }
+
+    fn add_value_cache_miss(&self) {
+        test_enable!(self);
+        self.value_cache_miss.fetch_add(1, Ordering::Relaxed);
+    }
+
+    fn add_value_cache_eviction(&self) {
+        test_enable!(self);
+        self.value_cache_eviction.fetch_add(1, Ordering::Relaxed);
+    }
+
+    fn add_flush_bytes(&self, bytes: usize) {
+        test_enable!(self);
+        self.flush_bytes.fetch_add(bytes, Ordering::Relaxed);
+    }
+
+    fn add_compaction_read_bytes(&self, bytes: usize) {
+        test_enable!(self);
+        self.compaction_read_bytes.fetch_add(bytes, Ordering::Relaxed);
+    }
+
+    fn add_compaction_write_bytes(&self, bytes: usize) {
+        test_enable!(self);
+        self.compaction_write_bytes.fetch_add(bytes, Ordering::Relaxed);
+    }
+
+    fn add_trivial_move(&self) {
+        test_enable!(self);
+        self.trivial_move.fetch_add(1, Ordering::Relaxed);
+    }
+
+    fn add_bulk_load_count(&self) {
+        test_enable!(self);
+        self.bulk_load_count.fetch_add(1, Ordering::Relaxed);
+    }
+
+    fn add_log_write_bytes(&self, bytes: usize) {
+        test_enable!(self);
+        self.log_write_bytes.fetch_add(bytes, Ordering::Relaxed);
+    }
+
+    fn add_log_sync_count(&self) {
+        test_enable!(self);
+        self.log_sync_count.fetch_add(1, Ordering::Relaxed);
+    }
+
 }
 
 impl Default for LsmMetricsInner {
@@ -146,6 +489,27 @@ impl Default for LsmMetricsInner {
             free_segments_count: AtomicUsize::new(0),
             use_free_segment_count: AtomicUsize::new(0),
             clone_snapshot_count: AtomicUsize::new(0),
+            write_stall_count: AtomicUsize::new(0),
+            bloom_filter_negative: AtomicUsize::new(0),
+            bloom_filter_positive: AtomicUsize::new(0),
+            bloom_filter_false_positive: AtomicUsize::new(0),
+            value_cache_hit: AtomicUsize::new(0),
+            value_cache_miss: AtomicUsize::new(0),
+            value_cache_eviction: AtomicUsize::new(0),
+            flush_bytes: AtomicUsize::new(0),
+            compaction_read_bytes: AtomicUsize::new(0),
+            compaction_write_bytes: AtomicUsize::new(0),
+            trivial_move: AtomicUsize::new(0),
+            bulk_load_count: AtomicUsize::new(0),
+            log_write_bytes: AtomicUsize::new(0),
+            log_sync_count: AtomicUsize::new(0),
+            commit_latency: LatencyHistogram::new(),
+            log_flush_latency: LatencyHistogram::new(),
+            sync_latency: LatencyHistogram::new(),
+            minor_compact_latency: LatencyHistogram::new(),
+            major_compact_latency: LatencyHistogram::new(),
+            leveled_compact_latency: LatencyHistogram::new(),
+            read_segment_latency: LatencyHistogram::new(),
         }
     }
 
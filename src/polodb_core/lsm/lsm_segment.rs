@@ -5,7 +5,11 @@
  */
 use std::sync::Arc;
 use bson::oid::ObjectId;
+use crate::Result;
+use crate::lsm::block_index::{BlockCursor, BlockIndex};
 use crate::lsm::lsm_tree::LsmTree;
+use crate::lsm::multi_cursor::CursorRepr;
+use crate::lsm::range_delete::{RangeDeletes, RangeDeletesBuilder};
 
 #[derive(Copy, Clone)]
 #[allow(dead_code)]
@@ -14,6 +18,10 @@ pub(crate) struct LsmTuplePtr {
     pub pid_ext:   u32,   // reserved for ObjectId
     pub offset:    u32,
     pub byte_size: u64,
+    /// The tuple is in a compressed block,
+    /// `pid` and `offset` point to the header of the block,
+    /// it's the offset of tuple in the decoded block.
+    pub block_offset: Option<u32>,
 }
 
 impl LsmTuplePtr {
@@ -35,6 +43,7 @@ impl LsmTuplePtr {
             pid_ext,
             offset,
             byte_size,
+            block_offset: None,
         }
     }
 
@@ -60,21 +69,141 @@ impl Default for LsmTuplePtr {
             pid_ext: 0,
             offset: 0,
             byte_size: 0,
+            block_offset: None,
         }
     }
 
 }
 
+#[derive(Clone)]
+pub(crate) enum SegmentIndex {
+    /// All the keys are loaded in memory.
+    /// Used by the legacy file format and IndexedDB.
+    Tree(LsmTree<Arc<[u8]>, LsmTuplePtr>),
+    /// Only the first key of every block is loaded,
+    /// the blocks are decoded from the mapped file on demand.
+    Blocks(Arc<BlockIndex>),
+}
+
 // Immutable segment
 #[derive(Clone)]
 pub(crate) struct ImLsmSegment {
-    pub segments:  LsmTree<Arc<[u8]>, LsmTuplePtr>,
+    pub index:     SegmentIndex,
     pub start_pid: u64,
     pub end_pid:   u64,
+    range_deletes: RangeDeletes,
 }
 
 impl ImLsmSegment {
 
+    pub fn new(index: SegmentIndex, start_pid: u64, end_pid: u64) -> ImLsmSegment {
+        let range_deletes = match &index {
+            SegmentIndex::Tree(tree) => {
+                let mut builder = RangeDeletesBuilder::new();
+                let mut cursor = tree.open_cursor();
+                cursor.go_to_min();
+                while let (Some(key), Some(marker)) = (cursor.key(), cursor.marker()) {
+                    builder.add_marker(key.as_ref(), &marker);
+                    cursor.next();
+                }
+                builder.build()
+            }
+            SegmentIndex::Blocks(index) => index.range_deletes().clone(),
+        };
+        ImLsmSegment {
+            index,
+            start_pid,
+            end_pid,
+            range_deletes,
+        }
+    }
+
+    /// The ranges deleted, they shadow the older segments
+    #[inline]
+    pub fn range_deletes(&self) -> &RangeDeletes {
+        &self.range_deletes
+    }
+
+    /// The ranges deleted by the segments of a level,
+    /// they don't overlap like the segments.
+    pub fn union_range_deletes(segments: &[ImLsmSegment]) -> RangeDeletes {
+        if segments.len() == 1 {
+            return segments[0].range_deletes.clone();
+        }
+        let mut result = RangeDeletes::new();
+        for segment in segments {
+            result.extend(&segment.range_deletes);
+        }
+        result
+    }
+
+    pub fn open_cursor(&self) -> CursorRepr {
+        match &self.index {
+            SegmentIndex::Tree(tree) => tree.open_cursor().into(),
+            SegmentIndex::Blocks(index) => BlockCursor::new(index.clone()).into(),
+        }
+    }
+
+    pub fn tuple_count(&self) -> u64 {
+        match &self.index {
+            SegmentIndex::Tree(tree) => tree.len() as u64,
+            SegmentIndex::Blocks(index) => index.tuple_count(),
+        }
+    }
+
+    pub fn first_key(&self) -> Option<Arc<[u8]>> {
+        match &self.index {
+            SegmentIndex::Tree(tree) => {
+                let mut cursor = tree.open_cursor();
+                cursor.go_to_min();
+                cursor.key()
+            }
+            SegmentIndex::Blocks(index) => index.first_key(),
+        }
+    }
+
+    pub fn last_key(&self) -> Result<Option<Arc<[u8]>>> {
+        match &self.index {
+            SegmentIndex::Tree(tree) => {
+                let mut cursor = tree.open_cursor();
+                cursor.go_to_min();
+                let mut result = None;
+                while !cursor.done() {
+                    result = cursor.key();
+                    cursor.next();
+                }
+                Ok(result)
+            }
+            SegmentIndex::Blocks(index) => index.last_key(),
+        }
+    }
+
+    /// Sample the keys in [start, end) with the count of the keys
+    /// every sample stands for, the block index only has the first keys.
+    pub fn sample_keys(&self, start: &[u8], end: &[u8], stride: usize, samples: &mut Vec<(Arc<[u8]>, u64)>) {
+        match &self.index {
+            SegmentIndex::Tree(tree) => tree.open_cursor().sample_keys(start, end, stride, samples),
+            SegmentIndex::Blocks(index) => index.sample_keys(start, end, samples),
+        }
+    }
+
+    /// The bytes of the pages occupied by the segment.
+    /// The pids of IndexedDB are parts of ObjectId,
+    /// so it's only meaningful on the file backend.
+    #[inline]
+    pub fn byte_size(&self, page_size: u32) -> u64 {
+        (self.end_pid.saturating_sub(self.start_pid) + 1).saturating_mul(page_size as u64)
+    }
+
+    /// The offset of block index footer relative to the segment,
+    /// 0 if the segment has no block index.
+    pub fn footer_offset(&self) -> u64 {
+        match &self.index {
+            SegmentIndex::Tree(_) => 0,
+            SegmentIndex::Blocks(index) => index.footer_offset(),
+        }
+    }
+
     #[allow(dead_code)]
     pub fn from_object_id(
         segments:  LsmTree<Arc<[u8]>, LsmTuplePtr>,
@@ -88,11 +217,11 @@ impl ImLsmSegment {
         start_bytes.copy_from_slice(&bytes[0..8]);
         end_bytes[0..4].copy_from_slice(&bytes[8..12]);
 
-        ImLsmSegment {
-            segments,
-            start_pid: u64::from_be_bytes(start_bytes),
-            end_pid: u64::from_be_bytes(end_bytes),
-        }
+        ImLsmSegment::new(
+            SegmentIndex::Tree(segments),
+            u64::from_be_bytes(start_bytes),
+            u64::from_be_bytes(end_bytes),
+        )
     }
 
     #[allow(dead_code)]
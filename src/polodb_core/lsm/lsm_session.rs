@@ -17,6 +17,9 @@ pub struct LsmSession {
     pub(crate) snapshot: Arc<Mutex<LsmSnapshot>>,
     log_buffer: Option<Vec<u8>>,
     transaction: Option<TransactionType>,
+    /// The writes of the transaction skip the log,
+    /// the memory table is written to a segment on the commit.
+    bulk_load: bool,
 }
 
 impl LsmSession {
@@ -46,6 +49,23 @@ impl LsmSession {
             snapshot,
             log_buffer,
             transaction: None,
+            bulk_load: false,
+        }
+    }
+
+    /// A session reading the same view of the data,
+    /// including the writes not committed of this session.
+    /// It's used by the workers of a partitioned scan.
+    pub(crate) fn fork_for_read(&self) -> LsmSession {
+        LsmSession {
+            engine: self.engine.clone(),
+            id: self.id,
+            prev_mem_table: self.mem_table.clone(),
+            mem_table: self.mem_table.clone(),
+            snapshot: self.snapshot.clone(),
+            log_buffer: None,
+            transaction: None,
+            bulk_load: false,
         }
     }
 
@@ -54,6 +74,38 @@ impl LsmSession {
         self.log_buffer.as_ref().map(|buf| buf.as_slice())
     }
 
+    /// Nothing is logged in the bulk load
+    #[inline]
+    fn log_buffer_mut(&mut self) -> Option<&mut Vec<u8>> {
+        if self.bulk_load {
+            return None;
+        }
+        self.log_buffer.as_mut()
+    }
+
+    #[inline]
+    pub fn is_bulk_load(&self) -> bool {
+        self.bulk_load
+    }
+
+    /// Write the transaction as a bulk load.
+    ///
+    /// The writes are not logged, it's durable once the memory
+    /// table is written to a segment and the snapshot is checkpointed
+    /// on the commit, so a large batch is written to the disk once.
+    /// The writes logged before in the transaction are dropped,
+    /// they are in the memory table written too.
+    pub(crate) fn start_bulk_load(&mut self) -> Result<()> {
+        if self.transaction != Some(TransactionType::Write) {
+            return Err(Error::NoTransactionStarted);
+        }
+        if let Some(log_buffer) = &mut self.log_buffer {
+            log_buffer.clear();
+        }
+        self.bulk_load = true;
+        Ok(())
+    }
+
     pub fn transaction(&self) -> Option<TransactionType> {
         self.transaction
     }
@@ -86,11 +138,12 @@ impl LsmSession {
         }
         self.mem_table = self.prev_mem_table.clone();
         self.transaction = None;
+        self.bulk_load = false;
         Ok(())
     }
 
     pub fn put(&mut self, key: &[u8], value: &[u8]) -> Result<()> {
-        if let Some(log_buffer) = &mut self.log_buffer {
+        if let Some(log_buffer) = self.log_buffer_mut() {
             LsmSession::put_log(log_buffer, key, value)?;
         }
 
@@ -116,7 +169,7 @@ impl LsmSession {
     }
 
     pub fn delete(&mut self, key: &[u8]) -> Result<()> {
-        if let Some(log_buffer) = &mut self.log_buffer {
+        if let Some(log_buffer) = self.log_buffer_mut() {
             LsmSession::delete_log(log_buffer, key)?;
         }
 
@@ -136,6 +189,35 @@ impl LsmSession {
         Ok(())
     }
 
+    /// Delete the keys in [start, end) with one tombstone,
+    /// the keys are not visited. `end` must not be a key
+    /// of the data, e.g. the successor of a prefix.
+    pub fn delete_range(&mut self, start: &[u8], end: &[u8]) -> Result<()> {
+        if start >= end {
+            return Ok(());
+        }
+
+        if let Some(log_buffer) = self.log_buffer_mut() {
+            LsmSession::delete_range_log(log_buffer, start, end)?;
+        }
+
+        self.mem_table.delete_range(start, end, false);
+
+        Ok(())
+    }
+
+    fn delete_range_log<W: Write>(writer: &mut W, start: &[u8], end: &[u8]) -> Result<()> {
+        writer.write_u8(format::DELETE_RANGE)?;
+
+        vli::encode(writer, start.len() as i64)?;
+        writer.write_all(start)?;
+
+        vli::encode(writer, end.len() as i64)?;
+        writer.write_all(end)?;
+
+        Ok(())
+    }
+
     pub(crate) fn update_cursor_current(&mut self, cursor: &mut MultiCursor, value: &[u8]) -> Result<bool> {
         let key = cursor.key();
         if key.is_none() {
@@ -144,7 +226,7 @@ impl LsmSession {
         let mut result = false;
         let key = key.as_ref().unwrap();
 
-        if let Some(log_buffer) = &mut self.log_buffer {
+        if let Some(log_buffer) = self.log_buffer_mut() {
             LsmSession::put_log(log_buffer, key, value)?;
         }
 
@@ -172,7 +254,7 @@ impl LsmSession {
         let mut result = false;
         let key = key.as_ref().unwrap();
 
-        if let Some(log_buffer) = &mut self.log_buffer {
+        if let Some(log_buffer) = self.log_buffer_mut() {
             LsmSession::delete_log(log_buffer, key)?;
         }
 
@@ -194,6 +276,18 @@ impl LsmSession {
         Ok(result)
     }
 
+    /// The commit is applied but the log failed to sync it,
+    /// the session goes back to the data before the transaction.
+    pub(crate) fn rollback_failed_commit(&mut self) {
+        if let Some(log_buffer) = &mut self.log_buffer {
+            log_buffer.clear();
+        }
+        self.mem_table = self.prev_mem_table.clone();
+        self.transaction = None;
+        self.bulk_load = false;
+        self.id += 1;
+    }
+
     pub(crate) fn finished_transaction(&mut self) {
         let t = self.transaction.unwrap();
 
@@ -202,6 +296,7 @@ impl LsmSession {
                 self.log_buffer = Some(Vec::new());
             }
             self.transaction = None;
+            self.bulk_load = false;
         }
         self.id += 1;
     }
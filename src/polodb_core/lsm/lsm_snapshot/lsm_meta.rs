@@ -39,7 +39,7 @@ const LEVEL_BEGIN_OFFSET: u32 = 128;
 /// 8 bytes: start pid
 /// 8 bytes: end pid
 /// 8 bytes: len
-/// 8 bytes: index page(preserved, default 0)
+/// 8 bytes: offset of the block index footer(0 for the legacy segment)
 ///
 /// Freelist record(16 bytes)
 /// 8 bytes: start_pid
@@ -113,8 +113,8 @@ impl<'a> LsmMetaDelegate<'a> {
     fn write_seg(&mut self, seg: &ImLsmSegment) {
         self.0.put_u64(seg.start_pid);
         self.0.put_u64(seg.end_pid);
-        self.0.put_u64(seg.segments.len() as u64);
-        self.0.put_u64(0);
+        self.0.put_u64(seg.tuple_count());
+        self.0.put_u64(seg.footer_offset());
     }
 
     pub fn write_free_segments(&mut self, free_segments: &[FreeSegmentRecord]) {
@@ -7,6 +7,8 @@ use serde::{Deserialize, Serialize};
 use smallvec::{smallvec, SmallVec};
 use crate::lsm::lsm_snapshot::LsmMetaDelegate;
 use crate::lsm::lsm_segment::ImLsmSegment;
+use crate::lsm::multi_cursor::{CursorRepr, LevelCursor};
+use crate::lsm::range_delete::RangeDeletes;
 use crate::page::RawPage;
 
 #[derive(Clone)]
@@ -17,7 +19,7 @@ pub(crate) struct LsmLevel {
 
 impl LsmLevel {
 
-    fn new() -> LsmLevel {
+    pub fn new() -> LsmLevel {
         LsmLevel {
             age: 0,
             content: smallvec![],
@@ -28,6 +30,25 @@ impl LsmLevel {
         self.content = smallvec![self.content.last().unwrap().clone()];
     }
 
+    /// Open a cursor over the whole level,
+    /// except level 0 whose segments are overlapped.
+    pub fn open_cursor(&self) -> CursorRepr {
+        if self.content.len() == 1 {
+            return self.content[0].open_cursor();
+        }
+        LevelCursor::new(&self.content).into()
+    }
+
+    #[inline]
+    pub fn range_deletes(&self) -> RangeDeletes {
+        ImLsmSegment::union_range_deletes(&self.content)
+    }
+
+    /// The bytes of the pages occupied by the level
+    pub fn byte_size(&self, page_size: u32) -> u64 {
+        self.content.iter().map(|segment| segment.byte_size(page_size)).sum()
+    }
+
 }
 
 #[derive(Clone, Copy, Serialize, Deserialize)]
@@ -106,6 +127,75 @@ impl LsmSnapshot {
         self.pending_free_segments.clear();
     }
 
+    /// Take the pages from the smallest free range holding them,
+    /// the lowest one if some ranges are of the same size,
+    /// so the file is filled from the start and the tail is freed.
+    /// The rest of the range stays in the list.
+    ///
+    /// The pages taken are adjacent, a segment is never split.
+    pub fn allocate_free_pages(&mut self, page_count: u64) -> Option<FreeSegmentRecord> {
+        assert!(page_count > 0);
+        let mut best: Option<usize> = None;
+        for (index, seg) in self.free_segments.iter().enumerate() {
+            let seg_count = seg.end_pid - seg.start_pid + 1;
+            if seg_count < page_count {
+                continue;
+            }
+            let is_better = match best {
+                None => true,
+                Some(best_index) => {
+                    let best_seg = &self.free_segments[best_index];
+                    let best_count = best_seg.end_pid - best_seg.start_pid + 1;
+                    seg_count < best_count || (seg_count == best_count && seg.start_pid < best_seg.start_pid)
+                }
+            };
+            if is_better {
+                best = Some(index);
+            }
+        }
+
+        let index = best?;
+        let seg = &mut self.free_segments[index];
+        let result = FreeSegmentRecord {
+            start_pid: seg.start_pid,
+            end_pid: seg.start_pid + page_count - 1,
+        };
+        if result.end_pid == seg.end_pid {
+            self.free_segments.remove(index);
+        } else {
+            seg.start_pid = result.end_pid + 1;
+        }
+        Some(result)
+    }
+
+    /// Remove the free range at the end of file from the list
+    /// and shrink `file_size`, return the range removed.
+    pub fn truncate_free_tail(&mut self, page_size: u32) -> Option<FreeSegmentRecord> {
+        let page_size = page_size as u64;
+        let (index, start_pid) = self.free_segments
+            .iter()
+            .enumerate()
+            .filter(|(_, seg)| (seg.end_pid + 1) * page_size >= self.file_size)
+            .map(|(index, seg)| (index, seg.start_pid))
+            .next()?;
+
+        // the meta pages are never freed
+        if start_pid < 2 {
+            return None;
+        }
+
+        let seg = self.free_segments.remove(index);
+        self.file_size = start_pid * page_size;
+        Some(seg)
+    }
+
+    /// Undo `truncate_free_tail` if the file is not truncated
+    pub fn restore_free_tail(&mut self, seg: FreeSegmentRecord, file_size: u64) {
+        self.file_size = file_size;
+        self.free_segments.push(seg);
+        self.normalize_free_segments();
+    }
+
     pub fn normalize_free_segments(&mut self) {
         if self.free_segments.is_empty() {
             return;
@@ -134,3 +224,54 @@ impl LsmSnapshot {
     }
 
 }
+
+#[cfg(test)]
+mod tests {
+    use crate::lsm::lsm_snapshot::{FreeSegmentRecord, LsmSnapshot};
+
+    fn free_ranges(snapshot: &LsmSnapshot) -> Vec<(u64, u64)> {
+        snapshot.free_segments.iter().map(|seg| (seg.start_pid, seg.end_pid)).collect()
+    }
+
+    #[test]
+    fn test_allocate_best_fit() {
+        let mut snapshot = LsmSnapshot::new();
+        snapshot.file_size = 100 * 4096;
+        for (start_pid, end_pid) in [(2, 21), (30, 34), (40, 44), (50, 59)] {
+            snapshot.free_segments.push(FreeSegmentRecord { start_pid, end_pid });
+        }
+
+        // the smallest range holding it, the lower one of the same size
+        let seg = snapshot.allocate_free_pages(4).unwrap();
+        assert_eq!((seg.start_pid, seg.end_pid), (30, 33));
+        assert_eq!(free_ranges(&snapshot), vec![(2, 21), (34, 34), (40, 44), (50, 59)]);
+
+        let seg = snapshot.allocate_free_pages(5).unwrap();
+        assert_eq!((seg.start_pid, seg.end_pid), (40, 44));
+        assert_eq!(free_ranges(&snapshot), vec![(2, 21), (34, 34), (50, 59)]);
+
+        let seg = snapshot.allocate_free_pages(11).unwrap();
+        assert_eq!((seg.start_pid, seg.end_pid), (2, 12));
+
+        assert!(snapshot.allocate_free_pages(20).is_none());
+    }
+
+    #[test]
+    fn test_truncate_free_tail() {
+        let mut snapshot = LsmSnapshot::new();
+        snapshot.file_size = 60 * 4096;
+        snapshot.free_segments.push(FreeSegmentRecord { start_pid: 10, end_pid: 19 });
+        assert!(snapshot.truncate_free_tail(4096).is_none());
+
+        snapshot.free_segments.push(FreeSegmentRecord { start_pid: 40, end_pid: 59 });
+        let seg = snapshot.truncate_free_tail(4096).unwrap();
+        assert_eq!((seg.start_pid, seg.end_pid), (40, 59));
+        assert_eq!(snapshot.file_size, 40 * 4096);
+        assert_eq!(free_ranges(&snapshot), vec![(10, 19)]);
+
+        snapshot.restore_free_tail(seg, 60 * 4096);
+        assert_eq!(snapshot.file_size, 60 * 4096);
+        assert_eq!(free_ranges(&snapshot), vec![(10, 19), (40, 59)]);
+    }
+
+}
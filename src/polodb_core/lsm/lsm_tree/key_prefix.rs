@@ -0,0 +1,89 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+use std::sync::Arc;
+
+/// A prefix of the key stored inline in the node.
+///
+/// The prefix must keep the order: if `a < b`, then
+/// `a.key_prefix() <= b.key_prefix()`. The keys are compared only if
+/// the prefixes are equal.
+pub(crate) trait KeyPrefix {
+
+    fn key_prefix(&self) -> u64;
+
+}
+
+impl KeyPrefix for [u8] {
+
+    /// The first 8 bytes in big endian, padded with zeros
+    #[inline]
+    fn key_prefix(&self) -> u64 {
+        let mut buf = [0u8; 8];
+        let len = std::cmp::min(self.len(), 8);
+        buf[0..len].copy_from_slice(&self[0..len]);
+        u64::from_be_bytes(buf)
+    }
+
+}
+
+impl KeyPrefix for Arc<[u8]> {
+
+    #[inline]
+    fn key_prefix(&self) -> u64 {
+        self.as_ref().key_prefix()
+    }
+
+}
+
+macro_rules! impl_unsigned_prefix {
+    ($($t:ty),*) => {
+        $(
+            impl KeyPrefix for $t {
+                #[inline]
+                fn key_prefix(&self) -> u64 {
+                    *self as u64
+                }
+            }
+        )*
+    }
+}
+
+macro_rules! impl_signed_prefix {
+    ($($t:ty),*) => {
+        $(
+            impl KeyPrefix for $t {
+                /// Flip the sign bit to keep the order
+                #[inline]
+                fn key_prefix(&self) -> u64 {
+                    (*self as i64 as u64) ^ (1 << 63)
+                }
+            }
+        )*
+    }
+}
+
+impl_unsigned_prefix!(u8, u16, u32, u64, usize);
+impl_signed_prefix!(i8, i16, i32, i64, isize);
+
+#[cfg(test)]
+mod tests {
+    use crate::lsm::lsm_tree::key_prefix::KeyPrefix;
+
+    #[test]
+    fn test_prefix_order() {
+        let keys: Vec<&[u8]> = vec![
+            b"", b"\x00", b"a", b"a\x00", b"a\x01", b"abcdefgh", b"abcdefgh\x00", b"abcdefgi", b"b",
+        ];
+        for i in 1..keys.len() {
+            assert!(keys[i - 1] < keys[i]);
+            assert!(keys[i - 1].key_prefix() <= keys[i].key_prefix());
+        }
+
+        assert!((-1i32).key_prefix() < 0i32.key_prefix());
+        assert!(i64::MIN.key_prefix() < i64::MAX.key_prefix());
+    }
+
+}
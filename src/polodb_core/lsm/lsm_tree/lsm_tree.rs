@@ -7,27 +7,29 @@
 use std::borrow::Borrow;
 use std::cmp::{max, Ordering};
 use std::sync::{Arc, RwLock};
+use crate::lsm::lsm_tree::key_prefix::KeyPrefix;
 use crate::lsm::lsm_tree::tree_cursor::TreeCursor;
 use crate::lsm::lsm_tree::value_marker::LsmTreeValueMarker;
 
-const ORDER: usize = 8;
+/// The max count of the keys in a node.
+/// The binary search only reads the inline prefixes in most cases,
+/// so a wider node makes the tree shallower with a few cache lines.
+/// But the copy-on-write insert copies the whole node on the path,
+/// see `bench_tree_orders` before changing it.
+pub(crate) const DEFAULT_ORDER: usize = 16;
 
-struct DivideInfo<K: Ord + Clone, V: Clone> {
+struct DivideInfo<K: Ord + Clone + KeyPrefix, V: Clone, const ORDER: usize> {
     tuple: (K, LsmTreeValueMarker<V>),
-    left: Arc<RwLock<TreeNode<K ,V>>>,
-    right: Arc<RwLock<TreeNode<K ,V>>>,
+    left: Arc<RwLock<TreeNode<K, V, ORDER>>>,
+    right: Arc<RwLock<TreeNode<K, V, ORDER>>>,
 }
 
-impl<K: Ord + Clone, V: Clone> DivideInfo<K, V> {
+impl<K: Ord + Clone + KeyPrefix, V: Clone, const ORDER: usize> DivideInfo<K, V, ORDER> {
 
-    fn generate_node(self) -> Arc<RwLock<TreeNode<K, V>>> {
+    fn generate_node(self) -> Arc<RwLock<TreeNode<K, V, ORDER>>> {
         let mut raw = TreeNode::new();
 
-        raw.data.push(ItemTuple {
-            left: Some(self.left),
-            key: self.tuple.0,
-            value: self.tuple.1,
-        });
+        raw.data.push(ItemTuple::new(self.tuple.0, self.tuple.1, Some(self.left)));
 
         raw.right = Some(self.right);
 
@@ -36,20 +38,20 @@ impl<K: Ord + Clone, V: Clone> DivideInfo<K, V> {
 
 }
 
-enum InsertResult<K: Ord + Clone, V: Clone> {
-    Replace(Arc<RwLock<TreeNode<K, V>>>),
-    Divide(Box<DivideInfo<K, V>>),
+enum InsertResult<K: Ord + Clone + KeyPrefix, V: Clone, const ORDER: usize> {
+    Replace(Arc<RwLock<TreeNode<K, V, ORDER>>>),
+    Divide(Box<DivideInfo<K, V, ORDER>>),
 }
 
-enum InsertInPlaceResult<K: Ord + Clone, V: Clone> {
+enum InsertInPlaceResult<K: Ord + Clone + KeyPrefix, V: Clone, const ORDER: usize> {
     Normal,
     LegacyValue(LsmTreeValueMarker<V>),
-    Divide(Box<DivideInfo<K, V>>),
+    Divide(Box<DivideInfo<K, V, ORDER>>),
 }
 
-impl<K: Ord + Clone, V: Clone> From<DivideInfo<K, V>> for InsertInPlaceResult<K, V> {
+impl<K: Ord + Clone + KeyPrefix, V: Clone, const ORDER: usize> From<DivideInfo<K, V, ORDER>> for InsertInPlaceResult<K, V, ORDER> {
 
-    fn from(value: DivideInfo<K, V>) -> Self {
+    fn from(value: DivideInfo<K, V, ORDER>) -> Self {
         InsertInPlaceResult::Divide(Box::new(value))
     }
 
@@ -61,41 +63,51 @@ impl<K: Ord + Clone, V: Clone> From<DivideInfo<K, V>> for InsertInPlaceResult<K,
 /// 1. Support cursor API
 /// 2. Support update in-place and incremental update
 /// 3. Does NOT support deletion
+///
+/// The `ORDER` is the max count of the keys in a node.
 #[derive(Clone)]
-pub(crate) struct LsmTree<K: Ord + Clone, V: Clone> {
-    root: Arc<RwLock<TreeNode<K, V>>>,
+pub(crate) struct LsmTree<K: Ord + Clone + KeyPrefix, V: Clone, const ORDER: usize = DEFAULT_ORDER> {
+    root: Arc<RwLock<TreeNode<K, V, ORDER>>>,
 }
 
-impl<K: Ord + Clone, V: Clone> LsmTree<K, V> {
+impl<K: Ord + Clone + KeyPrefix, V: Clone> LsmTree<K, V> {
 
     pub fn new() -> LsmTree<K, V> {
-        let empty = TreeNode::<K, V>::new();
+        LsmTree::new_with_order()
+    }
+
+}
+
+impl<K: Ord + Clone + KeyPrefix, V: Clone, const ORDER: usize> LsmTree<K, V, ORDER> {
+
+    pub fn new_with_order() -> LsmTree<K, V, ORDER> {
+        let empty = TreeNode::<K, V, ORDER>::new();
         LsmTree {
             root: Arc::new(RwLock::new(empty)),
         }
     }
 
-    pub(super) fn new_with_root(root: Arc<RwLock<TreeNode<K, V>>>) -> LsmTree<K, V>  {
+    pub(super) fn new_with_root(root: Arc<RwLock<TreeNode<K, V, ORDER>>>) -> LsmTree<K, V, ORDER>  {
         LsmTree {
             root,
         }
     }
 
     pub fn clear(&mut self) {
-        let empty = TreeNode::<K, V>::new();
+        let empty = TreeNode::<K, V, ORDER>::new();
         self.root = Arc::new(RwLock::new(empty));
     }
 
-    pub fn insert(&self, key: K, value: V) -> LsmTree<K, V> {
+    pub fn insert(&self, key: K, value: V) -> LsmTree<K, V, ORDER> {
         self.update(key, LsmTreeValueMarker::Value(value))
     }
 
-    pub fn delete(&self, key: K) -> LsmTree<K, V> {
+    pub fn delete(&self, key: K) -> LsmTree<K, V, ORDER> {
         self.update(key, LsmTreeValueMarker::Deleted)
     }
 
-    pub fn update(&self, key: K, value: LsmTreeValueMarker<V>) -> LsmTree<K, V> {
-        let insert_result = LsmTree::update_with_node(self.root.clone(), key, value);
+    pub fn update(&self, key: K, value: LsmTreeValueMarker<V>) -> LsmTree<K, V, ORDER> {
+        let insert_result = Self::update_with_node(self.root.clone(), key, value);
 
         match insert_result {
             InsertResult::Replace(node_ptr) => {
@@ -105,11 +117,7 @@ impl<K: Ord + Clone, V: Clone> LsmTree<K, V> {
             }
             InsertResult::Divide(divide_info) => {
                 let mut node = TreeNode::new();
-                node.data.push(ItemTuple {
-                    key: divide_info.tuple.0,
-                    value: divide_info.tuple.1,
-                    left: Some(divide_info.left),
-                });
+                node.data.push(ItemTuple::new(divide_info.tuple.0, divide_info.tuple.1, Some(divide_info.left)));
                 node.right = Some(divide_info.right);
                 LsmTree {
                     root: Arc::new(RwLock::new(node)),
@@ -119,18 +127,14 @@ impl<K: Ord + Clone, V: Clone> LsmTree<K, V> {
     }
 
     fn update_with_node(
-        node: Arc<RwLock<TreeNode<K, V>>>,
+        node: Arc<RwLock<TreeNode<K, V, ORDER>>>,
         key: K,
         value: LsmTreeValueMarker<V>,
-    ) -> InsertResult<K, V> {
+    ) -> InsertResult<K, V, ORDER> {
         let node_reader = node.read().unwrap();
         if node_reader.data.is_empty() {
             let mut cloned = node_reader.clone();
-            cloned.data.push(ItemTuple {
-                key,
-                value,
-                left: None,
-            });
+            cloned.data.push(ItemTuple::new(key, value, None));
             let node_ptr = Arc::new(RwLock::new(cloned));
             return InsertResult::Replace(node_ptr);
         }
@@ -138,22 +142,14 @@ impl<K: Ord + Clone, V: Clone> LsmTree<K, V> {
         let (index, ordering) = node_reader.find(&key);
         if ordering == Ordering::Equal {
             let mut cloned = node_reader.clone();
-            cloned.data[index] = ItemTuple {
-                key,
-                value,
-                left: node_reader.data[index].left.clone(),
-            };
+            cloned.data[index] = ItemTuple::new(key, value, node_reader.data[index].left.clone());
             let node_ptr = Arc::new(RwLock::new(cloned));
             return InsertResult::Replace(node_ptr);
         }
 
         if node_reader.is_leaf() {
             let mut cloned = node_reader.clone();
-            cloned.data.insert(index, ItemTuple {
-                key,
-                value,
-                left: None,
-            });
+            cloned.data.insert(index, ItemTuple::new(key, value, None));
 
             return if cloned.data.len() > ORDER {
                 let divide = cloned.divide_this_node();
@@ -165,10 +161,10 @@ impl<K: Ord + Clone, V: Clone> LsmTree<K, V> {
         }
 
         let insert_result = if index == node_reader.data.len() {
-            LsmTree::update_with_node(node_reader.right.clone().expect("this is not a leaf"), key ,value)
+            Self::update_with_node(node_reader.right.clone().expect("this is not a leaf"), key ,value)
         } else {
             let item = node_reader.data[index].left.clone().unwrap();
-            LsmTree::update_with_node(item, key, value)
+            Self::update_with_node(item, key, value)
         };
 
         let mut cloned = node_reader.clone();
@@ -183,11 +179,7 @@ impl<K: Ord + Clone, V: Clone> LsmTree<K, V> {
                 return InsertResult::Replace(Arc::new(RwLock::new(cloned)));
             }
             InsertResult::Divide(divide_info) => {
-                let new_item = ItemTuple::<K, V> {
-                    key: divide_info.tuple.0,
-                    value: divide_info.tuple.1,
-                    left: Some(divide_info.left),
-                };
+                let new_item = ItemTuple::new(divide_info.tuple.0, divide_info.tuple.1, Some(divide_info.left));
 
                 let index = max(0, index) as usize;
                 cloned.data.insert(index, new_item);
@@ -236,6 +228,8 @@ impl<K: Ord + Clone, V: Clone> LsmTree<K, V> {
         self.update_in_place(key, LsmTreeValueMarker::Deleted)
     }
 
+    /// Delete the keys in [start, end), the markers
+    /// of the range are written at `start` and `end`.
     #[allow(dead_code)]
     pub fn delete_range_in_place(&mut self, start: &K, end: &K) {
         assert!(start < end);
@@ -254,7 +248,7 @@ impl<K: Ord + Clone, V: Clone> LsmTree<K, V> {
 
         while !cursor.done() {
             let key = cursor.key().unwrap();
-            if &key > end {
+            if &key >= end {
                 break;
             }
 
@@ -264,7 +258,7 @@ impl<K: Ord + Clone, V: Clone> LsmTree<K, V> {
         }
     }
 
-    pub fn open_cursor(&self) -> TreeCursor<K, V> {
+    pub fn open_cursor(&self) -> TreeCursor<K, V, ORDER> {
         TreeCursor::new(self.root.clone())
     }
 
@@ -276,21 +270,38 @@ impl<K: Ord + Clone, V: Clone> LsmTree<K, V> {
 }
 
 #[derive(Clone)]
-pub(super) struct ItemTuple<K: Ord + Clone, V: Clone>{
+pub(super) struct ItemTuple<K: Ord + Clone + KeyPrefix, V: Clone, const ORDER: usize>{
+    /// The prefix of the key stored inline,
+    /// most of the comparisons don't need to read the key
+    pub(super) prefix: u64,
     pub(super) key: K,
     pub(super) value: LsmTreeValueMarker<V>,
-    pub(super) left: Option<Arc<RwLock<TreeNode<K, V>>>>,
+    pub(super) left: Option<Arc<RwLock<TreeNode<K, V, ORDER>>>>,
+}
+
+impl<K: Ord + Clone + KeyPrefix, V: Clone, const ORDER: usize> ItemTuple<K, V, ORDER> {
+
+    #[inline]
+    fn new(key: K, value: LsmTreeValueMarker<V>, left: Option<Arc<RwLock<TreeNode<K, V, ORDER>>>>) -> ItemTuple<K, V, ORDER> {
+        ItemTuple {
+            prefix: key.key_prefix(),
+            key,
+            value,
+            left,
+        }
+    }
+
 }
 
 #[derive(Clone)]
-pub(super) struct TreeNode<K: Ord + Clone, V: Clone> {
-    pub(super) data: Vec<ItemTuple<K, V>>,
-    pub(super) right: Option<Arc<RwLock<TreeNode<K, V>>>>,
+pub(super) struct TreeNode<K: Ord + Clone + KeyPrefix, V: Clone, const ORDER: usize> {
+    pub(super) data: Vec<ItemTuple<K, V, ORDER>>,
+    pub(super) right: Option<Arc<RwLock<TreeNode<K, V, ORDER>>>>,
 }
 
-impl<K: Ord + Clone, V: Clone> TreeNode<K, V> {
+impl<K: Ord + Clone + KeyPrefix, V: Clone, const ORDER: usize> TreeNode<K, V, ORDER> {
 
-    fn new() -> TreeNode<K, V> {
+    fn new() -> TreeNode<K, V, ORDER> {
         TreeNode {
             data: Vec::new(),
             right: None,
@@ -331,10 +342,11 @@ impl<K: Ord + Clone, V: Clone> TreeNode<K, V> {
     pub(super) fn find<Q: ?Sized>(&self, key: &Q) -> (usize, Ordering)
     where
         K: Borrow<Q> + Ord,
-        Q: Ord,
+        Q: Ord + KeyPrefix,
     {
         assert!(!self.data.is_empty());
 
+        let prefix = key.key_prefix();
         let mut low: isize = 0;
         let mut high: isize = (self.data.len() - 1) as isize;
 
@@ -342,7 +354,7 @@ impl<K: Ord + Clone, V: Clone> TreeNode<K, V> {
             let middle = (low + high) / 2;
             let tuple = &self.data[middle as usize];
 
-            let cmp_result = key.cmp(tuple.key.borrow());
+            let cmp_result = TreeNode::<K, V, ORDER>::cmp_tuple(prefix, key, tuple);
 
             match cmp_result {
                 Ordering::Equal => {
@@ -365,7 +377,19 @@ impl<K: Ord + Clone, V: Clone> TreeNode<K, V> {
             (idx, Ordering::Greater)
         } else {
             let tuple = &self.data[idx as usize];
-            (idx, key.cmp(tuple.key.borrow()))
+            (idx, TreeNode::<K, V, ORDER>::cmp_tuple(prefix, key, tuple))
+        }
+    }
+
+    #[inline]
+    fn cmp_tuple<Q: ?Sized>(prefix: u64, key: &Q, tuple: &ItemTuple<K, V, ORDER>) -> Ordering
+    where
+        K: Borrow<Q> + Ord,
+        Q: Ord + KeyPrefix,
+    {
+        match prefix.cmp(&tuple.prefix) {
+            Ordering::Equal => key.cmp(tuple.key.borrow()),
+            ord => ord,
         }
     }
 
@@ -375,17 +399,13 @@ impl<K: Ord + Clone, V: Clone> TreeNode<K, V> {
     }
 
     #[allow(dead_code)]
-    fn insert_in_place(&mut self, key: K, value: V) -> InsertInPlaceResult<K, V> {
+    fn insert_in_place(&mut self, key: K, value: V) -> InsertInPlaceResult<K, V, ORDER> {
         self.replace_in_place(key, LsmTreeValueMarker::Value(value))
     }
 
-    fn replace_in_place(&mut self, key: K, value: LsmTreeValueMarker<V>) -> InsertInPlaceResult<K, V> {
+    fn replace_in_place(&mut self, key: K, value: LsmTreeValueMarker<V>) -> InsertInPlaceResult<K, V, ORDER> {
         if self.data.is_empty() {
-            self.data.push(ItemTuple {
-                key,
-                value,
-                left: None,
-            });
+            self.data.push(ItemTuple::new(key, value, None));
             return InsertInPlaceResult::Normal;
         }
         let (index, order) = self.find(&key);
@@ -396,11 +416,7 @@ impl<K: Ord + Clone, V: Clone> TreeNode<K, V> {
             InsertInPlaceResult::LegacyValue(prev)
         } else {
             if self.is_leaf() {
-                let tuple = ItemTuple {
-                    key,
-                    value,
-                    left: None,
-                };
+                let tuple = ItemTuple::new(key, value, None);
                 self.data.insert(index, tuple);
 
                 if self.data.len() > ORDER {
@@ -421,11 +437,7 @@ impl<K: Ord + Clone, V: Clone> TreeNode<K, V> {
                     InsertInPlaceResult::Normal => insert_result,
                     InsertInPlaceResult::LegacyValue(_) => insert_result,
                     InsertInPlaceResult::Divide(divide_info) => {
-                        let new_item = ItemTuple::<K, V> {
-                            key: divide_info.tuple.0,
-                            value: divide_info.tuple.1,
-                            left: Some(divide_info.left),
-                        };
+                        let new_item = ItemTuple::new(divide_info.tuple.0, divide_info.tuple.1, Some(divide_info.left));
 
                         let index = max(0, index) as usize;
                         self.data.insert(index, new_item);
@@ -447,7 +459,7 @@ impl<K: Ord + Clone, V: Clone> TreeNode<K, V> {
         }
     }
 
-    fn divide_this_node(&mut self) -> DivideInfo<K, V> {
+    fn divide_this_node(&mut self) -> DivideInfo<K, V, ORDER> {
         let middle_index = self.data.len() / 2;
         let tuple = {
             let middle_item = &self.data[middle_index];
@@ -493,6 +505,8 @@ impl<K: Ord + Clone, V: Clone> TreeNode<K, V> {
 #[cfg(test)]
 mod tests {
     use std::cmp::Ordering;
+    use std::sync::Arc;
+    use std::time::Instant;
     use crate::lsm::lsm_tree::LsmTree;
 
     #[test]
@@ -660,4 +674,63 @@ mod tests {
         assert_eq!(tree.len(),  6);
     }
 
+    fn bench_order<const ORDER: usize>(keys: &[Arc<[u8]>]) {
+        let start = Instant::now();
+        let mut tree = LsmTree::<Arc<[u8]>, usize, ORDER>::new_with_order();
+        for (i, key) in keys.iter().enumerate() {
+            tree.insert_in_place(key.clone(), i);
+        }
+        let insert_in_place = start.elapsed();
+
+        let start = Instant::now();
+        let mut persistent = LsmTree::<Arc<[u8]>, usize, ORDER>::new_with_order();
+        for (i, key) in keys.iter().enumerate() {
+            persistent = persistent.insert(key.clone(), i);
+        }
+        let insert = start.elapsed();
+
+        let start = Instant::now();
+        let mut cursor = tree.open_cursor();
+        for key in keys {
+            assert_eq!(cursor.seek(key.as_ref()), Some(Ordering::Equal));
+        }
+        let seek = start.elapsed();
+
+        let start = Instant::now();
+        let mut cursor = tree.open_cursor();
+        cursor.go_to_min();
+        let mut count = 0;
+        while !cursor.done() {
+            count += 1;
+            cursor.next();
+        }
+        assert_eq!(count, keys.len());
+        let scan = start.elapsed();
+
+        let ops = |d: std::time::Duration| (keys.len() as f64) / d.as_secs_f64();
+        println!(
+            "order {:>3}: insert in place {:>10.0} ops/s, insert {:>10.0} ops/s, seek {:>10.0} ops/s, scan {:>11.0} ops/s",
+            ORDER, ops(insert_in_place), ops(insert), ops(seek), ops(scan),
+        );
+    }
+
+    /// Compare the orders of the tree,
+    /// run with `cargo test --release bench_tree_orders -- --ignored --nocapture`
+    #[test]
+    #[ignore]
+    fn bench_tree_orders() {
+        let keys: Vec<Arc<[u8]>> = (0..200_000u64)
+            .map(|i| {
+                let k = i.wrapping_mul(0x9e3779b97f4a7c15);
+                format!("key-{:016x}", k).as_bytes().into()
+            })
+            .collect();
+
+        bench_order::<8>(&keys);
+        bench_order::<16>(&keys);
+        bench_order::<32>(&keys);
+        bench_order::<64>(&keys);
+        bench_order::<128>(&keys);
+    }
+
 }
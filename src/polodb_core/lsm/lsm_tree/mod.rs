@@ -6,6 +6,7 @@
 mod lsm_tree;
 mod value_marker;
 mod tree_cursor;
+mod key_prefix;
 
 pub(crate) use lsm_tree::LsmTree;
 pub(crate) use tree_cursor::TreeCursor;
@@ -3,18 +3,20 @@ use std::cmp::{min, Ordering};
 use std::sync::{Arc, RwLock};
 use smallvec::{SmallVec, smallvec};
 use crate::lsm::lsm_tree::LsmTree;
+use crate::lsm::lsm_tree::lsm_tree::DEFAULT_ORDER;
+use super::key_prefix::KeyPrefix;
 use super::lsm_tree::TreeNode;
 use super::LsmTreeValueMarker;
 
-pub(crate) struct TreeCursor<K: Ord + Clone, V: Clone> {
-    root: Arc<RwLock<TreeNode<K, V>>>,
-    stack: SmallVec<[Arc<RwLock<TreeNode<K, V>>>; 8]>,
+pub(crate) struct TreeCursor<K: Ord + Clone + KeyPrefix, V: Clone, const ORDER: usize = DEFAULT_ORDER> {
+    root: Arc<RwLock<TreeNode<K, V, ORDER>>>,
+    stack: SmallVec<[Arc<RwLock<TreeNode<K, V, ORDER>>>; 8]>,
     indexes: SmallVec<[usize; 8]>,
 }
 
-impl<K: Ord + Clone, V: Clone> TreeCursor<K, V> {
+impl<K: Ord + Clone + KeyPrefix, V: Clone, const ORDER: usize> TreeCursor<K, V, ORDER> {
 
-    pub(super) fn new(root: Arc<RwLock<TreeNode<K, V>>>) -> TreeCursor<K, V> {
+    pub(super) fn new(root: Arc<RwLock<TreeNode<K, V, ORDER>>>) -> TreeCursor<K, V, ORDER> {
         let result = TreeCursor {
             root,
             stack: smallvec![],
@@ -48,7 +50,7 @@ impl<K: Ord + Clone, V: Clone> TreeCursor<K, V> {
     pub(crate) fn seek<Q: ?Sized>(&mut self, key: &Q) -> Option<Ordering>
     where
         K: Borrow<Q> + Ord,
-        Q: Ord
+        Q: Ord + KeyPrefix
     {
         self.stack.clear();
         self.indexes.clear();
@@ -62,7 +64,7 @@ impl<K: Ord + Clone, V: Clone> TreeCursor<K, V> {
     fn internal_seek<Q: ?Sized>(&mut self, key: &Q) -> Option<Ordering>
     where
         K: Borrow<Q> + Ord,
-        Q: Ord
+        Q: Ord + KeyPrefix
     {
         let back = self.stack.last().expect("the stack is empty").clone();
 
@@ -232,6 +234,33 @@ impl<K: Ord + Clone, V: Clone> TreeCursor<K, V> {
         self.stack.is_empty()
     }
 
+    /// Sample one of every `stride` keys in [start, end),
+    /// every sample stands for `stride` keys.
+    pub(crate) fn sample_keys(&mut self, start: &[u8], end: &[u8], stride: usize, samples: &mut Vec<(K, u64)>)
+    where
+        K: Borrow<[u8]>,
+    {
+        self.seek(start);
+        let mut index = 0usize;
+        while !self.done() {
+            let key = match self.key() {
+                Some(key) => key,
+                None => break,
+            };
+            let key_bytes: &[u8] = key.borrow();
+            if key_bytes >= end {
+                break;
+            }
+            if key_bytes >= start {
+                if index % stride == 0 {
+                    samples.push((key, stride as u64));
+                }
+                index += 1;
+            }
+            self.next();
+        }
+    }
+
     pub(super) fn update_inplace(&self, value: LsmTreeValueMarker<V>) -> LsmTreeValueMarker<V> {
         let index = *self.indexes.last().unwrap();
         let back = self.stack.last().unwrap();
@@ -241,7 +270,7 @@ impl<K: Ord + Clone, V: Clone> TreeCursor<K, V> {
         old_val
     }
 
-    pub(crate) fn update(&mut self, value: &LsmTreeValueMarker<V>) -> Option<(LsmTree<K, V>, Option<V>)> {
+    pub(crate) fn update(&mut self, value: &LsmTreeValueMarker<V>) -> Option<(LsmTree<K, V, ORDER>, Option<V>)> {
         let stack_len = self.stack.len() as i64;
         if stack_len == 0 {
             return None;
@@ -284,9 +313,9 @@ impl<K: Ord + Clone, V: Clone> TreeCursor<K, V> {
         Some(result)
     }
 
-    pub(crate) fn insert(&mut self, key: K, value: &LsmTreeValueMarker<V>) -> LsmTree<K, V> {
+    pub(crate) fn insert(&mut self, key: K, value: &LsmTreeValueMarker<V>) -> LsmTree<K, V, ORDER> {
         let root_node_ref = self.root.clone();
-        let root_tree = LsmTree::<K, V>::new_with_root(root_node_ref);
+        let root_tree = LsmTree::<K, V, ORDER>::new_with_root(root_node_ref);
         let new_tree = root_tree.update(key, value.clone());
         new_tree
     }
@@ -298,7 +327,7 @@ impl<K: Ord + Clone, V: Clone> TreeCursor<K, V> {
 
 }
 
-enum NextDirection<K: Ord + Clone, V: Clone> {
+enum NextDirection<K: Ord + Clone + KeyPrefix, V: Clone, const ORDER: usize> {
     Leaf(bool),  // is overflow
-    Other(Arc<RwLock<TreeNode<K, V>>>),  // next page
+    Other(Arc<RwLock<TreeNode<K, V, ORDER>>>),  // next page
 }
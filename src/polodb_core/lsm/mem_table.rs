@@ -1,12 +1,26 @@
 use std::cmp::Ordering;
 use std::sync::Arc;
-use crate::lsm::lsm_tree::TreeCursor;
+use crate::lsm::lsm_tree::{LsmTreeValueMarker, TreeCursor};
+use crate::lsm::range_delete::RangeDeletes;
+use crate::lsm::skip_list::{SkipList, SkipListCursor};
 use super::lsm_tree::LsmTree;
 
+/// The table is stored in a persistent b-tree by default.
+///
+/// If the skip list is enabled, the committed data is stored in the
+/// shared skip list, and the table is a view of it at `seq`.
+/// The tree only contains the writes of the session not committed.
+///
+/// The ranges deleted in the tree and the skip list are kept apart,
+/// the ones of the tree also shadow the skip list.
 #[derive(Clone)]
 pub(crate) struct MemTable {
     segments:    LsmTree<Arc<[u8]>, Arc<[u8]>>,
+    skip_list:   Option<Arc<SkipList>>,
+    seq:         u64,
     store_bytes: usize,
+    range_deletes:           RangeDeletes,
+    skip_list_range_deletes: RangeDeletes,
 }
 
 impl MemTable {
@@ -14,21 +28,38 @@ impl MemTable {
     pub fn new() -> MemTable {
         MemTable {
             segments: LsmTree::new(),
+            skip_list: None,
+            seq: 0,
             store_bytes: 0,
+            range_deletes: RangeDeletes::new(),
+            skip_list_range_deletes: RangeDeletes::new(),
+        }
+    }
+
+    pub fn new_with_skip_list() -> MemTable {
+        MemTable {
+            segments: LsmTree::new(),
+            skip_list: Some(Arc::new(SkipList::new())),
+            seq: 0,
+            store_bytes: 0,
+            range_deletes: RangeDeletes::new(),
+            skip_list_range_deletes: RangeDeletes::new(),
         }
     }
 
     pub fn get(&self, key: &[u8]) -> Option<Arc<[u8]>> {
+        self.get_marker(key)
+            .map(|marker| marker.into())
+            .flatten()
+    }
+
+    fn get_marker(&self, key: &[u8]) -> Option<LsmTreeValueMarker<Arc<[u8]>>> {
         let mut cursor = self.segments.open_cursor();
-        let ord  = cursor.seek(key)?;
-        if ord == Ordering::Equal {
-            cursor
-                .value()
-                .map(|marker| marker.into())
-                .flatten()
-        } else {
-            None
+        if cursor.seek(key) == Some(Ordering::Equal) {
+            return cursor.value();
         }
+        let skip_list = self.skip_list.as_ref()?;
+        skip_list.get(key, self.seq)
     }
 
     pub fn put<K, V>(&mut self, key: K, value: V, in_place: bool)
@@ -41,7 +72,13 @@ impl MemTable {
         let key_len = key.len();
         let value_len = value.len();
 
-        let prev = if in_place {
+        let prev = if let Some(skip_list) = self.skip_list.as_ref().filter(|_| in_place) {
+            // the versions are kept in the list,
+            // all of them take the space
+            self.seq += 1;
+            skip_list.insert(key, self.seq, LsmTreeValueMarker::Value(value));
+            None
+        } else if in_place {
             let prev = self.segments.insert_in_place(key, value);
             prev
         } else {
@@ -68,7 +105,11 @@ impl MemTable {
     where
         K: AsRef<[u8]>
     {
-        let prev = if in_place {
+        let prev = if let Some(skip_list) = self.skip_list.as_ref().filter(|_| in_place) {
+            self.seq += 1;
+            skip_list.insert(key.as_ref().into(), self.seq, LsmTreeValueMarker::Deleted);
+            None
+        } else if in_place {
             let key_arc = key.as_ref().into();
             self.segments.delete_in_place(key_arc);
             None
@@ -87,6 +128,78 @@ impl MemTable {
         }
     }
 
+    /// Delete the keys in [start, end) by a range.
+    ///
+    /// The keys of the table in the range are marked deleted,
+    /// the markers of the range are written at `start` and `end`,
+    /// and the range shadows the segments on the disk.
+    /// `end` must not be a key of the data, e.g. the successor of a prefix.
+    pub fn delete_range(&mut self, start: &[u8], end: &[u8], in_place: bool) {
+        let start: Arc<[u8]> = start.into();
+        let end: Arc<[u8]> = end.into();
+
+        if let Some(skip_list) = self.skip_list.clone().filter(|_| in_place) {
+            let mut cursor = SkipListCursor::new(skip_list.clone(), self.seq);
+            let keys = keys_not_deleted(&mut cursor, &start, &end);
+
+            self.seq += 1;
+            for key in keys {
+                self.store_bytes += 1 + key.len();
+                skip_list.insert(key, self.seq, LsmTreeValueMarker::Deleted);
+            }
+            skip_list.insert(start.clone(), self.seq, LsmTreeValueMarker::DeleteStart);
+            skip_list.insert(end.clone(), self.seq, LsmTreeValueMarker::DeleteEnd);
+            self.skip_list_range_deletes.insert(start.clone(), end.clone());
+        } else {
+            let mut cursor = self.segments.open_cursor();
+            let mut keys = vec![];
+            cursor.seek(start.as_ref());
+            while let Some(key) = cursor.key() {
+                if key.as_ref() >= end.as_ref() {
+                    break;
+                }
+                // the deleted keys and the markers of the nested ranges are kept
+                if let Some(LsmTreeValueMarker::Value(value)) = cursor.value() {
+                    self.store_bytes = self.store_bytes.saturating_sub(value.len());
+                    keys.push(key);
+                }
+                cursor.next();
+            }
+
+            for key in keys {
+                if in_place {
+                    self.segments.delete_in_place(key);
+                } else {
+                    self.segments = self.segments.delete(key);
+                }
+            }
+
+            if in_place {
+                self.segments.update_in_place(start.clone(), LsmTreeValueMarker::DeleteStart);
+                self.segments.update_in_place(end.clone(), LsmTreeValueMarker::DeleteEnd);
+            } else {
+                self.segments = self.segments
+                    .update(start.clone(), LsmTreeValueMarker::DeleteStart)
+                    .update(end.clone(), LsmTreeValueMarker::DeleteEnd);
+            }
+            self.range_deletes.insert(start.clone(), end.clone());
+        }
+
+        self.store_bytes += 2 + start.len() + end.len();
+    }
+
+    /// The ranges deleted in the tree
+    #[inline]
+    pub fn range_deletes(&self) -> &RangeDeletes {
+        &self.range_deletes
+    }
+
+    /// The ranges deleted in the skip list, not shadowed by the tree
+    #[inline]
+    pub fn skip_list_range_deletes(&self) -> &RangeDeletes {
+        &self.skip_list_range_deletes
+    }
+
     #[inline]
     pub fn store_bytes(&self) -> usize {
         self.store_bytes
@@ -101,19 +214,145 @@ impl MemTable {
         self.segments = new_tree;
     }
 
+    /// Make the writes of the session visible in this table.
+    pub fn commit(&mut self, session_table: &MemTable) {
+        if self.skip_list.is_none() {
+            *self = session_table.clone();
+            return;
+        }
+        let skip_list = self.skip_list.as_ref().unwrap();
+
+        // all the writes share a sequence number,
+        // the readers see none of them until the number is published
+        let seq = self.seq + 1;
+
+        // the ranges of the session shadow the committed keys,
+        // they are deleted in the list unless the session writes them again
+        for (start, end) in session_table.range_deletes.iter() {
+            let mut list_cursor = SkipListCursor::new(skip_list.clone(), self.seq);
+            for key in keys_not_deleted(&mut list_cursor, start, end) {
+                let mut tree_cursor = session_table.segments.open_cursor();
+                if tree_cursor.seek(key.as_ref()) == Some(Ordering::Equal) {
+                    continue;
+                }
+                self.store_bytes += 1 + key.len();
+                skip_list.insert(key, seq, LsmTreeValueMarker::Deleted);
+            }
+        }
+        self.skip_list_range_deletes.extend(&session_table.range_deletes);
+
+        let mut cursor = session_table.segments.open_cursor();
+        cursor.go_to_min();
+
+        while let (Some(key), Some(value)) = (cursor.key(), cursor.value()) {
+            self.store_bytes += 1 + key.len();
+            if let LsmTreeValueMarker::Value(v) = &value {
+                self.store_bytes += v.len();
+            }
+            skip_list.insert(key, seq, value);
+            cursor.next();
+        }
+
+        self.seq = seq;
+    }
+
+    /// The cursor on the tree, it's the whole table
+    /// if the skip list is not enabled.
     #[inline]
     pub fn open_cursor(&self) -> TreeCursor<Arc<[u8]>, Arc<[u8]>> {
         self.segments.open_cursor()
     }
 
+    /// The cursor on the committed data in the skip list
+    pub fn open_skip_list_cursor(&self) -> Option<SkipListCursor> {
+        self.skip_list
+            .as_ref()
+            .map(|skip_list| SkipListCursor::new(skip_list.clone(), self.seq))
+    }
+
+    /// Sample the keys in [start, end) of the tree and the skip list
+    pub fn sample_keys(&self, start: &[u8], end: &[u8], stride: usize, samples: &mut Vec<(Arc<[u8]>, u64)>) {
+        self.segments.open_cursor().sample_keys(start, end, stride, samples);
+        if let Some(mut cursor) = self.open_skip_list_cursor() {
+            cursor.sample_keys(start, end, stride, samples);
+        }
+    }
+
+    /// Iterate all the tuples of a committed table in order
+    pub fn tuples(&self) -> MemTableIter {
+        match self.open_skip_list_cursor() {
+            Some(mut cursor) => {
+                cursor.go_to_min();
+                MemTableIter::SkipList(cursor)
+            }
+            None => {
+                let mut cursor = self.segments.open_cursor();
+                cursor.go_to_min();
+                MemTableIter::Tree(cursor)
+            }
+        }
+    }
+
     pub(crate) fn clear(&mut self) {
         self.segments.clear();
+        self.range_deletes = RangeDeletes::new();
+        self.skip_list_range_deletes = RangeDeletes::new();
+        if self.skip_list.is_some() {
+            // the sessions reading the old list still hold it
+            self.skip_list = Some(Arc::new(SkipList::new()));
+            self.seq = 0;
+        }
         self.store_bytes = 0;
     }
 
     #[inline]
     pub fn len(&self) -> usize {
-        self.segments.len()
+        let list_len = self.skip_list
+            .as_ref()
+            .map(|skip_list| skip_list.len())
+            .unwrap_or(0);
+        self.segments.len() + list_len
+    }
+
+}
+
+/// The keys in [start, end) of the list not deleted
+fn keys_not_deleted(cursor: &mut SkipListCursor, start: &[u8], end: &[u8]) -> Vec<Arc<[u8]>> {
+    let mut keys = vec![];
+    cursor.seek(start);
+    while let (Some(key), Some(marker)) = (cursor.key(), cursor.marker()) {
+        if key.as_ref() >= end {
+            break;
+        }
+        if !marker.is_deleted() {
+            keys.push(key);
+        }
+        cursor.next();
+    }
+    keys
+}
+
+pub(crate) enum MemTableIter {
+    Tree(TreeCursor<Arc<[u8]>, Arc<[u8]>>),
+    SkipList(SkipListCursor),
+}
+
+impl Iterator for MemTableIter {
+    type Item = (Arc<[u8]>, LsmTreeValueMarker<Arc<[u8]>>);
+
+    fn next(&mut self) -> Option<Self::Item> {
+        match self {
+            MemTableIter::Tree(cursor) => {
+                let tuple = (cursor.key()?, cursor.value()?);
+                cursor.next();
+                Some(tuple)
+            }
+            MemTableIter::SkipList(cursor) => {
+                let tuple = (cursor.key()?, cursor.value()?);
+                cursor.next();
+                Some(tuple)
+            }
+        }
     }
 
 }
@@ -6,13 +6,21 @@
 mod lsm_backend;
 mod lsm_kv;
 mod lsm_segment;
+mod block_index;
+mod block_compression;
+mod bloom_filter;
 mod lsm_snapshot;
 mod mem_table;
+mod skip_list;
 mod kv_cursor;
 mod lsm_tree;
 pub(crate) mod multi_cursor;
 mod lsm_metrics;
 mod lsm_session;
+mod compaction_worker;
+mod leveled_compaction;
+mod value_cache;
+mod range_delete;
 
 pub use lsm_kv::LsmKv;
 pub(crate) use lsm_kv::LsmKvInner;
@@ -1,25 +1,60 @@
 use std::sync::Arc;
 use std::cmp::Ordering;
 use crate::Result;
+use crate::lsm::block_index::BlockCursor;
 use crate::lsm::lsm_kv::LsmKvInner;
 use crate::lsm::lsm_segment::LsmTuplePtr;
 use crate::lsm::lsm_tree::{LsmTree, LsmTreeValueMarker, TreeCursor};
+use crate::lsm::multi_cursor::LevelCursor;
+use crate::lsm::skip_list::SkipListCursor;
 
 pub(crate) enum CursorRepr {
     MemTableCursor(TreeCursor<Arc<[u8]>, Arc<[u8]>>),
     SegTableCursor(TreeCursor<Arc<[u8]>, LsmTuplePtr>),
+    SegBlockCursor(BlockCursor),
+    SkipListCursor(SkipListCursor),
+    /// The segments of a level after level 0
+    LevelCursor(LevelCursor),
 }
 
 impl CursorRepr {
 
-    pub fn seek(&mut self, key: &[u8]) -> Option<Ordering> {
+    pub fn seek(&mut self, key: &[u8]) -> Result<Option<Ordering>> {
         match self {
             CursorRepr::MemTableCursor(cursor) => {
-                cursor.seek(key)
+                Ok(cursor.seek(key))
             }
             CursorRepr::SegTableCursor(cursor) => {
+                Ok(cursor.seek(key))
+            }
+            CursorRepr::SegBlockCursor(cursor) => {
                 cursor.seek(key)
             }
+            CursorRepr::SkipListCursor(cursor) => {
+                Ok(cursor.seek(key))
+            }
+            CursorRepr::LevelCursor(cursor) => {
+                cursor.seek(key)
+            }
+        }
+    }
+
+    /// Return false if the cursor is on a segment whose Bloom filter
+    /// proves the key is absent.
+    pub fn may_contain(&self, key: &[u8]) -> bool {
+        match self {
+            CursorRepr::SegBlockCursor(cursor) => cursor.index().may_contain(key),
+            CursorRepr::LevelCursor(cursor) => cursor.may_contain(key),
+            _ => true,
+        }
+    }
+
+    #[inline]
+    pub fn has_filter(&self) -> bool {
+        match self {
+            CursorRepr::SegBlockCursor(cursor) => cursor.index().has_filter(),
+            CursorRepr::LevelCursor(cursor) => cursor.has_filter(),
+            _ => false,
         }
     }
 
@@ -58,6 +93,16 @@ impl CursorRepr {
                 cursor.go_to_min();
                 Ok(())
             }
+            CursorRepr::SegBlockCursor(cursor) => {
+                cursor.go_to_min()
+            }
+            CursorRepr::SkipListCursor(cursor) => {
+                cursor.go_to_min();
+                Ok(())
+            }
+            CursorRepr::LevelCursor(cursor) => {
+                cursor.go_to_min()
+            }
         }
     }
 
@@ -65,6 +110,9 @@ impl CursorRepr {
         match self {
             CursorRepr::MemTableCursor(cursor) => cursor.key(),
             CursorRepr::SegTableCursor(cursor) => cursor.key(),
+            CursorRepr::SegBlockCursor(cursor) => cursor.key(),
+            CursorRepr::SkipListCursor(cursor) => cursor.key(),
+            CursorRepr::LevelCursor(cursor) => cursor.key(),
         }
     }
 
@@ -75,25 +123,40 @@ impl CursorRepr {
                 Ok(result)
             }
             CursorRepr::SegTableCursor(cursor) => {
-                let ptr = cursor.value();
-                if ptr.is_none() {
-                    return Ok(None);
-                }
-                let marker = ptr.unwrap();
-                let result = match marker {
-                    LsmTreeValueMarker::Deleted => LsmTreeValueMarker::Deleted,
-                    LsmTreeValueMarker::DeleteStart => LsmTreeValueMarker::DeleteStart,
-                    LsmTreeValueMarker::DeleteEnd => LsmTreeValueMarker::DeleteEnd,
-                    LsmTreeValueMarker::Value(tuple) => {
-                        let buffer = db.read_segment_by_ptr(tuple)?;
-                        LsmTreeValueMarker::Value(buffer)
-                    }
-                };
-                Ok(Some(result))
+                CursorRepr::read_tuple_ptr(db, cursor.value())
+            }
+            CursorRepr::SegBlockCursor(cursor) => {
+                CursorRepr::read_tuple_ptr(db, cursor.value())
+            }
+            CursorRepr::SkipListCursor(cursor) => {
+                Ok(cursor.value())
+            }
+            CursorRepr::LevelCursor(cursor) => {
+                cursor.value(db)
             }
         }
     }
 
+    fn read_tuple_ptr(
+        db: &LsmKvInner,
+        ptr: Option<LsmTreeValueMarker<LsmTuplePtr>>,
+    ) -> Result<Option<LsmTreeValueMarker<Arc<[u8]>>>> {
+        if ptr.is_none() {
+            return Ok(None);
+        }
+        let marker = ptr.unwrap();
+        let result = match marker {
+            LsmTreeValueMarker::Deleted => LsmTreeValueMarker::Deleted,
+            LsmTreeValueMarker::DeleteStart => LsmTreeValueMarker::DeleteStart,
+            LsmTreeValueMarker::DeleteEnd => LsmTreeValueMarker::DeleteEnd,
+            LsmTreeValueMarker::Value(tuple) => {
+                let buffer = db.read_segment_by_ptr(tuple)?;
+                LsmTreeValueMarker::Value(buffer)
+            }
+        };
+        Ok(Some(result))
+    }
+
     pub fn marker(&self) -> Result<Option<LsmTreeValueMarker<()>>> {
         match self {
             CursorRepr::MemTableCursor(mem_table_cursor) => {
@@ -104,6 +167,17 @@ impl CursorRepr {
                 let result = cursor.marker();
                 Ok(result)
             }
+            CursorRepr::SegBlockCursor(cursor) => {
+                let result = cursor.marker();
+                Ok(result)
+            }
+            CursorRepr::SkipListCursor(cursor) => {
+                let result = cursor.marker();
+                Ok(result)
+            }
+            CursorRepr::LevelCursor(cursor) => {
+                cursor.marker()
+            }
         }
     }
 
@@ -117,6 +191,16 @@ impl CursorRepr {
                 cursor.next();
                 Ok(())
             }
+            CursorRepr::SegBlockCursor(cursor) => {
+                cursor.next()
+            }
+            CursorRepr::SkipListCursor(cursor) => {
+                cursor.next();
+                Ok(())
+            }
+            CursorRepr::LevelCursor(cursor) => {
+                cursor.next()
+            }
         }
     }
 
@@ -124,6 +208,9 @@ impl CursorRepr {
         match self {
             CursorRepr::MemTableCursor(cursor) => cursor.reset(),
             CursorRepr::SegTableCursor(cursor) => cursor.reset(),
+            CursorRepr::SegBlockCursor(cursor) => cursor.reset(),
+            CursorRepr::SkipListCursor(cursor) => cursor.reset(),
+            CursorRepr::LevelCursor(cursor) => cursor.reset(),
         }
     }
 
@@ -131,12 +218,17 @@ impl CursorRepr {
         match self {
             CursorRepr::MemTableCursor(cursor) => cursor.done(),
             CursorRepr::SegTableCursor(cursor) => cursor.done(),
+            CursorRepr::SegBlockCursor(cursor) => cursor.done(),
+            CursorRepr::SkipListCursor(cursor) => cursor.done(),
+            CursorRepr::LevelCursor(cursor) => cursor.done(),
         }
     }
 
     pub fn unwrap_tuple_ptr(&self) -> LsmTreeValueMarker<LsmTuplePtr> {
         match self {
             CursorRepr::SegTableCursor(cursor) => cursor.value().unwrap(),
+            CursorRepr::SegBlockCursor(cursor) => cursor.value().unwrap(),
+            CursorRepr::LevelCursor(cursor) => cursor.unwrap_tuple_ptr(),
             _ => panic!("this is not seg table"),
         }
     }
@@ -158,3 +250,27 @@ impl Into<CursorRepr> for TreeCursor<Arc<[u8]>, LsmTuplePtr> {
     }
 
 }
+
+impl Into<CursorRepr> for BlockCursor {
+
+    fn into(self) -> CursorRepr {
+        CursorRepr::SegBlockCursor(self)
+    }
+
+}
+
+impl Into<CursorRepr> for SkipListCursor {
+
+    fn into(self) -> CursorRepr {
+        CursorRepr::SkipListCursor(self)
+    }
+
+}
+
+impl Into<CursorRepr> for LevelCursor {
+
+    fn into(self) -> CursorRepr {
+        CursorRepr::LevelCursor(self)
+    }
+
+}
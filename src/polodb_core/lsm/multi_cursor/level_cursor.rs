@@ -0,0 +1,161 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+use std::cmp::Ordering;
+use std::sync::Arc;
+use crate::Result;
+use crate::lsm::lsm_kv::LsmKvInner;
+use crate::lsm::lsm_segment::{ImLsmSegment, LsmTuplePtr};
+use crate::lsm::lsm_tree::LsmTreeValueMarker;
+use crate::lsm::multi_cursor::CursorRepr;
+
+/// Iterate the segments of a level as one sorted run.
+///
+/// The segments must be sorted and not overlapped,
+/// a seek only searches the segment covering the key.
+pub(crate) struct LevelCursor {
+    first_keys: Vec<Arc<[u8]>>,
+    cursors:    Vec<CursorRepr>,
+    current:    usize,
+}
+
+impl LevelCursor {
+
+    pub fn new(segments: &[ImLsmSegment]) -> LevelCursor {
+        let mut first_keys = Vec::with_capacity(segments.len());
+        let mut cursors = Vec::with_capacity(segments.len());
+
+        for segment in segments {
+            // the empty segments contain nothing to iterate
+            if let Some(first_key) = segment.first_key() {
+                first_keys.push(first_key);
+                cursors.push(segment.open_cursor());
+            }
+        }
+
+        let current = cursors.len();
+        LevelCursor {
+            first_keys,
+            cursors,
+            current,
+        }
+    }
+
+    /// The last segment whose first key is not greater than the key
+    fn segment_of(&self, key: &[u8]) -> usize {
+        let pos = self.first_keys.partition_point(|first_key| first_key.as_ref() <= key);
+        if pos == 0 {
+            0
+        } else {
+            pos - 1
+        }
+    }
+
+    /// Move to the first key of the segment at `index`
+    fn enter_segment(&mut self, index: usize) -> Result<()> {
+        self.current = index;
+        if self.current < self.cursors.len() {
+            self.cursors[self.current].go_to_min()?;
+        }
+        Ok(())
+    }
+
+    pub fn seek(&mut self, key: &[u8]) -> Result<Option<Ordering>> {
+        if self.cursors.is_empty() {
+            return Ok(None);
+        }
+
+        self.current = self.segment_of(key);
+        match self.cursors[self.current].seek(key)? {
+            Some(Ordering::Greater) | None => {
+                self.cursors[self.current].reset();
+                // the next segment starts after the key
+                self.enter_segment(self.current + 1)?;
+                if self.done() {
+                    Ok(Some(Ordering::Greater))
+                } else {
+                    Ok(Some(Ordering::Less))
+                }
+            }
+            order => Ok(order),
+        }
+    }
+
+    /// The keys before the level can be excluded without the filter.
+    pub fn may_contain(&self, key: &[u8]) -> bool {
+        match self.first_keys.first() {
+            Some(first_key) if key >= first_key.as_ref() => {
+                self.cursors[self.segment_of(key)].may_contain(key)
+            }
+            _ => false,
+        }
+    }
+
+    #[inline]
+    pub fn has_filter(&self) -> bool {
+        match self.cursors.get(self.current) {
+            Some(cursor) => cursor.has_filter(),
+            None => false,
+        }
+    }
+
+    pub fn go_to_min(&mut self) -> Result<()> {
+        self.enter_segment(0)
+    }
+
+    pub fn next(&mut self) -> Result<()> {
+        if self.done() {
+            return Ok(());
+        }
+        self.cursors[self.current].next()?;
+        if self.cursors[self.current].done() {
+            self.enter_segment(self.current + 1)?;
+        }
+        Ok(())
+    }
+
+    #[inline]
+    fn current_cursor(&self) -> Option<&CursorRepr> {
+        self.cursors.get(self.current)
+    }
+
+    pub fn key(&self) -> Option<Arc<[u8]>> {
+        self.current_cursor().and_then(|cursor| cursor.key())
+    }
+
+    pub fn value(&self, db: &LsmKvInner) -> Result<Option<LsmTreeValueMarker<Arc<[u8]>>>> {
+        match self.current_cursor() {
+            Some(cursor) => cursor.value(db),
+            None => Ok(None),
+        }
+    }
+
+    pub fn marker(&self) -> Result<Option<LsmTreeValueMarker<()>>> {
+        match self.current_cursor() {
+            Some(cursor) => cursor.marker(),
+            None => Ok(None),
+        }
+    }
+
+    pub fn unwrap_tuple_ptr(&self) -> LsmTreeValueMarker<LsmTuplePtr> {
+        self.current_cursor().unwrap().unwrap_tuple_ptr()
+    }
+
+    pub fn reset(&mut self) {
+        if let Some(cursor) = self.cursors.get_mut(self.current) {
+            cursor.reset();
+        }
+        self.current = self.cursors.len();
+    }
+
+    #[inline]
+    pub fn done(&self) -> bool {
+        match self.current_cursor() {
+            Some(cursor) => cursor.done(),
+            None => true,
+        }
+    }
+
+}
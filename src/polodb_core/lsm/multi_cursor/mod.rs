@@ -5,6 +5,8 @@
  */
 mod cursor_repr;
 mod multi_cursor;
+mod level_cursor;
 
 pub(crate) use cursor_repr::CursorRepr;
 pub(crate) use multi_cursor::MultiCursor;
+pub(crate) use level_cursor::LevelCursor;
@@ -1,10 +1,12 @@
 use std::cmp::Ordering;
 use std::sync::Arc;
 use crate::Result;
+use crate::lsm::LsmMetrics;
 use crate::lsm::lsm_kv::LsmKvInner;
 use crate::lsm::lsm_segment::LsmTuplePtr;
 use crate::lsm::lsm_tree::{LsmTree, LsmTreeValueMarker};
 use crate::lsm::multi_cursor::CursorRepr;
+use crate::lsm::range_delete::RangeDeletes;
 
 /// This is a cursor used to iterate
 /// kv on multi-level lsm-tree.
@@ -12,6 +14,17 @@ pub(crate) struct MultiCursor {
     cursors: Vec<CursorRepr>,
     keys: Vec<Option<Arc<[u8]>>>,
     first_result: i64,
+    /// Some cursors are skipped by `seek_exact` with this key,
+    /// they must be positioned again before moving next.
+    partial_key: Option<Arc<[u8]>>,
+    metrics: Option<LsmMetrics>,
+    /// Return the point deletes instead of skipping them,
+    /// the compaction needs them to shadow the lower levels.
+    keep_deletes: bool,
+    /// The ranges deleted by every cursor, they shadow
+    /// the keys of the following cursors.
+    range_deletes: Vec<RangeDeletes>,
+    has_range_deletes: bool,
 }
 
 type UpdateResult = Option<(LsmTree<Arc<[u8]>, Arc<[u8]>>, Option<Arc<[u8]>>)>;
@@ -24,9 +37,32 @@ impl MultiCursor {
             cursors,
             keys: vec![None; len],
             first_result: -1,
+            partial_key: None,
+            metrics: None,
+            keep_deletes: false,
+            range_deletes: vec![RangeDeletes::new(); len],
+            has_range_deletes: false,
         }
     }
 
+    /// Return the point deletes and the markers of the ranges
+    /// instead of skipping them. The keys shadowed by the ranges
+    /// are skipped anyway.
+    pub fn set_keep_deletes(&mut self, keep_deletes: bool) {
+        self.keep_deletes = keep_deletes;
+    }
+
+    /// The ranges deleted by every cursor, in the order of the cursors
+    pub fn set_range_deletes(&mut self, range_deletes: Vec<RangeDeletes>) {
+        assert_eq!(range_deletes.len(), self.cursors.len());
+        self.has_range_deletes = range_deletes.iter().any(|ranges| !ranges.is_empty());
+        self.range_deletes = range_deletes;
+    }
+
+    pub fn set_metrics(&mut self, metrics: LsmMetrics) {
+        self.metrics = Some(metrics);
+    }
+
     pub fn update_current(&mut self, value: &[u8]) -> Result<UpdateResult> {
         let buf: Arc<[u8]> = value.into();
         if self.first_result == 0 {
@@ -68,6 +104,7 @@ impl MultiCursor {
 
     pub fn go_to_min(&mut self) -> Result<()> {
         self.first_result = -1;
+        self.partial_key = None;
         let mut idx: usize = 0;
         for cursor in &mut self.cursors {
             cursor.go_to_min()?;
@@ -82,10 +119,11 @@ impl MultiCursor {
 
     pub fn seek(&mut self, key: &[u8]) -> Result<()> {
         self.first_result = -1;
+        self.partial_key = None;
         let mut idx: usize = 0;
 
         for cursor in &mut self.cursors {
-            let tmp = cursor.seek(key);
+            let tmp = cursor.seek(key)?;
 
             // the key is greater than every keys in the set
             if let Some(Ordering::Greater) = tmp {
@@ -101,6 +139,68 @@ impl MultiCursor {
         self.fin_min_key_and_seek_to_value()
     }
 
+    /// Seek for a point lookup, return true if the key is found.
+    ///
+    /// The segments whose Bloom filters exclude the key are not searched.
+    /// The cursor is still valid for iteration, the skipped segments are
+    /// positioned again on the next move.
+    pub fn seek_exact(&mut self, key: &[u8]) -> Result<bool> {
+        self.first_result = -1;
+        self.partial_key = None;
+        let mut idx: usize = 0;
+
+        for cursor in &mut self.cursors {
+            if !cursor.may_contain(key) {
+                if let Some(metrics) = &self.metrics {
+                    metrics.add_bloom_filter_negative();
+                }
+                cursor.reset();
+                self.keys[idx] = None;
+                if self.partial_key.is_none() {
+                    self.partial_key = Some(key.into());
+                }
+                idx += 1;
+                continue;
+            }
+
+            let tmp = cursor.seek(key)?;
+
+            if cursor.has_filter() {
+                if let Some(metrics) = &self.metrics {
+                    if let Some(Ordering::Equal) = tmp {
+                        metrics.add_bloom_filter_positive();
+                    } else {
+                        metrics.add_bloom_filter_false_positive();
+                    }
+                }
+            }
+
+            if let Some(Ordering::Greater) = tmp {
+                cursor.reset();
+                self.keys[idx] = None;
+            } else {
+                self.keys[idx] = cursor.key();
+            }
+
+            idx += 1;
+        }
+
+        self.fin_min_key_and_seek_to_value()?;
+
+        match self.key() {
+            Some(current) => Ok(current.as_ref() == key),
+            None => Ok(false),
+        }
+    }
+
+    /// Position the skipped cursors after `seek_exact`
+    fn restore_partial(&mut self) -> Result<()> {
+        match self.partial_key.take() {
+            Some(key) => self.seek(key.as_ref()),
+            None => Ok(()),
+        }
+    }
+
     /// seek to the min keys in the cursor vec
     fn fin_min_key_and_seek_to_value(&mut self) -> Result<()> {
         let mut min_key_idx: i64 = -1;
@@ -147,63 +247,71 @@ impl MultiCursor {
 
         let first_fit = self.first_result as usize;
 
-        let fit_marker = self.cursors[first_fit].marker()?.clone();
-
-        match fit_marker {
+        let fit_marker = match self.cursors[first_fit].marker()? {
+            Some(marker) => marker,
             None => {
                 // The set is empty
                 return Ok(false);
             }
-            Some(LsmTreeValueMarker::Value(_)) => { return Ok(false) }
-            Some(LsmTreeValueMarker::Deleted) => {
-                let fit_key = self.keys[first_fit].clone().unwrap();
+        };
+        let fit_key = self.keys[first_fit].clone().unwrap();
+
+        if let Some((source, end)) = self.covering_range(first_fit, &fit_key) {
+            self.skip_covered_keys(source, &end)?;
+            return Ok(true);
+        }
+
+        match fit_marker {
+            LsmTreeValueMarker::Value(_) => Ok(false),
+            _ if self.keep_deletes => Ok(false),
+            _ => {
+                // the markers of the ranges are skipped like the point deletes,
+                // the ranges are checked by `covering_range`
                 self.push_following_cursor_bigger_than(first_fit, &fit_key)?;
 
                 self.cursor_next(first_fit)?;
 
                 Ok(true)
             }
-            Some(LsmTreeValueMarker::DeleteStart) => {
-                let mut key_base: Option<Arc<[u8]>> = None;
-                loop {
-                    self.cursors[first_fit].next()?;
-                    let key_opt = self.cursors[first_fit].key();
-                    let marker = self.cursors[first_fit].marker()?;
-                    self.keys[first_fit] = key_opt.clone();
-                    match (&key_opt, &marker) {
-                        (None, _) => {
-                            break;
-                        }
-                        (Some(key), Some(LsmTreeValueMarker::DeleteEnd)) => {
-                            key_base = Some(key.clone());
-                            break;
-                        }
-                        _ => ()  // continue
-                    }
-                }
-                match key_base {
-                    Some(key) => {
-                        self.push_following_cursor_bigger_than(first_fit, &key)?;
-
-                        self.cursor_next(first_fit)?;
+        }
+    }
 
-                        Ok(true)
-                    }
-                    None => {
-                        self.reset_following_cursors(first_fit)?;
-                        Ok(true)
-                    }
-                }
+    /// The newest cursor before `index` deleting a range containing the key,
+    /// and the end of the range.
+    fn covering_range(&self, index: usize, key: &[u8]) -> Option<(usize, Arc<[u8]>)> {
+        if !self.has_range_deletes {
+            return None;
+        }
+        for source in 0..index {
+            if let Some(end) = self.range_deletes[source].covering_end(key) {
+                return Some((source, end.clone()));
             }
-            Some(LsmTreeValueMarker::DeleteEnd) => {
-                let fit_key = self.keys[first_fit].clone().unwrap();
-                self.push_following_cursor_bigger_than(first_fit, &fit_key)?;
+        }
+        None
+    }
 
-                self.cursor_next(first_fit)?;
+    /// Move the cursors after `source` to the end of the range,
+    /// the keys before it are covered.
+    fn skip_covered_keys(&mut self, source: usize, end: &Arc<[u8]>) -> Result<()> {
+        for idx in (source + 1)..(self.cursors.len()) {
+            let covered = match &self.keys[idx] {
+                Some(key) => key.as_ref() < end.as_ref(),
+                None => false,
+            };
+            if !covered {
+                continue;
+            }
 
-                Ok(true)
+            let cursor = &mut self.cursors[idx];
+            if let Some(Ordering::Greater) = cursor.seek(end.as_ref())? {
+                cursor.reset();
+                self.keys[idx] = None;
+            } else {
+                self.keys[idx] = cursor.key();
             }
         }
+
+        Ok(())
     }
 
     #[inline]
@@ -241,14 +349,6 @@ impl MultiCursor {
         Ok(result)
     }
 
-    fn reset_following_cursors(&mut self, index_base: usize) -> Result<()> {
-        for idx in (index_base + 1)..(self.cursors.len()) {
-            self.cursors[idx].reset();
-        }
-
-        Ok(())
-    }
-
     pub fn value(&self, db: &LsmKvInner) -> Result<Option<Arc<[u8]>>> {
         if self.first_result >= 0 {
             let cursor = &self.cursors[self.first_result as usize];
@@ -272,6 +372,8 @@ impl MultiCursor {
     }
 
     pub fn next(&mut self) -> Result<()> {
+        self.restore_partial()?;
+
         if self.first_result < 0 && self.first_result >= (self.keys.len() as i64) {
             return Ok(());
         }
@@ -327,8 +429,9 @@ impl MultiCursor {
 #[cfg(test)]
 mod tests {
     use std::sync::Arc;
-    use crate::lsm::lsm_tree::LsmTree;
+    use crate::lsm::lsm_tree::{LsmTree, LsmTreeValueMarker};
     use crate::lsm::multi_cursor::MultiCursor;
+    use crate::lsm::range_delete::RangeDeletes;
 
     #[test]
     fn test_order_of_multi_cursor() {
@@ -420,4 +523,47 @@ mod tests {
         assert!(cursor.done());
     }
 
+    #[test]
+    fn test_range_deleted() {
+        let map0 = {
+            let mut map = LsmTree::<Arc<[u8]>, Arc<[u8]>>::new();
+            map.update_in_place([20].as_ref().into(), LsmTreeValueMarker::DeleteStart);
+            map.insert_in_place([30].as_ref().into(), vec![30].into());
+            map.update_in_place([45].as_ref().into(), LsmTreeValueMarker::DeleteEnd);
+            map
+        };
+
+        let map1 = {
+            let mut map = LsmTree::<Arc<[u8]>, Arc<[u8]>>::new();
+            for key in [10u8, 20, 30, 40, 50].iter() {
+                map.insert_in_place([*key].as_ref().into(), vec![*key].into());
+            }
+            map
+        };
+
+        let mut ranges = RangeDeletes::new();
+        ranges.insert([20].as_ref().into(), [45].as_ref().into());
+
+        let mut cursor = MultiCursor::new(vec![
+            map0.open_cursor().into(),
+            map1.open_cursor().into(),
+        ]);
+        cursor.set_range_deletes(vec![ranges, RangeDeletes::new()]);
+
+        cursor.seek(&[10]).unwrap();
+        assert_eq!(cursor.key().unwrap().as_ref(), &[10]);
+
+        cursor.next().unwrap();
+        assert_eq!(cursor.key().unwrap().as_ref(), &[30]);
+
+        cursor.next().unwrap();
+        assert_eq!(cursor.key().unwrap().as_ref(), &[50]);
+
+        cursor.next().unwrap();
+        assert!(cursor.done());
+
+        cursor.seek(&[35]).unwrap();
+        assert_eq!(cursor.key().unwrap().as_ref(), &[50]);
+    }
+
 }
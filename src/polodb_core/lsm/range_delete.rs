@@ -0,0 +1,152 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+use std::sync::Arc;
+use crate::lsm::lsm_tree::LsmTreeValueMarker;
+
+/// The ranges of the keys deleted in one source of the data,
+/// a memory table or a segment.
+///
+/// A range is [start, end), it shadows the keys of the older sources only.
+/// The keys of the same source in the range are written after it,
+/// because the older ones are marked deleted when the range is written.
+///
+/// Only the union of the ranges is kept, sorted by the start.
+#[derive(Clone, Default)]
+pub(crate) struct RangeDeletes {
+    ranges: Arc<Vec<(Arc<[u8]>, Arc<[u8]>)>>,
+}
+
+impl RangeDeletes {
+
+    pub fn new() -> RangeDeletes {
+        RangeDeletes::default()
+    }
+
+    #[inline]
+    pub fn is_empty(&self) -> bool {
+        self.ranges.is_empty()
+    }
+
+    #[inline]
+    pub fn iter(&self) -> std::slice::Iter<(Arc<[u8]>, Arc<[u8]>)> {
+        self.ranges.iter()
+    }
+
+    /// Merge the range with the ranges overlapped or adjacent
+    pub fn insert(&mut self, start: Arc<[u8]>, end: Arc<[u8]>) {
+        assert!(start < end);
+        let ranges = Arc::make_mut(&mut self.ranges);
+
+        let lo = ranges.partition_point(|(_, e)| e.as_ref() < start.as_ref());
+        let hi = ranges.partition_point(|(s, _)| s.as_ref() <= end.as_ref());
+
+        let mut start = start;
+        let mut end = end;
+        if lo < hi {
+            if ranges[lo].0 < start {
+                start = ranges[lo].0.clone();
+            }
+            if ranges[hi - 1].1 > end {
+                end = ranges[hi - 1].1.clone();
+            }
+        }
+
+        ranges.splice(lo..hi, std::iter::once((start, end)));
+    }
+
+    pub fn extend(&mut self, other: &RangeDeletes) {
+        for (start, end) in other.iter() {
+            self.insert(start.clone(), end.clone());
+        }
+    }
+
+    /// The end of the range containing the key
+    pub fn covering_end(&self, key: &[u8]) -> Option<&Arc<[u8]>> {
+        let index = self.ranges.partition_point(|(start, _)| start.as_ref() <= key);
+        if index == 0 {
+            return None;
+        }
+        let (_, end) = &self.ranges[index - 1];
+        if key < end.as_ref() {
+            Some(end)
+        } else {
+            None
+        }
+    }
+
+}
+
+/// Pair the start and the end markers of the ranges,
+/// the markers must be added in the order of the keys.
+#[derive(Default)]
+pub(crate) struct RangeDeletesBuilder {
+    starts: Vec<Arc<[u8]>>,
+    result: RangeDeletes,
+}
+
+impl RangeDeletesBuilder {
+
+    pub fn new() -> RangeDeletesBuilder {
+        RangeDeletesBuilder::default()
+    }
+
+    pub fn add_marker<V>(&mut self, key: &[u8], marker: &LsmTreeValueMarker<V>) {
+        match marker {
+            LsmTreeValueMarker::DeleteStart => self.starts.push(key.into()),
+            LsmTreeValueMarker::DeleteEnd => {
+                // the ranges are nested, the end closes the last start
+                if let Some(start) = self.starts.pop() {
+                    self.result.insert(start, key.into());
+                }
+            }
+            _ => (),
+        }
+    }
+
+    /// The ranges closed so far
+    #[inline]
+    pub fn ranges(&self) -> &RangeDeletes {
+        &self.result
+    }
+
+    pub fn build(self) -> RangeDeletes {
+        self.result
+    }
+
+}
+
+#[cfg(test)]
+mod tests {
+    use std::sync::Arc;
+    use crate::lsm::range_delete::RangeDeletes;
+
+    fn key(k: u8) -> Arc<[u8]> {
+        [k].as_ref().into()
+    }
+
+    #[test]
+    fn test_merge_ranges() {
+        let mut ranges = RangeDeletes::new();
+        ranges.insert(key(10), key(20));
+        ranges.insert(key(40), key(50));
+        ranges.insert(key(12), key(15));
+        assert_eq!(ranges.iter().count(), 2);
+
+        ranges.insert(key(20), key(30));
+        ranges.insert(key(5), key(8));
+        let bounds: Vec<(u8, u8)> = ranges.iter().map(|(s, e)| (s[0], e[0])).collect();
+        assert_eq!(bounds, vec![(5, 8), (10, 30), (40, 50)]);
+
+        assert!(ranges.covering_end(&[4]).is_none());
+        assert_eq!(ranges.covering_end(&[25]).unwrap().as_ref(), &[30]);
+        assert!(ranges.covering_end(&[30]).is_none());
+        assert_eq!(ranges.covering_end(&[40]).unwrap().as_ref(), &[50]);
+
+        ranges.insert(key(1), key(60));
+        assert_eq!(ranges.iter().count(), 1);
+    }
+
+}
@@ -0,0 +1,404 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+use std::cmp::Ordering;
+use std::ptr;
+use std::sync::Arc;
+use std::sync::atomic::{AtomicPtr, AtomicU64, AtomicUsize};
+use std::sync::atomic::Ordering as AtomicOrdering;
+use crate::lsm::lsm_tree::LsmTreeValueMarker;
+
+const MAX_HEIGHT: usize = 12;
+
+/// The probability to grow a level is 1/BRANCHING
+const BRANCHING: u64 = 4;
+
+struct Node {
+    key:   Arc<[u8]>,
+    seq:   u64,
+    value: LsmTreeValueMarker<Arc<[u8]>>,
+    next:  Box<[AtomicPtr<Node>]>,
+}
+
+impl Node {
+
+    fn alloc(key: Arc<[u8]>, seq: u64, value: LsmTreeValueMarker<Arc<[u8]>>, height: usize) -> *mut Node {
+        let next = (0..height)
+            .map(|_| AtomicPtr::new(ptr::null_mut()))
+            .collect::<Vec<_>>()
+            .into_boxed_slice();
+        Box::into_raw(Box::new(Node {
+            key,
+            seq,
+            value,
+            next,
+        }))
+    }
+
+    #[inline]
+    fn next(&self, level: usize) -> *mut Node {
+        self.next[level].load(AtomicOrdering::Acquire)
+    }
+
+    /// The versions of a key are ordered from the newest to the oldest.
+    #[inline]
+    fn cmp_to(&self, key: &[u8], seq: u64) -> Ordering {
+        self.key.as_ref().cmp(key).then_with(|| seq.cmp(&self.seq))
+    }
+
+}
+
+/// A concurrent skip list keeping all the versions of the keys.
+///
+/// Every version is tagged with a sequence number, a reader only sees
+/// the versions not newer than the sequence number it is reading at,
+/// so a snapshot is just an `Arc` and a number.
+///
+/// The nodes are never removed until the list is dropped,
+/// the readers never take a lock and the writers only use CAS.
+pub(crate) struct SkipList {
+    head:   *mut Node,
+    height: AtomicUsize,
+    len:    AtomicUsize,
+    rng:    AtomicU64,
+}
+
+unsafe impl Send for SkipList {}
+unsafe impl Sync for SkipList {}
+
+impl SkipList {
+
+    pub fn new() -> SkipList {
+        let head = Node::alloc(Arc::<[u8]>::from(Vec::<u8>::new()), 0, LsmTreeValueMarker::Deleted, MAX_HEIGHT);
+        SkipList {
+            head,
+            height: AtomicUsize::new(1),
+            len: AtomicUsize::new(0),
+            rng: AtomicU64::new(0x2545f4914f6cdd1d),
+        }
+    }
+
+    /// The count of the versions in the list
+    #[inline]
+    pub fn len(&self) -> usize {
+        self.len.load(AtomicOrdering::Relaxed)
+    }
+
+    fn random_height(&self) -> usize {
+        // xorshift, the quality is enough for the heights
+        let mut x = self.rng.load(AtomicOrdering::Relaxed);
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        self.rng.store(x, AtomicOrdering::Relaxed);
+
+        let mut height = 1;
+        while height < MAX_HEIGHT && (x % BRANCHING) == 0 {
+            height += 1;
+            x /= BRANCHING;
+        }
+        height
+    }
+
+    /// Return the first node not less than (key, seq),
+    /// and fill the predecessors of every level if `prev` is provided.
+    fn find_greater_or_equal(&self, key: &[u8], seq: u64, mut prev: Option<&mut [*mut Node; MAX_HEIGHT]>) -> *mut Node {
+        let mut x = self.head;
+        let mut level = MAX_HEIGHT - 1;
+        if prev.is_none() {
+            level = self.height.load(AtomicOrdering::Acquire) - 1;
+        }
+        loop {
+            let next = unsafe { (*x).next(level) };
+            if !next.is_null() && unsafe { (*next).cmp_to(key, seq) } == Ordering::Less {
+                x = next;
+                continue;
+            }
+            if let Some(prev) = prev.as_mut() {
+                prev[level] = x;
+            }
+            if level == 0 {
+                return next;
+            }
+            level -= 1;
+        }
+    }
+
+    /// Insert a version of the key.
+    /// The pair of (key, seq) must be unique.
+    pub fn insert(&self, key: Arc<[u8]>, seq: u64, value: LsmTreeValueMarker<Arc<[u8]>>) {
+        let mut prev = [ptr::null_mut(); MAX_HEIGHT];
+        self.find_greater_or_equal(key.as_ref(), seq, Some(&mut prev));
+
+        let height = self.random_height();
+        let node = Node::alloc(key.clone(), seq, value, height);
+
+        for level in 0..height {
+            loop {
+                let mut pred = prev[level];
+                // another writer may have inserted after the predecessor
+                let next = loop {
+                    let next = unsafe { (*pred).next(level) };
+                    if !next.is_null() && unsafe { (*next).cmp_to(key.as_ref(), seq) } == Ordering::Less {
+                        pred = next;
+                    } else {
+                        break next;
+                    }
+                };
+                prev[level] = pred;
+
+                unsafe {
+                    (*node).next[level].store(next, AtomicOrdering::Relaxed);
+                }
+                let cas = unsafe {
+                    (*pred).next[level].compare_exchange(
+                        next,
+                        node,
+                        AtomicOrdering::Release,
+                        AtomicOrdering::Acquire,
+                    )
+                };
+                if cas.is_ok() {
+                    break;
+                }
+            }
+        }
+
+        self.height.fetch_max(height, AtomicOrdering::Release);
+        self.len.fetch_add(1, AtomicOrdering::Relaxed);
+    }
+
+    /// Get the newest version of the key not newer than `seq`
+    pub fn get(&self, key: &[u8], seq: u64) -> Option<LsmTreeValueMarker<Arc<[u8]>>> {
+        let node = self.find_greater_or_equal(key, seq, None);
+        if node.is_null() {
+            return None;
+        }
+        let node = unsafe { &*node };
+        if node.key.as_ref() == key {
+            Some(node.value.clone())
+        } else {
+            None
+        }
+    }
+
+}
+
+impl Drop for SkipList {
+
+    fn drop(&mut self) {
+        let mut x = self.head;
+        while !x.is_null() {
+            let boxed = unsafe { Box::from_raw(x) };
+            x = boxed.next(0);
+        }
+    }
+
+}
+
+/// A cursor reading the list at a sequence number,
+/// only the newest visible version of every key is returned.
+pub(crate) struct SkipListCursor {
+    list:    Arc<SkipList>,
+    seq:     u64,
+    current: *mut Node,
+}
+
+unsafe impl Send for SkipListCursor {}
+unsafe impl Sync for SkipListCursor {}
+
+impl SkipListCursor {
+
+    pub fn new(list: Arc<SkipList>, seq: u64) -> SkipListCursor {
+        SkipListCursor {
+            list,
+            seq,
+            current: ptr::null_mut(),
+        }
+    }
+
+    #[inline]
+    fn node(&self) -> Option<&Node> {
+        if self.current.is_null() {
+            None
+        } else {
+            // the nodes live as long as the list
+            Some(unsafe { &*self.current })
+        }
+    }
+
+    /// Skip the versions newer than the cursor
+    fn settle(&mut self) {
+        loop {
+            let next = match self.node() {
+                Some(node) if node.seq > self.seq => node.next(0),
+                _ => break,
+            };
+            self.current = next;
+        }
+    }
+
+    pub fn seek(&mut self, key: &[u8]) -> Option<Ordering> {
+        self.current = self.list.find_greater_or_equal(key, self.seq, None);
+        self.settle();
+
+        match self.node() {
+            Some(node) => {
+                if node.key.as_ref() == key {
+                    Some(Ordering::Equal)
+                } else {
+                    Some(Ordering::Less)
+                }
+            }
+            None => {
+                if self.list.len() == 0 {
+                    None
+                } else {
+                    Some(Ordering::Greater)
+                }
+            }
+        }
+    }
+
+    pub fn go_to_min(&mut self) {
+        self.current = unsafe { (*self.list.head).next(0) };
+        self.settle();
+    }
+
+    pub fn next(&mut self) {
+        let key = match self.node() {
+            Some(node) => node.key.clone(),
+            None => return,
+        };
+        // the sequence numbers start from 1,
+        // so all the versions of the key are less than (key, 0)
+        self.current = self.list.find_greater_or_equal(key.as_ref(), 0, None);
+        self.settle();
+    }
+
+    #[inline]
+    pub fn key(&self) -> Option<Arc<[u8]>> {
+        self.node().map(|node| node.key.clone())
+    }
+
+    #[inline]
+    pub fn value(&self) -> Option<LsmTreeValueMarker<Arc<[u8]>>> {
+        self.node().map(|node| node.value.clone())
+    }
+
+    pub fn marker(&self) -> Option<LsmTreeValueMarker<()>> {
+        self.node().map(|node| match &node.value {
+            LsmTreeValueMarker::Deleted => LsmTreeValueMarker::Deleted,
+            LsmTreeValueMarker::DeleteStart => LsmTreeValueMarker::DeleteStart,
+            LsmTreeValueMarker::DeleteEnd => LsmTreeValueMarker::DeleteEnd,
+            LsmTreeValueMarker::Value(_) => LsmTreeValueMarker::Value(()),
+        })
+    }
+
+    #[inline]
+    pub fn reset(&mut self) {
+        self.current = ptr::null_mut();
+    }
+
+    /// Sample one of every `stride` keys in [start, end),
+    /// every sample stands for `stride` keys.
+    pub fn sample_keys(&mut self, start: &[u8], end: &[u8], stride: usize, samples: &mut Vec<(Arc<[u8]>, u64)>) {
+        self.seek(start);
+        let mut index = 0usize;
+        while let Some(key) = self.key() {
+            if key.as_ref() >= end {
+                break;
+            }
+            if index % stride == 0 {
+                samples.push((key, stride as u64));
+            }
+            index += 1;
+            self.next();
+        }
+    }
+
+    #[inline]
+    pub fn done(&self) -> bool {
+        self.current.is_null()
+    }
+
+}
+
+#[cfg(test)]
+mod tests {
+    use std::sync::Arc;
+    use std::thread;
+    use crate::lsm::lsm_tree::LsmTreeValueMarker;
+    use crate::lsm::skip_list::{SkipList, SkipListCursor};
+
+    fn key_of(i: u32) -> Arc<[u8]> {
+        i.to_be_bytes().as_ref().into()
+    }
+
+    #[test]
+    fn test_skip_list_versions() {
+        let list = Arc::new(SkipList::new());
+        for i in 0..1000u32 {
+            list.insert(key_of(i), 1, LsmTreeValueMarker::Value(key_of(i)));
+        }
+        for i in (0..1000u32).step_by(2) {
+            list.insert(key_of(i), 2, LsmTreeValueMarker::Deleted);
+        }
+
+        let mut cursor = SkipListCursor::new(list.clone(), 1);
+        cursor.go_to_min();
+        let mut count = 0;
+        while !cursor.done() {
+            assert!(cursor.value().unwrap().is_value());
+            count += 1;
+            cursor.next();
+        }
+        assert_eq!(count, 1000);
+
+        let mut cursor = SkipListCursor::new(list.clone(), 2);
+        cursor.go_to_min();
+        let mut count = 0;
+        while !cursor.done() {
+            if cursor.value().unwrap().is_value() {
+                count += 1;
+            }
+            cursor.next();
+        }
+        assert_eq!(count, 500);
+
+        assert!(list.get(&key_of(10), 1).unwrap().is_value());
+        assert!(list.get(&key_of(10), 2).unwrap().is_deleted());
+        assert!(list.get(&key_of(10), 0).is_none());
+    }
+
+    #[test]
+    fn test_skip_list_concurrent_insert() {
+        let list = Arc::new(SkipList::new());
+        let mut handles = vec![];
+        for t in 0..4u32 {
+            let list = list.clone();
+            handles.push(thread::spawn(move || {
+                for i in 0..2000u32 {
+                    let k = i * 4 + t;
+                    list.insert(key_of(k), 1, LsmTreeValueMarker::Value(key_of(k)));
+                }
+            }));
+        }
+        for handle in handles {
+            handle.join().unwrap();
+        }
+
+        let mut cursor = SkipListCursor::new(list, 1);
+        cursor.go_to_min();
+        let mut expected = 0u32;
+        while !cursor.done() {
+            assert_eq!(cursor.key().unwrap(), key_of(expected));
+            expected += 1;
+            cursor.next();
+        }
+        assert_eq!(expected, 8000);
+    }
+
+}
@@ -0,0 +1,305 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+use std::sync::{Arc, Mutex};
+use hashbrown::HashMap;
+use crate::lsm::LsmMetrics;
+use crate::lsm::lsm_segment::LsmTuplePtr;
+
+const SHARD_COUNT: usize = 16;
+
+/// The estimated bytes of an entry except the value
+const ENTRY_OVERHEAD: usize = 64;
+
+const NIL: usize = usize::MAX;
+
+#[derive(Copy, Clone, Hash, Eq, PartialEq)]
+struct CacheKey {
+    pid:     u64,
+    pid_ext: u32,
+    offset:  u32,
+    block_offset: Option<u32>,
+}
+
+impl From<&LsmTuplePtr> for CacheKey {
+
+    fn from(ptr: &LsmTuplePtr) -> Self {
+        CacheKey {
+            pid: ptr.pid,
+            pid_ext: ptr.pid_ext,
+            offset: ptr.offset,
+            block_offset: ptr.block_offset,
+        }
+    }
+
+}
+
+struct CacheEntry {
+    key:   CacheKey,
+    value: Arc<[u8]>,
+    prev:  usize,
+    next:  usize,
+}
+
+/// A LRU list stored in a slab.
+/// The head is the most recently used one.
+struct CacheShard {
+    capacity:   usize,
+    used_bytes: usize,
+    map:        HashMap<CacheKey, usize>,
+    entries:    Vec<Option<CacheEntry>>,
+    free_slots: Vec<usize>,
+    head:       usize,
+    tail:       usize,
+}
+
+impl CacheShard {
+
+    fn new(capacity: usize) -> CacheShard {
+        CacheShard {
+            capacity,
+            used_bytes: 0,
+            map: HashMap::new(),
+            entries: Vec::new(),
+            free_slots: Vec::new(),
+            head: NIL,
+            tail: NIL,
+        }
+    }
+
+    #[inline]
+    fn entry(&self, slot: usize) -> &CacheEntry {
+        self.entries[slot].as_ref().unwrap()
+    }
+
+    #[inline]
+    fn entry_mut(&mut self, slot: usize) -> &mut CacheEntry {
+        self.entries[slot].as_mut().unwrap()
+    }
+
+    fn unlink(&mut self, slot: usize) {
+        let (prev, next) = {
+            let entry = self.entry(slot);
+            (entry.prev, entry.next)
+        };
+        if prev == NIL {
+            self.head = next;
+        } else {
+            self.entry_mut(prev).next = next;
+        }
+        if next == NIL {
+            self.tail = prev;
+        } else {
+            self.entry_mut(next).prev = prev;
+        }
+    }
+
+    fn push_front(&mut self, slot: usize) {
+        let head = self.head;
+        {
+            let entry = self.entry_mut(slot);
+            entry.prev = NIL;
+            entry.next = head;
+        }
+        if head != NIL {
+            self.entry_mut(head).prev = slot;
+        }
+        self.head = slot;
+        if self.tail == NIL {
+            self.tail = slot;
+        }
+    }
+
+    fn get(&mut self, key: &CacheKey) -> Option<Arc<[u8]>> {
+        let slot = *self.map.get(key)?;
+        self.unlink(slot);
+        self.push_front(slot);
+        Some(self.entry(slot).value.clone())
+    }
+
+    /// Return the count of evicted entries
+    fn insert(&mut self, key: CacheKey, value: Arc<[u8]>) -> usize {
+        let size = value.len() + ENTRY_OVERHEAD;
+        if size > self.capacity {
+            return 0;
+        }
+
+        if let Some(slot) = self.map.get(&key).cloned() {
+            self.remove_slot(slot);
+        }
+
+        let mut evicted = 0;
+        while self.used_bytes + size > self.capacity && self.tail != NIL {
+            let tail = self.tail;
+            self.remove_slot(tail);
+            evicted += 1;
+        }
+
+        let entry = CacheEntry {
+            key,
+            value,
+            prev: NIL,
+            next: NIL,
+        };
+        let slot = match self.free_slots.pop() {
+            Some(slot) => {
+                self.entries[slot] = Some(entry);
+                slot
+            }
+            None => {
+                self.entries.push(Some(entry));
+                self.entries.len() - 1
+            }
+        };
+        self.push_front(slot);
+        self.map.insert(key, slot);
+        self.used_bytes += size;
+
+        evicted
+    }
+
+    fn remove_slot(&mut self, slot: usize) {
+        self.unlink(slot);
+        let entry = self.entries[slot].take().unwrap();
+        self.map.remove(&entry.key);
+        self.used_bytes -= entry.value.len() + ENTRY_OVERHEAD;
+        self.free_slots.push(slot);
+    }
+
+    fn invalidate_pages(&mut self, start_pid: u64, end_pid: u64) {
+        let slots: Vec<usize> = self.map
+            .iter()
+            .filter(|(key, _)| key.pid_ext == 0 && key.pid >= start_pid && key.pid <= end_pid)
+            .map(|(_, slot)| *slot)
+            .collect();
+
+        for slot in slots {
+            self.remove_slot(slot);
+        }
+    }
+
+}
+
+/// The cache of the values read from the segments,
+/// keyed by the position of the tuple.
+///
+/// The entries of a segment must be invalidated
+/// once the pages are freed, because the pages
+/// will be reused by other segments.
+#[derive(Clone)]
+pub(crate) struct ValueCache {
+    shards:  Arc<Vec<Mutex<CacheShard>>>,
+    metrics: LsmMetrics,
+}
+
+impl ValueCache {
+
+    pub fn new(capacity: usize, metrics: LsmMetrics) -> ValueCache {
+        let shard_capacity = capacity / SHARD_COUNT;
+        let shards = (0..SHARD_COUNT)
+            .map(|_| Mutex::new(CacheShard::new(shard_capacity)))
+            .collect();
+        ValueCache {
+            shards: Arc::new(shards),
+            metrics,
+        }
+    }
+
+    #[inline]
+    fn shard_of(&self, key: &CacheKey) -> &Mutex<CacheShard> {
+        let h = key.pid
+            .wrapping_mul(0x9e3779b97f4a7c15)
+            ^ ((key.offset as u64) << 16)
+            ^ (key.pid_ext as u64)
+            ^ ((key.block_offset.unwrap_or(0) as u64) << 40);
+        &self.shards[(h >> 32) as usize % SHARD_COUNT]
+    }
+
+    pub fn get(&self, ptr: &LsmTuplePtr) -> Option<Arc<[u8]>> {
+        let key = CacheKey::from(ptr);
+        let result = {
+            let mut shard = self.shard_of(&key).lock().unwrap();
+            shard.get(&key)
+        };
+        if result.is_some() {
+            self.metrics.add_value_cache_hit();
+        } else {
+            self.metrics.add_value_cache_miss();
+        }
+        result
+    }
+
+    pub fn insert(&self, ptr: &LsmTuplePtr, value: Arc<[u8]>) {
+        let key = CacheKey::from(ptr);
+        let evicted = {
+            let mut shard = self.shard_of(&key).lock().unwrap();
+            shard.insert(key, value)
+        };
+        for _ in 0..evicted {
+            self.metrics.add_value_cache_eviction();
+        }
+    }
+
+    /// Remove the entries on the pages from `start_pid` to `end_pid`
+    pub fn invalidate_pages(&self, start_pid: u64, end_pid: u64) {
+        for shard in self.shards.iter() {
+            let mut shard = shard.lock().unwrap();
+            shard.invalidate_pages(start_pid, end_pid);
+        }
+    }
+
+}
+
+#[cfg(test)]
+mod tests {
+    use std::sync::Arc;
+    use crate::lsm::LsmMetrics;
+    use crate::lsm::lsm_segment::LsmTuplePtr;
+    use crate::lsm::value_cache::ValueCache;
+
+    fn ptr(pid: u64, offset: u32) -> LsmTuplePtr {
+        LsmTuplePtr {
+            pid,
+            pid_ext: 0,
+            offset,
+            byte_size: 0,
+            block_offset: None,
+        }
+    }
+
+    #[test]
+    fn test_value_cache_evict() {
+        let metrics = LsmMetrics::new();
+        metrics.enable();
+
+        // about 8 entries per shard
+        let cache = ValueCache::new(16 * 8 * (64 + 100), metrics.clone());
+        for i in 0..10000u64 {
+            let value: Arc<[u8]> = vec![0u8; 100].into();
+            cache.insert(&ptr(i, 0), value);
+        }
+
+        assert!(metrics.value_cache_eviction() > 0);
+        assert!(cache.get(&ptr(9999, 0)).is_some());
+        assert!(cache.get(&ptr(0, 0)).is_none());
+    }
+
+    #[test]
+    fn test_value_cache_invalidate() {
+        let cache = ValueCache::new(1024 * 1024, LsmMetrics::new());
+        for i in 0..100u64 {
+            let value: Arc<[u8]> = vec![i as u8; 10].into();
+            cache.insert(&ptr(i, 8), value);
+        }
+
+        cache.invalidate_pages(10, 19);
+
+        for i in 0..100u64 {
+            let found = cache.get(&ptr(i, 8)).is_some();
+            assert_eq!(found, !(10..20).contains(&i), "pid: {}", i);
+        }
+    }
+
+}
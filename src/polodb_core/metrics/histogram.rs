@@ -0,0 +1,215 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+use std::sync::atomic::{AtomicU64, Ordering};
+#[cfg(not(target_arch = "wasm32"))]
+use std::time::Instant;
+use bson::{Bson, Document};
+
+/// Every power of two is split into 2^SUB_BITS buckets,
+/// the error of a value is at most 1/8 of it.
+const SUB_BITS: u32 = 3;
+const SUB_COUNT: usize = 1 << SUB_BITS;
+/// The values below it have a bucket of their own
+const LINEAR_COUNT: usize = SUB_COUNT * 2;
+const BUCKET_COUNT: usize = (64 - SUB_BITS as usize + 1) * SUB_COUNT;
+
+/// The durations in nanoseconds in log-linear buckets like HdrHistogram.
+///
+/// Recording is a few atomic adds without a lock,
+/// the buckets are read by a snapshot.
+pub(crate) struct LatencyHistogram {
+    buckets: Box<[AtomicU64]>,
+    sum:     AtomicU64,
+    max:     AtomicU64,
+}
+
+impl LatencyHistogram {
+
+    pub fn new() -> LatencyHistogram {
+        let buckets = (0..BUCKET_COUNT).map(|_| AtomicU64::new(0)).collect();
+        LatencyHistogram {
+            buckets,
+            sum: AtomicU64::new(0),
+            max: AtomicU64::new(0),
+        }
+    }
+
+    fn bucket_index(value: u64) -> usize {
+        if value < LINEAR_COUNT as u64 {
+            return value as usize;
+        }
+        let bits = 64 - value.leading_zeros();
+        let shift = bits - (SUB_BITS + 1);
+        (shift as usize) * SUB_COUNT + ((value >> shift) as usize)
+    }
+
+    /// The largest value of the bucket
+    fn bucket_upper_bound(index: usize) -> u64 {
+        if index < LINEAR_COUNT {
+            return index as u64;
+        }
+        let shift = (index / SUB_COUNT - 1) as u32;
+        let mantissa = (index - (shift as usize) * SUB_COUNT) as u64;
+        ((mantissa + 1) << shift).wrapping_sub(1)
+    }
+
+    pub fn record(&self, nanos: u64) {
+        self.buckets[LatencyHistogram::bucket_index(nanos)].fetch_add(1, Ordering::Relaxed);
+        self.sum.fetch_add(nanos, Ordering::Relaxed);
+        self.max.fetch_max(nanos, Ordering::Relaxed);
+    }
+
+    pub fn snapshot(&self) -> HistogramSnapshot {
+        let buckets: Vec<u64> = self.buckets.iter().map(|bucket| bucket.load(Ordering::Relaxed)).collect();
+        let count = buckets.iter().sum();
+        HistogramSnapshot {
+            buckets,
+            count,
+            sum: self.sum.load(Ordering::Relaxed),
+            max: self.max.load(Ordering::Relaxed),
+        }
+    }
+
+}
+
+/// The values of a histogram at a moment, in nanoseconds.
+#[derive(Clone)]
+pub struct HistogramSnapshot {
+    buckets: Vec<u64>,
+    count:   u64,
+    sum:     u64,
+    max:     u64,
+}
+
+impl HistogramSnapshot {
+
+    #[inline]
+    pub fn count(&self) -> u64 {
+        self.count
+    }
+
+    #[inline]
+    pub fn max(&self) -> u64 {
+        self.max
+    }
+
+    /// 0 if nothing is recorded
+    pub fn mean(&self) -> f64 {
+        if self.count == 0 {
+            return 0.0;
+        }
+        (self.sum as f64) / (self.count as f64)
+    }
+
+    /// The upper bound of the bucket the quantile falls in,
+    /// `quantile` is in [0, 1].
+    pub fn value_at_quantile(&self, quantile: f64) -> u64 {
+        if self.count == 0 {
+            return 0;
+        }
+        let rank = ((quantile * self.count as f64).ceil() as u64).max(1);
+        let mut seen = 0u64;
+        for (index, count) in self.buckets.iter().enumerate() {
+            seen += *count;
+            if seen >= rank {
+                return LatencyHistogram::bucket_upper_bound(index).min(self.max);
+            }
+        }
+        self.max
+    }
+
+    /// The count and the durations in microseconds
+    pub fn to_document(&self) -> Document {
+        let micros = |nanos: u64| Bson::Double((nanos as f64) / 1000.0);
+        let mut doc = Document::new();
+        doc.insert("count", Bson::Int64(self.count as i64));
+        doc.insert("meanMicros", Bson::Double(self.mean() / 1000.0));
+        doc.insert("p50Micros", micros(self.value_at_quantile(0.5)));
+        doc.insert("p90Micros", micros(self.value_at_quantile(0.9)));
+        doc.insert("p99Micros", micros(self.value_at_quantile(0.99)));
+        doc.insert("maxMicros", micros(self.max));
+        doc
+    }
+
+}
+
+/// Measures an operation if the metrics are enabled.
+/// It does nothing on wasm32, which has no clock of `Instant`.
+pub(crate) struct LatencyTimer {
+    #[cfg(not(target_arch = "wasm32"))]
+    start: Option<Instant>,
+}
+
+impl LatencyTimer {
+
+    #[cfg(not(target_arch = "wasm32"))]
+    #[inline]
+    pub fn start(enabled: bool) -> LatencyTimer {
+        LatencyTimer {
+            start: if enabled { Some(Instant::now()) } else { None },
+        }
+    }
+
+    #[cfg(target_arch = "wasm32")]
+    #[inline]
+    pub fn start(_enabled: bool) -> LatencyTimer {
+        LatencyTimer {}
+    }
+
+    #[cfg(not(target_arch = "wasm32"))]
+    #[inline]
+    pub fn stop(self, histogram: &LatencyHistogram) {
+        if let Some(start) = self.start {
+            histogram.record(start.elapsed().as_nanos() as u64);
+        }
+    }
+
+    #[cfg(target_arch = "wasm32")]
+    #[inline]
+    pub fn stop(self, _histogram: &LatencyHistogram) {}
+
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::metrics::histogram::{LatencyHistogram, BUCKET_COUNT};
+
+    #[test]
+    fn test_bucket_bounds() {
+        let mut last_index = 0;
+        for value in (0..100_000u64).chain([u64::MAX / 2, u64::MAX]) {
+            let index = LatencyHistogram::bucket_index(value);
+            assert!(index < BUCKET_COUNT);
+            assert!(index >= last_index);
+            assert!(value <= LatencyHistogram::bucket_upper_bound(index));
+            if index > 0 {
+                assert!(value > LatencyHistogram::bucket_upper_bound(index - 1));
+            }
+            last_index = index;
+        }
+    }
+
+    #[test]
+    fn test_quantiles() {
+        let histogram = LatencyHistogram::new();
+        for value in 1..=1000u64 {
+            histogram.record(value * 1000);
+        }
+        let snapshot = histogram.snapshot();
+        assert_eq!(snapshot.count(), 1000);
+        assert_eq!(snapshot.max(), 1_000_000);
+
+        let p50 = snapshot.value_at_quantile(0.5) as f64;
+        assert!(p50 >= 500_000.0 && p50 <= 500_000.0 * 1.125, "p50: {}", p50);
+        let p99 = snapshot.value_at_quantile(0.99) as f64;
+        assert!(p99 >= 990_000.0 && p99 <= 1_000_000.0, "p99: {}", p99);
+        assert_eq!(snapshot.value_at_quantile(1.0), 1_000_000);
+
+        let doc = snapshot.to_document();
+        assert_eq!(doc.get_i64("count").unwrap(), 1000);
+    }
+
+}
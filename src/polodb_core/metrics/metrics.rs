@@ -5,6 +5,8 @@
  */
 use std::sync::Arc;
 use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use bson::{Bson, Document};
+use crate::metrics::{HistogramSnapshot, LatencyHistogram, LatencyTimer};
 
 #[derive(Clone)]
 pub struct Metrics {
@@ -34,11 +36,48 @@ impl Metrics {
         self.inner.find_by_index_count.load(Ordering::SeqCst)
     }
 
+    #[inline]
+    pub(crate) fn add_plan_cache_hit_count(&self) {
+        self.inner.add_plan_cache_hit_count();
+    }
+
+    /// The count of the programs reused from the plan cache
+    pub fn plan_cache_hit_count(&self) -> usize {
+        self.inner.plan_cache_hit_count.load(Ordering::SeqCst)
+    }
+
+    /// Times nothing if the metrics are not enabled
+    #[inline]
+    pub(crate) fn start_timer(&self) -> LatencyTimer {
+        LatencyTimer::start(self.inner.enable.load(Ordering::Relaxed))
+    }
+
+    #[inline]
+    pub(crate) fn record_vm_execute(&self, timer: LatencyTimer) {
+        timer.stop(&self.inner.vm_execute_latency);
+    }
+
+    /// The durations of running the VM until it yields a row or halts
+    pub fn vm_execute_latency(&self) -> HistogramSnapshot {
+        self.inner.vm_execute_latency.snapshot()
+    }
+
+    pub fn to_document(&self) -> Document {
+        let mut doc = Document::new();
+        doc.insert("enabled", Bson::Boolean(self.inner.enable.load(Ordering::Relaxed)));
+        doc.insert("findByIndexCount", Bson::Int64(self.find_by_index_count() as i64));
+        doc.insert("planCacheHitCount", Bson::Int64(self.plan_cache_hit_count() as i64));
+        doc.insert("vmExecute", self.vm_execute_latency().to_document());
+        doc
+    }
+
 }
 
 struct MetricsInner {
     enable: AtomicBool,
     find_by_index_count: AtomicUsize,
+    plan_cache_hit_count: AtomicUsize,
+    vm_execute_latency: LatencyHistogram,
 }
 
 macro_rules! test_enable {
@@ -56,6 +95,8 @@ impl MetricsInner {
         MetricsInner {
             enable: AtomicBool::new(false),
             find_by_index_count: AtomicUsize::new(0),
+            plan_cache_hit_count: AtomicUsize::new(0),
+            vm_execute_latency: LatencyHistogram::new(),
         }
     }
 
@@ -70,5 +111,11 @@ impl MetricsInner {
         self.find_by_index_count.fetch_add(1, Ordering::SeqCst);
     }
 
+    pub(crate) fn add_plan_cache_hit_count(&self) {
+        test_enable!(self);
+
+        self.plan_cache_hit_count.fetch_add(1, Ordering::SeqCst);
+    }
+
 }
 
@@ -5,5 +5,8 @@
  */
 
 mod metrics;
+mod histogram;
 
 pub use metrics::{Metrics};
+pub use histogram::HistogramSnapshot;
+pub(crate) use histogram::{LatencyHistogram, LatencyTimer};
@@ -60,6 +60,22 @@ pub struct CountDocumentsResult {
     pub count: u64,
 }
 
+/// A batch of the documents found, `cursor_id` is 0
+/// if there is nothing more to fetch.
+#[derive(Debug, Serialize)]
+#[serde(rename_all = "camelCase")]
+pub struct CursorBatchResult {
+    pub cursor_id: i64,
+    pub batch: Vec<Bson>,
+}
+
+#[derive(Debug, Serialize)]
+#[serde(rename_all = "camelCase")]
+pub struct KillCursorsResult {
+    pub cursors_killed: Vec<i64>,
+    pub cursors_not_found: Vec<i64>,
+}
+
 #[cfg(test)]
 mod tests {
     use bson::doc;
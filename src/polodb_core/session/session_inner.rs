@@ -42,11 +42,24 @@ impl SessionInner {
         self.kv_session.delete(key)
     }
 
+    /// See [`LsmSession::delete_range`]
+    #[inline]
+    pub fn delete_range(&mut self, start: &[u8], end: &[u8]) -> Result<()> {
+        self.kv_session.delete_range(start, end)
+    }
+
     #[inline]
     pub fn delete_cursor_current(&mut self, cursor: &mut MultiCursor) -> Result<bool> {
         self.kv_session.delete_cursor_current(cursor)
     }
 
+    /// The batch written by the transaction is large,
+    /// see [`LsmSession::start_bulk_load`]
+    #[inline]
+    pub fn start_bulk_load(&mut self) -> Result<()> {
+        self.kv_session.start_bulk_load()
+    }
+
     pub fn auto_start_transaction(&mut self, ty: TransactionType) -> Result<()> {
         match &self.transaction_state {
             TransactionState::DbAuto(counter) => {
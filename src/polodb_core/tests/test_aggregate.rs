@@ -4,7 +4,7 @@
  * file, You can obtain one at https://mozilla.org/MPL/2.0/.
  */
 use bson::{doc, Document};
-use polodb_core::{Database, Result};
+use polodb_core::{Collection, ConfigBuilder, Database, IndexModel, Result};
 
 #[test]
 fn test_aggregate_empty() {
@@ -146,3 +146,380 @@ fn test_aggregate_count() {
     assert_eq!(result.len(), 1);
     assert_eq!(result[0].get("count").unwrap().as_i64().unwrap(), 5);
 }
+
+fn names_of(result: &[Document]) -> Vec<&str> {
+    result
+        .iter()
+        .map(|doc| doc.get("name").unwrap().as_str().unwrap())
+        .collect()
+}
+
+fn insert_prices(db: &Database) -> Collection<Document> {
+    let fruits = db.collection::<Document>("fruits");
+    fruits.insert_many(vec![
+        doc! { "name": "apple", "price": 5 },
+        doc! { "name": "banana", "price": 2 },
+        doc! { "name": "orange", "price": 4 },
+        doc! { "name": "pear", "price": 2 },
+        doc! { "name": "peach", "price": 7 },
+    ]).unwrap();
+    fruits
+}
+
+#[test]
+fn test_aggregate_sort() {
+    let db = Database::open_memory().unwrap();
+    let fruits = insert_prices(&db);
+
+    let result = fruits
+        .aggregate(vec![
+            doc! {
+                "$sort": { "price": 1 },
+            },
+        ])
+        .unwrap()
+        .collect::<Result<Vec<Document>>>()
+        .unwrap();
+    assert_eq!(names_of(&result), vec!["banana", "pear", "orange", "apple", "peach"]);
+
+    let result = fruits
+        .aggregate(vec![
+            doc! {
+                "$sort": { "price": -1, "name": 1 },
+            },
+        ])
+        .unwrap()
+        .collect::<Result<Vec<Document>>>()
+        .unwrap();
+    assert_eq!(names_of(&result), vec!["peach", "apple", "orange", "banana", "pear"]);
+
+    let result = fruits.aggregate(vec![
+        doc! {
+            "$sort": { "price": 2 },
+        },
+    ]);
+    assert!(result.is_err());
+}
+
+#[test]
+fn test_aggregate_sort_limit() {
+    let db = Database::open_memory().unwrap();
+    let fruits = insert_prices(&db);
+
+    let result = fruits
+        .aggregate(vec![
+            doc! {
+                "$match": { "price": { "$gt": 2 } },
+            },
+            doc! {
+                "$sort": { "price": -1 },
+            },
+            doc! {
+                "$limit": 2,
+            },
+        ])
+        .unwrap()
+        .collect::<Result<Vec<Document>>>()
+        .unwrap();
+    assert_eq!(names_of(&result), vec!["peach", "apple"]);
+
+    let result = fruits
+        .aggregate(vec![
+            doc! {
+                "$sort": { "price": 1, "name": 1 },
+            },
+            doc! {
+                "$skip": 1,
+            },
+            doc! {
+                "$limit": 3,
+            },
+        ])
+        .unwrap()
+        .collect::<Result<Vec<Document>>>()
+        .unwrap();
+    assert_eq!(names_of(&result), vec!["pear", "orange", "apple"]);
+
+    let result = fruits
+        .aggregate(vec![
+            doc! {
+                "$sort": { "price": 1 },
+            },
+            doc! {
+                "$limit": 3,
+            },
+            doc! {
+                "$count": "count",
+            },
+        ])
+        .unwrap()
+        .collect::<Result<Vec<Document>>>()
+        .unwrap();
+    assert_eq!(result.len(), 1);
+    assert_eq!(result[0].get("count").unwrap().as_i64().unwrap(), 3);
+}
+
+#[test]
+fn test_aggregate_skip_limit() {
+    let db = Database::open_memory().unwrap();
+    let fruits = insert_prices(&db);
+
+    let result = fruits
+        .aggregate(vec![
+            doc! {
+                "$skip": 1,
+            },
+            doc! {
+                "$limit": 2,
+            },
+        ])
+        .unwrap()
+        .collect::<Result<Vec<Document>>>()
+        .unwrap();
+    assert_eq!(names_of(&result), vec!["banana", "orange"]);
+
+    let result = fruits
+        .aggregate(vec![
+            doc! {
+                "$limit": 2,
+            },
+            doc! {
+                "$count": "count",
+            },
+        ])
+        .unwrap()
+        .collect::<Result<Vec<Document>>>()
+        .unwrap();
+    assert_eq!(result[0].get("count").unwrap().as_i64().unwrap(), 2);
+
+    let result = fruits.aggregate(vec![
+        doc! {
+            "$limit": 0,
+        },
+    ]);
+    assert!(result.is_err());
+}
+
+#[test]
+fn test_aggregate_sort_by_index() {
+    let db = Database::open_memory().unwrap();
+    let fruits = db.collection::<Document>("fruits");
+    fruits.create_index(IndexModel {
+        keys: doc! {
+            "name": 1,
+        },
+        options: None,
+    }).unwrap();
+
+    let mut docs = Vec::new();
+    for i in 0..100 {
+        docs.push(doc! {
+            "name": format!("fruit-{:02}", 99 - i),
+        });
+    }
+    fruits.insert_many(docs).unwrap();
+
+    let result = fruits
+        .aggregate(vec![
+            doc! {
+                "$match": {
+                    "name": { "$gte": "fruit-10", "$lt": "fruit-20" },
+                },
+            },
+            doc! {
+                "$sort": { "name": 1 },
+            },
+            doc! {
+                "$limit": 3,
+            },
+        ])
+        .unwrap()
+        .collect::<Result<Vec<Document>>>()
+        .unwrap();
+    assert_eq!(names_of(&result), vec!["fruit-10", "fruit-11", "fruit-12"]);
+
+    let result = fruits
+        .aggregate(vec![
+            doc! {
+                "$match": {
+                    "name": { "$gte": "fruit-10", "$lt": "fruit-20" },
+                },
+            },
+            doc! {
+                "$sort": { "name": -1 },
+            },
+            doc! {
+                "$limit": 2,
+            },
+        ])
+        .unwrap()
+        .collect::<Result<Vec<Document>>>()
+        .unwrap();
+    assert_eq!(names_of(&result), vec!["fruit-19", "fruit-18"]);
+}
+
+#[test]
+fn test_aggregate_group() {
+    let db = Database::open_memory().unwrap();
+    let fruits = db.collection::<Document>("fruits");
+    fruits.insert_many(vec![
+        doc! { "name": "apple", "color": "red", "price": 5 },
+        doc! { "name": "banana", "color": "yellow", "price": 2 },
+        doc! { "name": "cherry", "color": "red", "price": 9.5 },
+        doc! { "name": "lemon", "color": "yellow", "price": 3 },
+        doc! { "name": "lime", "color": "green" },
+    ]).unwrap();
+
+    let result = fruits
+        .aggregate(vec![
+            doc! {
+                "$group": {
+                    "_id": "$color",
+                    "total": { "$sum": "$price" },
+                    "avg": { "$avg": "$price" },
+                    "min": { "$min": "$price" },
+                    "max": { "$max": "$price" },
+                    "count": { "$count": {} },
+                },
+            },
+            doc! {
+                "$sort": { "_id": 1 },
+            },
+        ])
+        .unwrap()
+        .collect::<Result<Vec<Document>>>()
+        .unwrap();
+    assert_eq!(result, vec![
+        doc! { "_id": "green", "total": 0, "avg": null, "min": null, "max": null, "count": 1_i64 },
+        doc! { "_id": "red", "total": 14.5, "avg": 7.25, "min": 5, "max": 9.5, "count": 2_i64 },
+        doc! { "_id": "yellow", "total": 5, "avg": 2.5, "min": 2, "max": 3, "count": 2_i64 },
+    ]);
+
+    let result = fruits
+        .aggregate(vec![
+            doc! {
+                "$match": { "color": "red" },
+            },
+            doc! {
+                "$group": {
+                    "_id": null,
+                    "count": { "$sum": 1 },
+                },
+            },
+        ])
+        .unwrap()
+        .collect::<Result<Vec<Document>>>()
+        .unwrap();
+    assert_eq!(result, vec![doc! { "_id": null, "count": 2 }]);
+
+    let result = fruits.aggregate(vec![
+        doc! {
+            "$group": {
+                "_id": "$color",
+                "names": { "$push": "$name" },
+            },
+        },
+    ]);
+    assert!(result.is_err());
+}
+
+#[test]
+fn test_aggregate_group_spill() {
+    let mut config_builder = ConfigBuilder::new();
+    config_builder.set_group_memory_budget(1024);
+    let db = Database::open_memory_with_config(config_builder.take()).unwrap();
+    let orders = db.collection::<Document>("orders");
+
+    let mut docs = Vec::new();
+    for i in 0..1000 {
+        docs.push(doc! {
+            "customer": format!("customer-{:03}", i % 100),
+            "amount": i,
+        });
+    }
+    orders.insert_many(docs).unwrap();
+
+    let result = orders
+        .aggregate(vec![
+            doc! {
+                "$group": {
+                    "_id": "$customer",
+                    "total": { "$sum": "$amount" },
+                    "max": { "$max": "$amount" },
+                    "count": { "$count": {} },
+                },
+            },
+            doc! {
+                "$sort": { "_id": 1 },
+            },
+        ])
+        .unwrap()
+        .collect::<Result<Vec<Document>>>()
+        .unwrap();
+    assert_eq!(result.len(), 100);
+
+    for (i, group) in result.iter().enumerate() {
+        let i = i as i32;
+        assert_eq!(group.get_str("_id").unwrap(), format!("customer-{:03}", i));
+        assert_eq!(group.get_i32("total").unwrap(), (0..10).map(|j| i + j * 100).sum::<i32>());
+        assert_eq!(group.get_i32("max").unwrap(), i + 900);
+        assert_eq!(group.get_i64("count").unwrap(), 10);
+    }
+}
+
+#[test]
+fn test_aggregate_partitioned() {
+    let mut config_builder = ConfigBuilder::new();
+    config_builder.set_scan_parallelism(4);
+    let db = Database::open_memory_with_config(config_builder.take()).unwrap();
+    let orders = db.collection::<Document>("orders");
+
+    let mut docs = Vec::new();
+    for i in 0..1000 {
+        docs.push(doc! {
+            "kind": i % 3,
+            "amount": i,
+        });
+    }
+    orders.insert_many(docs).unwrap();
+
+    assert_eq!(orders.count_documents().unwrap(), 1000);
+
+    let result = orders
+        .aggregate(vec![
+            doc! {
+                "$match": { "kind": 1 },
+            },
+            doc! {
+                "$count": "count",
+            },
+        ])
+        .unwrap()
+        .collect::<Result<Vec<Document>>>()
+        .unwrap();
+    assert_eq!(result, vec![doc! { "count": 333_i64 }]);
+
+    let result = orders
+        .aggregate(vec![
+            doc! {
+                "$group": {
+                    "_id": "$kind",
+                    "total": { "$sum": "$amount" },
+                    "count": { "$count": {} },
+                },
+            },
+        ])
+        .unwrap()
+        .collect::<Result<Vec<Document>>>()
+        .unwrap();
+    assert_eq!(result.len(), 3);
+
+    // the groups are given in the order they're found
+    for (kind, group) in result.iter().enumerate() {
+        let kind = kind as i32;
+        let amounts = (0..1000).filter(|i| i % 3 == kind);
+        assert_eq!(group.get_i32("_id").unwrap(), kind);
+        assert_eq!(group.get_i32("total").unwrap(), amounts.clone().sum::<i32>());
+        assert_eq!(group.get_i64("count").unwrap(), amounts.count() as i64);
+    }
+}
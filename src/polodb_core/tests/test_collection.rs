@@ -4,11 +4,12 @@
  * file, You can obtain one at https://mozilla.org/MPL/2.0/.
  */
 use polodb_core::bson::{Document, doc};
-use polodb_core::{Database, Collection, Result};
+use polodb_core::{Database, Collection, ConfigBuilder, Result};
 mod common;
 
 use common::{
     prepare_db,
+    prepare_db_with_config,
     create_file_and_return_db_with_items,
     create_memory_and_return_db_with_items,
 };
@@ -70,6 +71,50 @@ fn test_create_collection_and_drop() {
     });
 }
 
+/// The range deleted by the drop covers the documents inserted again,
+/// the leveled compaction splits it with the documents.
+#[test]
+fn test_drop_and_insert_again_with_leveled_compaction() {
+    let mut config_builder = ConfigBuilder::new();
+    config_builder
+        .set_lsm_block_size(16 * 1024)
+        .set_lsm_leveled_compaction(true);
+    let config = config_builder.take();
+
+    let db = prepare_db_with_config("test-drop-and-insert-again", config).unwrap();
+    let metrics = db.lsm_metrics();
+    metrics.enable();
+
+    let collection = db.collection::<Document>("test");
+    for i in 0..1000 {
+        collection.insert_one(doc! {
+            "round": 1,
+            "content": i.to_string().repeat(16),
+        }).unwrap();
+    }
+    collection.drop().unwrap();
+
+    for i in 0..3000 {
+        collection.insert_one(doc! {
+            "round": 2,
+            "content": i.to_string().repeat(16),
+        }).unwrap();
+    }
+
+    assert!(metrics.minor_compact() + metrics.major_compact() > 0);
+    assert_eq!(collection.count_documents().unwrap(), 3000);
+
+    let all = collection
+        .find(None)
+        .unwrap()
+        .collect::<Result<Vec<Document>>>()
+        .unwrap();
+    assert_eq!(all.len(), 3000);
+    for doc in &all {
+        assert_eq!(doc.get_i32("round").unwrap(), 2);
+    }
+}
+
 #[test]
 fn test_create_collection_with_number_pkey() {
     vec![
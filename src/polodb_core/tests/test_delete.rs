@@ -3,7 +3,7 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at https://mozilla.org/MPL/2.0/.
  */
-use polodb_core::{Database, Result};
+use polodb_core::{Database, IndexModel, Result};
 use polodb_core::bson::{doc, Document};
 
 mod common;
@@ -101,6 +101,58 @@ fn test_delete_many() {
     });
 }
 
+#[test]
+fn test_delete_many_all_with_index() {
+    let db_path_str = "test-delete-many-all-with-index";
+    let db_path = mk_db_path(db_path_str);
+    {
+        let db = prepare_db(db_path_str).unwrap();
+        let collection = db.collection::<Document>("test");
+        collection.create_index(IndexModel {
+            keys: doc! {
+                "content": 1,
+            },
+            options: None,
+        }).unwrap();
+        let other = db.collection::<Document>("other");
+
+        let mut doc_collection = vec![];
+        for i in 0..1000 {
+            doc_collection.push(doc! {
+                "_id": i,
+                "content": i.to_string(),
+            });
+        }
+        collection.insert_many(&doc_collection).unwrap();
+        other.insert_many(&doc_collection).unwrap();
+
+        let result = collection.delete_many(doc! {}).unwrap();
+        assert_eq!(result.deleted_count, 1000);
+        assert_eq!(collection.count_documents().unwrap(), 0);
+        assert!(collection.find_one(doc! { "content": "10" }).unwrap().is_none());
+        assert_eq!(other.count_documents().unwrap(), 1000);
+
+        collection.insert_one(doc! {
+            "_id": 10,
+            "content": "10",
+        }).unwrap();
+        assert_eq!(collection.count_documents().unwrap(), 1);
+    }
+
+    {
+        let db = Database::open_file(db_path.as_path()).unwrap();
+        let collection = db.collection::<Document>("test");
+        let result = collection
+            .find(doc! { "content": "10" })
+            .unwrap()
+            .collect::<Result<Vec<Document>>>()
+            .unwrap();
+        assert_eq!(result.len(), 1);
+        assert_eq!(collection.count_documents().unwrap(), 1);
+        assert_eq!(db.collection::<Document>("other").count_documents().unwrap(), 1000);
+    }
+}
+
 #[test]
 fn test_delete_all_items() {
     vec![
@@ -3,7 +3,7 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at https://mozilla.org/MPL/2.0/.
  */
-use polodb_core::{Database, Result};
+use polodb_core::{Database, IndexModel, Result};
 use polodb_core::bson::{doc, Document};
 
 mod common;
@@ -201,3 +201,81 @@ fn test_not_expression() {
         assert_eq!(result[1].get("name").unwrap().as_str().unwrap(), "John");
     });
 }
+
+#[test]
+fn test_find_raw_batch() {
+    vec![
+        prepare_db("test-find-raw-batch").unwrap(),
+        Database::open_memory().unwrap(),
+    ].iter().for_each(|db| {
+        let collection = db.collection::<Document>("test");
+        let docs: Vec<Document> = (0..10).map(|i| doc! {
+            "_id": i,
+            "name": i.to_string(),
+        }).collect();
+        collection.insert_many(&docs).unwrap();
+
+        let mut cursor = collection.find(None).unwrap();
+        let mut buffer = vec![];
+        let mut offsets = vec![];
+        assert_eq!(cursor.next_raw_batch(4, &mut buffer, &mut offsets).unwrap(), 4);
+        assert_eq!(cursor.next_raw_batch(10, &mut buffer, &mut offsets).unwrap(), 6);
+        assert_eq!(cursor.next_raw_batch(10, &mut buffer, &mut offsets).unwrap(), 0);
+        assert_eq!(offsets.len(), 10);
+
+        for (i, offset) in offsets.iter().enumerate() {
+            let end = offsets.get(i + 1).cloned().unwrap_or(buffer.len());
+            let doc: Document = polodb_core::bson::from_slice(&buffer[*offset..end]).unwrap();
+            assert_eq!(doc, docs[i]);
+        }
+    });
+}
+
+#[test]
+fn test_explain_find() {
+    vec![
+        prepare_db("test-explain-find").unwrap(),
+        Database::open_memory().unwrap(),
+    ].iter().for_each(|db| {
+        let collection = db.collection::<Document>("test");
+        let docs: Vec<Document> = (0..100).map(|i| doc! {
+            "_id": i,
+            "age": i,
+            "name": (i % 10).to_string(),
+        }).collect();
+        collection.insert_many(&docs).unwrap();
+        collection.create_index(IndexModel {
+            keys: doc! {
+                "age": 1,
+            },
+            options: None,
+        }).unwrap();
+
+        let result = collection.explain_find(doc! { "name": "3" }).unwrap();
+        let access_path = result.get_document("accessPath").unwrap();
+        assert_eq!(access_path.get_str("stage").unwrap(), "COLLECTION_SCAN");
+        assert!(result.get_str("program").unwrap().contains("Rewind"));
+        let stats = result.get_document("executionStats").unwrap();
+        assert_eq!(stats.get_i64("nReturned").unwrap(), 10);
+        assert_eq!(stats.get_i64("rowsExamined").unwrap(), 100);
+        assert!(!stats.get_array("ops").unwrap().is_empty());
+
+        let result = collection.explain_find(doc! { "age": 42 }).unwrap();
+        let access_path = result.get_document("accessPath").unwrap();
+        assert_eq!(access_path.get_str("stage").unwrap(), "INDEX_SCAN");
+        assert_eq!(access_path.get_str("indexName").unwrap(), "age_1");
+        let stats = result.get_document("executionStats").unwrap();
+        assert_eq!(stats.get_i64("nReturned").unwrap(), 1);
+
+        let result = collection.explain_find(doc! { "_id": 7 }).unwrap();
+        let access_path = result.get_document("accessPath").unwrap();
+        assert_eq!(access_path.get_str("stage").unwrap(), "PRIMARY_KEY");
+
+        let result = collection.explain_aggregate(vec![
+            doc! { "$match": { "name": "3" } },
+            doc! { "$count": "count" },
+        ]).unwrap();
+        let stats = result.get_document("executionStats").unwrap();
+        assert_eq!(stats.get_i64("nReturned").unwrap(), 1);
+    });
+}
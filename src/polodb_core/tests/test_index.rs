@@ -5,7 +5,7 @@
  */
 
 use polodb_core::{Database, IndexModel, IndexOptions, Result};
-use bson::{doc, Document};
+use bson::{doc, DateTime, Document};
 use crate::common::prepare_db;
 
 mod common;
@@ -14,29 +14,41 @@ mod common;
 fn test_create_multi_keys_index() {
     let db = Database::open_memory().unwrap();
     let col = db.collection::<Document>("teacher");
-    let result = col.create_index(IndexModel {
+    col.create_index(IndexModel {
         keys: doc! {
             "age": 1,
             "name": 1,
         },
         options: None,
+    }).unwrap();
+
+    let result = col.create_index(IndexModel {
+        keys: doc! {},
+        options: None,
     });
     assert!(result.is_err());
-    assert!(result.unwrap_err().to_string().contains("only support single field indexes currently"));
+    assert!(result.unwrap_err().to_string().contains("the keys of the index are empty"));
 }
 
 #[test]
 fn test_create_reverse_order_index() {
     let db = Database::open_memory().unwrap();
     let col = db.collection::<Document>("teacher");
-    let result = col.create_index(IndexModel {
+    col.create_index(IndexModel {
         keys: doc! {
             "age": -1,
         },
         options: None,
+    }).unwrap();
+
+    let result = col.create_index(IndexModel {
+        keys: doc! {
+            "age": 2,
+        },
+        options: None,
     });
     assert!(result.is_err());
-    assert!(result.unwrap_err().to_string().contains("only support ascending order index currently"));
+    assert!(result.unwrap_err().to_string().contains("must be 1 or -1"));
 }
 
 #[test]
@@ -241,7 +253,481 @@ fn test_update_with_index() {
 
         assert_eq!(doc.get_str("name").unwrap(), "David");
 
+        // both the update and the query are driven by the index
+        assert_eq!(metrics.find_by_index_count(), 2);
+    });
+}
+
+#[test]
+fn test_update_many_by_index() {
+    vec![
+        prepare_db("test-update-many-by-index").unwrap(),
+        Database::open_memory().unwrap(),
+    ].iter().for_each(|db| {
+        let metrics = db.metrics();
+        metrics.enable();
+
+        let col = db.collection::<Document>("teacher");
+
+        col.create_index(IndexModel {
+            keys: doc! {
+                "age": 1,
+            },
+            options: None,
+        }).unwrap();
+
+        let mut docs = vec![];
+        for i in 0..100 {
+            docs.push(doc! {
+                "name": format!("name-{}", i),
+                "age": i % 10,
+            });
+        }
+        col.insert_many(docs).unwrap();
+
+        // the updated documents are put on the index entries after the current one
+        let result = col.update_many(doc! {
+            "age": 3,
+        }, doc! {
+            "$set": {
+                "age": 30,
+            },
+        }).unwrap();
+        assert_eq!(result.modified_count, 10);
+        assert_eq!(metrics.find_by_index_count(), 1);
+
+        let result = col.update_one(doc! {
+            "age": 30,
+            "name": "name-13",
+        }, doc! {
+            "$set": {
+                "age": 31,
+            },
+        }).unwrap();
+        assert_eq!(result.modified_count, 1);
+        assert_eq!(metrics.find_by_index_count(), 2);
+
+        let result = col.update_one(doc! {
+            "age": 30,
+        }, doc! {
+            "$set": {
+                "age": 31,
+            },
+        }).unwrap();
+        assert_eq!(result.modified_count, 1);
+
+        assert_eq!(col.find(doc! { "age": 3 }).unwrap().count(), 0);
+        assert_eq!(col.find(doc! { "age": 30 }).unwrap().count(), 8);
+        assert_eq!(col.find(doc! { "age": 31 }).unwrap().count(), 2);
+        assert_eq!(col.find(doc! { "age": 4 }).unwrap().count(), 10);
+        assert_eq!(col.count_documents().unwrap(), 100);
+    });
+}
+
+#[test]
+fn test_delete_many_by_index() {
+    vec![
+        prepare_db("test-delete-many-by-index").unwrap(),
+        Database::open_memory().unwrap(),
+    ].iter().for_each(|db| {
+        let metrics = db.metrics();
+        metrics.enable();
+
+        let col = db.collection::<Document>("teacher");
+
+        col.create_index(IndexModel {
+            keys: doc! {
+                "age": 1,
+            },
+            options: None,
+        }).unwrap();
+
+        let mut docs = vec![];
+        for i in 0..100 {
+            docs.push(doc! {
+                "name": format!("name-{}", i),
+                "age": i % 10,
+            });
+        }
+        col.insert_many(docs).unwrap();
+
+        let result = col.delete_one(doc! {
+            "age": 5,
+        }).unwrap();
+        assert_eq!(result.deleted_count, 1);
+        assert_eq!(metrics.find_by_index_count(), 1);
+
+        let result = col.delete_many(doc! {
+            "age": 5,
+            "name": "name-95",
+        }).unwrap();
+        assert_eq!(result.deleted_count, 1);
+
+        let result = col.delete_many(doc! {
+            "age": 5,
+        }).unwrap();
+        assert_eq!(result.deleted_count, 8);
+        assert_eq!(metrics.find_by_index_count(), 3);
+
+        assert_eq!(col.find(doc! { "age": 5 }).unwrap().count(), 0);
+        assert_eq!(col.find(doc! { "age": 6 }).unwrap().count(), 10);
+        assert_eq!(col.count_documents().unwrap(), 90);
+    });
+}
+
+#[test]
+fn test_find_by_index_range() {
+    vec![
+        prepare_db("test-find-by-index-range").unwrap(),
+        Database::open_memory().unwrap(),
+    ].iter().for_each(|db| {
+        let metrics = db.metrics();
+        metrics.enable();
+
+        let col = db.collection::<Document>("teacher");
+
+        col.create_index(IndexModel {
+            keys: doc! {
+                "age": 1,
+            },
+            options: None,
+        }).unwrap();
+
+        let mut docs = vec![];
+        for i in -50..50 {
+            docs.push(doc! {
+                "name": format!("name-{}", i),
+                "age": i,
+            });
+        }
+        docs.push(doc! {
+            "name": "int64",
+            "age": 20i64,
+        });
+        docs.push(doc! {
+            "name": "double",
+            "age": 20.5,
+        });
+        docs.push(doc! {
+            "name": "string",
+            "age": "20",
+        });
+        col.insert_many(docs).unwrap();
+
+        let count = |query: Document| col.find(query).unwrap().count();
+
+        assert_eq!(count(doc! { "age": { "$gte": 10, "$lt": 20 } }), 10);
+        assert_eq!(count(doc! { "age": { "$gt": 19, "$lte": 21 } }), 4);
+        assert_eq!(count(doc! { "age": { "$gte": -5, "$lt": 5 } }), 10);
+        assert_eq!(count(doc! { "age": { "$gte": 45 } }), 5);
+        assert_eq!(count(doc! { "age": { "$gte": 10, "$lt": 20 }, "name": "name-11" }), 1);
+        // the strings are ordered before the numbers
+        assert_eq!(count(doc! { "age": { "$lt": -45 } }), 6);
+        assert_eq!(count(doc! { "age": { "$gt": 20.25, "$lt": 21 } }), 2);
+        assert_eq!(metrics.find_by_index_count(), 7);
+
+        assert_eq!(count(doc! { "age": { "$in": [1, 3, 3, 20, "20", 100] } }), 5);
+        assert_eq!(count(doc! { "age": { "$in": [] } }), 0);
+        assert_eq!(metrics.find_by_index_count(), 8);
+    });
+}
+
+#[test]
+fn test_find_by_time_window() {
+    vec![
+        prepare_db("test-find-by-time-window").unwrap(),
+        Database::open_memory().unwrap(),
+    ].iter().for_each(|db| {
+        let metrics = db.metrics();
+        metrics.enable();
+
+        let col = db.collection::<Document>("events");
+
+        col.create_index(IndexModel {
+            keys: doc! {
+                "ts": 1,
+            },
+            options: None,
+        }).unwrap();
+
+        let mut docs = vec![];
+        for i in 0..100 {
+            docs.push(doc! {
+                "seq": i,
+                "ts": DateTime::from_millis(1_600_000_000_000 + i * 1000),
+            });
+        }
+        col.insert_many(docs).unwrap();
+
+        let from = DateTime::from_millis(1_600_000_000_000 + 10 * 1000);
+        let to = DateTime::from_millis(1_600_000_000_000 + 20 * 1000);
+        let result = col.find(doc! {
+            "ts": {
+                "$gte": from,
+                "$lt": to,
+            },
+        }).unwrap().collect::<Result<Vec<Document>>>().unwrap();
+
+        let seq: Vec<i32> = result.iter().map(|doc| doc.get_i32("seq").unwrap()).collect();
+        assert_eq!(seq, (10..20).collect::<Vec<i32>>());
         assert_eq!(metrics.find_by_index_count(), 1);
+
+        // the documents updated are moved after the window
+        let result = col.update_many(doc! {
+            "ts": {
+                "$gte": from,
+            },
+        }, doc! {
+            "$inc": {
+                "seq": 1000,
+            },
+            "$set": {
+                "ts": DateTime::from_millis(1_700_000_000_000),
+            },
+        }).unwrap();
+        assert_eq!(result.modified_count, 90);
+
+        let result = col.delete_many(doc! {
+            "ts": {
+                "$lt": from,
+            },
+        }).unwrap();
+        assert_eq!(result.deleted_count, 10);
+        assert_eq!(metrics.find_by_index_count(), 3);
+
+        assert_eq!(col.count_documents().unwrap(), 90);
+        assert_eq!(col.find(doc! { "seq": { "$gte": 1000 } }).unwrap().count(), 90);
+    });
+}
+
+#[test]
+fn test_find_by_compound_index() {
+    vec![
+        prepare_db("test-find-by-compound-index").unwrap(),
+        Database::open_memory().unwrap(),
+    ].iter().for_each(|db| {
+        let metrics = db.metrics();
+        metrics.enable();
+
+        let col = db.collection::<Document>("events");
+
+        col.create_index(IndexModel {
+            keys: doc! {
+                "tenant": 1,
+                "ts": -1,
+            },
+            options: None,
+        }).unwrap();
+
+        let mut docs = vec![];
+        for i in 0..60 {
+            docs.push(doc! {
+                "seq": i,
+                "tenant": format!("tenant-{}", i % 3),
+                "ts": DateTime::from_millis(1_600_000_000_000 + i * 1000),
+            });
+        }
+        col.insert_many(docs).unwrap();
+
+        // the documents are given out in the order of the index
+        let result = col.find(doc! {
+            "tenant": "tenant-1",
+            "ts": {
+                "$gte": DateTime::from_millis(1_600_000_000_000 + 10 * 1000),
+                "$lt": DateTime::from_millis(1_600_000_000_000 + 30 * 1000),
+            },
+        }).unwrap().collect::<Result<Vec<Document>>>().unwrap();
+        let seq: Vec<i32> = result.iter().map(|doc| doc.get_i32("seq").unwrap()).collect();
+        assert_eq!(seq, vec![28, 25, 22, 19, 16, 13, 10]);
+        assert_eq!(metrics.find_by_index_count(), 1);
+
+        // only the prefix of the keys
+        let result = col.find(doc! {
+            "tenant": "tenant-2",
+        }).unwrap().collect::<Result<Vec<Document>>>().unwrap();
+        assert_eq!(result.len(), 20);
+        assert_eq!(result[0].get_i32("seq").unwrap(), 59);
+        assert_eq!(metrics.find_by_index_count(), 2);
+
+        let result = col.find(doc! {
+            "tenant": {
+                "$in": ["tenant-0", "tenant-2"],
+            },
+        }).unwrap().count();
+        assert_eq!(result, 40);
+        assert_eq!(metrics.find_by_index_count(), 3);
+
+        // the second key alone can't be served
+        let result = col.find(doc! {
+            "ts": DateTime::from_millis(1_600_000_000_000),
+        }).unwrap().count();
+        assert_eq!(result, 1);
+        assert_eq!(metrics.find_by_index_count(), 3);
+
+        let result = col.update_many(doc! {
+            "tenant": "tenant-0",
+            "ts": {
+                "$lt": DateTime::from_millis(1_600_000_000_000 + 30 * 1000),
+            },
+        }, doc! {
+            "$set": {
+                "tenant": "tenant-3",
+            },
+        }).unwrap();
+        assert_eq!(result.modified_count, 10);
+
+        let result = col.delete_many(doc! {
+            "tenant": "tenant-3",
+        }).unwrap();
+        assert_eq!(result.deleted_count, 10);
+        assert_eq!(metrics.find_by_index_count(), 5);
+
+        assert_eq!(col.count_documents().unwrap(), 50);
+        assert_eq!(col.find(doc! { "tenant": "tenant-0" }).unwrap().count(), 10);
+    });
+}
+
+#[test]
+fn test_find_by_descending_index() {
+    vec![
+        prepare_db("test-find-by-descending-index").unwrap(),
+        Database::open_memory().unwrap(),
+    ].iter().for_each(|db| {
+        let metrics = db.metrics();
+        metrics.enable();
+
+        let col = db.collection::<Document>("teacher");
+
+        col.create_index(IndexModel {
+            keys: doc! {
+                "age": -1,
+            },
+            options: None,
+        }).unwrap();
+
+        let mut docs = vec![];
+        for i in 0..50 {
+            docs.push(doc! {
+                "name": format!("teacher-{}", i),
+                "age": i,
+            });
+        }
+        col.insert_many(docs).unwrap();
+
+        let result = col.find(doc! {
+            "age": {
+                "$gt": 20,
+                "$lte": 25,
+            },
+        }).unwrap().collect::<Result<Vec<Document>>>().unwrap();
+        let ages: Vec<i32> = result.iter().map(|doc| doc.get_i32("age").unwrap()).collect();
+        assert_eq!(ages, vec![25, 24, 23, 22, 21]);
+        assert_eq!(metrics.find_by_index_count(), 1);
+
+        let doc = col.find_one(doc! {
+            "age": 33,
+        }).unwrap().unwrap();
+        assert_eq!(doc.get_str("name").unwrap(), "teacher-33");
+        assert_eq!(metrics.find_by_index_count(), 2);
+    });
+}
+
+#[test]
+fn test_create_compound_unique_index() {
+    vec![
+        prepare_db("test-create-compound-unique-index").unwrap(),
+        Database::open_memory().unwrap(),
+    ].iter().for_each(|db| {
+        let col = db.collection("teacher");
+
+        col.create_index(IndexModel {
+            keys: doc! {
+                "school": 1,
+                "name": -1,
+            },
+            options: Some(IndexOptions{
+                unique: Some(true),
+                ..Default::default()
+            }),
+        }).unwrap();
+
+        col.insert_one(doc! {
+            "school": "North",
+            "name": "David",
+        }).unwrap();
+
+        col.insert_one(doc! {
+            "school": "South",
+            "name": "David",
+        }).unwrap();
+
+        let result = col.insert_one(doc! {
+            "school": "North",
+            "name": "David",
+        });
+
+        assert!(result.is_err());
+        assert!(result.unwrap_err().to_string().contains("duplicate key error"));
+        assert_eq!(col.count_documents().unwrap(), 2);
+    });
+}
+
+#[test]
+fn test_find_by_selective_index() {
+    vec![
+        prepare_db("test-find-by-selective-index").unwrap(),
+        Database::open_memory().unwrap(),
+    ].iter().for_each(|db| {
+        let metrics = db.metrics();
+        metrics.enable();
+
+        let col = db.collection::<Document>("orders");
+
+        col.create_index(IndexModel {
+            keys: doc! {
+                "status": 1,
+            },
+            options: None,
+        }).unwrap();
+
+        let mut docs = vec![];
+        for i in 0..2000 {
+            docs.push(doc! {
+                "order_id": i,
+                "status": if i % 2 == 0 { "paid" } else { "open" },
+            });
+        }
+        col.insert_many(docs).unwrap();
+
+        col.create_index(IndexModel {
+            keys: doc! {
+                "order_id": 1,
+            },
+            options: None,
+        }).unwrap();
+
+        let result = col.find(doc! {
+            "status": "paid",
+            "order_id": 42,
+        }).unwrap().collect::<Result<Vec<Document>>>().unwrap();
+        assert_eq!(result.len(), 1);
+        assert_eq!(metrics.find_by_index_count(), 1);
+
+        // half of the collection is scanned instead
+        let result = col.find(doc! {
+            "status": "paid",
+        }).unwrap().count();
+        assert_eq!(result, 1000);
+        assert_eq!(metrics.find_by_index_count(), 1);
+
+        let result = col.find(doc! {
+            "order_id": {
+                "$gte": 100,
+                "$lt": 110,
+            },
+        }).unwrap().count();
+        assert_eq!(result, 10);
+        assert_eq!(metrics.find_by_index_count(), 2);
     });
 }
 
@@ -323,3 +809,52 @@ fn test_drop_index() {
         assert_eq!(metrics.find_by_index_count(), 0);
     });
 }
+
+#[test]
+fn test_find_by_cached_plan() {
+    vec![
+        prepare_db("test-find-by-cached-plan").unwrap(),
+        Database::open_memory().unwrap(),
+    ].iter().for_each(|db| {
+        let metrics = db.metrics();
+        metrics.enable();
+
+        let col = db.collection::<Document>("teacher");
+
+        col.create_index(IndexModel {
+            keys: doc! {
+                "age": 1,
+            },
+            options: None,
+        }).unwrap();
+
+        for age in 30..40 {
+            col.insert_one(doc! {
+                "name": format!("David-{}", age),
+                "age": age,
+            }).unwrap();
+        }
+
+        for age in 30..40 {
+            let doc = col.find_one(doc! {
+                "age": age,
+            }).unwrap().unwrap();
+            assert_eq!(doc.get_str("name").unwrap(), format!("David-{}", age));
+        }
+        assert_eq!(metrics.plan_cache_hit_count(), 9);
+
+        // the programs are compiled again on the new index
+        col.create_index(IndexModel {
+            keys: doc! {
+                "name": 1,
+            },
+            options: None,
+        }).unwrap();
+
+        let doc = col.find_one(doc! {
+            "age": 35,
+        }).unwrap().unwrap();
+        assert_eq!(doc.get_str("name").unwrap(), "David-35");
+        assert_eq!(metrics.plan_cache_hit_count(), 9);
+    });
+}
@@ -9,12 +9,12 @@ use std::path::PathBuf;
 use bson::Document;
 use bson::spec::ElementType;
 use serde::{Deserialize, Serialize};
-use polodb_core::{Database, Result};
+use polodb_core::{ConfigBuilder, Database, IndexModel, IndexOptions, Result};
 use polodb_core::bson::{doc, Bson};
 
 mod common;
 
-use common::prepare_db;
+use common::{prepare_db, prepare_db_with_config};
 use polodb_core::test_utils::{mk_db_path, mk_journal_path};
 
 #[derive(Debug, Serialize, Deserialize)]
@@ -254,6 +254,63 @@ fn test_insert_different_types_as_key() {
     assert_eq!(result[1].as_ref().unwrap().get("_id").unwrap().element_type(), ElementType::Int32);
 }
 
+#[test]
+fn test_insert_many_raw() {
+    let db = Database::open_memory().unwrap();
+    let collection = db.collection::<Document>("test");
+
+    let mut buffer = vec![];
+    for i in 0..100 {
+        buffer.extend(bson::to_vec(&doc! {
+            "_id": i,
+            "name": i.to_string(),
+        }).unwrap());
+    }
+    let result = collection.insert_many_raw(&buffer).unwrap();
+    assert_eq!(result.inserted_ids.len(), 100);
+    assert_eq!(collection.count_documents().unwrap(), 100);
+
+    let doc = collection.find_one(doc! { "_id": 42 }).unwrap().unwrap();
+    assert_eq!(doc.get_str("name").unwrap(), "42");
+
+    // a truncated buffer inserts nothing
+    assert!(collection.insert_many_raw(&buffer[..buffer.len() - 1]).is_err());
+    assert_eq!(collection.count_documents().unwrap(), 100);
+}
+
+#[test]
+fn test_insert_many_raw_indexed() {
+    let db = Database::open_memory().unwrap();
+    let collection = db.collection::<Document>("test");
+    collection.create_index(IndexModel {
+        keys: doc! {
+            "name": 1,
+        },
+        options: Some(IndexOptions {
+            unique: Some(true),
+            ..Default::default()
+        }),
+    }).unwrap();
+
+    // the ids are added to the documents without them
+    let mut buffer = vec![];
+    for i in 0..10 {
+        buffer.extend(bson::to_vec(&doc! {
+            "name": i.to_string(),
+        }).unwrap());
+    }
+    let result = collection.insert_many_raw(&buffer).unwrap();
+    assert_eq!(result.inserted_ids.len(), 10);
+
+    let doc = collection.find_one(doc! { "name": "7" }).unwrap().unwrap();
+    assert_eq!(&doc.get("_id").unwrap().clone(), result.inserted_ids.get(&7).unwrap());
+
+    // the unique index is checked as the other inserts
+    let duplicated = bson::to_vec(&doc! { "name": "7" }).unwrap();
+    assert!(collection.insert_many_raw(&duplicated).is_err());
+    assert_eq!(collection.count_documents().unwrap(), 10);
+}
+
 #[test]
 fn test_insert_persist() {
     const NAME: &str = "test-insert-persist";
@@ -278,3 +335,60 @@ fn test_insert_persist() {
         assert_eq!(result.len() as u64, i as u64 + 1);
     }
 }
+
+#[test]
+fn test_insert_many_bulk_load() {
+    const NAME: &str = "test-insert-many-bulk-load";
+    let mut config_builder = ConfigBuilder::new();
+    config_builder.set_bulk_load_min_bytes(1024);
+    let config = config_builder.take();
+
+    {
+        let db = prepare_db_with_config(NAME, config.clone()).unwrap();
+        let collection = db.collection::<Document>("test");
+        collection.create_index(IndexModel {
+            keys: doc! {
+                "content": 1,
+            },
+            options: Some(IndexOptions {
+                unique: Some(true),
+                ..Default::default()
+            }),
+        }).unwrap();
+
+        let docs: Vec<Document> = (0..1000).rev().map(|i| doc! {
+            "_id": i,
+            "content": format!("content-{}", i),
+        }).collect();
+        let result = collection.insert_many(&docs).unwrap();
+        assert_eq!(result.inserted_ids.len(), 1000);
+
+        // duplicated in the batch, nothing is inserted
+        let result = collection.insert_many(&[
+            doc! { "_id": 1000, "content": "content-1000" },
+            doc! { "_id": 1001, "content": "content-1000" },
+        ]);
+        assert!(result.unwrap_err().to_string().contains("duplicate key error"));
+
+        // duplicated with the documents inserted before
+        let result = collection.insert_many(&[
+            doc! { "_id": 1002, "content": "content-1002" },
+            doc! { "_id": 1003, "content": "content-500" },
+        ]);
+        assert!(result.unwrap_err().to_string().contains("duplicate key error"));
+
+        assert_eq!(collection.count_documents().unwrap(), 1000);
+    }
+
+    let db = Database::open_file_with_config(mk_db_path(NAME).to_str().unwrap(), config).unwrap();
+    let collection = db.collection::<Document>("test");
+    assert_eq!(collection.count_documents().unwrap(), 1000);
+
+    let one = collection.find_one(doc! {
+        "content": "content-500",
+    }).unwrap().unwrap();
+    assert_eq!(one.get("_id").unwrap().as_i32().unwrap(), 500);
+
+    let all = collection.find(None).unwrap().collect::<Result<Vec<_>>>().unwrap();
+    assert_eq!(all[0].get("_id").unwrap().as_i32().unwrap(), 0);
+}
@@ -7,7 +7,7 @@ use std::collections::HashMap;
 use std::fs::File;
 use std::path::{Path, PathBuf};
 use csv::{Reader, StringRecord};
-use polodb_core::LsmKv;
+use polodb_core::{ConfigBuilder, Error, LsmCompression, LsmKv, TransactionType};
 use polodb_core::test_utils::mk_db_path;
 
 #[test]
@@ -319,3 +319,441 @@ fn test_dataset_18k() {
         counter += 1;
     }
 }
+
+/// The data must be the same when the compaction
+/// is running on the background thread.
+#[test]
+fn test_dataset_18k_background_compaction() {
+    let dir = env!("CARGO_MANIFEST_DIR");
+    let data_set_path = dir.to_string() + "/tests/dataset/CrimeDataFrom2020.csv";
+    let file = File::open(data_set_path).unwrap();
+
+    let db_path = mk_db_path("test-kv-dataset-18k-bg");
+    clean_path(db_path.as_path());
+
+    let mut mem_table: HashMap<String, String> = HashMap::new();
+
+    {
+        let mut config_builder = ConfigBuilder::new();
+        config_builder.set_background_compaction(true);
+        let db = LsmKv::open_file_with_config(db_path.as_path(), config_builder.take()).unwrap();
+        let metrics = db.metrics();
+        metrics.enable();
+
+        let mut rdr = Reader::from_reader(&file);
+
+        insert_csv_to_db(&db, &mut rdr, &mut mem_table, 18000);
+
+        for (key, value) in &mem_table {
+            let test_value = db.get_string(key.as_str()).unwrap().unwrap();
+            assert_eq!(test_value.as_str(), value.as_str(), "key: {}", key);
+        }
+    }
+
+    let db = LsmKv::open_file(db_path.as_path()).unwrap();
+
+    for (key, value) in &mem_table {
+        let test_value = db.get_string(key.as_str())
+            .unwrap()
+            .expect(format!("no value, key: {}", key).as_str());
+        assert_eq!(test_value.as_str(), value.as_str(), "key: {}", key);
+    }
+}
+
+#[test]
+fn test_persist_with_group_commit() {
+    let db_path = mk_db_path("test-kv-persist-group-commit");
+    clean_path(db_path.as_path());
+    {
+        let mut config_builder = ConfigBuilder::new();
+        config_builder
+            .set_log_group_commit(true)
+            .set_log_group_commit_window_us(10);
+        let db = LsmKv::open_file_with_config(db_path.as_path(), config_builder.take()).unwrap();
+        for i in 0..100 {
+            db.put(format!("key-{}", i), format!("value-{}", i)).unwrap();
+        }
+        db.delete("key-50").unwrap();
+    }
+
+    {
+        let db = LsmKv::open_file(db_path.as_path()).unwrap();
+        for i in 0..100 {
+            let value = db.get_string(format!("key-{}", i)).unwrap();
+            if i == 50 {
+                assert!(value.is_none());
+            } else {
+                assert_eq!(value.unwrap(), format!("value-{}", i));
+            }
+        }
+    }
+}
+
+/// The writers retry the outdated sessions,
+/// the commits waiting for the sync share it.
+#[test]
+fn test_group_commit_concurrent_writers() {
+    let db_path = mk_db_path("test-kv-group-commit-concurrent");
+    clean_path(db_path.as_path());
+    let thread_count = 8;
+    let put_count = 100;
+    {
+        let mut config_builder = ConfigBuilder::new();
+        config_builder
+            .set_log_group_commit(true)
+            .set_log_group_commit_window_us(2000);
+        let db = LsmKv::open_file_with_config(db_path.as_path(), config_builder.take()).unwrap();
+        let metrics = db.metrics();
+        metrics.enable();
+
+        let handles: Vec<_> = (0..thread_count)
+            .map(|thread_index| {
+                let db = db.clone();
+                std::thread::spawn(move || {
+                    for i in 0..put_count {
+                        let key = format!("key-{}-{}", thread_index, i);
+                        loop {
+                            match db.put(&key, "value") {
+                                Ok(()) => break,
+                                Err(Error::SessionOutdated) => continue,
+                                Err(err) => panic!("put failed: {}", err),
+                            }
+                        }
+                    }
+                })
+            })
+            .collect();
+        for handle in handles {
+            handle.join().unwrap();
+        }
+
+        let commit_count = thread_count * put_count;
+        let sync_count = metrics.log_sync_count();
+        assert!(sync_count > 0);
+        assert!(sync_count < commit_count, "syncs: {}, commits: {}", sync_count, commit_count);
+    }
+
+    let db = LsmKv::open_file(db_path.as_path()).unwrap();
+    for thread_index in 0..thread_count {
+        for i in 0..put_count {
+            let value = db.get_string(format!("key-{}-{}", thread_index, i)).unwrap();
+            assert_eq!(value.unwrap(), "value");
+        }
+    }
+}
+
+#[test]
+fn test_group_commit_session_outdated() {
+    let db_path = mk_db_path("test-kv-group-commit-outdated");
+    clean_path(db_path.as_path());
+
+    let mut config_builder = ConfigBuilder::new();
+    config_builder.set_log_group_commit(true);
+    let db = LsmKv::open_file_with_config(db_path.as_path(), config_builder.take()).unwrap();
+
+    let mut session1 = db.new_session();
+    let mut session2 = db.new_session();
+    session1.start_transaction(TransactionType::Write).unwrap();
+    session2.start_transaction(TransactionType::Write).unwrap();
+    session1.put(b"a", b"1").unwrap();
+    session2.put(b"b", b"2").unwrap();
+
+    session1.commit_transaction().unwrap();
+    let result = session2.commit_transaction();
+    assert!(matches!(result, Err(Error::SessionOutdated)));
+
+    assert_eq!(db.get_string("a").unwrap().unwrap(), "1");
+    assert!(db.get_string("b").unwrap().is_none());
+}
+
+#[test]
+fn test_bloom_filter_skip_segments() {
+    let db_path = mk_db_path("test-kv-bloom-filter");
+    clean_path(db_path.as_path());
+
+    let mut config_builder = ConfigBuilder::new();
+    config_builder.set_lsm_block_size(64 * 1024);
+
+    let value = vec![0x42u8; 1024];
+    {
+        let db = LsmKv::open_file_with_config(db_path.as_path(), config_builder.take()).unwrap();
+        for i in 0..1000 {
+            db.put(format!("key-{:05}", i * 2), value.as_slice()).unwrap();
+        }
+    }
+
+    let db = LsmKv::open_file(db_path.as_path()).unwrap();
+    let metrics = db.metrics();
+    metrics.enable();
+
+    for i in 0..1000 {
+        assert!(db.get(format!("key-{:05}", i * 2)).unwrap().is_some());
+        assert!(db.get(format!("key-{:05}", i * 2 + 1)).unwrap().is_none());
+    }
+
+    assert!(metrics.bloom_filter_negative() > 0);
+    assert!(metrics.bloom_filter_positive() > 0);
+}
+
+#[test]
+fn test_read_without_mmap() {
+    let db_path = mk_db_path("test-kv-read-without-mmap");
+    clean_path(db_path.as_path());
+
+    let make_config = || {
+        let mut config_builder = ConfigBuilder::new();
+        config_builder
+            .set_lsm_block_size(64 * 1024)
+            .set_lsm_mmap_read(false);
+        config_builder.take()
+    };
+
+    {
+        let db = LsmKv::open_file_with_config(db_path.as_path(), make_config()).unwrap();
+        for i in 0..500 {
+            db.put(format!("key-{:05}", i), format!("value-{}", i).repeat(64)).unwrap();
+        }
+    }
+
+    let db = LsmKv::open_file_with_config(db_path.as_path(), make_config()).unwrap();
+    for i in 0..500 {
+        let value = db.get_string(format!("key-{:05}", i)).unwrap().unwrap();
+        assert_eq!(value, format!("value-{}", i).repeat(64));
+    }
+}
+
+#[test]
+fn test_value_cache() {
+    let db_path = mk_db_path("test-kv-value-cache");
+    clean_path(db_path.as_path());
+
+    let mut config_builder = ConfigBuilder::new();
+    config_builder.set_lsm_block_size(64 * 1024);
+
+    {
+        let db = LsmKv::open_file_with_config(db_path.as_path(), config_builder.take()).unwrap();
+        for i in 0..500 {
+            db.put(format!("key-{:05}", i), format!("value-{}", i).repeat(64)).unwrap();
+        }
+    }
+
+    let db = LsmKv::open_file(db_path.as_path()).unwrap();
+    let metrics = db.metrics();
+    metrics.enable();
+
+    for _ in 0..2 {
+        for i in 0..100 {
+            let value = db.get_string(format!("key-{:05}", i)).unwrap().unwrap();
+            assert_eq!(value, format!("value-{}", i).repeat(64));
+        }
+    }
+
+    assert!(metrics.value_cache_miss() > 0);
+    assert!(metrics.value_cache_hit() >= 100);
+}
+
+#[test]
+fn test_skip_list_mem_table() {
+    let db_path = mk_db_path("test-kv-skip-list");
+    clean_path(db_path.as_path());
+
+    let make_config = || {
+        let mut config_builder = ConfigBuilder::new();
+        config_builder
+            .set_lsm_block_size(64 * 1024)
+            .set_lsm_skip_list_mem_table(true);
+        config_builder.take()
+    };
+
+    {
+        let db = LsmKv::open_file_with_config(db_path.as_path(), make_config()).unwrap();
+        for i in 0..500 {
+            db.put(format!("key-{:05}", i), format!("value-{}", i).repeat(16)).unwrap();
+        }
+        for i in (0..500).step_by(5) {
+            db.delete(format!("key-{:05}", i)).unwrap();
+        }
+        db.put("key-00001", "updated").unwrap();
+
+        let cursor = db.open_cursor();
+        cursor.seek("key-00004").unwrap();
+        cursor.next().unwrap();
+        // key-00005 is deleted
+        assert_eq!(cursor.key().unwrap().unwrap().as_ref(), &b"key-00006"[..]);
+    }
+
+    let db = LsmKv::open_file_with_config(db_path.as_path(), make_config()).unwrap();
+    assert_eq!(db.get_string("key-00001").unwrap().unwrap(), "updated");
+    for i in 2..500 {
+        let value = db.get_string(format!("key-{:05}", i)).unwrap();
+        if i % 5 == 0 {
+            assert!(value.is_none());
+        } else {
+            assert_eq!(value.unwrap(), format!("value-{}", i).repeat(16));
+        }
+    }
+
+    let memory_db = LsmKv::open_memory_with_config(make_config()).unwrap();
+    memory_db.put("Hello", "World").unwrap();
+    memory_db.put("Hello", "Polo").unwrap();
+    assert_eq!(memory_db.get_string("Hello").unwrap().unwrap(), "Polo");
+}
+
+#[test]
+fn test_leveled_compaction() {
+    for background in [false, true] {
+        let db_path = mk_db_path(&format!("test-kv-leveled-{}", background));
+        clean_path(db_path.as_path());
+
+        let make_config = || {
+            let mut config_builder = ConfigBuilder::new();
+            config_builder
+                .set_lsm_block_size(16 * 1024)
+                .set_lsm_leveled_compaction(true)
+                .set_background_compaction(background);
+            config_builder.take()
+        };
+
+        // not in the order of keys, so the segments overlap
+        let key_of = |i: u32| format!("key-{:06}", (i * 7919) % 6000);
+
+        let metrics = {
+            let db = LsmKv::open_file_with_config(db_path.as_path(), make_config()).unwrap();
+            let metrics = db.metrics();
+            metrics.enable();
+
+            for i in 0..6000 {
+                db.put(key_of(i), format!("value-{}", i).repeat(16)).unwrap();
+            }
+            for i in (0..6000).step_by(3) {
+                db.delete(key_of(i)).unwrap();
+            }
+
+            metrics
+        };
+
+        if !background {
+            assert!(metrics.minor_compact() > 0);
+            assert!(metrics.major_compact() + metrics.trivial_move() > 0);
+            assert!(metrics.compaction_write_bytes() > 0);
+            assert!(metrics.write_amplification() > 1.0);
+        }
+
+        let db = LsmKv::open_file_with_config(db_path.as_path(), make_config()).unwrap();
+        for i in 0..6000 {
+            let value = db.get_string(key_of(i)).unwrap();
+            if i % 3 == 0 {
+                assert!(value.is_none(), "key: {}", key_of(i));
+            } else {
+                assert_eq!(value.unwrap(), format!("value-{}", i).repeat(16));
+            }
+        }
+
+        let cursor = db.open_cursor();
+        cursor.seek("key-").unwrap();
+        let mut count = 0;
+        let mut last_key: Option<Vec<u8>> = None;
+        while let Some(key) = cursor.key().unwrap() {
+            let key = key.to_vec();
+            if let Some(last_key) = &last_key {
+                assert!(last_key < &key);
+            }
+            last_key = Some(key);
+            count += 1;
+            cursor.next().unwrap();
+        }
+        assert_eq!(count, 4000);
+    }
+}
+
+#[test]
+fn test_compressed_segments() {
+    for leveled in [false, true] {
+        let db_path = mk_db_path(&format!("test-kv-compressed-{}", leveled));
+        clean_path(db_path.as_path());
+
+        let make_config = || {
+            let mut config_builder = ConfigBuilder::new();
+            config_builder
+                .set_lsm_block_size(16 * 1024)
+                .set_lsm_leveled_compaction(leveled)
+                .set_lsm_level_compression(vec![LsmCompression::None, LsmCompression::Lz4]);
+            config_builder.take()
+        };
+
+        let key_of = |i: u32| format!("key-{:06}", (i * 7919) % 6000);
+
+        {
+            let db = LsmKv::open_file_with_config(db_path.as_path(), make_config()).unwrap();
+            for i in 0..6000 {
+                db.put(key_of(i), format!("value-{}", i).repeat(16)).unwrap();
+            }
+            for i in (0..6000).step_by(3) {
+                db.delete(key_of(i)).unwrap();
+            }
+        }
+
+        let db = LsmKv::open_file_with_config(db_path.as_path(), make_config()).unwrap();
+        for i in 0..6000 {
+            let value = db.get_string(key_of(i)).unwrap();
+            if i % 3 == 0 {
+                assert!(value.is_none(), "key: {}", key_of(i));
+            } else {
+                assert_eq!(value.unwrap(), format!("value-{}", i).repeat(16));
+            }
+        }
+
+        let cursor = db.open_cursor();
+        cursor.seek("key-").unwrap();
+        let mut count = 0;
+        while cursor.key().unwrap().is_some() {
+            assert!(cursor.value().unwrap().is_some());
+            count += 1;
+            cursor.next().unwrap();
+        }
+        assert_eq!(count, 4000);
+    }
+}
+
+/// Compare the file size and the scan throughput of the codecs,
+/// run with `cargo test --release -- --ignored bench_segment_compression`.
+#[test]
+#[ignore]
+fn bench_segment_compression() {
+    let count = 200_000u32;
+    for compression in [LsmCompression::None, LsmCompression::Lz4] {
+        let db_path = mk_db_path(&format!("bench-kv-compression-{:?}", compression));
+        clean_path(db_path.as_path());
+
+        let mut config_builder = ConfigBuilder::new();
+        config_builder.set_lsm_level_compression(vec![compression]);
+        let config = config_builder.take();
+
+        let db = LsmKv::open_file_with_config(db_path.as_path(), config).unwrap();
+        for i in 0..count {
+            let value = format!("{{\"name\": \"user-{}\", \"age\": {}, \"city\": \"city-{}\"}}", i, i % 100, i % 50);
+            db.put(format!("key-{:08}", i), value).unwrap();
+        }
+
+        let start = std::time::Instant::now();
+        let cursor = db.open_cursor();
+        cursor.seek("key-").unwrap();
+        let mut scanned = 0;
+        while cursor.key().unwrap().is_some() {
+            cursor.value().unwrap();
+            scanned += 1;
+            cursor.next().unwrap();
+        }
+        let elapsed = start.elapsed();
+        assert_eq!(scanned, count);
+
+        let file_size = std::fs::metadata(db_path.as_path()).unwrap().len();
+        println!(
+            "{:?}: file size {} bytes, scan {:?}, {:.0} keys/s",
+            compression,
+            file_size,
+            elapsed,
+            (scanned as f64) / elapsed.as_secs_f64(),
+        );
+    }
+}
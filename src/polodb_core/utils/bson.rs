@@ -4,9 +4,11 @@
  * file, You can obtain one at https://mozilla.org/MPL/2.0/.
  */
 use std::cmp::Ordering;
+use std::convert::TryFrom;
 use std::io::{BufRead, Read, Write};
 use bson::{Bson, DateTime, Decimal128, Document, Timestamp};
 use bson::oid::ObjectId;
+use bson::raw::{RawBsonRef, RawDocument};
 use bson::spec::ElementType;
 use byteorder::{BigEndian, ReadBytesExt, WriteBytesExt};
 use bson::ser::Error as BsonErr;
@@ -101,6 +103,58 @@ pub fn stacked_key_bytes<W: Write>(writer: &mut W, key: &Bson) -> Result<()> {
     Ok(())
 }
 
+/// Write the key of a descending index, all the bytes are inverted,
+/// so the order of the keys is reversed.
+///
+/// The inverted types are all greater than 0x80,
+/// [`split_stacked_keys`] tells them from the ascending ones.
+pub fn stacked_key_bytes_desc<W: Write>(writer: &mut W, key: &Bson) -> Result<()> {
+    let mut buffer = Vec::<u8>::with_capacity(16);
+    stacked_key_bytes(&mut buffer, key)?;
+
+    for byte in buffer.iter_mut() {
+        *byte = !*byte;
+    }
+
+    writer.write_all(&buffer)?;
+
+    Ok(())
+}
+
+/// The length of the key after the type byte,
+/// the strings are ended by `terminator`.
+fn stacked_value_len(ty: u8, data: &[u8], terminator: u8) -> Result<usize> {
+    let len = if ty == ElementType::Double as u8
+        || ty == ElementType::Int64 as u8
+        || ty == ElementType::Timestamp as u8
+        || ty == ElementType::DateTime as u8 {
+        8
+    } else if ty == ElementType::String as u8 || ty == ElementType::Symbol as u8 {
+        match data.iter().position(|byte| *byte == terminator) {
+            Some(pos) => pos + 1,
+            None => return Err(Error::data_malformed()),
+        }
+    } else if ty == ElementType::Boolean as u8 {
+        1
+    } else if ty == ElementType::Null as u8 || ty == ElementType::Undefined as u8 {
+        0
+    } else if ty == ElementType::Int32 as u8 {
+        4
+    } else if ty == ElementType::ObjectId as u8 {
+        12
+    } else if ty == ElementType::Decimal128 as u8 {
+        16
+    } else {
+        return Err(Error::UnknownBsonElementType(ty));
+    };
+
+    if len > data.len() {
+        return Err(Error::data_malformed());
+    }
+
+    Ok(len)
+}
+
 pub fn split_stacked_keys(buffer: &[u8]) -> Result<Vec<Bson>> {
     let mut result = Vec::<Bson>::new();
     let mut reader = buffer;
@@ -111,7 +165,18 @@ pub fn split_stacked_keys(buffer: &[u8]) -> Result<Vec<Bson>> {
             break;
         }
         let ch = ch_result.unwrap();
-        if ch == ElementType::Double as u8 {
+        if ch & 0x80 != 0 {
+            // the key of a descending index
+            let ty = !ch;
+            let len = stacked_value_len(ty, reader, !0u8)?;
+
+            let mut ascending = Vec::<u8>::with_capacity(len + 1);
+            ascending.push(ty);
+            ascending.extend(reader[0..len].iter().map(|byte| !byte));
+            reader = &reader[len..];
+
+            result.extend(split_stacked_keys(&ascending)?);
+        } else if ch == ElementType::Double as u8 {
             let val = reader.read_f64::<BigEndian>()?;
             result.push(Bson::Double(val));
         } else if ch == ElementType::String as u8 {
@@ -214,6 +279,19 @@ pub fn value_cmp(a: &Bson, b: &Bson) -> BsonResult<Ordering> {
     }
 }
 
+/// The bytes the value takes in memory, roughly
+pub(crate) fn approx_size_of(value: &Bson) -> usize {
+    match value {
+        Bson::String(s) => 16 + s.len(),
+        Bson::Binary(bin) => 16 + bin.bytes.len(),
+        Bson::Document(doc) => {
+            16 + doc.iter().map(|(key, value)| key.len() + approx_size_of(value)).sum::<usize>()
+        }
+        Bson::Array(arr) => 16 + arr.iter().map(approx_size_of).sum::<usize>(),
+        _ => 16,
+    }
+}
+
 pub fn try_get_document_value(doc: &Document, key: &str) -> Option<Bson> {
     let keys = key.split('.').collect::<Vec<&str>>();
     let keys_slice = keys.as_slice();
@@ -242,6 +320,106 @@ fn try_get_document_by_slices(doc: &Document, keys: &[&str]) -> Option<Bson> {
         .flatten()
 }
 
+/// The same as [`try_get_document_value`], but only the value found
+/// is decoded from the raw document.
+pub fn try_get_raw_document_value(buf: &[u8], key: &str) -> Result<Option<Bson>> {
+    let mut doc = RawDocument::from_bytes(buf).map_err(|_| Error::data_malformed())?;
+    let mut keys = key.split('.').peekable();
+
+    while let Some(key) = keys.next() {
+        let value = doc.get(key).map_err(|_| Error::data_malformed())?;
+        match (value, keys.peek()) {
+            (Some(RawBsonRef::Document(sub_doc)), Some(_)) => {
+                doc = sub_doc;
+            }
+            (Some(value), None) => {
+                let value = Bson::try_from(value).map_err(|_| Error::data_malformed())?;
+                return Ok(Some(value));
+            }
+            _ => return Ok(None),
+        }
+    }
+
+    Ok(None)
+}
+
+/// The same as [`try_get_document_value`] on a raw document,
+/// only the value found is decoded.
+/// A sub document is not a value, as it's not with a [`Document`].
+pub fn try_get_raw_field_value(doc: &RawDocument, key: &str) -> Result<Option<Bson>> {
+    let mut doc = doc;
+    let mut keys = key.split('.').peekable();
+
+    while let Some(key) = keys.next() {
+        let value = doc.get(key).map_err(|_| Error::data_malformed())?;
+        match (value, keys.peek()) {
+            (Some(RawBsonRef::Document(sub_doc)), Some(_)) => {
+                doc = sub_doc;
+            }
+            (Some(RawBsonRef::Document(_)), None) => return Ok(None),
+            (Some(value), None) => {
+                let value = Bson::try_from(value).map_err(|_| Error::data_malformed())?;
+                return Ok(Some(value));
+            }
+            _ => return Ok(None),
+        }
+    }
+
+    Ok(None)
+}
+
+/// Split the documents concatenated in the buffer,
+/// e.g. written by another driver.
+///
+/// All the elements are checked, but nothing is decoded.
+pub fn split_concatenated_documents(buffer: &[u8]) -> Result<Vec<&RawDocument>> {
+    let mut result = Vec::new();
+    let mut rest = buffer;
+
+    while !rest.is_empty() {
+        if rest.len() < 5 {
+            return Err(Error::data_malformed());
+        }
+        let mut len_bytes = [0u8; 4];
+        len_bytes.copy_from_slice(&rest[0..4]);
+        let len = i32::from_le_bytes(len_bytes);
+        if len < 5 || len as usize > rest.len() {
+            return Err(Error::data_malformed());
+        }
+
+        let (doc_bytes, next) = rest.split_at(len as usize);
+        let raw_doc = RawDocument::from_bytes(doc_bytes).map_err(|_| Error::data_malformed())?;
+        validate_raw_document(raw_doc)?;
+        result.push(raw_doc);
+
+        rest = next;
+    }
+
+    Ok(result)
+}
+
+fn validate_raw_document(doc: &RawDocument) -> Result<()> {
+    for element in doc {
+        let (_, value) = element.map_err(|_| Error::data_malformed())?;
+        validate_raw_value(value)?;
+    }
+    Ok(())
+}
+
+fn validate_raw_value(value: RawBsonRef) -> Result<()> {
+    match value {
+        RawBsonRef::Document(doc) => validate_raw_document(doc),
+        RawBsonRef::Array(arr) => {
+            for item in arr {
+                let item = item.map_err(|_| Error::data_malformed())?;
+                validate_raw_value(item)?;
+            }
+            Ok(())
+        }
+        _ => Ok(()),
+    }
+}
+
 #[cfg(not(target_arch = "wasm32"))]
 pub fn bson_datetime_now() -> bson::datetime::DateTime {
     return bson::datetime::DateTime::now()
@@ -257,9 +435,11 @@ pub fn bson_datetime_now() -> bson::datetime::DateTime {
 #[cfg(test)]
 mod tests {
     use std::cmp::Ordering;
-    use bson::{Bson, doc, Timestamp};
+    use std::convert::TryFrom;
+    use bson::{Bson, doc, Document, Timestamp};
     use bson::oid::ObjectId;
-    use crate::utils::bson::{split_stacked_keys, stacked_key, value_cmp};
+    use bson::raw::RawDocument;
+    use crate::utils::bson::{split_concatenated_documents, split_stacked_keys, try_get_document_value, try_get_raw_field_value, stacked_key, stacked_key_bytes, stacked_key_bytes_desc, value_cmp};
 
     #[test]
     fn test_value_cmp() {
@@ -282,6 +462,23 @@ mod tests {
         assert_eq!(super::try_get_document_value(&doc!{"a": { "b": { "c": 1 }}}, "a.b.d"), None);
     }
 
+    #[test]
+    fn test_try_get_raw_document_value() {
+        let get = |doc: bson::Document, key: &str| {
+            let buf = bson::to_vec(&doc).unwrap();
+            super::try_get_raw_document_value(&buf, key).unwrap()
+        };
+        assert_eq!(get(doc!{}, "a"), None);
+        assert_eq!(get(doc!{"a": 1}, "a"), Some(Bson::Int32(1)));
+        assert_eq!(get(doc!{"a": 1}, "b"), None);
+        assert_eq!(get(doc!{"a": 1}, "a.b"), None);
+        assert_eq!(get(doc!{"a": { "b": 1 }}, "a.b"), Some(Bson::Int32(1)));
+        assert_eq!(get(doc!{"a": { "b": 1 }}, "a"), Some(Bson::Document(doc!{ "b": 1 })));
+        assert_eq!(get(doc!{"a": { "b": { "c": 1 }}}, "a.b.c"), Some(Bson::Int32(1)));
+        assert_eq!(get(doc!{"a": { "b": { "c": 1 }}}, "a.b.d"), None);
+        assert_eq!(get(doc!{"a": [1, 2]}, "a"), Some(Bson::Array(vec![Bson::Int32(1), Bson::Int32(2)])));
+    }
+
     #[test]
     fn test_split_stacked_keys() {
         let values = vec![
@@ -304,6 +501,74 @@ mod tests {
         for i in 0..slices.len() {
             assert_eq!(slices[i], values[i]);
         }
+
+        let mut stacked = vec![];
+        for (i, value) in values.iter().enumerate() {
+            if i % 2 == 0 {
+                stacked_key_bytes_desc(&mut stacked, value).unwrap();
+            } else {
+                stacked_key_bytes(&mut stacked, value).unwrap();
+            }
+        }
+        let slices = split_stacked_keys(&stacked).unwrap();
+        assert_eq!(slices, values);
+    }
+
+    #[test]
+    fn test_descending_keys_order() {
+        let values = vec![
+            Bson::String("a".to_string()),
+            Bson::String("ab".to_string()),
+            Bson::String("b".to_string()),
+        ];
+        let keys: Vec<Vec<u8>> = values.iter().map(|value| {
+            let mut key = vec![];
+            stacked_key_bytes_desc(&mut key, value).unwrap();
+            key
+        }).collect();
+
+        assert!(keys[0] > keys[1]);
+        assert!(keys[1] > keys[2]);
+    }
+
+    #[test]
+    fn test_split_concatenated_documents() {
+        let mut buffer = bson::to_vec(&doc! { "_id": 1 }).unwrap();
+        buffer.extend(bson::to_vec(&doc! { "_id": 2, "name": "a" }).unwrap());
+
+        let docs: Vec<Document> = split_concatenated_documents(&buffer)
+            .unwrap()
+            .into_iter()
+            .map(|raw_doc| Document::try_from(raw_doc).unwrap())
+            .collect();
+        assert_eq!(docs, vec![doc! { "_id": 1 }, doc! { "_id": 2, "name": "a" }]);
+
+        assert!(split_concatenated_documents(&buffer[..buffer.len() - 1]).is_err());
+        assert!(split_concatenated_documents(&[]).unwrap().is_empty());
+
+        // the length of a nested string is broken
+        let mut nested = bson::to_vec(&doc! { "a": { "b": "c" } }).unwrap();
+        let pos = nested.iter().rposition(|b| *b == 2).unwrap();
+        nested[pos] = 100;
+        assert!(split_concatenated_documents(&nested).is_err());
+    }
+
+    #[test]
+    fn test_raw_field_value() {
+        let doc = doc! {
+            "a": 1,
+            "b": { "c": "d" },
+            "e": [1, 2],
+        };
+        let buffer = bson::to_vec(&doc).unwrap();
+        let raw_doc = RawDocument::from_bytes(&buffer).unwrap();
+
+        for key in ["a", "b", "b.c", "b.x", "e", "a.x", "x"] {
+            assert_eq!(
+                try_get_raw_field_value(raw_doc, key).unwrap(),
+                try_get_document_value(&doc, key),
+            );
+        }
     }
 
 }
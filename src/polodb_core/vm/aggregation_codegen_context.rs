@@ -4,21 +4,42 @@
  * file, You can obtain one at https://mozilla.org/MPL/2.0/.
  */
 
+use crate::vm::global_variable::GlobalVariable;
 use crate::vm::label::Label;
 
 pub(crate) struct PipelineItem {
     pub next_label: Label,
     pub complete_label: Option<Label>,
+    /// The `$sort` stage gets the documents in order from the index scan
+    pub ordered_by_scan: bool,
+    /// The `$limit` stage stops the scan when it's full
+    pub stops_scan: bool,
+}
+
+impl PipelineItem {
+
+    pub fn new(next_label: Label, complete_label: Option<Label>) -> PipelineItem {
+        PipelineItem {
+            next_label,
+            complete_label,
+            ordered_by_scan: false,
+            stops_scan: false,
+        }
+    }
+
 }
 
 pub(crate) struct AggregationCodeGenContext {
-    pub items: Vec<PipelineItem>
+    pub items: Vec<PipelineItem>,
+    /// Set to true by the `$limit` stopping the scan
+    pub limit_reached: Option<GlobalVariable>,
 }
 
 impl Default for AggregationCodeGenContext {
     fn default() -> Self {
         AggregationCodeGenContext {
             items: Vec::default(),
+            limit_reached: None,
         }
     }
 }
@@ -4,12 +4,31 @@
  * file, You can obtain one at https://mozilla.org/MPL/2.0/.
  */
 use super::label::{JumpTableRecord, Label, LabelSlot};
-use crate::coll::collection_info::CollectionSpecification;
+use crate::coll::collection_info::{CollectionSpecification, IndexInfo};
 use crate::errors::{mk_invalid_query_field, FieldTypeUnexpectedStruct};
-use crate::index::INDEX_PREFIX;
+use crate::index::{
+    intervals_of_point,
+    intervals_of_range,
+    intervals_to_bson,
+    is_range_scan_ordered,
+    merge_intervals,
+    prefix_successor,
+    KeyInterval,
+    INDEX_PREFIX,
+};
 use crate::vm::op::DbOp;
-use crate::vm::subprogram::SubProgramIndexItem;
+use crate::vm::subprogram::{
+    AccessPath,
+    GroupAccumulator,
+    GroupAccumulatorKind,
+    GroupExpr,
+    SubProgramGroupItem,
+    SubProgramIndexItem,
+    SubProgramSortItem,
+};
+use crate::vm::subprogram_cache::{ParamPath, ParamSlot};
 use crate::vm::SubProgram;
+use crate::utils::bson::{stacked_key_bytes, stacked_key_bytes_desc};
 use crate::{Error, Result};
 use bson::spec::{BinarySubtype, ElementType};
 use bson::{Array, Binary, Bson, Document};
@@ -19,6 +38,20 @@ use crate::vm::global_variable::{GlobalVariable, GlobalVariableSlot};
 const JUMP_TABLE_DEFAULT_SIZE: usize = 8;
 const PATH_DEFAULT_SIZE: usize = 8;
 
+/// The fraction of the entries of a key with an equal value,
+/// if the index has no statistics
+const DEFAULT_EQUALITY_SELECTIVITY: f64 = 0.1;
+/// The fraction of the entries of a key in a range with one bound
+const RANGE_SELECTIVITY: f64 = 1.0 / 3.0;
+/// The fraction of the entries of a key in a range with both bounds
+const BETWEEN_SELECTIVITY: f64 = 1.0 / 4.0;
+/// A document found by the index costs the index entry
+/// and a random read, instead of a document scanned in order.
+const INDEX_FETCH_COST: f64 = 2.5;
+/// The collections smaller than this never give up the index,
+/// the estimates are too rough for them.
+const SCAN_FALLBACK_MIN_ENTRIES: u64 = 1000;
+
 mod update_op {
     use crate::vm::codegen::Codegen;
     use crate::vm::op::DbOp;
@@ -35,7 +68,7 @@ mod update_op {
 
             let key_id_1 = codegen.push_static(Bson::from(key.clone()));
             let key_id_2 = codegen.push_static(Bson::from(key.clone()));
-            let value_id = codegen.push_static(value.clone());
+            let value_id = codegen.push_param_of_key(key, value);
 
             codegen.emit_goto2(DbOp::GetField, key_id_1, next_element_label); // stack +1
 
@@ -76,12 +109,59 @@ mod update_op {
     }
 }
 
+/// How the index is searched
+enum IndexProbe {
+    /// The index keys of the value
+    Value(Bson),
+    /// The index keys of the values in the intervals
+    Intervals(Vec<KeyInterval>),
+}
+
+/// How the values of a key are scanned by the index
+enum KeyScanOrder {
+    /// All the values are equal
+    Fixed,
+    /// The values are scanned in the order of the index key
+    Ordered,
+}
+
+/// The order of the documents scanned by an index,
+/// a `$sort` in this order is not sorted again.
+#[derive(Default)]
+struct IndexScanOrder {
+    fixed: Vec<String>,
+    /// The key after the fixed ones, and the order of the index key
+    ordered: Option<(String, i8)>,
+}
+
+impl IndexScanOrder {
+
+    fn satisfies(&self, sort_keys: &[(String, i8)]) -> bool {
+        sort_keys.iter().all(|(key, order)| {
+            if self.fixed.contains(key) {
+                return true;
+            }
+            match &self.ordered {
+                Some((ordered_key, ordered_order)) => ordered_key == key && ordered_order == order,
+                None => false,
+            }
+        })
+    }
+
+}
+
 pub(super) struct Codegen {
     program: Box<SubProgram>,
     jump_table: Vec<JumpTableRecord>,
     skip_annotation: bool,
     is_write: bool,
     paths: Vec<String>,
+    /// The document of the params pushed, see [`ParamPath`]
+    param_root: usize,
+    /// The order of the index scanned, None for the table scan
+    scan_order: Option<IndexScanOrder>,
+    /// Jump to the label to stop the scan in the result callback
+    scan_close_label: Option<Label>,
 }
 
 macro_rules! path_hint {
@@ -100,6 +180,9 @@ impl Codegen {
             skip_annotation,
             is_write,
             paths: Vec::with_capacity(PATH_DEFAULT_SIZE),
+            param_root: 0,
+            scan_order: None,
+            scan_close_label: None,
         }
     }
 
@@ -193,9 +276,10 @@ impl Codegen {
         let close_label = self.new_label();
         let result_label = self.new_label();
 
-        let pkey_id = self.push_static(pkey);
+        let pkey_id = self.push_param_of_key("_id", &pkey);
         self.emit_push_value(pkey_id);
 
+        self.set_access_path(AccessPath::PrimaryKey);
         self.emit_goto(DbOp::FindByPrimaryKey, close_label);
 
         self.emit_goto(DbOp::Goto, result_label);
@@ -212,7 +296,7 @@ impl Codegen {
             }
 
             let key_static_id = self.push_static(Bson::String(key.clone()));
-            let value_static_id = self.push_static(value.clone());
+            let value_static_id = self.push_param_of_key(key, value);
 
             self.emit_goto2(DbOp::GetField, key_static_id, close_label); // push a value1
             self.emit_push_value(value_static_id); // push a value2
@@ -250,12 +334,22 @@ impl Codegen {
 
         let result_callback: F = try_pkey_result.unwrap();
 
-        let try_index_result = self.try_query_by_index(col_spec, query, result_callback)?;
+        let (try_index_result, before_close) = self.try_query_by_index(
+            col_spec,
+            query,
+            result_callback,
+            before_close,
+            is_many,
+        )?;
         if try_index_result.is_none() {
             return Ok(());
         }
 
         self.emit_open(col_spec._id.clone().into());
+        if is_many {
+            self.mark_table_scan();
+        }
+        self.set_access_path(AccessPath::CollectionScan);
 
         let result_callback: F = try_index_result.unwrap();
 
@@ -292,6 +386,7 @@ impl Codegen {
         // <==== result position
         // give out the result, or update the item
         self.emit_label_with_name(result_label, "result");
+        self.scan_close_label = Some(close_label);
         result_callback(self)?;
 
         if is_many {
@@ -348,48 +443,304 @@ impl Codegen {
         col_spec: &CollectionSpecification,
         query: &Document,
         result_callback: F,
-    ) -> Result<Option<F>>
+        before_close: Option<Box<dyn FnOnce(&mut Codegen) -> Result<()>>>,
+        is_many: bool,
+    ) -> Result<(Option<F>, Option<Box<dyn FnOnce(&mut Codegen) -> Result<()>>>)>
     where
         F: FnOnce(&mut Codegen) -> Result<()>,
     {
-        if self.is_write {
-            return Ok(Some(result_callback));
-        }
-
         let index_meta = &col_spec.indexes;
+        let mut best: Option<(&str, IndexProbe, Document, f64)> = None;
+
         for (index_name, index_info) in index_meta {
-            let (key, _order) = index_info.keys.iter().next().unwrap();
-            // the key is ellipse representation, such as "a.b.c"
-            // the query is supposed to be ellipse too, such as
-            // { "a.b.c": 1 }
-            let test_result = query.get(key);
-            if let Some(query_doc) = test_result {
-                if query_doc.element_type() != ElementType::EmbeddedDocument {
+            let (probe, remain_query, selectivity) = match Codegen::plan_index_probe(index_info, query) {
+                Some(plan) => plan,
+                None => continue,
+            };
+
+            // the fraction is compared if the index has no statistics
+            let rows = match &index_info.statistics {
+                Some(statistics) => selectivity * statistics.entry_count as f64,
+                None => selectivity,
+            };
+
+            // the first index wins the ties
+            let better = match &best {
+                Some((_, _, _, best_rows)) => rows < *best_rows,
+                None => true,
+            };
+            if better {
+                best = Some((index_name.as_str(), probe, remain_query, rows));
+            }
+        }
+
+        let (index_name, probe, remain_query, rows) = match best {
+            Some(best) => best,
+            None => return Ok((Some(result_callback), before_close)),
+        };
+
+        if Codegen::is_scan_cheaper(col_spec, rows) {
+            return Ok((Some(result_callback), before_close));
+        }
+
+        let index_info = &col_spec.indexes[index_name];
+        self.scan_order = Some(Codegen::index_scan_order(index_info, query));
+
+        self.indeed_emit_query_by_index(
+            col_spec._id.as_str(),
+            index_name,
+            index_info,
+            probe,
+            &remain_query,
+            result_callback,
+            before_close,
+            is_many,
+        )?;
+
+        Ok((None, None))
+    }
+
+    /// The entries of the largest index are the least documents
+    /// of the collection, so the cost of the scan is never overestimated.
+    fn is_scan_cheaper(col_spec: &CollectionSpecification, index_rows: f64) -> bool {
+        let collection_rows = col_spec.indexes
+            .values()
+            .filter_map(|index_info| index_info.statistics.map(|statistics| statistics.entry_count))
+            .max();
+
+        match collection_rows {
+            Some(collection_rows) if collection_rows >= SCAN_FALLBACK_MIN_ENTRIES => {
+                index_rows * INDEX_FETCH_COST > collection_rows as f64
+            }
+            _ => false,
+        }
+    }
+
+    /// The fraction of the entries with an equal value of one key.
+    /// The values of the keys are supposed to be independent,
+    /// so every key of the index takes the same share of the distinct values.
+    fn key_selectivity(index_info: &IndexInfo) -> f64 {
+        match &index_info.statistics {
+            Some(statistics) if statistics.distinct_count > 0 => {
+                (statistics.distinct_count as f64).powf(-1.0 / index_info.keys.len() as f64)
+            }
+            Some(_) => 1.0,
+            None => DEFAULT_EQUALITY_SELECTIVITY,
+        }
+    }
+
+    /// Return the probe of the index, the query remained and the
+    /// estimated fraction of the entries in the probe,
+    /// None if the index can't serve the query.
+    ///
+    /// The keys are used in order, the equal values make a prefix
+    /// of the index keys, and the first key queried by the operators
+    /// gives the intervals after the prefix.
+    /// The keys are ellipse representation, such as "a.b.c",
+    /// the query is supposed to be ellipse too, such as
+    /// { "a.b.c": 1 }
+    fn plan_index_probe(index_info: &IndexInfo, query: &Document) -> Option<(IndexProbe, Document, f64)> {
+        let key_selectivity = Codegen::key_selectivity(index_info);
+
+        if index_info.keys.len() == 1 {
+            let (key, order) = index_info.keys.iter().next().unwrap();
+            match query.get(key) {
+                Some(Bson::Document(_)) | None => (),
+                Some(value) if *order > 0 => {
                     let mut remain_query = query.clone();
                     remain_query.remove(key);
+                    return Some((IndexProbe::Value(value.clone()), remain_query, key_selectivity));
+                }
+                _ => (),
+            }
+        }
 
-                    self.indeed_emit_query_by_index(
-                        col_spec._id.as_str(),
-                        index_name.as_str(),
-                        query_doc,
-                        &remain_query,
-                        result_callback,
-                    )?;
-                    return Ok(None);
+        let mut prefix: Vec<u8> = vec![];
+        let mut intervals: Option<Vec<KeyInterval>> = None;
+        let mut remain_query = query.clone();
+        let mut selectivity = 1.0;
+
+        for (key, order) in &index_info.keys {
+            let descending = *order < 0;
+            let value = match query.get(key) {
+                Some(value) => value,
+                None => break,
+            };
+
+            match value {
+                // the intervals may cover more values,
+                // so the field is compared again
+                Bson::Document(sub_query) => {
+                    let served = Codegen::index_intervals_of_query_doc(sub_query, descending, key_selectivity);
+                    if let Some((sub_intervals, sub_selectivity)) = served {
+                        intervals = Some(sub_intervals);
+                        selectivity *= sub_selectivity;
+                    }
+                    break;
+                }
+
+                // the numbers of different types are equal,
+                // they can't make a prefix
+                Bson::Int32(_) | Bson::Int64(_) | Bson::Double(_) => {
+                    intervals = intervals_of_point(value, descending);
+                    if intervals.is_some() {
+                        selectivity *= key_selectivity;
+                    }
+                    break;
+                }
+
+                Bson::Null | Bson::Undefined => break,
+
+                _ => {
+                    if descending {
+                        stacked_key_bytes_desc(&mut prefix, value).ok()?;
+                    } else {
+                        stacked_key_bytes(&mut prefix, value).ok()?;
+                    }
+                    remain_query.remove(key);
+                    selectivity *= key_selectivity;
                 }
             }
         }
 
-        Ok(Some(result_callback))
+        let intervals = match intervals {
+            Some(intervals) => intervals
+                .into_iter()
+                .map(|(start, end)| {
+                    let mut prefixed_start = prefix.clone();
+                    prefixed_start.extend_from_slice(&start);
+                    let mut prefixed_end = prefix.clone();
+                    prefixed_end.extend_from_slice(&end);
+                    (prefixed_start, prefixed_end)
+                })
+                .collect(),
+            None if !prefix.is_empty() => {
+                let end = prefix_successor(&prefix);
+                vec![(prefix, end)]
+            }
+            None => return None,
+        };
+
+        Some((IndexProbe::Intervals(intervals), remain_query, selectivity))
     }
 
+    /// The order of the documents scanned by the index for the query,
+    /// the same keys are planned as [`Codegen::plan_index_probe`].
+    fn index_scan_order(index_info: &IndexInfo, query: &Document) -> IndexScanOrder {
+        let mut scan_order = IndexScanOrder::default();
+
+        if index_info.keys.len() == 1 {
+            let (key, order) = index_info.keys.iter().next().unwrap();
+            match query.get(key) {
+                Some(Bson::Document(_)) | None => (),
+                Some(_) if *order > 0 => {
+                    scan_order.fixed.push(key.clone());
+                    return scan_order;
+                }
+                _ => (),
+            }
+        }
+
+        for (key, order) in &index_info.keys {
+            let value = match query.get(key) {
+                Some(value) => value,
+                None => break,
+            };
+
+            match value {
+                Bson::Document(sub_query) => {
+                    match Codegen::scan_order_of_query_doc(sub_query) {
+                        Some(KeyScanOrder::Fixed) => scan_order.fixed.push(key.clone()),
+                        Some(KeyScanOrder::Ordered) => scan_order.ordered = Some((key.clone(), *order)),
+                        None => (),
+                    }
+                    break;
+                }
+
+                // the numbers of all the types are equal
+                Bson::Int32(_) | Bson::Int64(_) | Bson::Double(_) => {
+                    if intervals_of_point(value, false).is_some() {
+                        scan_order.fixed.push(key.clone());
+                    }
+                    break;
+                }
+
+                Bson::Null | Bson::Undefined => break,
+
+                _ => scan_order.fixed.push(key.clone()),
+            }
+        }
+
+        scan_order
+    }
+
+    /// The same operators are served as [`Codegen::index_intervals_of_query_doc`]
+    fn scan_order_of_query_doc(query_doc: &Document) -> Option<KeyScanOrder> {
+        let mut points: Option<Option<KeyScanOrder>> = None;
+        let mut lower: Option<&Bson> = None;
+        let mut upper: Option<&Bson> = None;
+
+        for (sub_key, sub_value) in query_doc.iter() {
+            match sub_key.as_str() {
+                "$eq" => {
+                    if intervals_of_point(sub_value, false).is_some() {
+                        points = Some(Some(KeyScanOrder::Fixed));
+                    }
+                }
+
+                "$in" => {
+                    if let Bson::Array(items) = sub_value {
+                        if items.iter().all(|item| intervals_of_point(item, false).is_some()) {
+                            let order = if items.len() <= 1 {
+                                Some(KeyScanOrder::Fixed)
+                            } else if items.iter().all(|item| is_range_scan_ordered(item, &items[0])) {
+                                Some(KeyScanOrder::Ordered)
+                            } else {
+                                None
+                            };
+                            points = Some(order);
+                        }
+                    }
+                }
+
+                "$gt" | "$gte" => lower = Some(sub_value),
+
+                "$lt" | "$lte" => upper = Some(sub_value),
+
+                _ => (),
+            }
+        }
+
+        if let Some(order) = points {
+            return order;
+        }
+
+        // the intervals of one bound cover the other types
+        match (lower, upper) {
+            (Some(lower), Some(upper))
+                if intervals_of_range(Some(lower), Some(upper), false).is_some()
+                    && is_range_scan_ordered(lower, upper) => Some(KeyScanOrder::Ordered),
+            _ => None,
+        }
+    }
+
+    /// The layout is the same as [`Codegen::emit_query_layout`],
+    /// but the documents are iterated by the index.
+    ///
+    /// In a write program, the VM collects the documents matched
+    /// before the first one is given out, so the index entries
+    /// deleted and inserted by the callback are never visited.
+    #[allow(clippy::too_many_arguments)]
     fn indeed_emit_query_by_index<F>(
         &mut self,
         col_name: &str,
         index_name: &str,
-        query_value: &Bson,
+        index_info: &IndexInfo,
+        probe: IndexProbe,
         remain_query: &Document,
         result_callback: F,
+        before_close: Option<Box<dyn FnOnce(&mut Codegen) -> Result<()>>>,
+        is_many: bool,
     ) -> Result<()>
     where
         F: FnOnce(&mut Codegen) -> Result<()>,
@@ -408,50 +759,87 @@ impl Codegen {
             bytes: prefix_bytes,
         }));
 
-        let close_label = self.new_label();
-        let result_label = self.new_label();
+        let compare_fun = self.new_label();
+        let compare_fun_clean = self.new_label();
+        let compare_label = self.new_label();
         let next_label = self.new_label();
+        let result_label = self.new_label();
+        let not_found_label = self.new_label();
+        let close_label = self.new_label();
 
-        let value_id = self.push_static(query_value.clone());
+        // the value of a single key is copied,
+        // the intervals are planned on the values of all the keys
+        let (value_id, find_op) = match probe {
+            IndexProbe::Value(value) => {
+                let key = index_info.keys.keys().next().unwrap();
+                (self.push_param_of_key(key, &value), DbOp::FindByIndex)
+            }
+            IndexProbe::Intervals(intervals) => {
+                for key in index_info.keys.keys() {
+                    self.pin_param_path(key);
+                }
+                (self.push_static(intervals_to_bson(&intervals)), DbOp::FindByIndexRange)
+            }
+        };
         self.emit_push_value(value_id);
 
         let col_name_id = self.push_static(Bson::String(col_name.to_string()));
         self.emit_push_value(col_name_id);
 
-        self.emit_goto(DbOp::FindByIndex, close_label);
+        self.set_access_path(AccessPath::Index {
+            name: index_name.to_string(),
+            range: find_op == DbOp::FindByIndexRange,
+        });
+        self.emit_goto(find_op, close_label);
 
-        self.emit_goto(DbOp::Goto, result_label);
+        self.emit_goto(DbOp::Goto, compare_label);
 
         self.emit_label(next_label);
-        self.emit_goto(DbOp::NextIndexValue, result_label);
+        self.emit_goto(DbOp::NextIndexValue, compare_label);
 
-        self.emit_label(close_label);
+        // <==== close cursor
+        self.emit_label_with_name(close_label, "close");
 
         self.emit(DbOp::Pop); // pop the collection name
         self.emit(DbOp::Pop); // pop the query value
 
+        if let Some(before_close) = before_close {
+            before_close(self)?;
+        }
+
         self.emit(DbOp::Close);
         self.emit(DbOp::Halt);
 
-        self.emit_label(result_label);
-        for (key, value) in remain_query.iter() {
-            let key_static_id = self.push_static(Bson::String(key.clone()));
-            let value_static_id = self.push_static(value.clone());
-
-            self.emit_goto2(DbOp::GetField, key_static_id, close_label); // push a value1
-            self.emit_push_value(value_static_id); // push a value2
+        // <==== not this item, go to next item
+        self.emit_label_with_name(not_found_label, "not_this_item");
+        self.emit(DbOp::Pop); // pop the current value;
+        self.emit_goto(DbOp::Goto, next_label);
 
-            self.emit(DbOp::Equal);
-            // if not equal，go to next
-            self.emit_goto(DbOp::IfFalse, close_label);
+        // <==== result position
+        self.emit_label_with_name(result_label, "result");
+        self.scan_close_label = Some(close_label);
+        result_callback(self)?;
 
-            self.emit(DbOp::Pop); // pop a value2
-            self.emit(DbOp::Pop); // pop a value1
+        if is_many {
+            self.emit_goto(DbOp::Goto, next_label);
+        } else {
+            self.emit_goto(DbOp::Goto, close_label);
         }
 
-        result_callback(self)?;
+        // <==== compare the rest of the query
+        self.emit_label_with_name(compare_label, "compare");
+        self.emit(DbOp::Dup);
+        self.emit_goto(DbOp::Call, compare_fun);
+        self.emit_u32(1);
+        self.emit_goto(DbOp::IfFalse, not_found_label);
+        self.emit_goto(DbOp::Goto, result_label);
 
-        self.emit_goto(DbOp::Goto, next_label);
+        self.emit_label_with_name(compare_fun, "compare_function");
+
+        self.emit_standard_query_doc(remain_query, result_label, compare_fun_clean)?;
+
+        self.emit_label_with_name(compare_fun_clean, "compare_function_clean");
+        self.emit_ret(0);
 
         Ok(())
     }
@@ -612,7 +1000,7 @@ impl Codegen {
                     let key_static_id = self.push_static(key.into());
                     self.emit_goto2(DbOp::GetField, key_static_id, not_found_label);
 
-                    let value_static_id = self.push_static(value.clone());
+                    let value_static_id = self.push_param(value);
                     self.emit_push_value(value_static_id); // push a value2
 
                     self.emit(DbOp::Equal);
@@ -644,6 +1032,77 @@ impl Codegen {
         }
     }
 
+    /// The intervals of the index serving the operators on a field,
+    /// and the estimated fraction of the entries in them.
+    /// The operators are the ones of [`Codegen::emit_query_tuple_document_kv`].
+    ///
+    /// Any of the operators is enough to narrow the documents,
+    /// the others are still checked by the compare function.
+    fn index_intervals_of_query_doc(
+        query_doc: &Document,
+        descending: bool,
+        key_selectivity: f64,
+    ) -> Option<(Vec<KeyInterval>, f64)> {
+        let mut points: Option<(Vec<KeyInterval>, usize)> = None;
+        let mut lower: Option<&Bson> = None;
+        let mut upper: Option<&Bson> = None;
+
+        for (sub_key, sub_value) in query_doc.iter() {
+            match sub_key.as_str() {
+                "$eq" => {
+                    if let Some(intervals) = intervals_of_point(sub_value, descending) {
+                        points = Some((intervals, 1));
+                    }
+                }
+
+                "$in" => {
+                    if let Bson::Array(items) = sub_value {
+                        let mut intervals = vec![];
+                        let served = items.iter().all(|item| match intervals_of_point(item, descending) {
+                            Some(item_intervals) => {
+                                intervals.extend(item_intervals);
+                                true
+                            }
+                            None => false,
+                        });
+                        if served {
+                            points = Some((merge_intervals(intervals), items.len()));
+                        }
+                    }
+                }
+
+                "$gt" | "$gte" => lower = Some(sub_value),
+
+                "$lt" | "$lte" => upper = Some(sub_value),
+
+                _ => (),
+            }
+        }
+
+        if let Some((intervals, count)) = points {
+            let selectivity = f64::min(count as f64 * key_selectivity, 1.0);
+            return Some((intervals, selectivity));
+        }
+
+        if lower.is_none() && upper.is_none() {
+            return None;
+        }
+
+        // the bounds of different types are served one by one
+        if let Some(intervals) = intervals_of_range(lower, upper, descending) {
+            let selectivity = if lower.is_some() && upper.is_some() {
+                BETWEEN_SELECTIVITY
+            } else {
+                RANGE_SELECTIVITY
+            };
+            return Some((intervals, selectivity));
+        }
+
+        lower.and_then(|lower| intervals_of_range(Some(lower), None, descending))
+            .or_else(|| upper.and_then(|upper| intervals_of_range(None, Some(upper), descending)))
+            .map(|intervals| (intervals, RANGE_SELECTIVITY))
+    }
+
     fn emit_query_tuple_document_kv(
         &mut self,
         key: &str,
@@ -656,7 +1115,7 @@ impl Codegen {
             "$eq" => {
                 let field_size = self.recursively_get_field(key, not_found_label);
 
-                let stat_val_id = self.push_static(sub_value.clone());
+                let stat_val_id = self.push_param(sub_value);
                 self.emit_push_value(stat_val_id);
                 self.emit_logical(DbOp::Equal, is_in_not);
 
@@ -670,7 +1129,7 @@ impl Codegen {
             "$gt" => {
                 let field_size = self.recursively_get_field(key, not_found_label);
 
-                let stat_val_id = self.push_static(sub_value.clone());
+                let stat_val_id = self.push_param(sub_value);
                 self.emit_push_value(stat_val_id);
                 self.emit_logical(DbOp::Greater, is_in_not);
 
@@ -683,7 +1142,7 @@ impl Codegen {
             "$gte" => {
                 let field_size = self.recursively_get_field(key, not_found_label);
 
-                let stat_val_id = self.push_static(sub_value.clone());
+                let stat_val_id = self.push_param(sub_value);
                 self.emit_push_value(stat_val_id);
                 self.emit_logical(DbOp::GreaterEqual, is_in_not);
 
@@ -707,7 +1166,7 @@ impl Codegen {
 
                 let field_size = self.recursively_get_field(key, not_found_label);
 
-                let stat_val_id = self.push_static(sub_value.clone());
+                let stat_val_id = self.push_param(sub_value);
                 self.emit_push_value(stat_val_id);
                 self.emit_logical(DbOp::In, is_in_not);
 
@@ -720,7 +1179,7 @@ impl Codegen {
             "$lt" => {
                 let field_size = self.recursively_get_field(key, not_found_label);
 
-                let stat_val_id = self.push_static(sub_value.clone());
+                let stat_val_id = self.push_param(sub_value);
                 self.emit_push_value(stat_val_id);
                 self.emit_logical(DbOp::Less, is_in_not);
 
@@ -733,7 +1192,7 @@ impl Codegen {
             "$lte" => {
                 let field_size = self.recursively_get_field(key, not_found_label);
 
-                let stat_val_id = self.push_static(sub_value.clone());
+                let stat_val_id = self.push_param(sub_value);
                 self.emit_push_value(stat_val_id);
                 self.emit_logical(DbOp::LessEqual, is_in_not);
 
@@ -747,7 +1206,7 @@ impl Codegen {
             "$ne" => {
                 let field_size = self.recursively_get_field(key, not_found_label);
 
-                let stat_val_id = self.push_static(sub_value.clone());
+                let stat_val_id = self.push_param(sub_value);
                 self.emit_push_value(stat_val_id);
                 self.emit_logical(DbOp::Equal, is_in_not);
 
@@ -771,7 +1230,7 @@ impl Codegen {
 
                 let field_size = self.recursively_get_field(key, not_found_label);
 
-                let stat_val_id = self.push_static(sub_value.clone());
+                let stat_val_id = self.push_param(sub_value);
                 self.emit_push_value(stat_val_id);
                 self.emit_logical(DbOp::In, is_in_not);
 
@@ -795,7 +1254,7 @@ impl Codegen {
                 let field_size = self.recursively_get_field(key, not_found_label);
                 self.emit(DbOp::ArraySize);
 
-                let expect_size_stat_id = self.push_static(Bson::from(expected_size));
+                let expect_size_stat_id = self.push_param(&Bson::from(expected_size));
                 self.emit_push_value(expect_size_stat_id);
 
                 self.emit_logical(DbOp::Equal, is_in_not);
@@ -819,7 +1278,7 @@ impl Codegen {
 
                 let field_size = self.recursively_get_field(key, not_found_label);
 
-                let stat_val_id = self.push_static(sub_value.clone());
+                let stat_val_id = self.push_param(sub_value);
                 self.emit_push_value(stat_val_id);
 
                 self.emit_logical(DbOp::Regex, is_in_not);
@@ -890,17 +1349,24 @@ impl Codegen {
         }
         let next_label = self.new_label();
 
-        for stage_item in &ctx.items {
-            self.emit_goto(DbOp::Call, stage_item.next_label);
+        self.plan_aggregation_stream(ctx, pipeline)?;
+
+        // every stage calls the next one
+        if let Some(first_item) = ctx.items.first() {
+            self.emit_goto(DbOp::Call, first_item.next_label);
             self.emit_u32(1);
         }
 
+        if let (Some(limit_reached), Some(close_label)) = (ctx.limit_reached, self.scan_close_label) {
+            self.emit_load_global(limit_reached);
+            self.emit(DbOp::StoreR0);
+            self.emit(DbOp::Pop);
+            self.emit_goto(DbOp::IfTrue, close_label);
+        }
+
         // the final pipeline item to emit the final result
         let final_result_label = self.new_label();
-        let final_pipeline_item = PipelineItem {
-            next_label: final_result_label,
-            complete_label: None,
-        };
+        let final_pipeline_item = PipelineItem::new(final_result_label, None);
 
         ctx.items.push(final_pipeline_item);
 
@@ -918,6 +1384,44 @@ impl Codegen {
         Ok(())
     }
 
+    /// The stages before the first one collecting the documents
+    /// get the documents in the order of the scan.
+    /// The `$sort` in the order of the index is not sorted again,
+    /// and the `$limit` stops the scan when it's full.
+    fn plan_aggregation_stream(&mut self, ctx: &mut AggregationCodeGenContext, pipeline: &[Document]) -> Result<()> {
+        for (index, stage) in pipeline.iter().enumerate().take(ctx.items.len()) {
+            if stage.len() != 1 {
+                break;
+            }
+            let (key, value) = stage.iter().next().unwrap();
+
+            match key.as_str() {
+                "$sort" => {
+                    let sort_keys = Codegen::parse_sort_keys(stage, value)?;
+                    let ordered = self.scan_order
+                        .as_ref()
+                        .map_or(false, |scan_order| scan_order.satisfies(&sort_keys));
+                    if !ordered {
+                        break;
+                    }
+                    ctx.items[index].ordered_by_scan = true;
+                }
+                "$skip" => (),
+                "$limit" => {
+                    if self.scan_close_label.is_none() {
+                        continue;
+                    }
+                    if ctx.limit_reached.is_none() {
+                        ctx.limit_reached = Some(self.new_global_variable(Bson::Boolean(false))?);
+                    }
+                    ctx.items[index].stops_scan = true;
+                }
+                _ => break,
+            }
+        }
+        Ok(())
+    }
+
     // Generate the implementation code of the pipeline
     // The implementation code is a function with parameters:
     // Param 1(bool): is_the_last
@@ -941,6 +1445,7 @@ impl Codegen {
         path_hint!(self, stage_num, {
             let first_tuple = stage.iter().next().unwrap();
             let (key, value) = first_tuple;
+            let next_fun = ctx.items[index + 1].next_label;
 
             match key.as_str() {
                 "$count" => {
@@ -973,10 +1478,142 @@ impl Codegen {
 
                     self.emit(DbOp::Pop);
 
-                    let next_fun = ctx.items[index + 1].next_label;
                     self.emit_goto(DbOp::Call, next_fun);
                     self.emit_u32(1);
 
+                    self.emit_call_next_complete(ctx, index);
+                    self.emit_ret(0);
+                }
+                "$sort" => {
+                    let sort_keys = Codegen::parse_sort_keys(stage, value)?;
+                    let complete_label = stage_ctx_item.complete_label.unwrap();
+
+                    if stage_ctx_item.ordered_by_scan {
+                        // $sort_next => the documents are in order already
+                        self.emit_label(stage_ctx_item.next_label);
+                        self.emit_goto(DbOp::Call, next_fun);
+                        self.emit_u32(1);
+                        self.emit_ret(0);
+
+                        // $sort_complete =>
+                        self.emit_label(complete_label);
+                        self.emit_call_next_complete(ctx, index);
+                        self.emit_ret(0);
+                    } else {
+                        let sort_id = self.push_sort_info(SubProgramSortItem {
+                            keys: sort_keys,
+                            limit: Codegen::sort_limit_of(pipeline, index),
+                        });
+                        let sorted_next_label = self.new_label();
+                        let sorted_end_label = self.new_label();
+
+                        // $sort_next =>
+                        self.emit_label(stage_ctx_item.next_label);
+                        self.emit(DbOp::SortAdd);
+                        self.emit_u32(sort_id);
+                        self.emit_ret(0);
+
+                        // $sort_complete => pass the documents in order
+                        self.emit_label(complete_label);
+                        self.emit_label(sorted_next_label);
+                        self.emit_goto2(DbOp::SortNext, sort_id, sorted_end_label);
+                        self.emit_goto(DbOp::Call, next_fun);
+                        self.emit_u32(1);
+                        self.emit_goto(DbOp::Goto, sorted_next_label);
+
+                        self.emit_label(sorted_end_label);
+                        self.emit_call_next_complete(ctx, index);
+                        self.emit_ret(0);
+                    }
+                }
+                "$group" => {
+                    let group_item = Codegen::parse_group_stage(stage, value)?;
+                    let group_id = self.push_group_info(group_item);
+                    let grouped_next_label = self.new_label();
+                    let grouped_end_label = self.new_label();
+
+                    // $group_next =>
+                    self.emit_label(stage_ctx_item.next_label);
+                    self.emit(DbOp::GroupAdd);
+                    self.emit_u32(group_id);
+                    self.emit_ret(0);
+
+                    // $group_complete => pass the groups
+                    self.emit_label(stage_ctx_item.complete_label.unwrap());
+                    self.emit_label(grouped_next_label);
+                    self.emit_goto2(DbOp::GroupNext, group_id, grouped_end_label);
+                    self.emit_goto(DbOp::Call, next_fun);
+                    self.emit_u32(1);
+                    self.emit_goto(DbOp::Goto, grouped_next_label);
+
+                    self.emit_label(grouped_end_label);
+                    self.emit_call_next_complete(ctx, index);
+                    self.emit_ret(0);
+                }
+                "$skip" => {
+                    let skip = Codegen::parse_stage_count(stage, value, 0)?;
+                    let skipped = self.new_global_variable(Bson::Int64(0))?;
+                    let skip_id = self.push_static(Bson::Int64(skip));
+                    let pass_label = self.new_label();
+
+                    // $skip_next =>
+                    self.emit_label(stage_ctx_item.next_label);
+                    self.emit_load_global(skipped);
+                    self.emit_push_value(skip_id);
+                    self.emit(DbOp::Less);
+                    self.emit(DbOp::Pop2);
+                    self.emit_u32(2);
+                    self.emit_goto(DbOp::IfFalse, pass_label);
+
+                    self.emit_load_global(skipped);
+                    self.emit(DbOp::Inc);
+                    self.emit_store_global(skipped);
+                    self.emit(DbOp::Pop);
+                    self.emit_ret(0);
+
+                    self.emit_label(pass_label);
+                    self.emit_goto(DbOp::Call, next_fun);
+                    self.emit_u32(1);
+                    self.emit_ret(0);
+                }
+                "$limit" => {
+                    let limit = Codegen::parse_stage_count(stage, value, 1)?;
+                    let passed = self.new_global_variable(Bson::Int64(0))?;
+                    let limit_id = self.push_static(Bson::Int64(limit));
+                    let drop_label = self.new_label();
+
+                    // $limit_next =>
+                    self.emit_label(stage_ctx_item.next_label);
+                    self.emit_load_global(passed);
+                    self.emit_push_value(limit_id);
+                    self.emit(DbOp::Less);
+                    self.emit(DbOp::Pop2);
+                    self.emit_u32(2);
+                    self.emit_goto(DbOp::IfFalse, drop_label);
+
+                    self.emit_load_global(passed);
+                    self.emit(DbOp::Inc);
+                    self.emit_store_global(passed);
+
+                    // the scan is stopped after the last document
+                    if let (true, Some(limit_reached)) = (stage_ctx_item.stops_scan, ctx.limit_reached) {
+                        let not_full_label = self.new_label();
+                        self.emit_push_value(limit_id);
+                        self.emit(DbOp::Equal);
+                        self.emit(DbOp::Pop);
+                        self.emit_goto(DbOp::IfFalse, not_full_label);
+                        self.emit(DbOp::PushTrue);
+                        self.emit_store_global(limit_reached);
+                        self.emit(DbOp::Pop);
+                        self.emit_label(not_full_label);
+                    }
+
+                    self.emit(DbOp::Pop);
+                    self.emit_goto(DbOp::Call, next_fun);
+                    self.emit_u32(1);
+                    self.emit_ret(0);
+
+                    self.emit_label(drop_label);
                     self.emit_ret(0);
                 }
                 _ => {
@@ -988,6 +1625,128 @@ impl Codegen {
         Ok(())
     }
 
+    /// Complete the stages after the one of the index,
+    /// the first stage completed calls the next one.
+    fn emit_call_next_complete(&mut self, ctx: &AggregationCodeGenContext, index: usize) {
+        let next_complete = ctx.items[index + 1..]
+            .iter()
+            .find_map(|item| item.complete_label);
+        if let Some(complete_label) = next_complete {
+            self.emit_goto(DbOp::Call, complete_label);
+            self.emit_u32(0);
+        }
+    }
+
+    fn parse_sort_keys(stage: &Document, value: &Bson) -> Result<Vec<(String, i8)>> {
+        let sort_doc = match value {
+            Bson::Document(doc) if !doc.is_empty() => doc,
+            _ => return Err(Error::InvalidAggregationStage(Box::new(stage.clone()))),
+        };
+        let mut result = Vec::with_capacity(sort_doc.len());
+        for (key, order) in sort_doc {
+            let order = match order {
+                Bson::Int32(1) | Bson::Int64(1) => 1,
+                Bson::Int32(-1) | Bson::Int64(-1) => -1,
+                Bson::Double(d) if *d == 1.0 => 1,
+                Bson::Double(d) if *d == -1.0 => -1,
+                _ => return Err(Error::InvalidAggregationStage(Box::new(stage.clone()))),
+            };
+            result.push((key.clone(), order));
+        }
+        Ok(result)
+    }
+
+    pub(super) fn parse_group_stage(stage: &Document, value: &Bson) -> Result<SubProgramGroupItem> {
+        let group_doc = match value {
+            Bson::Document(doc) => doc,
+            _ => return Err(Error::InvalidAggregationStage(Box::new(stage.clone()))),
+        };
+        let key = match group_doc.get("_id") {
+            Some(key) => Codegen::parse_group_expr(key),
+            None => return Err(Error::InvalidAggregationStage(Box::new(stage.clone()))),
+        };
+
+        let mut accumulators = Vec::with_capacity(group_doc.len() - 1);
+        for (name, accumulator_value) in group_doc {
+            if name == "_id" {
+                continue;
+            }
+            let (op, operand) = match accumulator_value {
+                Bson::Document(doc) if doc.len() == 1 => doc.iter().next().unwrap(),
+                _ => return Err(Error::InvalidAggregationStage(Box::new(stage.clone()))),
+            };
+            let kind = match op.as_str() {
+                "$sum" => GroupAccumulatorKind::Sum,
+                "$avg" => GroupAccumulatorKind::Avg,
+                "$min" => GroupAccumulatorKind::Min,
+                "$max" => GroupAccumulatorKind::Max,
+                "$count" => {
+                    let is_empty_doc = matches!(operand, Bson::Document(doc) if doc.is_empty());
+                    if !is_empty_doc {
+                        return Err(Error::InvalidAggregationStage(Box::new(stage.clone())));
+                    }
+                    GroupAccumulatorKind::Count
+                }
+                _ => return Err(Error::UnknownAggregationOperation(op.clone())),
+            };
+            accumulators.push(GroupAccumulator {
+                name: name.clone(),
+                kind,
+                operand: Codegen::parse_group_expr(operand),
+            });
+        }
+
+        Ok(SubProgramGroupItem {
+            key,
+            accumulators,
+        })
+    }
+
+    /// The strings starting with "$" are the paths of the fields
+    fn parse_group_expr(value: &Bson) -> GroupExpr {
+        match value {
+            Bson::String(path) if path.starts_with('$') => GroupExpr::Field(path[1..].to_string()),
+            Bson::Document(doc) => GroupExpr::Document(
+                doc.iter()
+                    .map(|(key, value)| (key.clone(), Codegen::parse_group_expr(value)))
+                    .collect()
+            ),
+            _ => GroupExpr::Const(value.clone()),
+        }
+    }
+
+    /// The count of `$skip` and `$limit`, which is at least the min
+    fn parse_stage_count(stage: &Document, value: &Bson, min: i64) -> Result<i64> {
+        let count = match value {
+            Bson::Int32(i) => *i as i64,
+            Bson::Int64(i) => *i,
+            _ => return Err(Error::InvalidAggregationStage(Box::new(stage.clone()))),
+        };
+        if count < min {
+            return Err(Error::InvalidAggregationStage(Box::new(stage.clone())));
+        }
+        Ok(count)
+    }
+
+    /// The documents kept by the `$sort` followed by the `$limit`,
+    /// the ones skipped between them are kept too.
+    fn sort_limit_of(pipeline: &[Document], index: usize) -> Option<usize> {
+        let stage_count = |offset: usize, name: &str| -> Option<i64> {
+            let stage = pipeline.get(index + offset)?;
+            if stage.len() != 1 {
+                return None;
+            }
+            let value = stage.get(name)?;
+            Codegen::parse_stage_count(stage, value, 0).ok()
+        };
+        if let Some(limit) = stage_count(1, "$limit") {
+            return Some(limit as usize);
+        }
+        let skip = stage_count(1, "$skip")?;
+        let limit = stage_count(2, "$limit")?;
+        Some(skip.saturating_add(limit) as usize)
+    }
+
     pub fn emit_aggregation_before_query(&mut self, ctx: &mut AggregationCodeGenContext, pipeline: &[Document]) -> Result<()> {
         for stage_doc in pipeline {
             if stage_doc.is_empty() {
@@ -998,17 +1757,14 @@ impl Codegen {
 
             let label = self.new_label();
             let complete_label = match key.as_str() {
-                "$count" => {
+                "$count" | "$sort" | "$group" => {
                     let complete_label = self.new_label();
                     Some(complete_label)
                 }
                 _ => None,
             };
 
-            ctx.items.push(PipelineItem {
-                next_label: label,
-                complete_label,
-            });
+            ctx.items.push(PipelineItem::new(label, complete_label));
         }
         Ok(())
     }
@@ -1147,7 +1903,7 @@ impl Codegen {
                 return Err(Error::UnableToUpdatePrimaryKey);
             }
 
-            let value_id = self.push_static(value.clone());
+            let value_id = self.push_param_of_key(key, value);
             self.emit_push_value(value_id);
 
             let key_id = self.push_static(Bson::from(key.clone()));
@@ -1200,12 +1956,79 @@ impl Codegen {
         pos
     }
 
+    /// Push a value copied from the document compiled,
+    /// the value is at the current path.
+    pub(super) fn push_param(&mut self, value: &Bson) -> u32 {
+        let static_id = self.push_static(value.clone());
+        self.program.params.push(ParamSlot {
+            path: ParamPath {
+                root: self.param_root,
+                path: self.paths.clone(),
+            },
+            static_id,
+        });
+        static_id
+    }
+
+    pub(super) fn push_param_of_key(&mut self, key: &str, value: &Bson) -> u32 {
+        self.paths.push(key.to_string());
+        let static_id = self.push_param(value);
+        self.paths.pop();
+        static_id
+    }
+
+    /// The values under the key are planned,
+    /// the params copied from them are not bound.
+    fn pin_param_path(&mut self, key: &str) {
+        let mut path = self.paths.clone();
+        path.push(key.to_string());
+        self.program.pinned_paths.push(ParamPath {
+            root: self.param_root,
+            path,
+        });
+    }
+
+    #[inline]
+    pub(super) fn set_param_root(&mut self, root: usize) {
+        self.param_root = root;
+    }
+
     pub(super) fn push_index_info(&mut self, index_item: SubProgramIndexItem) -> u32 {
         let pos = self.program.index_infos.len() as u32;
         self.program.index_infos.push(index_item);
         pos
     }
 
+    pub(super) fn push_sort_info(&mut self, sort_item: SubProgramSortItem) -> u32 {
+        let pos = self.program.sort_infos.len() as u32;
+        self.program.sort_infos.push(sort_item);
+        pos
+    }
+
+    pub(super) fn push_group_info(&mut self, group_item: SubProgramGroupItem) -> u32 {
+        let pos = self.program.group_infos.len() as u32;
+        self.program.group_infos.push(group_item);
+        pos
+    }
+
+    #[inline]
+    /// The program scans all the documents of the collection
+    #[inline]
+    pub(super) fn mark_table_scan(&mut self) {
+        self.program.table_scan = true;
+    }
+
+    /// Only the first scan emitted is kept
+    pub(super) fn set_access_path(&mut self, access_path: AccessPath) {
+        if self.program.access_path == AccessPath::None {
+            self.program.access_path = access_path;
+        }
+    }
+
+    pub(super) fn set_scan_close_label(&mut self, label: Label) {
+        self.scan_close_label = Some(label);
+    }
+
     pub(super) fn emit_push_value(&mut self, static_id: u32) {
         self.emit(DbOp::PushValue);
         let bytes = static_id.to_le_bytes();
@@ -1240,7 +2063,7 @@ impl Codegen {
         let name_id = self.push_static(field_name.into());
         self.emit_goto2(DbOp::GetField, name_id, get_field_failed_label);
 
-        let value_id = self.push_static(value.clone());
+        let value_id = self.push_param_of_key(field_name, value);
         self.emit(DbOp::PushValue);
         self.emit_u32(value_id);
 
@@ -23,6 +23,7 @@ impl GlobalVariable {
 }
 
 #[allow(dead_code)]
+#[derive(Clone)]
 pub(crate) struct GlobalVariableSlot {
     pub pos: u32,
     pub init_value: Bson,
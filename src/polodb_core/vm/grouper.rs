@@ -0,0 +1,553 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+use std::cmp::{Ordering, Reverse};
+use std::collections::BinaryHeap;
+use std::fs::{File, OpenOptions};
+use std::io::{BufReader, BufWriter, Seek, SeekFrom};
+use std::path::PathBuf;
+use bson::{Bson, Document};
+use bson::spec::BinarySubtype;
+use indexmap::IndexMap;
+use crate::utils::bson::approx_size_of;
+use crate::vm::subprogram::{GroupAccumulator, GroupAccumulatorKind, GroupExpr, SubProgramGroupItem};
+use crate::{Error, Result};
+
+/// The bytes counted for a group besides its key and values
+const GROUP_ENTRY_SIZE: usize = 64;
+
+fn number_of(value: &Bson) -> Option<f64> {
+    match value {
+        Bson::Int32(i) => Some(*i as f64),
+        Bson::Int64(i) => Some(*i as f64),
+        Bson::Double(d) => Some(*d),
+        _ => None,
+    }
+}
+
+fn add_i64(a: i64, b: i64) -> Bson {
+    match a.checked_add(b) {
+        Some(sum) => Bson::Int64(sum),
+        None => Bson::Double(a as f64 + b as f64),
+    }
+}
+
+/// The integers are widened instead of overflowing,
+/// None if any of them is not a number.
+fn add_numbers(a: &Bson, b: &Bson) -> Option<Bson> {
+    let result = match (a, b) {
+        (Bson::Int32(a), Bson::Int32(b)) => match a.checked_add(*b) {
+            Some(sum) => Bson::Int32(sum),
+            None => Bson::Int64(*a as i64 + *b as i64),
+        },
+        (Bson::Int32(a), Bson::Int64(b)) | (Bson::Int64(b), Bson::Int32(a)) => add_i64(*a as i64, *b),
+        (Bson::Int64(a), Bson::Int64(b)) => add_i64(*a, *b),
+        _ => Bson::Double(number_of(a)? + number_of(b)?),
+    };
+    Some(result)
+}
+
+/// The numbers of the same value are grouped together,
+/// such as 1 and 1.0.
+fn normalize_key(value: &Bson) -> Bson {
+    match value {
+        Bson::Int32(i) => Bson::Int64(*i as i64),
+        Bson::Double(d) if d.fract() == 0.0 && d.abs() < i64::MAX as f64 => Bson::Int64(*d as i64),
+        Bson::Document(doc) => Bson::Document(
+            doc.iter().map(|(key, value)| (key.clone(), normalize_key(value))).collect()
+        ),
+        Bson::Array(arr) => Bson::Array(arr.iter().map(normalize_key).collect()),
+        _ => value.clone(),
+    }
+}
+
+fn eval_expr<F>(expr: &GroupExpr, get_field: &mut F) -> Result<Option<Bson>>
+where
+    F: FnMut(&str) -> Result<Option<Bson>>,
+{
+    match expr {
+        GroupExpr::Field(path) => get_field(path),
+        GroupExpr::Const(value) => Ok(Some(value.clone())),
+        GroupExpr::Document(fields) => {
+            let mut doc = Document::new();
+            for (key, sub_expr) in fields {
+                if let Some(value) = eval_expr(sub_expr, get_field)? {
+                    doc.insert(key.clone(), value);
+                }
+            }
+            Ok(Some(Bson::Document(doc)))
+        }
+    }
+}
+
+/// The partial result of an accumulator,
+/// the partial results of the same group are merged.
+enum AccState {
+    Sum(Bson),
+    Avg(f64, i64),
+    Min(Option<Bson>),
+    Max(Option<Bson>),
+    Count(i64),
+}
+
+impl AccState {
+
+    fn new(kind: GroupAccumulatorKind) -> AccState {
+        match kind {
+            GroupAccumulatorKind::Sum => AccState::Sum(Bson::Int32(0)),
+            GroupAccumulatorKind::Avg => AccState::Avg(0.0, 0),
+            GroupAccumulatorKind::Min => AccState::Min(None),
+            GroupAccumulatorKind::Max => AccState::Max(None),
+            GroupAccumulatorKind::Count => AccState::Count(0),
+        }
+    }
+
+    fn approx_size(&self) -> usize {
+        match self {
+            AccState::Sum(value) => approx_size_of(value),
+            AccState::Min(Some(value)) | AccState::Max(Some(value)) => approx_size_of(value),
+            _ => 16,
+        }
+    }
+
+    /// The values which are not numbers are ignored by `$sum` and `$avg`,
+    /// the null values are ignored by `$min` and `$max`.
+    fn accumulate(&mut self, value: Option<Bson>) {
+        match self {
+            AccState::Count(count) => *count += 1,
+            AccState::Sum(sum) => {
+                if let Some(new_sum) = value.and_then(|value| add_numbers(sum, &value)) {
+                    *sum = new_sum;
+                }
+            }
+            AccState::Avg(sum, count) => {
+                if let Some(number) = value.as_ref().and_then(number_of) {
+                    *sum += number;
+                    *count += 1;
+                }
+            }
+            AccState::Min(min) => AccState::replace_by(min, value, Ordering::Less),
+            AccState::Max(max) => AccState::replace_by(max, value, Ordering::Greater),
+        }
+    }
+
+    fn replace_by(current: &mut Option<Bson>, value: Option<Bson>, ord: Ordering) {
+        let value = match value {
+            Some(Bson::Null) | Some(Bson::Undefined) | None => return,
+            Some(value) => value,
+        };
+        let replace = match current {
+            Some(current) => crate::utils::bson::value_cmp(&value, current).ok() == Some(ord),
+            None => true,
+        };
+        if replace {
+            *current = Some(value);
+        }
+    }
+
+    fn merge(&mut self, other: AccState) {
+        match (self, other) {
+            (AccState::Count(count), AccState::Count(other)) => *count += other,
+            (AccState::Sum(sum), AccState::Sum(other)) => {
+                if let Some(new_sum) = add_numbers(sum, &other) {
+                    *sum = new_sum;
+                }
+            }
+            (AccState::Avg(sum, count), AccState::Avg(other_sum, other_count)) => {
+                *sum += other_sum;
+                *count += other_count;
+            }
+            (AccState::Min(min), AccState::Min(other)) => AccState::replace_by(min, other, Ordering::Less),
+            (AccState::Max(max), AccState::Max(other)) => AccState::replace_by(max, other, Ordering::Greater),
+            _ => unreachable!("merge the partial results of different accumulators"),
+        }
+    }
+
+    fn finish(self) -> Bson {
+        match self {
+            AccState::Sum(sum) => sum,
+            AccState::Avg(_, 0) => Bson::Null,
+            AccState::Avg(sum, count) => Bson::Double(sum / count as f64),
+            AccState::Min(value) | AccState::Max(value) => value.unwrap_or(Bson::Null),
+            AccState::Count(count) => Bson::Int64(count),
+        }
+    }
+
+    fn to_bson(&self) -> Bson {
+        match self {
+            AccState::Sum(sum) => sum.clone(),
+            AccState::Avg(sum, count) => Bson::Array(vec![Bson::Double(*sum), Bson::Int64(*count)]),
+            AccState::Min(value) | AccState::Max(value) => value.clone().unwrap_or(Bson::Null),
+            AccState::Count(count) => Bson::Int64(*count),
+        }
+    }
+
+    fn from_bson(kind: GroupAccumulatorKind, value: &Bson) -> Result<AccState> {
+        let state = match (kind, value) {
+            (GroupAccumulatorKind::Sum, _) => AccState::Sum(value.clone()),
+            (GroupAccumulatorKind::Avg, Bson::Array(arr)) => match arr.as_slice() {
+                [Bson::Double(sum), Bson::Int64(count)] => AccState::Avg(*sum, *count),
+                _ => return Err(Error::data_malformed()),
+            },
+            (GroupAccumulatorKind::Min, Bson::Null) => AccState::Min(None),
+            (GroupAccumulatorKind::Min, _) => AccState::Min(Some(value.clone())),
+            (GroupAccumulatorKind::Max, Bson::Null) => AccState::Max(None),
+            (GroupAccumulatorKind::Max, _) => AccState::Max(Some(value.clone())),
+            (GroupAccumulatorKind::Count, Bson::Int64(count)) => AccState::Count(*count),
+            _ => return Err(Error::data_malformed()),
+        };
+        Ok(state)
+    }
+
+}
+
+struct GroupEntry {
+    /// The key of the group, as it's first found
+    id: Bson,
+    states: Vec<AccState>,
+}
+
+impl GroupEntry {
+
+    fn merge(&mut self, other: GroupEntry) {
+        for (state, other_state) in self.states.iter_mut().zip(other.states) {
+            state.merge(other_state);
+        }
+    }
+
+    fn finish(self, accumulators: &[GroupAccumulator]) -> Document {
+        let mut doc = Document::new();
+        doc.insert("_id", self.id);
+        for (accumulator, state) in accumulators.iter().zip(self.states) {
+            doc.insert(accumulator.name.clone(), state.finish());
+        }
+        doc
+    }
+
+    fn to_spilled_doc(&self, key: Vec<u8>) -> Document {
+        let mut doc = Document::new();
+        doc.insert("k", Bson::Binary(bson::Binary {
+            subtype: BinarySubtype::Generic,
+            bytes: key,
+        }));
+        doc.insert("i", self.id.clone());
+        doc.insert("s", Bson::Array(self.states.iter().map(AccState::to_bson).collect()));
+        doc
+    }
+
+    fn from_spilled_doc(mut doc: Document, kinds: &[GroupAccumulatorKind]) -> Result<(Vec<u8>, GroupEntry)> {
+        let key = match doc.remove("k") {
+            Some(Bson::Binary(bin)) => bin.bytes,
+            _ => return Err(Error::data_malformed()),
+        };
+        let id = doc.remove("i").ok_or_else(Error::data_malformed)?;
+        let states = match doc.get("s") {
+            Some(Bson::Array(arr)) if arr.len() == kinds.len() => {
+                kinds
+                    .iter()
+                    .zip(arr)
+                    .map(|(kind, value)| AccState::from_bson(*kind, value))
+                    .collect::<Result<Vec<AccState>>>()?
+            }
+            _ => return Err(Error::data_malformed()),
+        };
+        Ok((key, GroupEntry { id, states }))
+    }
+
+}
+
+/// The groups sorted by the keys, written to a temp file.
+/// The file is removed when the run is dropped.
+struct SpillRun {
+    path: PathBuf,
+    reader: Option<BufReader<File>>,
+    remain: usize,
+}
+
+impl SpillRun {
+
+    fn write(groups: Vec<(Vec<u8>, GroupEntry)>) -> Result<SpillRun> {
+        let path = std::env::temp_dir()
+            .join(format!("polodb-group-{}.tmp", uuid::Uuid::new_v4()));
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create_new(true)
+            .open(&path)?;
+        let mut run = SpillRun {
+            path,
+            reader: None,
+            remain: groups.len(),
+        };
+
+        let mut writer = BufWriter::new(file);
+        for (key, entry) in groups {
+            entry.to_spilled_doc(key).to_writer(&mut writer)?;
+        }
+        let mut file = writer.into_inner().map_err(|err| err.into_error())?;
+        file.seek(SeekFrom::Start(0))?;
+
+        run.reader = Some(BufReader::new(file));
+        Ok(run)
+    }
+
+    fn next(&mut self, kinds: &[GroupAccumulatorKind]) -> Result<Option<(Vec<u8>, GroupEntry)>> {
+        if self.remain == 0 {
+            return Ok(None);
+        }
+        self.remain -= 1;
+
+        let reader = self.reader.as_mut().unwrap();
+        let doc = Document::from_reader(reader)?;
+        GroupEntry::from_spilled_doc(doc, kinds).map(Some)
+    }
+
+}
+
+impl Drop for SpillRun {
+
+    fn drop(&mut self) {
+        // the file is closed before it's removed
+        self.reader = None;
+        let _ = std::fs::remove_file(&self.path);
+    }
+
+}
+
+/// Merge the runs spilled and the groups in memory by the keys,
+/// the partial results of the same key are merged into one group.
+struct GroupMerger {
+    kinds: Vec<GroupAccumulatorKind>,
+    runs: Vec<SpillRun>,
+    /// The groups in memory, as the source after the runs
+    memory: std::vec::IntoIter<(Vec<u8>, GroupEntry)>,
+    heads: Vec<Option<GroupEntry>>,
+    heap: BinaryHeap<Reverse<(Vec<u8>, usize)>>,
+}
+
+impl GroupMerger {
+
+    fn new(
+        kinds: Vec<GroupAccumulatorKind>,
+        runs: Vec<SpillRun>,
+        memory: Vec<(Vec<u8>, GroupEntry)>,
+    ) -> Result<GroupMerger> {
+        let source_count = runs.len() + 1;
+        let mut merger = GroupMerger {
+            kinds,
+            runs,
+            memory: memory.into_iter(),
+            heads: (0..source_count).map(|_| None).collect(),
+            heap: BinaryHeap::with_capacity(source_count),
+        };
+        for source in 0..source_count {
+            merger.advance(source)?;
+        }
+        Ok(merger)
+    }
+
+    fn advance(&mut self, source: usize) -> Result<()> {
+        let next = if source < self.runs.len() {
+            self.runs[source].next(&self.kinds)?
+        } else {
+            self.memory.next()
+        };
+        if let Some((key, entry)) = next {
+            self.heap.push(Reverse((key, source)));
+            self.heads[source] = Some(entry);
+        }
+        Ok(())
+    }
+
+    fn next(&mut self) -> Result<Option<GroupEntry>> {
+        let (key, source) = match self.heap.pop() {
+            Some(Reverse(head)) => head,
+            None => return Ok(None),
+        };
+        let mut entry = self.heads[source].take().unwrap();
+        self.advance(source)?;
+
+        while let Some(Reverse((next_key, _))) = self.heap.peek() {
+            if *next_key != key {
+                break;
+            }
+            let Reverse((_, next_source)) = self.heap.pop().unwrap();
+            entry.merge(self.heads[next_source].take().unwrap());
+            self.advance(next_source)?;
+        }
+
+        Ok(Some(entry))
+    }
+
+}
+
+enum GroupOutput {
+    Memory(indexmap::map::IntoIter<Vec<u8>, GroupEntry>),
+    Merge(GroupMerger),
+}
+
+/// The groups of a `$group` stage, aggregated in a hash table.
+///
+/// When the groups exceed the memory budget, they're spilled
+/// to a temp file sorted by the keys, and the runs are merged
+/// after the last document is added.
+/// The groups are given in the order they're found if nothing
+/// is spilled, otherwise in the order of the keys.
+///
+/// The groups are never spilled on wasm32.
+pub(crate) struct Grouper {
+    item: SubProgramGroupItem,
+    memory_budget: usize,
+    memory_used: usize,
+    groups: IndexMap<Vec<u8>, GroupEntry>,
+    runs: Vec<SpillRun>,
+    output: Option<GroupOutput>,
+}
+
+impl Grouper {
+
+    /// The groups are not spilled until the budget is set
+    pub fn new(item: &SubProgramGroupItem) -> Grouper {
+        Grouper {
+            item: item.clone(),
+            memory_budget: usize::MAX,
+            memory_used: 0,
+            groups: IndexMap::new(),
+            runs: Vec::new(),
+            output: None,
+        }
+    }
+
+    #[inline]
+    pub fn set_memory_budget(&mut self, memory_budget: usize) {
+        self.memory_budget = memory_budget;
+    }
+
+    fn key_bytes(id: &Bson) -> Result<Vec<u8>> {
+        let mut key_doc = Document::new();
+        key_doc.insert("k", normalize_key(id));
+        let bytes = bson::to_vec(&key_doc)?;
+        Ok(bytes)
+    }
+
+    /// Add a document by the values of its fields
+    pub fn add<F>(&mut self, mut get_field: F) -> Result<()>
+    where
+        F: FnMut(&str) -> Result<Option<Bson>>,
+    {
+        let id = eval_expr(&self.item.key, &mut get_field)?.unwrap_or(Bson::Null);
+        let key = Grouper::key_bytes(&id)?;
+
+        let mut values = Vec::with_capacity(self.item.accumulators.len());
+        for accumulator in &self.item.accumulators {
+            let value = match accumulator.kind {
+                GroupAccumulatorKind::Count => None,
+                _ => eval_expr(&accumulator.operand, &mut get_field)?,
+            };
+            values.push(value);
+        }
+
+        let accumulators = &self.item.accumulators;
+        let mut memory_used = self.memory_used;
+        let entry = match self.groups.entry(key) {
+            indexmap::map::Entry::Occupied(entry) => entry.into_mut(),
+            indexmap::map::Entry::Vacant(entry) => {
+                memory_used += GROUP_ENTRY_SIZE + entry.key().len() + approx_size_of(&id);
+                let states: Vec<AccState> = accumulators
+                    .iter()
+                    .map(|accumulator| AccState::new(accumulator.kind))
+                    .collect();
+                memory_used += states.iter().map(AccState::approx_size).sum::<usize>();
+                entry.insert(GroupEntry { id, states })
+            }
+        };
+
+        for (state, value) in entry.states.iter_mut().zip(values) {
+            let size_before = state.approx_size();
+            state.accumulate(value);
+            memory_used = (memory_used + state.approx_size()).saturating_sub(size_before);
+        }
+        self.memory_used = memory_used;
+
+        if self.memory_used > self.memory_budget && cfg!(not(target_arch = "wasm32")) {
+            self.spill()?;
+        }
+
+        Ok(())
+    }
+
+    /// Merge the groups of another grouper of the same stage,
+    /// the groups of a partitioned scan are aggregated by the workers.
+    pub fn absorb(&mut self, mut other: Grouper) -> Result<()> {
+        self.runs.append(&mut other.runs);
+
+        for (key, other_entry) in std::mem::take(&mut other.groups) {
+            match self.groups.entry(key) {
+                indexmap::map::Entry::Occupied(entry) => {
+                    let entry = entry.into_mut();
+                    let size_before: usize = entry.states.iter().map(AccState::approx_size).sum();
+                    entry.merge(other_entry);
+                    let size_after: usize = entry.states.iter().map(AccState::approx_size).sum();
+                    self.memory_used = (self.memory_used + size_after).saturating_sub(size_before);
+                }
+                indexmap::map::Entry::Vacant(entry) => {
+                    self.memory_used += GROUP_ENTRY_SIZE + entry.key().len() + approx_size_of(&other_entry.id);
+                    self.memory_used += other_entry.states.iter().map(AccState::approx_size).sum::<usize>();
+                    entry.insert(other_entry);
+                }
+            }
+        }
+
+        if self.memory_used > self.memory_budget && cfg!(not(target_arch = "wasm32")) {
+            self.spill()?;
+        }
+
+        Ok(())
+    }
+
+    fn take_sorted_groups(&mut self) -> Vec<(Vec<u8>, GroupEntry)> {
+        let mut groups: Vec<(Vec<u8>, GroupEntry)> = std::mem::take(&mut self.groups)
+            .into_iter()
+            .collect();
+        groups.sort_by(|(a, _), (b, _)| a.cmp(b));
+        self.memory_used = 0;
+        groups
+    }
+
+    fn spill(&mut self) -> Result<()> {
+        let groups = self.take_sorted_groups();
+        let run = SpillRun::write(groups)?;
+        self.runs.push(run);
+        Ok(())
+    }
+
+    fn take_output(&mut self) -> Result<GroupOutput> {
+        if self.runs.is_empty() {
+            let groups = std::mem::take(&mut self.groups);
+            return Ok(GroupOutput::Memory(groups.into_iter()));
+        }
+
+        let memory = self.take_sorted_groups();
+        let kinds = self.item.accumulators.iter().map(|accumulator| accumulator.kind).collect();
+        let runs = std::mem::take(&mut self.runs);
+        let merger = GroupMerger::new(kinds, runs, memory)?;
+        Ok(GroupOutput::Merge(merger))
+    }
+
+    /// The groups are given after the last document is added
+    pub fn next(&mut self) -> Result<Option<Document>> {
+        if self.output.is_none() {
+            self.output = Some(self.take_output()?);
+        }
+
+        let entry = match self.output.as_mut().unwrap() {
+            GroupOutput::Memory(groups) => groups.next().map(|(_, entry)| entry),
+            GroupOutput::Merge(merger) => merger.next()?,
+        };
+
+        Ok(entry.map(|entry| entry.finish(&self.item.accumulators)))
+    }
+
+}
@@ -43,6 +43,7 @@ impl JumpTableRecord {
 
 }
 
+#[derive(Clone)]
 pub(crate) enum LabelSlot {
     Empty,
     UnnamedLabel(u32),
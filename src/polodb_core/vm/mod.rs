@@ -10,6 +10,13 @@ mod label;
 mod vm;
 mod global_variable;
 mod aggregation_codegen_context;
+mod subprogram_cache;
+mod sorter;
+mod grouper;
+mod partitioned_scan;
+mod profiler;
 
 pub(crate) use subprogram::SubProgram;
+pub(crate) use subprogram_cache::SubProgramCache;
+pub(crate) use partitioned_scan::{PartitionedScan, PartitionedStage};
 pub(crate) use vm::{VM, VmState};
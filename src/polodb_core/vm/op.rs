@@ -5,7 +5,7 @@
  */
 
 #[repr(u8)]
-#[derive(Copy, Clone, Eq, PartialEq)]
+#[derive(Copy, Clone, Eq, PartialEq, Debug)]
 #[allow(dead_code)]
 pub enum DbOp {
     _EOF = 0,
@@ -60,6 +60,14 @@ pub enum DbOp {
     // op1. location: 4 bytes
     FindByIndex,
 
+    // reset the cursor pointer to the first index key
+    // in the intervals on the second of the stack
+    // if nothing is in the intervals, jump to the location
+    //
+    // 5 bytes
+    // op1. location: 4 bytes
+    FindByIndexRange,
+
     // next element of the cursor
     // if no next element, pass
     // otherwise, jump to location
@@ -285,6 +293,36 @@ pub enum DbOp {
     // op1. global variable id: 4 bytes
     StoreGlobal,
 
+    // add the document on the top of the stack to the sorter,
+    // the stack is not changed
+    //
+    // 5 bytes
+    // op1. sort info id: 4 bytes
+    SortAdd,
+
+    // push the next document of the sorter in order
+    // if no document remains, jump to location
+    //
+    // 9 bytes
+    // op1. sort info id: 4 bytes
+    // op2. location: 4 bytes
+    SortNext,
+
+    // accumulate the document on the top of the stack to its group,
+    // the stack is not changed
+    //
+    // 5 bytes
+    // op1. group info id: 4 bytes
+    GroupAdd,
+
+    // push the next group of the grouper
+    // if no group remains, jump to location
+    //
+    // 9 bytes
+    // op1. group info id: 4 bytes
+    // op2. location: 4 bytes
+    GroupNext,
+
     // Exit
     // Close cursor automatically
     Halt,
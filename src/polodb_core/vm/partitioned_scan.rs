@@ -0,0 +1,226 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+use bson::{Bson, Document};
+use crate::coll::collection_info::CollectionSpecification;
+use crate::index::{prefix_successor, IndexStatisticsRegistry};
+use crate::lsm::LsmSession;
+use crate::session::SessionInner;
+use crate::vm::codegen::Codegen;
+use crate::vm::grouper::Grouper;
+use crate::vm::subprogram::SubProgramGroupItem;
+use crate::vm::{SubProgram, VM, VmState};
+use crate::{LsmKv, Metrics, Result};
+
+/// The keys of a part of the collection, `None` if the range is not
+/// bounded on the side, the bound of the collection is used.
+type ScanRange = (Option<Vec<u8>>, Option<Vec<u8>>);
+
+/// The last stage of a pipeline merged from the results of the workers
+pub(crate) enum PartitionedStage {
+    /// `$count` with the name of the field
+    Count(String),
+    Group(SubProgramGroupItem),
+}
+
+impl PartitionedStage {
+
+    /// The pipeline can be partitioned if it's an optional `$match`
+    /// followed by `$count` or `$group`, nothing follows it.
+    /// Return the stages before the last one and the last one.
+    pub fn from_pipeline(pipeline: &[Document]) -> Result<Option<(&[Document], PartitionedStage)>> {
+        let (last, before) = match pipeline.split_last() {
+            Some(result) => result,
+            None => return Ok(None),
+        };
+        let is_match = |stage: &Document| stage.len() == 1 && stage.contains_key("$match");
+        if before.len() > 1 || !before.iter().all(is_match) || last.len() != 1 {
+            return Ok(None);
+        }
+
+        let stage = match last.iter().next().unwrap() {
+            (key, Bson::String(name)) if key == "$count" => PartitionedStage::Count(name.clone()),
+            (key, value) if key == "$group" => {
+                PartitionedStage::Group(Codegen::parse_group_stage(last, value)?)
+            }
+            _ => return Ok(None),
+        };
+
+        Ok(Some((before, stage)))
+    }
+
+}
+
+/// A scan of a collection split into the ranges of the keys.
+///
+/// Every range is scanned by a VM on its own thread, the rows are
+/// folded on the thread and the partial results are merged by the caller.
+/// The workers read the view of the session started the scan,
+/// including the writes of it not committed.
+///
+/// Only the programs scanning the whole collection are partitioned,
+/// the scans by the primary key or the indexes are run by one VM.
+pub(crate) struct PartitionedScan {
+    kv_engine: LsmKv,
+    program: SubProgram,
+    metrics: Metrics,
+    index_statistics: IndexStatisticsRegistry,
+    ranges: Vec<ScanRange>,
+    sessions: Vec<LsmSession>,
+}
+
+impl PartitionedScan {
+
+    /// `None` if the program can't be partitioned,
+    /// or the collection is too small to be split.
+    pub fn new(
+        kv_engine: LsmKv,
+        metrics: Metrics,
+        index_statistics: IndexStatisticsRegistry,
+        session: &SessionInner,
+        col_spec: &CollectionSpecification,
+        program: SubProgram,
+        parallelism: usize,
+    ) -> Result<Option<PartitionedScan>> {
+        if parallelism <= 1 || !program.is_table_scan() || cfg!(target_arch = "wasm32") {
+            return Ok(None);
+        }
+
+        let mut prefix = Vec::<u8>::new();
+        crate::utils::bson::stacked_key_bytes(&mut prefix, &Bson::String(col_spec.name().to_string()))?;
+        let end = prefix_successor(&prefix);
+
+        let kv_session = session.kv_session();
+        let split_keys = kv_engine.split_keys(kv_session, &prefix, &end, parallelism)?;
+        if split_keys.is_empty() {
+            return Ok(None);
+        }
+
+        let mut ranges: Vec<ScanRange> = Vec::with_capacity(split_keys.len() + 1);
+        let mut start: Option<Vec<u8>> = None;
+        for key in split_keys {
+            let key = key.to_vec();
+            ranges.push((start, Some(key.clone())));
+            start = Some(key);
+        }
+        ranges.push((start, None));
+
+        let sessions = ranges.iter().map(|_| kv_session.fork_for_read()).collect();
+
+        Ok(Some(PartitionedScan {
+            kv_engine,
+            program,
+            metrics,
+            index_statistics,
+            ranges,
+            sessions,
+        }))
+    }
+
+    /// Run the program on every range, the rows of a range
+    /// are folded into the value made by `init` on the worker.
+    /// The values are given in the order of the ranges.
+    pub fn run<T, I, F>(self, init: I, fold: F) -> Result<Vec<T>>
+    where
+        T: Send,
+        I: Fn() -> T + Sync,
+        F: Fn(&mut T, &Bson) -> Result<()> + Sync,
+    {
+        let PartitionedScan {
+            kv_engine,
+            program,
+            metrics,
+            index_statistics,
+            ranges,
+            sessions,
+        } = self;
+        let init = &init;
+        let fold = &fold;
+
+        std::thread::scope(|scope| {
+            let handles: Vec<_> = ranges
+                .into_iter()
+                .zip(sessions)
+                .map(|((start, end), kv_session)| {
+                    let kv_engine = kv_engine.clone();
+                    let program = program.clone();
+                    let metrics = metrics.clone();
+                    let index_statistics = index_statistics.clone();
+
+                    // the VM and the session are made on the worker
+                    scope.spawn(move || -> Result<T> {
+                        let mut session = SessionInner::new(kv_session);
+                        let mut vm = VM::new(kv_engine, program, metrics, index_statistics);
+                        vm.set_scan_range(start, end);
+
+                        let mut result = init();
+                        vm.execute(&mut session)?;
+                        while vm.state == VmState::HasRow {
+                            fold(&mut result, vm.stack_top())?;
+                            vm.execute(&mut session)?;
+                        }
+                        Ok(result)
+                    })
+                })
+                .collect();
+
+            handles
+                .into_iter()
+                .map(|handle| match handle.join() {
+                    Ok(result) => result,
+                    Err(panic) => std::panic::resume_unwind(panic),
+                })
+                .collect()
+        })
+    }
+
+    /// Count the rows of all the ranges
+    pub fn count(self) -> Result<u64> {
+        let counts = self.run(|| 0u64, |count, _| {
+            *count += 1;
+            Ok(())
+        })?;
+        Ok(counts.into_iter().sum())
+    }
+
+    /// Aggregate the rows by the stage, the results are given in the
+    /// order the serial stage gives them if nothing is spilled.
+    pub fn merge_stage(self, stage: PartitionedStage, group_memory_budget: usize) -> Result<Vec<Document>> {
+        match stage {
+            PartitionedStage::Count(name) => {
+                let count = self.count()?;
+                let mut doc = Document::new();
+                doc.insert(name, Bson::Int64(count as i64));
+                Ok(vec![doc])
+            }
+            PartitionedStage::Group(item) => {
+                // the workers share the budget
+                let worker_budget = group_memory_budget / self.ranges.len();
+                let new_grouper = || {
+                    let mut grouper = Grouper::new(&item);
+                    grouper.set_memory_budget(worker_budget);
+                    grouper
+                };
+                let groupers = self.run(new_grouper, |grouper, row| {
+                    let doc = crate::try_unwrap_document!("$group", row);
+                    grouper.add(|key| Ok(crate::utils::bson::try_get_document_value(doc, key)))
+                })?;
+
+                let mut result = Grouper::new(&item);
+                result.set_memory_budget(group_memory_budget);
+                for grouper in groupers {
+                    result.absorb(grouper)?;
+                }
+
+                let mut docs = Vec::new();
+                while let Some(doc) = result.next()? {
+                    docs.push(doc);
+                }
+                Ok(docs)
+            }
+        }
+    }
+
+}
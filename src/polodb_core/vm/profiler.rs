@@ -0,0 +1,96 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+use std::time::Instant;
+use bson::{Bson, Document};
+use crate::vm::op::DbOp;
+
+#[derive(Clone, Copy)]
+struct OpProfile {
+    op:    DbOp,
+    count: u64,
+    nanos: u64,
+}
+
+/// The counts and the time of the ops run by a VM, collected for explain.
+///
+/// The time of an op lasts until the next op starts,
+/// or until the VM yields a row. It's not measured on wasm32.
+pub(crate) struct VmProfiler {
+    /// By the code of the op
+    ops:           Vec<Option<OpProfile>>,
+    current:       Option<(DbOp, Instant)>,
+    rows_examined: u64,
+}
+
+impl VmProfiler {
+
+    pub fn new() -> VmProfiler {
+        VmProfiler {
+            ops: vec![None; 256],
+            current: None,
+            rows_examined: 0,
+        }
+    }
+
+    #[inline]
+    fn now() -> Option<Instant> {
+        if cfg!(target_arch = "wasm32") {
+            None
+        } else {
+            Some(Instant::now())
+        }
+    }
+
+    pub fn enter(&mut self, op: DbOp) {
+        self.pause();
+        let profile = self.ops[op as usize].get_or_insert(OpProfile {
+            op,
+            count: 0,
+            nanos: 0,
+        });
+        profile.count += 1;
+        if let Some(now) = VmProfiler::now() {
+            self.current = Some((op, now));
+        }
+    }
+
+    /// Stop the time of the current op
+    pub fn pause(&mut self) {
+        if let Some((op, start)) = self.current.take() {
+            if let Some(profile) = &mut self.ops[op as usize] {
+                profile.nanos += start.elapsed().as_nanos() as u64;
+            }
+        }
+    }
+
+    /// The cursor is moved to a document or an index key
+    #[inline]
+    pub fn add_row_examined(&mut self) {
+        self.rows_examined += 1;
+    }
+
+    #[inline]
+    pub fn rows_examined(&self) -> u64 {
+        self.rows_examined
+    }
+
+    /// The ops run, in the order of the codes
+    pub fn ops_to_bson(&self) -> Bson {
+        let ops = self.ops
+            .iter()
+            .flatten()
+            .map(|profile| {
+                let mut doc = Document::new();
+                doc.insert("op", format!("{:?}", profile.op));
+                doc.insert("count", Bson::Int64(profile.count as i64));
+                doc.insert("timeMicros", Bson::Double((profile.nanos as f64) / 1000.0));
+                Bson::Document(doc)
+            })
+            .collect();
+        Bson::Array(ops)
+    }
+
+}
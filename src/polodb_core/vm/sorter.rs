@@ -0,0 +1,144 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+use std::cmp::Ordering;
+use std::collections::BinaryHeap;
+use std::sync::Arc;
+use bson::{Bson, Document};
+use crate::vm::subprogram::SubProgramSortItem;
+use crate::Result;
+
+/// The values of the sort keys of a document,
+/// the documents without the key are sorted as null.
+type SortValues = Vec<Bson>;
+
+struct SortRow {
+    /// The orders of the keys, shared by all the rows of the sorter
+    orders: Arc<[i8]>,
+    values: SortValues,
+    /// The documents of the same values keep the order they're added
+    seq: u64,
+    doc: Document,
+}
+
+/// The documents of a `$sort` stage.
+///
+/// If the stage is followed by `$limit`, only the first documents
+/// are kept in a heap, the greatest one is replaced by the smaller ones,
+/// so the documents out of the limit are never decoded.
+pub(crate) struct Sorter {
+    keys: Vec<String>,
+    orders: Arc<[i8]>,
+    limit: Option<usize>,
+    seq: u64,
+    rows: BinaryHeap<SortRow>,
+    sorted: Option<std::vec::IntoIter<SortRow>>,
+}
+
+/// The values are compared by the keys in order,
+/// the values can't be compared are supposed to be equal.
+fn cmp_values(orders: &[i8], left: &[Bson], right: &[Bson]) -> Ordering {
+    for (order, (left, right)) in orders.iter().zip(left.iter().zip(right.iter())) {
+        let ord = crate::utils::bson::value_cmp(left, right).unwrap_or(Ordering::Equal);
+        let ord = if *order < 0 { ord.reverse() } else { ord };
+        if ord != Ordering::Equal {
+            return ord;
+        }
+    }
+    Ordering::Equal
+}
+
+impl Sorter {
+
+    pub fn new(item: &SubProgramSortItem) -> Sorter {
+        Sorter {
+            keys: item.keys.iter().map(|(key, _)| key.clone()).collect(),
+            orders: item.keys.iter().map(|(_, order)| *order).collect(),
+            limit: item.limit,
+            seq: 0,
+            rows: BinaryHeap::new(),
+            sorted: None,
+        }
+    }
+
+    pub fn values_of_doc(&self, doc: &Document) -> SortValues {
+        self.keys
+            .iter()
+            .map(|key| crate::utils::bson::try_get_document_value(doc, key).unwrap_or(Bson::Null))
+            .collect()
+    }
+
+    pub fn values_of_raw_doc(&self, buf: &[u8]) -> Result<SortValues> {
+        let mut result = Vec::with_capacity(self.keys.len());
+        for key in &self.keys {
+            let value = crate::utils::bson::try_get_raw_document_value(buf, key)?;
+            result.push(value.unwrap_or(Bson::Null));
+        }
+        Ok(result)
+    }
+
+    /// The document of the values would be kept,
+    /// it's added after all the documents kept, so it loses the ties.
+    pub fn accepts(&self, values: &[Bson]) -> bool {
+        match (self.limit, self.rows.peek()) {
+            (Some(limit), Some(greatest)) if self.rows.len() >= limit => {
+                cmp_values(&self.orders, values, &greatest.values) == Ordering::Less
+            }
+            (Some(0), _) => false,
+            _ => true,
+        }
+    }
+
+    pub fn add(&mut self, values: SortValues, doc: Document) {
+        if !self.accepts(&values) {
+            return;
+        }
+
+        self.rows.push(SortRow {
+            orders: self.orders.clone(),
+            values,
+            seq: self.seq,
+            doc,
+        });
+        self.seq += 1;
+
+        if let Some(limit) = self.limit {
+            if self.rows.len() > limit {
+                self.rows.pop();
+            }
+        }
+    }
+
+    /// The documents are given in order after the last one is added
+    pub fn next(&mut self) -> Option<Document> {
+        if self.sorted.is_none() {
+            let rows = std::mem::take(&mut self.rows);
+            self.sorted = Some(rows.into_sorted_vec().into_iter());
+        }
+        self.sorted.as_mut().unwrap().next().map(|row| row.doc)
+    }
+
+}
+
+impl Ord for SortRow {
+    fn cmp(&self, other: &Self) -> Ordering {
+        cmp_values(&self.orders, &self.values, &other.values)
+            .then_with(|| self.seq.cmp(&other.seq))
+    }
+}
+
+impl PartialOrd for SortRow {
+    fn partial_cmp(&self, other: &Self) -> Option<Ordering> {
+        Some(self.cmp(other))
+    }
+}
+
+impl PartialEq for SortRow {
+    fn eq(&self, other: &Self) -> bool {
+        self.cmp(other) == Ordering::Equal
+    }
+}
+
+impl Eq for SortRow {}
@@ -17,18 +17,107 @@ use std::rc::Rc;
 use crate::errors::FieldTypeUnexpectedStruct;
 use crate::vm::aggregation_codegen_context::AggregationCodeGenContext;
 use crate::vm::global_variable::GlobalVariableSlot;
+use crate::vm::subprogram_cache::{ParamPath, ParamSlot};
 
+#[derive(Clone)]
 pub(crate) struct SubProgramIndexItem {
     pub col_name: String,
     pub indexes: IndexMap<String, IndexInfo>,
 }
 
+/// The sort keys of a `$sort` stage
+#[derive(Clone)]
+pub(crate) struct SubProgramSortItem {
+    pub keys: Vec<(String, i8)>,
+    /// Only the first documents are kept if it's followed by `$limit`
+    pub limit: Option<usize>,
+}
+
+/// An expression of a `$group` stage
+#[derive(Clone)]
+pub(crate) enum GroupExpr {
+    /// The path of a field, such as "$a.b"
+    Field(String),
+    Const(Bson),
+    Document(Vec<(String, GroupExpr)>),
+}
+
+#[derive(Clone, Copy, PartialEq)]
+pub(crate) enum GroupAccumulatorKind {
+    Sum,
+    Avg,
+    Min,
+    Max,
+    Count,
+}
+
+#[derive(Clone)]
+pub(crate) struct GroupAccumulator {
+    pub name: String,
+    pub kind: GroupAccumulatorKind,
+    pub operand: GroupExpr,
+}
+
+/// The key and the accumulators of a `$group` stage
+#[derive(Clone)]
+pub(crate) struct SubProgramGroupItem {
+    pub key: GroupExpr,
+    pub accumulators: Vec<GroupAccumulator>,
+}
+
+/// How the program finds the documents, shown by explain
+#[derive(Clone, PartialEq, Debug)]
+pub(crate) enum AccessPath {
+    /// Nothing is read from the collection
+    None,
+    PrimaryKey,
+    /// The index is probed by a value, or by the intervals if `range` is true
+    Index { name: String, range: bool },
+    CollectionScan,
+}
+
+impl AccessPath {
+
+    pub fn to_document(&self) -> Document {
+        let mut doc = Document::new();
+        match self {
+            AccessPath::None => {
+                doc.insert("stage", "EOF");
+            }
+            AccessPath::PrimaryKey => {
+                doc.insert("stage", "PRIMARY_KEY");
+            }
+            AccessPath::Index { name, range } => {
+                doc.insert("stage", "INDEX_SCAN");
+                doc.insert("indexName", name.as_str());
+                doc.insert("range", *range);
+            }
+            AccessPath::CollectionScan => {
+                doc.insert("stage", "COLLECTION_SCAN");
+            }
+        }
+        doc
+    }
+
+}
+
+#[derive(Clone)]
 pub(crate) struct SubProgram {
     pub(super) static_values: Vec<Bson>,
     pub(super) instructions: Vec<u8>,
     pub(super) global_variables: Vec<GlobalVariableSlot>,
     pub(super) label_slots: Vec<LabelSlot>,
     pub(super) index_infos: Vec<SubProgramIndexItem>,
+    pub(super) sort_infos: Vec<SubProgramSortItem>,
+    pub(super) group_infos: Vec<SubProgramGroupItem>,
+    /// The statics copied from the documents compiled
+    pub(super) params: Vec<ParamSlot>,
+    /// The values under the paths are planned, they're never bound
+    pub(super) pinned_paths: Vec<ParamPath>,
+    /// All the documents of the collection are scanned in order,
+    /// so the scan can be partitioned by the keys.
+    pub(super) table_scan: bool,
+    pub(super) access_path: AccessPath,
 }
 
 impl SubProgram {
@@ -39,9 +128,41 @@ impl SubProgram {
             global_variables: Vec::with_capacity(16),
             label_slots: Vec::with_capacity(32),
             index_infos: Vec::new(),
+            sort_infos: Vec::new(),
+            group_infos: Vec::new(),
+            params: Vec::new(),
+            pinned_paths: Vec::new(),
+            table_scan: false,
+            access_path: AccessPath::None,
         }
     }
 
+    #[inline]
+    pub(crate) fn is_table_scan(&self) -> bool {
+        self.table_scan
+    }
+
+    #[inline]
+    pub(crate) fn access_path(&self) -> &AccessPath {
+        &self.access_path
+    }
+
+    /// Give out the documents in order, the results merged
+    /// from the workers of a partitioned scan are returned by it.
+    pub(crate) fn compile_values(values: Vec<Document>) -> SubProgram {
+        let mut codegen = Codegen::new(true, false);
+
+        for value in values {
+            let value_id = codegen.push_static(Bson::Document(value));
+            codegen.emit_push_value(value_id);
+            codegen.emit(DbOp::ResultRow);
+            codegen.emit(DbOp::Pop);
+        }
+        codegen.emit(DbOp::Halt);
+
+        codegen.take()
+    }
+
     pub(crate) fn compile_empty_query() -> SubProgram {
         let mut codegen = Codegen::new(true, false);
 
@@ -104,7 +225,10 @@ impl SubProgram {
                     codegen.emit_u32(index_item_id);
                 }
 
+                // the params of the update are in the second document
+                codegen.set_param_root(1);
                 codegen.emit_update_operation(update)?;
+                codegen.set_param_root(0);
 
                 if has_indexes {
                     codegen.emit(DbOp::InsertIndex);
@@ -163,6 +287,7 @@ impl SubProgram {
     }
 
     // TODO: need test
+    #[allow(dead_code)]
     pub(crate) fn compile_delete_all(
         col_spec: &CollectionSpecification,
         col_name: &str,
@@ -185,6 +310,7 @@ impl SubProgram {
         let close_label = codegen.new_label();
 
         codegen.emit_open(col_name.into());
+        codegen.set_access_path(AccessPath::CollectionScan);
 
         codegen.emit_goto(DbOp::Rewind, close_label);
 
@@ -227,6 +353,8 @@ impl SubProgram {
         let close_label = codegen.new_label();
 
         codegen.emit_open(col_name.into());
+        codegen.mark_table_scan();
+        codegen.set_access_path(AccessPath::CollectionScan);
 
         codegen.emit_goto(DbOp::Rewind, close_label);
 
@@ -273,6 +401,8 @@ impl SubProgram {
         codegen.emit_aggregation_before_query(&mut ctx, &pipeline_vec)?;
 
         codegen.emit_open(col_spec.name().into());
+        codegen.mark_table_scan();
+        codegen.set_access_path(AccessPath::CollectionScan);
 
         codegen.emit_goto(DbOp::Rewind, close_label);
 
@@ -287,6 +417,7 @@ impl SubProgram {
         codegen.emit(DbOp::Halt);
 
         codegen.emit_label(result_label);
+        codegen.set_scan_close_label(close_label);
         codegen.emit_aggregation_pipeline(&mut ctx, &pipeline_vec)?;
 
         codegen.emit_goto(DbOp::Goto, next_label);
@@ -439,6 +570,12 @@ impl fmt::Display for SubProgram {
                         pc += 5;
                     }
 
+                    DbOp::FindByIndexRange => {
+                        let location = begin.add(pc + 1).cast::<u32>().read();
+                        writeln!(f, "{}: FindByIndexRange({})", pc, location)?;
+                        pc += 5;
+                    }
+
                     DbOp::Next => {
                         let location = begin.add(pc + 1).cast::<u32>().read();
                         writeln!(f, "{}: Next({})", pc, location)?;
@@ -686,6 +823,32 @@ impl fmt::Display for SubProgram {
                         pc += 5;
                     }
 
+                    DbOp::SortAdd => {
+                        let sort_id = begin.add(pc + 1).cast::<u32>().read();
+                        writeln!(f, "{}: SortAdd({})", pc, sort_id)?;
+                        pc += 5;
+                    }
+
+                    DbOp::SortNext => {
+                        let sort_id = begin.add(pc + 1).cast::<u32>().read();
+                        let location = begin.add(pc + 5).cast::<u32>().read();
+                        writeln!(f, "{}: SortNext({}, {})", pc, sort_id, location)?;
+                        pc += 9;
+                    }
+
+                    DbOp::GroupAdd => {
+                        let group_id = begin.add(pc + 1).cast::<u32>().read();
+                        writeln!(f, "{}: GroupAdd({})", pc, group_id)?;
+                        pc += 5;
+                    }
+
+                    DbOp::GroupNext => {
+                        let group_id = begin.add(pc + 1).cast::<u32>().read();
+                        let location = begin.add(pc + 5).cast::<u32>().read();
+                        writeln!(f, "{}: GroupNext({}, {})", pc, group_id, location)?;
+                        pc += 9;
+                    }
+
                     _ => {
                         writeln!(f, "{}: Unknown", pc)?;
                         break;
@@ -700,8 +863,9 @@ impl fmt::Display for SubProgram {
 #[cfg(test)]
 mod tests {
     use crate::coll::collection_info::{CollectionSpecification, IndexInfo};
-    use crate::vm::SubProgram;
-    use bson::{doc, Regex};
+    use crate::index::IndexStatistics;
+    use crate::vm::{SubProgram, SubProgramCache};
+    use bson::{doc, Document, Regex};
     use indexmap::indexmap;
     use polodb_line_diff::assert_eq;
 
@@ -895,6 +1059,7 @@ mod tests {
                     "age".into() => 1,
                 },
                 options: None,
+                statistics: None,
             },
         );
 
@@ -912,31 +1077,95 @@ mod tests {
 5: PushValue(32)
 10: PushValue("test")
 15: FindByIndex(35)
-20: Goto(44)
+20: Goto(67)
 
-25: Label(2)
-30: NextIndexValue(44)
+25: Label(3)
+30: NextIndexValue(67)
 
-35: Label(0)
+35: Label(6, "close")
 40: Pop
 41: Pop
 42: Close
 43: Halt
 
-44: Label(1)
-49: GetField("name", 35)
-58: PushValue("Vincent Chan")
-63: Equal
-64: FalseJump(35)
-69: Pop
-70: Pop
-71: ResultRow
-72: Pop
-73: Goto(25)
+44: Label(5, "not_this_item")
+49: Pop
+50: Goto(25)
+
+55: Label(4, "result")
+60: ResultRow
+61: Pop
+62: Goto(25)
+
+67: Label(2, "compare")
+72: Dup
+73: Call(92, 1)
+82: FalseJump(44)
+87: Goto(55)
+
+92: Label(0, "compare_function")
+97: GetField("name", 119)
+106: PushValue("Vincent Chan")
+111: Equal
+112: FalseJump(119)
+117: Pop
+118: Pop
+
+119: Label(1, "compare_function_clean")
+124: Ret0
 "#;
         assert_eq!(expect, actual);
     }
 
+    #[test]
+    fn query_by_selective_index() {
+        let mut col_spec = new_spec("orders");
+
+        col_spec.indexes.insert(
+            "status_1".into(),
+            IndexInfo {
+                keys: indexmap! {
+                    "status".into() => 1,
+                },
+                options: None,
+                statistics: Some(IndexStatistics {
+                    entry_count: 10000,
+                    distinct_count: 2,
+                }),
+            },
+        );
+        col_spec.indexes.insert(
+            "order_id_1".into(),
+            IndexInfo {
+                keys: indexmap! {
+                    "order_id".into() => 1,
+                },
+                options: None,
+                statistics: Some(IndexStatistics {
+                    entry_count: 10000,
+                    distinct_count: 10000,
+                }),
+            },
+        );
+
+        let test_doc = doc! {
+            "status": "paid",
+            "order_id": 42,
+        };
+        let program = SubProgram::compile_query(&col_spec, &test_doc, false).unwrap();
+        let actual = format!("{}", program);
+        assert!(actual.contains("order_id_1"));
+        assert!(!actual.contains("status_1"));
+
+        // half of the collection, the scan is cheaper
+        let test_doc = doc! {
+            "status": "paid",
+        };
+        let program = SubProgram::compile_query(&col_spec, &test_doc, false).unwrap();
+        let actual = format!("{}", program);
+        assert!(!actual.contains("$I"));
+    }
+
     #[test]
     fn query_by_logic_and() {
         let col_spec = new_spec("test");
@@ -1372,6 +1601,7 @@ mod tests {
                     "age".into() => 1,
                 },
                 options: None,
+                statistics: None,
             },
         );
 
@@ -1625,4 +1855,117 @@ $0 = Int64(0)
 "#;
         assert_eq!(expect, actual);
     }
+
+    #[test]
+    fn bind_cached_program() {
+        let mut col_spec = new_spec("test");
+        col_spec.indexes.insert(
+            "age_1".into(),
+            IndexInfo {
+                keys: indexmap! {
+                    "age".into() => 1,
+                },
+                options: None,
+                statistics: None,
+            },
+        );
+        let cache = SubProgramCache::new(16);
+
+        let compile = |query: &Document, update: &Document| {
+            cache.get_or_compile("update_many", &col_spec, &[query, update], || {
+                SubProgram::compile_update(&col_spec, Some(query), update, false, true)
+            }).unwrap()
+        };
+
+        let query = doc! {
+            "name": "Vincent",
+            "$or": [ { "score": { "$lt": 10 } } ],
+        };
+        let update = doc! { "$set": { "level": 1 } };
+        let (_, hit) = compile(&query, &update);
+        assert!(!hit);
+
+        let query = doc! {
+            "name": "Alan",
+            "$or": [ { "score": { "$lt": 20 } } ],
+        };
+        let update = doc! { "$set": { "level": 2 } };
+        let (program, hit) = compile(&query, &update);
+        assert!(hit);
+        let expect = SubProgram::compile_update(&col_spec, Some(&query), &update, false, true).unwrap();
+        assert_eq!(format!("{}", expect), format!("{}", program));
+
+        // the value planned into the intervals is not bound
+        let query = doc! { "age": { "$gt": 3 } };
+        let (_, hit) = compile(&query, &update);
+        assert!(!hit);
+        let query = doc! { "age": { "$gt": 30 } };
+        let (program, hit) = compile(&query, &update);
+        assert!(!hit);
+        let expect = SubProgram::compile_update(&col_spec, Some(&query), &update, false, true).unwrap();
+        assert_eq!(format!("{}", expect), format!("{}", program));
+
+        // the value of the single key is bound
+        let query = doc! { "age": 3 };
+        compile(&query, &update);
+        let query = doc! { "age": 30 };
+        let (program, hit) = compile(&query, &update);
+        assert!(hit);
+        let expect = SubProgram::compile_update(&col_spec, Some(&query), &update, false, true).unwrap();
+        assert_eq!(format!("{}", expect), format!("{}", program));
+
+        // another type is another shape
+        let query = doc! { "age": "30" };
+        let (_, hit) = compile(&query, &update);
+        assert!(!hit);
+    }
+
+    #[test]
+    fn cached_program_of_changed_spec() {
+        let mut col_spec = new_spec("test");
+        col_spec.indexes.insert(
+            "age_1".into(),
+            IndexInfo {
+                keys: indexmap! {
+                    "age".into() => 1,
+                },
+                options: None,
+                statistics: Some(IndexStatistics {
+                    entry_count: 100,
+                    distinct_count: 100,
+                }),
+            },
+        );
+        let cache = SubProgramCache::new(16);
+        let query = doc! { "name": "Vincent" };
+
+        let compile = |col_spec: &CollectionSpecification| {
+            let (_, hit) = cache.get_or_compile("find", col_spec, &[&query], || {
+                SubProgram::compile_query(col_spec, &query, true)
+            }).unwrap();
+            hit
+        };
+
+        assert!(!compile(&col_spec));
+        assert!(compile(&col_spec));
+
+        // the statistics of the same magnitude
+        col_spec.indexes.get_mut("age_1").unwrap().statistics = Some(IndexStatistics {
+            entry_count: 120,
+            distinct_count: 110,
+        });
+        assert!(compile(&col_spec));
+
+        // the index grows more than twice
+        col_spec.indexes.get_mut("age_1").unwrap().statistics = Some(IndexStatistics {
+            entry_count: 1000,
+            distinct_count: 110,
+        });
+        assert!(!compile(&col_spec));
+        assert!(compile(&col_spec));
+
+        // another version of the indexes
+        col_spec.version += 1;
+        assert!(!compile(&col_spec));
+    }
 }
@@ -0,0 +1,247 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+use std::fmt::Write;
+use std::sync::Mutex;
+use bson::{Bson, Document};
+use indexmap::IndexMap;
+use crate::coll::collection_info::{CollectionSpecification, IndexInfo};
+use crate::vm::SubProgram;
+use crate::Result;
+
+/// The path of a value in one of the documents compiled,
+/// such as the query and the update of an update program.
+///
+/// The keys of the arrays are the indexes in brackets, such as "[0]",
+/// the same as the paths of the codegen.
+#[derive(Clone, PartialEq)]
+pub(crate) struct ParamPath {
+    pub root: usize,
+    pub path: Vec<String>,
+}
+
+impl ParamPath {
+
+    fn value_of<'a>(&self, roots: &[&'a Document]) -> Option<&'a Bson> {
+        let (first, rest) = self.path.split_first()?;
+        let root: &'a Document = *roots.get(self.root)?;
+        let mut value = root.get(first)?;
+        for key in rest {
+            value = match value {
+                Bson::Document(doc) => doc.get(key)?,
+                Bson::Array(arr) => arr.get(ParamPath::array_index(key)?)?,
+                _ => return None,
+            };
+        }
+        Some(value)
+    }
+
+    fn value_of_mut<'a>(&self, roots: &'a mut [Document]) -> Option<&'a mut Bson> {
+        let (first, rest) = self.path.split_first()?;
+        let mut value = roots.get_mut(self.root)?.get_mut(first)?;
+        for key in rest {
+            value = match value {
+                Bson::Document(doc) => doc.get_mut(key)?,
+                Bson::Array(arr) => arr.get_mut(ParamPath::array_index(key)?)?,
+                _ => return None,
+            };
+        }
+        Some(value)
+    }
+
+    fn array_index(key: &str) -> Option<usize> {
+        key.strip_prefix('[')?.strip_suffix(']')?.parse().ok()
+    }
+
+    fn starts_with(&self, prefix: &ParamPath) -> bool {
+        self.root == prefix.root && self.path.starts_with(&prefix.path)
+    }
+
+}
+
+/// A static value copied from the documents compiled,
+/// it's bound again when the program is reused.
+#[derive(Clone)]
+pub(crate) struct ParamSlot {
+    pub path: ParamPath,
+    pub static_id: u32,
+}
+
+struct CachedSubProgram {
+    program: SubProgram,
+    col_name: String,
+    /// The documents compiled with the params replaced by null
+    masked_roots: Vec<Document>,
+    /// The magnitudes of the statistics of the indexes planned with
+    statistics: Vec<Option<(u32, u32)>>,
+}
+
+impl CachedSubProgram {
+
+    /// The plan is chosen again when an index grows
+    /// or shrinks more than twice
+    fn statistics_magnitude(index_info: &IndexInfo) -> Option<(u32, u32)> {
+        index_info.statistics.map(|statistics| (
+            64 - statistics.entry_count.leading_zeros(),
+            64 - statistics.distinct_count.leading_zeros(),
+        ))
+    }
+
+    fn same_statistics(&self, col_spec: &CollectionSpecification) -> bool {
+        let current = col_spec.indexes.values().map(CachedSubProgram::statistics_magnitude);
+        self.statistics.iter().copied().eq(current)
+    }
+
+    /// The params used by the plan are pinned,
+    /// they must be the same to reuse the program.
+    fn bound_params(program: &SubProgram) -> impl Iterator<Item = &ParamSlot> {
+        program.params.iter().filter(move |param| {
+            !program.pinned_paths.iter().any(|pinned| param.path.starts_with(pinned))
+        })
+    }
+
+    fn mask_roots(program: &SubProgram, roots: &[&Document]) -> Vec<Document> {
+        let mut masked_roots: Vec<Document> = roots.iter().map(|root| (*root).clone()).collect();
+        for param in CachedSubProgram::bound_params(program) {
+            if let Some(value) = param.path.value_of_mut(&mut masked_roots) {
+                *value = Bson::Null;
+            }
+        }
+        masked_roots
+    }
+
+    /// Return the program with the values of the roots,
+    /// None if the roots differ in anything but the params.
+    fn bind(&self, roots: &[&Document]) -> Option<SubProgram> {
+        if CachedSubProgram::mask_roots(&self.program, roots) != self.masked_roots {
+            return None;
+        }
+
+        let mut program = self.program.clone();
+        for param in CachedSubProgram::bound_params(&self.program) {
+            let value = param.path.value_of(roots)?;
+            program.static_values[param.static_id as usize] = value.clone();
+        }
+
+        Some(program)
+    }
+
+}
+
+/// The programs compiled, keyed by the shapes of the documents
+/// and the version of the collection spec.
+///
+/// The shape keeps the keys and the types of the values,
+/// the programs of the same shape only differ in the values
+/// copied to the statics, so they are bound instead of compiling again.
+/// The values which are not copied, such as the ones planned into
+/// the intervals of the index, must be the same to hit.
+pub(crate) struct SubProgramCache {
+    capacity: usize,
+    entries: Mutex<IndexMap<String, CachedSubProgram>>,
+}
+
+impl SubProgramCache {
+
+    pub fn new(capacity: usize) -> SubProgramCache {
+        SubProgramCache {
+            capacity,
+            entries: Mutex::new(IndexMap::new()),
+        }
+    }
+
+    /// The kind distinguishes the compile functions of the same documents,
+    /// such as the update of one and many documents.
+    pub fn get_or_compile<F>(
+        &self,
+        kind: &str,
+        col_spec: &CollectionSpecification,
+        roots: &[&Document],
+        compile: F,
+    ) -> Result<(SubProgram, bool)>
+    where
+        F: FnOnce() -> Result<SubProgram>,
+    {
+        if self.capacity == 0 {
+            return Ok((compile()?, false));
+        }
+
+        let key = SubProgramCache::make_key(kind, col_spec, roots);
+
+        {
+            let entries = self.entries.lock()?;
+            let program = entries.get(&key)
+                .filter(|entry| entry.same_statistics(col_spec))
+                .and_then(|entry| entry.bind(roots));
+            if let Some(program) = program {
+                return Ok((program, true));
+            }
+        }
+
+        let program = compile()?;
+        let entry = CachedSubProgram {
+            masked_roots: CachedSubProgram::mask_roots(&program, roots),
+            program: program.clone(),
+            col_name: col_spec._id.clone(),
+            statistics: col_spec.indexes.values().map(CachedSubProgram::statistics_magnitude).collect(),
+        };
+
+        let mut entries = self.entries.lock()?;
+        // the oldest shape is evicted
+        if entries.len() >= self.capacity && !entries.contains_key(&key) {
+            entries.shift_remove_index(0);
+        }
+        entries.insert(key, entry);
+
+        Ok((program, false))
+    }
+
+    /// The programs of the collection are dropped when the indexes change
+    pub fn invalidate_collection(&self, col_name: &str) {
+        if let Ok(mut entries) = self.entries.lock() {
+            entries.retain(|_, entry| entry.col_name != col_name);
+        }
+    }
+
+    fn make_key(kind: &str, col_spec: &CollectionSpecification, roots: &[&Document]) -> String {
+        let mut key = String::with_capacity(128);
+        let _ = write!(key, "{}/{:?}/{}", kind, col_spec._id, col_spec.version);
+
+        for root in roots {
+            key.push('/');
+            SubProgramCache::write_shape_of_doc(&mut key, root);
+        }
+
+        key
+    }
+
+    fn write_shape_of_doc(key: &mut String, doc: &Document) {
+        key.push('{');
+        for (sub_key, value) in doc {
+            let _ = write!(key, "{:?}:", sub_key);
+            SubProgramCache::write_shape(key, value);
+            key.push(',');
+        }
+        key.push('}');
+    }
+
+    fn write_shape(key: &mut String, value: &Bson) {
+        match value {
+            Bson::Document(doc) => SubProgramCache::write_shape_of_doc(key, doc),
+            Bson::Array(arr) => {
+                key.push('[');
+                for item in arr {
+                    SubProgramCache::write_shape(key, item);
+                    key.push(',');
+                }
+                key.push(']');
+            }
+            _ => {
+                let _ = write!(key, "{:02x}", value.element_type() as u8);
+            }
+        }
+    }
+
+}
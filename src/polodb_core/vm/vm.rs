@@ -7,15 +7,20 @@ use crate::cursor::Cursor;
 use crate::errors::{
     CannotApplyOperationForTypes, FieldTypeUnexpectedStruct, RegexError, UnexpectedTypeForOpStruct,
 };
-use crate::index::{IndexHelper, IndexHelperOperation};
+use crate::index::{intervals_from_bson, IndexHelper, IndexHelperOperation, IndexStatisticsRegistry};
 use crate::session::SessionInner;
 use crate::vm::op::DbOp;
+use crate::vm::sorter::Sorter;
+use crate::vm::grouper::Grouper;
 use crate::vm::SubProgram;
+use crate::vm::profiler::VmProfiler;
 use crate::{Error, LsmKv, Metrics, Result, TransactionType};
 use bson::{Bson, Document};
 use regex::RegexBuilder;
 use std::cell::Cell;
 use std::cmp::Ordering;
+use std::collections::VecDeque;
+use std::sync::Arc;
 
 macro_rules! try_vm {
     ($self:ident, $action:expr) => {
@@ -57,9 +62,11 @@ impl Default for VMFrame {
 pub(crate) struct VM {
     kv_engine: LsmKv,
     pub(crate) state: VmState,
-    pc: *const u8,
+    pc: Pc,
     r0: i32, // usually the logic register
     r1: Option<Cursor>,
+    /// r1 is opened by a write program
+    r1_writable: bool,
     pub(crate) r2: i64, // usually the counter
     r3: usize,
     stack: Vec<Bson>,
@@ -67,8 +74,40 @@ pub(crate) struct VM {
     pub(crate) program: SubProgram,
     global_vars: Vec<Bson>,
     metrics: Metrics,
+    index_statistics: IndexStatisticsRegistry,
+    /// The keys of the documents found by the index in a write program.
+    /// They are all collected before the first document is written,
+    /// so the index entries changed by the program are never visited.
+    index_doc_keys: VecDeque<Vec<u8>>,
+    /// The key of the current document found by the index,
+    /// r1 is on the index key instead of the document.
+    index_doc_key: Option<Vec<u8>>,
+    /// The documents read but not decoded yet, with their positions on the stack.
+    /// The slots are null until the documents are decoded,
+    /// only the fields read by [`DbOp::GetField`] are decoded before.
+    lazy_docs: Vec<(usize, Arc<[u8]>)>,
+    /// The documents of the `$sort` stages, by the ids of the sort infos
+    sorters: Vec<Sorter>,
+    /// The groups of the `$group` stages, by the ids of the group infos
+    groupers: Vec<Grouper>,
+    /// The part of the collection scanned by a worker of a partitioned scan
+    scan_range: Option<(Option<Vec<u8>>, Option<Vec<u8>>)>,
+    /// The document of a row read from the disk is left undecoded,
+    /// see [`VM::stack_top_raw`].
+    raw_result: bool,
+    /// Only available when the program is explained
+    profiler: Option<Box<VmProfiler>>,
 }
 
+/// The program counter, it points into the instructions of the program of the VM.
+#[derive(Copy, Clone)]
+struct Pc(*const u8);
+
+// SAFETY: the pointer is only read by the VM owning it. It points into
+// the heap buffer of `program.instructions`, which moves with the VM
+// and isn't changed while the VM runs, so the VM can run on another thread.
+unsafe impl Send for Pc {}
+
 fn generic_cmp(op: DbOp, val1: &Bson, val2: &Bson) -> Result<bool> {
     let ord = crate::utils::bson::value_cmp(val1, val2)?;
     let result = matches!(
@@ -85,21 +124,30 @@ fn generic_cmp(op: DbOp, val1: &Bson, val2: &Bson) -> Result<bool> {
 }
 
 impl VM {
-    pub(crate) fn new(kv_engine: LsmKv, program: SubProgram, metrics: Metrics) -> VM {
+    pub(crate) fn new(
+        kv_engine: LsmKv,
+        program: SubProgram,
+        metrics: Metrics,
+        index_statistics: IndexStatisticsRegistry,
+    ) -> VM {
         let stack = Vec::with_capacity(STACK_SIZE);
-        let pc = program.instructions.as_ptr();
+        let pc = Pc(program.instructions.as_ptr());
         let mut global_vars = Vec::<Bson>::new();
 
         for item in &program.global_variables {
             global_vars.push(item.init_value.clone());
         }
 
+        let sorters = program.sort_infos.iter().map(Sorter::new).collect();
+        let groupers = program.group_infos.iter().map(Grouper::new).collect();
+
         VM {
             kv_engine,
             state: VmState::Init,
             pc,
             r0: 0,
             r1: None,
+            r1_writable: false,
             r2: 0,
             r3: 0,
             stack,
@@ -107,6 +155,15 @@ impl VM {
             program,
             global_vars,
             metrics,
+            index_statistics,
+            index_doc_keys: VecDeque::new(),
+            index_doc_key: None,
+            lazy_docs: Vec::new(),
+            sorters,
+            groupers,
+            scan_range: None,
+            raw_result: false,
+            profiler: None,
         }
     }
 
@@ -131,7 +188,12 @@ impl VM {
 
         let prefix_bytes = VM::prefix_bytes_from_bson(prefix)?;
 
-        self.r1 = Some(Cursor::new(prefix_bytes, cursor));
+        let mut cursor = Cursor::new(prefix_bytes, cursor);
+        if let Some((start, end)) = self.scan_range.clone() {
+            cursor.set_scan_range(start, end);
+        }
+        self.r1 = Some(cursor);
+        self.r1_writable = false;
         Ok(())
     }
 
@@ -143,6 +205,7 @@ impl VM {
         let prefix_bytes = VM::prefix_bytes_from_bson(prefix)?;
 
         self.r1 = Some(Cursor::new(prefix_bytes, cursor));
+        self.r1_writable = true;
         Ok(())
     }
 
@@ -151,8 +214,7 @@ impl VM {
         cursor.reset()?;
         if cursor.has_next() {
             let item = cursor.peek_data(self.kv_engine.inner.as_ref())?.unwrap();
-            let doc = bson::from_slice(item.as_ref())?;
-            self.stack.push(Bson::Document(doc));
+            self.push_lazy_doc(item);
             is_empty.set(false);
         } else {
             is_empty.set(true);
@@ -172,24 +234,38 @@ impl VM {
         }
 
         let buf = cursor.peek_data(self.kv_engine.inner.as_ref())?.unwrap();
-        let doc = bson::from_slice(buf.as_ref())?;
-        self.stack.push(Bson::Document(doc));
+        self.push_lazy_doc(buf);
         Ok(true)
     }
 
-    fn find_by_index(&mut self, session: &mut SessionInner) -> Result<bool> {
+    fn find_by_index(&mut self, session: &mut SessionInner, by_intervals: bool) -> Result<bool> {
         let stack_len = self.stack.len();
         // let col_name = self.stack[stack_len - 1].as_str().expect("col_name must be string").to_string();
         let query_value = &self.stack[stack_len - 2];
 
         let cursor = self.r1.as_mut().unwrap();
-        let result = cursor.reset_by_index_value(query_value)?;
+        let result = if by_intervals {
+            cursor.reset_by_index_intervals(intervals_from_bson(query_value))?
+        } else {
+            cursor.reset_by_index_value(query_value)?
+        };
 
         if !result {
             return Ok(false);
         }
 
-        let key = cursor.peek_key().expect("key must exist");
+        self.metrics.add_find_by_index_count();
+
+        if self.r1_writable {
+            self.collect_index_doc_keys()?;
+            let found = self.next_index_doc(session)?;
+            if found {
+                self.r0 = 1;
+            }
+            return Ok(found);
+        }
+
+        let key = cursor.peek_index_key().expect("key must exist");
 
         let index_value = self.read_index_value_by_index_key(key.as_ref(), session)?;
 
@@ -197,45 +273,73 @@ impl VM {
             return Ok(false);
         }
 
-        self.stack.push(index_value.unwrap());
-
-        self.metrics.add_find_by_index_count();
+        self.push_lazy_doc(index_value.unwrap());
+        self.r0 = 1;
 
         Ok(true)
     }
 
-    fn read_index_value_by_index_key(
-        &mut self,
-        index_key: &[u8],
-        session: &mut SessionInner,
-    ) -> Result<Option<Bson>> {
-        let slices = crate::utils::bson::split_stacked_keys(index_key.as_ref())?;
-        let pkey = slices.last().expect("pkey must exist");
+    fn collect_index_doc_keys(&mut self) -> Result<()> {
+        self.index_doc_keys.clear();
 
-        let col_name = &slices[1];
+        let cursor = self.r1.as_mut().unwrap();
+        while let Some(index_key) = cursor.peek_index_key() {
+            let doc_key = VM::doc_key_of_index_key(index_key.as_ref())?;
+            self.index_doc_keys.push_back(doc_key);
+            cursor.next_index_key()?;
+        }
 
-        let pkey_in_kv = crate::utils::bson::stacked_key(vec![col_name, pkey])?;
+        Ok(())
+    }
 
-        let mut value_cursor = self.kv_engine.open_multi_cursor(Some(session.kv_session()));
-        value_cursor.go_to_min()?;
+    /// Push the next document collected by [`VM::collect_index_doc_keys`],
+    /// the documents deleted after the collection are skipped.
+    fn next_index_doc(&mut self, session: &mut SessionInner) -> Result<bool> {
+        while let Some(doc_key) = self.index_doc_keys.pop_front() {
+            if let Some(doc) = self.read_document_by_key(doc_key.as_slice(), session)? {
+                self.push_lazy_doc(doc);
+                self.index_doc_key = Some(doc_key);
+                return Ok(true);
+            }
+        }
 
-        value_cursor.seek(pkey_in_kv.as_slice())?;
+        self.index_doc_key = None;
+        Ok(false)
+    }
 
-        let current_key = value_cursor.key();
-        if current_key.is_none() {
-            return Ok(None);
-        }
+    fn doc_key_of_index_key(index_key: &[u8]) -> Result<Vec<u8>> {
+        let slices = crate::utils::bson::split_stacked_keys(index_key)?;
+        let pkey = slices.last().expect("pkey must exist");
 
-        let current_key = current_key.unwrap();
+        let col_name = &slices[1];
+
+        crate::utils::bson::stacked_key(vec![col_name, pkey])
+    }
 
-        if current_key.as_ref().cmp(pkey_in_kv.as_slice()) != Ordering::Equal {
+    fn read_index_value_by_index_key(
+        &mut self,
+        index_key: &[u8],
+        session: &mut SessionInner,
+    ) -> Result<Option<Arc<[u8]>>> {
+        let pkey_in_kv = VM::doc_key_of_index_key(index_key)?;
+        self.read_document_by_key(pkey_in_kv.as_slice(), session)
+    }
+
+    fn read_document_by_key(
+        &mut self,
+        key: &[u8],
+        session: &mut SessionInner,
+    ) -> Result<Option<Arc<[u8]>>> {
+        let mut value_cursor = self.kv_engine.open_multi_cursor(Some(session.kv_session()));
+
+        let found = value_cursor.seek_exact(key)?;
+        if !found {
             return Ok(None);
         }
 
         let buf = value_cursor.value(self.kv_engine.inner.as_ref())?.unwrap();
-        let doc = bson::from_slice(buf.as_ref())?;
 
-        Ok(Some(Bson::Document(doc)))
+        Ok(Some(buf))
     }
 
     fn next(&mut self) -> Result<()> {
@@ -243,8 +347,7 @@ impl VM {
         cursor.next()?;
         match cursor.peek_data(self.kv_engine.inner.as_ref())? {
             Some(bytes) => {
-                let doc = bson::from_slice(bytes.as_ref())?;
-                self.stack.push(Bson::Document(doc));
+                self.push_lazy_doc(bytes);
 
                 debug_assert!(
                     self.stack.len() <= 64,
@@ -263,18 +366,19 @@ impl VM {
     }
 
     fn next_index_value(&mut self, session: &mut SessionInner) -> Result<()> {
+        if self.r1_writable {
+            self.r0 = if self.next_index_doc(session)? { 1 } else { 0 };
+            return Ok(());
+        }
+
         let cursor = self.r1.as_mut().unwrap();
-        cursor.next()?;
-        let current_key = cursor.peek_key();
+        cursor.next_index_key()?;
+        let current_key = cursor.peek_index_key();
         if current_key.is_none() {
             self.r0 = 0;
             return Ok(());
         }
         let current_key = current_key.unwrap();
-        if !current_key.starts_with(cursor.prefix_bytes.as_slice()) {
-            self.r0 = 0;
-            return Ok(());
-        }
 
         let value_opt = self.read_index_value_by_index_key(current_key.as_ref(), session)?;
         if value_opt.is_none() {
@@ -282,21 +386,234 @@ impl VM {
             return Ok(());
         }
 
-        self.stack.push(value_opt.unwrap());
+        self.push_lazy_doc(value_opt.unwrap());
 
         self.r0 = 1;
 
         Ok(())
     }
 
+    /// The document is decoded when it's returned or changed,
+    /// see [`VM::decode_lazy_docs_for`].
+    fn push_lazy_doc(&mut self, buf: Arc<[u8]>) {
+        self.lazy_docs.push((self.stack.len(), buf));
+        self.stack.push(Bson::Null);
+    }
+
+    fn lazy_doc_at(&self, pos: usize) -> Option<&Arc<[u8]>> {
+        self.lazy_docs
+            .iter()
+            .rev()
+            .find(|(lazy_pos, _)| *lazy_pos == pos)
+            .map(|(_, buf)| buf)
+    }
+
+    fn decode_lazy_docs_from(&mut self, from: usize) -> Result<()> {
+        while let Some((pos, _)) = self.lazy_docs.last() {
+            if *pos < from {
+                break;
+            }
+            let (pos, buf) = self.lazy_docs.pop().unwrap();
+            let doc = bson::from_slice(buf.as_ref())?;
+            self.stack[pos] = Bson::Document(doc);
+        }
+        Ok(())
+    }
+
+    /// Decode the lazy documents which the op is about to read.
+    /// The ops handling the lazy documents, or only reading
+    /// the values on the top, leave the others undecoded.
+    fn decode_lazy_docs_for(&mut self, op: DbOp) -> Result<()> {
+        let stack_len = self.stack.len();
+        let from = match op {
+            DbOp::Goto
+            | DbOp::Label
+            | DbOp::IncR2
+            | DbOp::IfTrue
+            | DbOp::IfFalse
+            | DbOp::Not
+            | DbOp::Rewind
+            | DbOp::FindByPrimaryKey
+            | DbOp::FindByIndex
+            | DbOp::FindByIndexRange
+            | DbOp::Next
+            | DbOp::NextIndexValue
+            | DbOp::PushValue
+            | DbOp::PushTrue
+            | DbOp::PushFalse
+            | DbOp::PushDocument
+            | DbOp::PushR0
+            | DbOp::GetField
+            | DbOp::Dup
+            | DbOp::Pop
+            | DbOp::Pop2
+            | DbOp::SaveStackPos
+            | DbOp::RecoverStackPos
+            | DbOp::Call
+            | DbOp::Ret0
+            | DbOp::Ret
+            | DbOp::IfFalseRet
+            | DbOp::LoadGlobal
+            | DbOp::SortAdd
+            | DbOp::SortNext
+            | DbOp::GroupAdd
+            | DbOp::GroupNext => return Ok(()),
+
+            DbOp::ResultRow if self.raw_result => return Ok(()),
+
+            DbOp::Equal
+            | DbOp::Greater
+            | DbOp::GreaterEqual
+            | DbOp::Less
+            | DbOp::LessEqual
+            | DbOp::In
+            | DbOp::Regex => stack_len.saturating_sub(2),
+
+            DbOp::Inc | DbOp::StoreR0 | DbOp::StoreGlobal => stack_len.saturating_sub(1),
+
+            _ => 0,
+        };
+        self.decode_lazy_docs_from(from)
+    }
+
+    /// Resize the stack, the lazy documents removed are dropped
+    fn resize_stack(&mut self, new_len: usize) {
+        self.stack.resize(new_len, Bson::Null);
+        while let Some((pos, _)) = self.lazy_docs.last() {
+            if *pos < new_len {
+                break;
+            }
+            self.lazy_docs.pop();
+        }
+    }
+
+    fn get_field(&self, key_stat_id: usize) -> Result<Option<Bson>> {
+        let key_name = self.borrow_static(key_stat_id).as_str().unwrap();
+        let top_pos = self.stack.len() - 1;
+
+        if let Some(buf) = self.lazy_doc_at(top_pos) {
+            return crate::utils::bson::try_get_raw_document_value(buf.as_ref(), key_name);
+        }
+
+        let top = &self.stack[top_pos];
+        let doc = match top {
+            Bson::Document(doc) => doc,
+            _ => {
+                let name = format!("{}", top);
+                return Err(FieldTypeUnexpectedStruct {
+                    field_name: key_name.into(),
+                    expected_ty: "Document".into(),
+                    actual_ty: name,
+                }.into());
+            }
+        };
+
+        Ok(crate::utils::bson::try_get_document_value(doc, key_name))
+    }
+
+    /// Only the values of the keys are read from a lazy document,
+    /// it's decoded if the sorter keeps it.
+    fn sort_add(&mut self, sort_id: usize) -> Result<()> {
+        let top_pos = self.stack.len() - 1;
+
+        match self.lazy_doc_at(top_pos).cloned() {
+            Some(buf) => {
+                let sorter = &mut self.sorters[sort_id];
+                let values = sorter.values_of_raw_doc(buf.as_ref())?;
+                if sorter.accepts(&values) {
+                    let doc = bson::from_slice(buf.as_ref())?;
+                    sorter.add(values, doc);
+                }
+            }
+            None => {
+                let doc = crate::try_unwrap_document!("$sort", &self.stack[top_pos]);
+                let sorter = &mut self.sorters[sort_id];
+                let values = sorter.values_of_doc(doc);
+                if sorter.accepts(&values) {
+                    sorter.add(values, doc.clone());
+                }
+            }
+        }
+
+        Ok(())
+    }
+
+    /// Only the fields of the group are read from a lazy document
+    fn group_add(&mut self, group_id: usize) -> Result<()> {
+        let top_pos = self.stack.len() - 1;
+
+        match self.lazy_doc_at(top_pos).cloned() {
+            Some(buf) => {
+                self.groupers[group_id].add(|key| {
+                    crate::utils::bson::try_get_raw_document_value(buf.as_ref(), key)
+                })
+            }
+            None => {
+                let doc = crate::try_unwrap_document!("$group", &self.stack[top_pos]);
+                self.groupers[group_id].add(|key| {
+                    Ok(crate::utils::bson::try_get_document_value(doc, key))
+                })
+            }
+        }
+    }
+
+    /// The groups exceeding the budget in bytes are spilled to the temp files
+    pub(crate) fn set_group_memory_budget(&mut self, memory_budget: usize) {
+        for grouper in &mut self.groupers {
+            grouper.set_memory_budget(memory_budget);
+        }
+    }
+
+    /// Only scan the keys of the collection in [start, end),
+    /// it's used by the workers of a partitioned scan.
+    pub(crate) fn set_scan_range(&mut self, start: Option<Vec<u8>>, end: Option<Vec<u8>>) {
+        self.scan_range = Some((start, end));
+    }
+
+    fn dup(&mut self) {
+        let top_pos = self.stack.len() - 1;
+        match self.lazy_doc_at(top_pos).cloned() {
+            Some(buf) => self.push_lazy_doc(buf),
+            None => self.stack.push(self.stack[top_pos].clone()),
+        }
+    }
+
     pub(crate) fn stack_top(&self) -> &Bson {
         &self.stack[self.stack.len() - 1]
     }
 
+    #[inline]
+    pub(crate) fn set_raw_result(&mut self, raw_result: bool) {
+        self.raw_result = raw_result;
+    }
+
+    /// Count the ops run and the rows examined, see [`VmProfiler`]
+    pub(crate) fn enable_profiler(&mut self) {
+        self.profiler = Some(Box::new(VmProfiler::new()));
+    }
+
+    #[inline]
+    pub(crate) fn profiler(&self) -> Option<&VmProfiler> {
+        self.profiler.as_deref()
+    }
+
+    #[inline]
+    fn add_row_examined(&mut self) {
+        if let Some(profiler) = &mut self.profiler {
+            profiler.add_row_examined();
+        }
+    }
+
+    /// The bytes of the row if it's returned as stored,
+    /// the top of the stack is null then.
+    pub(crate) fn stack_top_raw(&self) -> Option<&Arc<[u8]>> {
+        self.lazy_doc_at(self.stack.len() - 1)
+    }
+
     #[inline]
     fn reset_location(&mut self, location: u32) {
         unsafe {
-            self.pc = self.program.instructions.as_ptr().add(location as usize);
+            self.pc.0 = self.program.instructions.as_ptr().add(location as usize);
         }
     }
 
@@ -488,9 +805,15 @@ impl VM {
         let doc = top_value.as_document().unwrap();
         let doc_buf = bson::to_vec(doc)?;
 
-        let updated = {
-            let cursor = self.r1.as_mut().unwrap();
-            cursor.update_current(session, &doc_buf)?
+        let updated = match &self.index_doc_key {
+            Some(doc_key) => {
+                session.put(doc_key.as_slice(), &doc_buf)?;
+                true
+            }
+            None => {
+                let cursor = self.r1.as_mut().unwrap();
+                cursor.update_current(session, &doc_buf)?
+            }
         };
 
         if updated {
@@ -500,6 +823,25 @@ impl VM {
         Ok(())
     }
 
+    fn delete_current(&mut self, session: &mut SessionInner) -> Result<()> {
+        let deleted = match &self.index_doc_key {
+            Some(doc_key) => {
+                session.delete(doc_key.as_slice())?;
+                true
+            }
+            None => {
+                let cursor = self.r1.as_mut().unwrap();
+                session.delete_cursor_current(cursor.multi_cursor_mut())?
+            }
+        };
+
+        if deleted {
+            self.r2 += 1;
+        }
+
+        Ok(())
+    }
+
     fn insert_index(&mut self, index_info_id: u32, session: &mut SessionInner) -> Result<()> {
         let info = &self.program.index_infos[index_info_id as usize];
 
@@ -517,6 +859,7 @@ impl VM {
                 index_name.as_str(),
                 index_info,
                 &self.kv_engine,
+                &self.index_statistics,
                 session,
             )?;
         }
@@ -541,6 +884,7 @@ impl VM {
                 index_name.as_str(),
                 index_info,
                 &self.kv_engine,
+                &self.index_statistics,
                 session,
             )?;
         }
@@ -556,7 +900,16 @@ impl VM {
             self.stack[frame.stack_begin_pos + i] = self.stack[clone_start_pos + i].clone();
         }
 
-        self.stack.resize(frame.stack_begin_pos + return_size, Bson::Null);
+        // the lazy documents returned are moved with the values
+        let stack_begin_pos = frame.stack_begin_pos;
+        self.lazy_docs.retain(|(pos, _)| *pos < stack_begin_pos || *pos >= clone_start_pos);
+        for (pos, _) in self.lazy_docs.iter_mut() {
+            if *pos >= clone_start_pos {
+                *pos = *pos - clone_start_pos + stack_begin_pos;
+            }
+        }
+
+        self.resize_stack(stack_begin_pos + return_size);
 
         self.reset_location(frame.return_pos as u32);
     }
@@ -577,55 +930,71 @@ impl VM {
     }
 
     pub(crate) fn execute(&mut self, session: &mut SessionInner) -> Result<()> {
+        let timer = self.metrics.start_timer();
+        let result = self.execute_ops(session);
+        self.metrics.record_vm_execute(timer);
+        if let Some(profiler) = &mut self.profiler {
+            profiler.pause();
+        }
+        result
+    }
+
+    fn execute_ops(&mut self, session: &mut SessionInner) -> Result<()> {
         if self.state == VmState::Halt {
             return Err(Error::VmIsHalt);
         }
         self.state = VmState::Running;
         unsafe {
             loop {
-                let op = self.pc.cast::<DbOp>().read();
+                let op = self.pc.0.cast::<DbOp>().read();
+                if let Some(profiler) = &mut self.profiler {
+                    profiler.enter(op);
+                }
+                if !self.lazy_docs.is_empty() {
+                    try_vm!(self, self.decode_lazy_docs_for(op));
+                }
                 match op {
                     DbOp::Goto => {
-                        let location = self.pc.add(1).cast::<u32>().read();
+                        let location = self.pc.0.add(1).cast::<u32>().read();
                         self.reset_location(location);
                     }
 
                     DbOp::Label => {
-                        self.pc = self.pc.add(5);
+                        self.pc.0 = self.pc.0.add(5);
                     }
 
                     DbOp::Inc => {
                         self.inc();
-                        self.pc = self.pc.add(1);
+                        self.pc.0 = self.pc.0.add(1);
                     }
 
                     DbOp::IncR2 => {
                         self.r2 += 1;
-                        self.pc = self.pc.add(1);
+                        self.pc.0 = self.pc.0.add(1);
                     }
 
                     DbOp::IfTrue => {
-                        let location = self.pc.add(1).cast::<u32>().read();
+                        let location = self.pc.0.add(1).cast::<u32>().read();
                         if self.r0 != 0 {
                             // true
                             self.reset_location(location);
                         } else {
-                            self.pc = self.pc.add(5);
+                            self.pc.0 = self.pc.0.add(5);
                         }
                     }
 
                     DbOp::IfFalse => {
-                        let location = self.pc.add(1).cast::<u32>().read();
+                        let location = self.pc.0.add(1).cast::<u32>().read();
                         if self.r0 == 0 {
                             // false
                             self.reset_location(location);
                         } else {
-                            self.pc = self.pc.add(5);
+                            self.pc.0 = self.pc.0.add(5);
                         }
                     }
 
                     DbOp::Rewind => {
-                        let location = self.pc.add(1).cast::<u32>().read();
+                        let location = self.pc.0.add(1).cast::<u32>().read();
 
                         let is_empty = Cell::new(false);
                         try_vm!(self, self.reset_cursor(&is_empty));
@@ -633,79 +1002,97 @@ impl VM {
                         if is_empty.get() {
                             self.reset_location(location);
                         } else {
-                            self.pc = self.pc.add(5);
+                            self.add_row_examined();
+                            self.pc.0 = self.pc.0.add(5);
                         }
                     }
 
                     DbOp::FindByPrimaryKey => {
-                        let location = self.pc.add(1).cast::<u32>().read();
+                        let location = self.pc.0.add(1).cast::<u32>().read();
 
                         let found = try_vm!(self, self.find_by_primary_key());
 
                         if !found {
                             self.reset_location(location);
                         } else {
-                            self.pc = self.pc.add(5);
+                            self.add_row_examined();
+                            self.pc.0 = self.pc.0.add(5);
                         }
                     }
 
                     DbOp::FindByIndex => {
-                        let location = self.pc.add(1).cast::<u32>().read();
+                        let location = self.pc.0.add(1).cast::<u32>().read();
 
-                        let found = try_vm!(self, self.find_by_index(session));
+                        let found = try_vm!(self, self.find_by_index(session, false));
 
                         if !found {
                             self.reset_location(location);
                         } else {
-                            self.pc = self.pc.add(5);
+                            self.add_row_examined();
+                            self.pc.0 = self.pc.0.add(5);
+                        }
+                    }
+
+                    DbOp::FindByIndexRange => {
+                        let location = self.pc.0.add(1).cast::<u32>().read();
+
+                        let found = try_vm!(self, self.find_by_index(session, true));
+
+                        if !found {
+                            self.reset_location(location);
+                        } else {
+                            self.add_row_examined();
+                            self.pc.0 = self.pc.0.add(5);
                         }
                     }
 
                     DbOp::Next => {
                         try_vm!(self, self.next());
                         if self.r0 != 0 {
-                            let location = self.pc.add(1).cast::<u32>().read();
+                            self.add_row_examined();
+                            let location = self.pc.0.add(1).cast::<u32>().read();
                             self.reset_location(location);
                         } else {
-                            self.pc = self.pc.add(5);
+                            self.pc.0 = self.pc.0.add(5);
                         }
                     }
 
                     DbOp::NextIndexValue => {
                         try_vm!(self, self.next_index_value(session));
                         if self.r0 != 0 {
-                            let location = self.pc.add(1).cast::<u32>().read();
+                            self.add_row_examined();
+                            let location = self.pc.0.add(1).cast::<u32>().read();
                             self.reset_location(location);
                         } else {
-                            self.pc = self.pc.add(5);
+                            self.pc.0 = self.pc.0.add(5);
                         }
                     }
 
                     DbOp::PushValue => {
-                        let id = self.pc.add(1).cast::<u32>().read();
+                        let id = self.pc.0.add(1).cast::<u32>().read();
                         let value = self.borrow_static(id as usize).clone();
                         self.stack.push(value);
-                        self.pc = self.pc.add(5);
+                        self.pc.0 = self.pc.0.add(5);
                     }
 
                     DbOp::PushTrue => {
                         self.stack.push(Bson::Boolean(true));
-                        self.pc = self.pc.add(1);
+                        self.pc.0 = self.pc.0.add(1);
                     }
 
                     DbOp::PushFalse => {
                         self.stack.push(Bson::Boolean(false));
-                        self.pc = self.pc.add(1);
+                        self.pc.0 = self.pc.0.add(1);
                     }
 
                     DbOp::PushDocument => {
                         self.stack.push(Bson::Document(Document::new()));
-                        self.pc = self.pc.add(1);
+                        self.pc.0 = self.pc.0.add(1);
                     }
 
                     DbOp::PushR0 => {
                         self.stack.push(Bson::from(self.r0));
-                        self.pc = self.pc.add(1);
+                        self.pc.0 = self.pc.0.add(1);
                     }
 
                     DbOp::StoreR0 => {
@@ -722,35 +1109,20 @@ impl VM {
                             }
                             _ => panic!("store r0 failed")
                         };
-                        self.pc = self.pc.add(1);
+                        self.pc.0 = self.pc.0.add(1);
                     }
 
                     DbOp::GetField => {
-                        let key_stat_id = self.pc.add(1).cast::<u32>().read();
-                        let location = self.pc.add(5).cast::<u32>().read();
-
-                        let key = self.borrow_static(key_stat_id as usize);
-                        let key_name = key.as_str().unwrap();
-                        let top = &self.stack[self.stack.len() - 1];
-                        let doc = match top {
-                            Bson::Document(doc) => doc,
-                            _ => {
-                                let name = format!("{}", top);
-                                let err = FieldTypeUnexpectedStruct {
-                                    field_name: key_name.into(),
-                                    expected_ty: "Document".into(),
-                                    actual_ty: name,
-                                };
-                                self.state = VmState::Halt;
-                                return Err(err.into());
-                            }
-                        };
+                        let key_stat_id = self.pc.0.add(1).cast::<u32>().read();
+                        let location = self.pc.0.add(5).cast::<u32>().read();
+
+                        let value = try_vm!(self, self.get_field(key_stat_id as usize));
 
-                        match crate::utils::bson::try_get_document_value(doc, key_name) {
+                        match value {
                             Some(val) => {
                                 self.r0 = 1;
                                 self.stack.push(val);
-                                self.pc = self.pc.add(9);
+                                self.pc.0 = self.pc.0.add(9);
                             }
 
                             None => {
@@ -761,31 +1133,31 @@ impl VM {
                     }
 
                     DbOp::UnsetField => {
-                        let field_id = self.pc.add(1).cast::<u32>().read();
+                        let field_id = self.pc.0.add(1).cast::<u32>().read();
 
                         try_vm!(self, self.unset_field(field_id));
 
-                        self.pc = self.pc.add(5);
+                        self.pc.0 = self.pc.0.add(5);
                     }
 
                     DbOp::IncField => {
-                        let filed_id = self.pc.add(1).cast::<u32>().read();
+                        let filed_id = self.pc.0.add(1).cast::<u32>().read();
 
                         try_vm!(self, self.inc_field(filed_id as usize));
 
-                        self.pc = self.pc.add(5);
+                        self.pc.0 = self.pc.0.add(5);
                     }
 
                     DbOp::MulField => {
-                        let filed_id = self.pc.add(1).cast::<u32>().read();
+                        let filed_id = self.pc.0.add(1).cast::<u32>().read();
 
                         try_vm!(self, self.mul_field(filed_id as usize));
 
-                        self.pc = self.pc.add(5);
+                        self.pc.0 = self.pc.0.add(5);
                     }
 
                     DbOp::SetField => {
-                        let filed_id = self.pc.add(1).cast::<u32>().read();
+                        let filed_id = self.pc.0.add(1).cast::<u32>().read();
 
                         let key = self.program.static_values[filed_id as usize]
                             .as_str()
@@ -800,7 +1172,7 @@ impl VM {
 
                         mut_doc.insert::<String, Bson>(key.into(), value);
 
-                        self.pc = self.pc.add(5);
+                        self.pc.0 = self.pc.0.add(5);
                     }
 
                     DbOp::ArraySize => {
@@ -808,78 +1180,71 @@ impl VM {
 
                         self.stack.push(Bson::from(size as i64));
 
-                        self.pc = self.pc.add(1);
+                        self.pc.0 = self.pc.0.add(1);
                     }
 
                     DbOp::ArrayPush => {
                         try_vm!(self, self.array_push());
 
-                        self.pc = self.pc.add(1);
+                        self.pc.0 = self.pc.0.add(1);
                     }
 
                     DbOp::ArrayPopFirst => {
                         try_vm!(self, self.array_pop_first());
 
-                        self.pc = self.pc.add(1);
+                        self.pc.0 = self.pc.0.add(1);
                     }
 
                     DbOp::ArrayPopLast => {
                         try_vm!(self, self.array_pop_last());
 
-                        self.pc = self.pc.add(1);
+                        self.pc.0 = self.pc.0.add(1);
                     }
 
                     DbOp::UpdateCurrent => {
                         try_vm!(self, self.update_current(session));
 
-                        self.pc = self.pc.add(1);
+                        self.pc.0 = self.pc.0.add(1);
                     }
 
                     DbOp::DeleteCurrent => {
-                        let deleted = {
-                            let cursor = self.r1.as_mut().unwrap();
-                            session.delete_cursor_current(cursor.multi_cursor_mut())?
-                        };
-                        if deleted {
-                            self.r2 += 1;
-                        }
+                        try_vm!(self, self.delete_current(session));
 
-                        self.pc = self.pc.add(1);
+                        self.pc.0 = self.pc.0.add(1);
                     }
 
                     DbOp::InsertIndex => {
-                        let index_info_id = self.pc.add(1).cast::<u32>().read();
+                        let index_info_id = self.pc.0.add(1).cast::<u32>().read();
 
                         self.insert_index(index_info_id, session)?;
 
-                        self.pc = self.pc.add(5);
+                        self.pc.0 = self.pc.0.add(5);
                     }
 
                     DbOp::DeleteIndex => {
-                        let index_info_id = self.pc.add(1).cast::<u32>().read();
+                        let index_info_id = self.pc.0.add(1).cast::<u32>().read();
 
                         self.delete_index(index_info_id, session)?;
 
-                        self.pc = self.pc.add(5);
+                        self.pc.0 = self.pc.0.add(5);
                     }
 
                     DbOp::Dup => {
-                        self.stack.push(self.stack.last().unwrap().clone());
-                        self.pc = self.pc.add(1);
+                        self.dup();
+                        self.pc.0 = self.pc.0.add(1);
                     }
 
                     DbOp::Pop => {
-                        self.stack.pop();
-                        self.pc = self.pc.add(1);
+                        self.resize_stack(self.stack.len().saturating_sub(1));
+                        self.pc.0 = self.pc.0.add(1);
                     }
 
                     DbOp::Pop2 => {
-                        let offset = self.pc.add(1).cast::<u32>().read();
+                        let offset = self.pc.0.add(1).cast::<u32>().read();
 
-                        self.stack
-                            .resize(self.stack.len() - (offset as usize), Bson::Null);
+                        self.resize_stack(self.stack.len() - (offset as usize));
 
-                        self.pc = self.pc.add(5);
+                        self.pc.0 = self.pc.0.add(5);
                     }
 
                     DbOp::Equal
@@ -894,7 +1259,7 @@ impl VM {
 
                         self.r0 = if cmp { 1 } else { 0 };
 
-                        self.pc = self.pc.add(1);
+                        self.pc.0 = self.pc.0.add(1);
                     }
 
                     // stack
@@ -916,7 +1281,7 @@ impl VM {
                             }
                         }
 
-                        self.pc = self.pc.add(1);
+                        self.pc.0 = self.pc.0.add(1);
                     }
 
                     DbOp::Regex => {
@@ -970,7 +1335,7 @@ impl VM {
                             }
                         }
 
-                        self.pc = self.pc.add(1);
+                        self.pc.0 = self.pc.0.add(1);
                     }
 
                     DbOp::Not =>{
@@ -980,56 +1345,58 @@ impl VM {
                             0
                         };
 
-                        self.pc = self.pc.add(1);
+                        self.pc.0 = self.pc.0.add(1);
                     }
 
                     DbOp::OpenRead => {
-                        let prefix_idx = self.pc.add(1).cast::<u32>().read();
+                        let prefix_idx = self.pc.0.add(1).cast::<u32>().read();
                         let prefix = self.program.static_values[prefix_idx as usize].clone();
 
                         try_vm!(self, self.open_read(session, prefix));
 
-                        self.pc = self.pc.add(5);
+                        self.pc.0 = self.pc.0.add(5);
                     }
 
                     DbOp::OpenWrite => {
-                        let prefix_idx = self.pc.add(1).cast::<u32>().read();
+                        let prefix_idx = self.pc.0.add(1).cast::<u32>().read();
                         let prefix = self.program.static_values[prefix_idx as usize].clone();
 
                         try_vm!(self, self.open_write(session, prefix));
 
-                        self.pc = self.pc.add(5);
+                        self.pc.0 = self.pc.0.add(5);
                     }
 
                     DbOp::ResultRow => {
-                        self.pc = self.pc.add(1);
+                        self.pc.0 = self.pc.0.add(1);
                         self.state = VmState::HasRow;
                         return Ok(());
                     }
 
                     DbOp::Close => {
                         self.r1 = None;
+                        self.index_doc_keys.clear();
+                        self.index_doc_key = None;
                         session.auto_commit()?;
 
-                        self.pc = self.pc.add(1);
+                        self.pc.0 = self.pc.0.add(1);
                     }
 
                     DbOp::SaveStackPos => {
                         self.r3 = self.stack.len();
-                        self.pc = self.pc.add(1);
+                        self.pc.0 = self.pc.0.add(1);
                     }
 
                     DbOp::RecoverStackPos => {
-                        self.stack.resize(self.r3, Bson::Null);
-                        self.pc = self.pc.add(1);
+                        self.resize_stack(self.r3);
+                        self.pc.0 = self.pc.0.add(1);
                     }
 
                     DbOp::Call => {
-                        let location = self.pc.add(1).cast::<u32>().read();
-                        let size_of_param = self.pc.add(5).cast::<u32>().read() as usize;
+                        let location = self.pc.0.add(1).cast::<u32>().read();
+                        let size_of_param = self.pc.0.add(5).cast::<u32>().read() as usize;
 
                         let start = self.program.instructions.as_ptr() as usize;
-                        let return_pos = self.pc.add(9).sub(start) as usize;
+                        let return_pos = self.pc.0.add(9).sub(start) as usize;
 
                         self.frames.push(VMFrame {
                             stack_begin_pos: self.stack.len() - size_of_param,
@@ -1044,29 +1411,78 @@ impl VM {
                     }
 
                     DbOp::Ret => {
-                        let return_size = self.pc.add(1).cast::<u32>().read() as usize;
+                        let return_size = self.pc.0.add(1).cast::<u32>().read() as usize;
                         self.ret(return_size);
                     }
 
                     DbOp::IfFalseRet => {
-                        let return_size = self.pc.add(1).cast::<u32>().read() as usize;
+                        let return_size = self.pc.0.add(1).cast::<u32>().read() as usize;
                         if self.r0 == 0 {  // false
                             self.ret(return_size);
                         } else {
-                            self.pc = self.pc.add(5);
+                            self.pc.0 = self.pc.0.add(5);
                         }
                     }
 
                     DbOp::LoadGlobal => {
-                        let idx = self.pc.add(1).cast::<u32>().read();
+                        let idx = self.pc.0.add(1).cast::<u32>().read();
                         self.stack.push(self.global_vars[idx as usize].clone());
-                        self.pc = self.pc.add(5);
+                        self.pc.0 = self.pc.0.add(5);
                     }
 
                     DbOp::StoreGlobal => {
-                        let idx = self.pc.add(1).cast::<u32>().read();
+                        let idx = self.pc.0.add(1).cast::<u32>().read();
                         self.global_vars[idx as usize] = self.stack.last().unwrap().clone();
-                        self.pc = self.pc.add(5);
+                        self.pc.0 = self.pc.0.add(5);
+                    }
+
+                    DbOp::SortAdd => {
+                        let sort_id = self.pc.0.add(1).cast::<u32>().read();
+
+                        try_vm!(self, self.sort_add(sort_id as usize));
+
+                        self.pc.0 = self.pc.0.add(5);
+                    }
+
+                    DbOp::SortNext => {
+                        let sort_id = self.pc.0.add(1).cast::<u32>().read();
+                        let location = self.pc.0.add(5).cast::<u32>().read();
+
+                        match self.sorters[sort_id as usize].next() {
+                            Some(doc) => {
+                                self.stack.push(Bson::Document(doc));
+                                self.pc.0 = self.pc.0.add(9);
+                            }
+
+                            None => {
+                                self.reset_location(location);
+                            }
+                        }
+                    }
+
+                    DbOp::GroupAdd => {
+                        let group_id = self.pc.0.add(1).cast::<u32>().read();
+
+                        try_vm!(self, self.group_add(group_id as usize));
+
+                        self.pc.0 = self.pc.0.add(5);
+                    }
+
+                    DbOp::GroupNext => {
+                        let group_id = self.pc.0.add(1).cast::<u32>().read();
+                        let location = self.pc.0.add(5).cast::<u32>().read();
+
+                        let next = try_vm!(self, self.groupers[group_id as usize].next());
+                        match next {
+                            Some(doc) => {
+                                self.stack.push(Bson::Document(doc));
+                                self.pc.0 = self.pc.0.add(9);
+                            }
+
+                            None => {
+                                self.reset_location(location);
+                            }
+                        }
                     }
 
                     DbOp::_EOF | DbOp::Halt => {
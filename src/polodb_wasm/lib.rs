@@ -5,7 +5,7 @@ use polodb_core::{bson, DatabaseServer};
 #[cfg(target_arch = "wasm32")]
 use polodb_core::lsm::IndexeddbBackend;
 #[cfg(target_arch = "wasm32")]
-use polodb_core::Database;
+use polodb_core::{Database, ConfigBuilder};
 
 #[wasm_bindgen(js_name = Database)]
 pub struct DatabaseWrapper {
@@ -26,14 +26,17 @@ impl DatabaseWrapper {
         }
     }
 
-    /// If a name is provided, the data will be synced to IndexedDB
+    /// If a name is provided, the data will be synced to IndexedDB.
+    /// If `batch_writes` is true, the writes to IndexedDB are flushed together when idle.
     #[wasm_bindgen]
     #[cfg(target_arch = "wasm32")]
-    pub async fn open(&mut self, name: Option<String>) -> Result<(), JsError> {
+    pub async fn open(&mut self, name: Option<String>, batch_writes: Option<bool>) -> Result<(), JsError> {
         match name {
             Some(name) => {
                 let init_data = IndexeddbBackend::load_snapshot(&name).await;
-                let db = Database::open_indexeddb(init_data)?;
+                let mut config = ConfigBuilder::new();
+                config.set_idb_write_batching(batch_writes.unwrap_or(false));
+                let db = Database::open_indexeddb_with_config(init_data, config.take())?;
                 let mut db_ref = self.db.as_ref().borrow_mut();
                 *db_ref = Some(DatabaseServer::new(db));
             },
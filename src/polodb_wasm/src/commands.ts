@@ -17,5 +17,8 @@ export enum Commands {
     AbortTransaction = "AbortTransaction",
     StartSession = "StartSession",
     DropSession = "DropSession",
+    GetMore = "GetMore",
+    KillCursors = "KillCursors",
+    ServerStatus = "ServerStatus",
     SafelyQuit = "SafelyQuit",
 }
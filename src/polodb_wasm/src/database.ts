@@ -29,11 +29,18 @@ export class Collection {
 
 }
 
+export interface OpenOptions {
+    /**
+     * Flush the writes to IndexedDB together when the browser is idle.
+     */
+    batchWrites?: boolean;
+}
+
 export class DatabaseDelegate {
 
-    static async open(name: string) {
+    static async open(name: string, options?: OpenOptions) {
         const database = new Database();
-        await database.open(name);
+        await database.open(name, options?.batchWrites);
 
         return new DatabaseDelegate(database);
     }